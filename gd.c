@@ -1,6 +1,33 @@
+#if !defined(_WIN32) && !defined(_POSIX_C_SOURCE)
+// clock_gettime
+#define _POSIX_C_SOURCE 200809L
+#endif
+
 #include "gd.h"
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
+
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#define GD_SSE2
+#include <emmintrin.h>
+#endif
+
+#if defined(_WIN32)
+#include <windows.h>
+#endif
+
+#if !defined(GD_NO_THREADS) && !defined(_WIN32)
+#include <pthread.h>
+#endif
+
+#if defined(_MSC_VER)
+#define GD_FORCEINLINE __forceinline
+#elif defined(__GNUC__)
+#define GD_FORCEINLINE __attribute__((always_inline)) inline
+#else
+#define GD_FORCEINLINE inline
+#endif
 
 
 #define SIGNATURE_SIZE 3
@@ -12,14 +39,66 @@
 #define DESCRIPTOR_TABLE_SIZE(DescriptorFields) (2 << ((DescriptorFields) & 7))
 
 
+#define MASK_INTERLACED 0x40
+#define MASK_TRANSPARENCY 0x01
+#define GRAPHICS_DISPOSAL(PackedFields) (((PackedFields) >> 2) & 7)
+
+
 #define LZW_MAX_CODEWIDTH 12
 #define LZW_INVALID_CODE 0xFFFF
 
+// Longest string a code can expand to, extra room given to decompression buffers
+#define LZW_OUTPUT_SLACK (1 << LZW_MAX_CODEWIDTH)
+
+#define GD_DEFAULT_STRIP_HEIGHT 16
+#define GD_DEFAULT_WORKING_SET 4
+
+//
+// Frame store codec, LZ77 with a single-probe hash table: sequences of literals
+// followed by a match of at least GD_PACK_MIN_MATCH bytes at most 64K bytes back
+//
+#define GD_PACK_MIN_MATCH 4
+#define GD_PACK_HASH_BITS 12
+#define GD_PACK_MAX_OFFSET 0xFFFF
+
+// Indices decompressed between two checks of the time budget
+#define GD_BUDGET_CHECK_INTERVAL (64 * 1024)
+
+// Smallest share of an image worth decoding on a thread of its own
+#define GD_PARALLEL_MIN_INDICES (256 * 1024)
+#define GD_MAX_THREADS 64
+
+// Frames are expanded and drawn in bands of rows about this large, and only split
+// across threads once each thread gets this many pixels
+#define GD_BAND_BYTES (256 * 1024)
+#define GD_PARALLEL_MIN_PIXELS (256 * 1024)
+
+// Open-addressing table of the LZW encoder, at most half full with 4096 codes
+#define LZW_HASH_BITS 13
+
+// Indices compressed ahead to decide whether a full encoder table is worth keeping
+#define LZW_CHECK_GAP 4096
+
+//
+// Color quantizer: histogram cells of 5 bits per channel, nearest palette entries cached
+// for cells of 6 bits per channel
+//
+#define GD_QUANT_HISTOGRAM_BITS 5
+#define GD_QUANT_LOOKUP_BITS 6
+#define GD_QUANT_KMEANS_ROUNDS 3
+#define GD_QUANT_UNKNOWN 0xFFFF
+
 
 typedef struct GD_EXT_ROUTINES
 {
 	void* Routines[MAX_REGISTERED_ROUTINES];
 	size_t RegisteredCount;
+
+	//
+	// Application extension routines can be restricted to one application identifier
+	//
+	GD_BYTE AppIds[MAX_REGISTERED_ROUTINES][8];
+	GD_BOOL AppIdFilter[MAX_REGISTERED_ROUTINES];
 } GD_EXT_ROUTINES;
 
 
@@ -39,6 +118,38 @@ typedef enum GD_SOURCE_MODE
 #define CHUNK_SIZE 1024
 
 
+//
+// Identifies the decoded content of an image, two images with the same key and
+// compressed data decode to the same buffers whatever their position
+//
+typedef struct GD_FRAME_KEY
+{
+	const struct GD_PALETTE* Palette;
+	GD_WORD PositionLeft;
+	GD_WORD PositionTop;
+	GD_WORD Width;
+	GD_WORD Height;
+	GD_WORD VisibleLeft;
+	GD_WORD VisibleTop;
+	GD_WORD VisibleWidth;
+	GD_WORD VisibleHeight;
+	GD_BYTE Interlaced;
+	GD_BYTE LzwCodeWidth;
+	GD_BYTE HasTransparency;
+	GD_BYTE TransparentIndex;
+} GD_FRAME_KEY;
+
+
+typedef struct GD_DUPLICATE_ENTRY
+{
+	GD_QWORD Hash;
+	GD_DWORD FrameIndex;
+	GD_FRAME_KEY Key;
+	GD_BYTE* CompressedData;
+	GD_DWORD CompressedDataLength;
+} GD_DUPLICATE_ENTRY;
+
+
 typedef struct GD_DECODE_CONTEXT
 {
 	//
@@ -76,22 +187,347 @@ typedef struct GD_DECODE_CONTEXT
 	//
 	size_t DataStreamOffset;
 
+	//
+	// Last Graphic Control Extension read, it applies to the next image only
+	//
+	GD_EXT_GRAPHICS PendingGraphics;
+	GD_BOOL HasPendingGraphics;
+
+	//
+	// Open-addressing table of the images decoded so far, used to detect duplicates
+	//
+	GD_DUPLICATE_ENTRY* Duplicates;
+	size_t DuplicateCapacity;
+	size_t DuplicateCount;
+
+	//
+	// Resources used so far, checked against the limits of the decoding options
+	//
+	size_t DecodedBytes;
+	GD_QWORD Deadline;
+	GD_BOOL HasDeadline;
+
+	//
+	// Reused by every extension: the spans handed to the routines and, when reading
+	// from a stream, the sub-blocks they point to
+	//
+	GD_DATA_SPAN* Spans;
+	size_t SpanCapacity;
+	GD_BYTE* Scratch;
+	size_t ScratchCapacity;
+
 } GD_DECODE_CONTEXT;
 
 
+//
+// Interned color table, frames reference Table. Anything derived
+// from the colors belongs here so it is computed once per table
+//
+typedef struct GD_PALETTE
+{
+	GD_COLOR_TABLE Table;
+	GD_QWORD Hash;
+	GD_DWORD Index;
+
+	//
+	// Table converted to the handle's color space, what frames are expanded with
+	//
+	GD_GIF_COLOR Expanded[GCT_MAX_SIZE];
+} GD_PALETTE;
+
+
+//
+// Expanded frame of a compressed store, linked from the most to the least recently used
+//
+typedef struct GD_CACHE_NODE
+{
+	struct GD_GIF* Gif;
+	GD_DWORD FrameIndex;
+	size_t Size;
+	struct GD_CACHE_NODE* Newer;
+	struct GD_CACHE_NODE* Older;
+} GD_CACHE_NODE;
+
+
+typedef struct GD_FRAME_CACHE
+{
+	size_t ByteBudget;
+	GD_DWORD MaxFrames;
+
+	size_t Size;
+	GD_DWORD FrameCount;
+	GD_CACHE_NODE* Newest;
+	GD_CACHE_NODE* Oldest;
+
+	GD_QWORD Hits;
+	GD_QWORD Misses;
+	GD_QWORD Evictions;
+} GD_FRAME_CACHE, *GD_FRAME_CACHE_HANDLE;
+
+
+typedef struct GD_STORED_FRAME
+{
+	//
+	// Index stream packed with GD_PackIndices, shared by duplicates.
+	// NULL for frames without pixels
+	//
+	GD_BYTE* Packed;
+	size_t PackedSize;
+
+	// Set while the frame is expanded
+	GD_CACHE_NODE* Node;
+
+	// Processor time of the last expansion, in microseconds
+	GD_DWORD ExpandTime;
+} GD_STORED_FRAME;
+
+
 typedef struct GD_GIF
 {
 	GD_GIF_VERSION Version;
+	GD_DECODE_OPTIONS Options;
 	GD_LOGICAL_SCREEN_DESCRIPTOR ScreenDesc;
-	GD_COLOR_TABLE PaletteGlobal;
-	GD_COLOR_TABLE PaletteLocal;
-	GD_COLOR_TABLE* ActivePalette;
+	GD_PALETTE* PaletteGlobal;
+	GD_PALETTE* ActivePalette;
 	GD_FRAME* Frames;
 	GD_DWORD FrameCount;
 
+	//
+	// Every distinct color table of the data stream, PaletteSlots is an open-addressing
+	// table of (index + 1) into Palettes, 0 meaning empty
+	//
+	GD_PALETTE** Palettes;
+	GD_DWORD PaletteCount;
+	GD_DWORD* PaletteSlots;
+	size_t PaletteSlotCount;
+
+	//
+	// Area of the logical screen being decoded, the whole screen unless a region was
+	// requested in the options
+	//
+	GD_RECT SourceRect;
+
+	//
+	// Size of the composited output. When downscaling, ScaleMap maps a column/row of
+	// SourceRect to its canvas column/row and ScaleSpan counts the source
+	// columns/rows falling in each canvas column/row
+	//
+	GD_WORD CanvasWidth;
+	GD_WORD CanvasHeight;
+	GD_BOOL Scaled;
+	GD_WORD* ScaleMapX;
+	GD_WORD* ScaleMapY;
+	GD_WORD* ScaleSpanX;
+	GD_WORD* ScaleSpanY;
+
+	//
+	// Compositor state: Canvas holds every frame before CanvasNext drawn, the disposal
+	// of the last one is not applied yet if DisposalPending is set (it is on screen).
+	// CanvasBackup holds what was under that frame for GD_DISPOSAL_PREVIOUS
+	//
+	GD_GIF_COLOR* Canvas;
+	GD_GIF_COLOR* CanvasBackup;
+	GD_GIF_COLOR CanvasBackground;
+	GD_DWORD CanvasNext;
+	GD_BOOL DisposalPending;
+
+	//
+	// Canvas snapshots, Checkpoints[i] is the canvas right before drawing
+	// frame (i + 1) * CheckpointInterval, or NULL if it was not reached yet
+	//
+	GD_GIF_COLOR** Checkpoints;
+	GD_DWORD CheckpointCount;
+	GD_DWORD CheckpointInterval;
+
+	//
+	// Compressed frame store, Stored[i] goes with Frames[i]. Frames expanded by GD_GetFrame
+	// are tracked by Cache, owned by the handle unless the options gave a shared one.
+	// Unpacked has room for the largest frame, the compositor unpacks frames there
+	//
+	GD_BOOL PackFrames;
+	GD_STORED_FRAME* Stored;
+	GD_FRAME_CACHE* Cache;
+	GD_BOOL OwnsCache;
+	GD_BYTE* Unpacked;
+	size_t UnpackedSize;
+
+	//
+	// Canvas regions changed since the last canvas handed out by GD_ComposeFrame
+	//
+	GD_RECT DirtyRects[GD_MAX_DIRTY_RECTS];
+	GD_DWORD DirtyCount;
+
 } GD_GIF, *GD_GIF_HANDLE;
 
 
+typedef struct GD_ENCODER
+{
+	GD_ENCODER_OPTIONS Options;
+
+	// Bits per entry of the global color table, 0 without one
+	GD_BYTE GlobalBits;
+
+	GD_BYTE* Data;
+	size_t Size;
+	size_t Capacity;
+
+	GD_DWORD FrameCount;
+	GD_BOOL Finished;
+
+	// First failure to grow Data, every later call returns it
+	GD_ERR Error;
+} GD_ENCODER, *GD_ENCODER_HANDLE;
+
+
+//
+// Set of up to 256 colors, an open-addressing table of (color + 1) with their index
+//
+#define GD_COLOR_SET_BITS 10
+#define GD_COLOR_SET_SLOTS (1 << GD_COLOR_SET_BITS)
+
+typedef struct GD_COLOR_SET
+{
+	GD_DWORD Keys[GD_COLOR_SET_SLOTS];
+	GD_BYTE Values[GD_COLOR_SET_SLOTS];
+} GD_COLOR_SET;
+
+
+typedef struct GD_QUANT_CELL
+{
+	GD_QWORD Count;
+	GD_QWORD Sum[3];
+} GD_QUANT_CELL;
+
+
+typedef struct GD_QUANTIZER
+{
+	GD_QUANT_CELL Histogram[1 << (3 * GD_QUANT_HISTOGRAM_BITS)];
+	GD_QWORD PixelCount;
+
+	//
+	// Distinct colors added since the last palette, as long as there are at most
+	// GCT_MAX_SIZE of them. The palette is then made of these colors as they are
+	//
+	GD_COLOR_SET ExactSet;
+	GD_COLOR_TABLE Exact;
+	GD_BOOL ExactOverflow;
+
+	// Count is 0 until there is a palette
+	GD_COLOR_TABLE Palette;
+
+	//
+	// The palette as (r, g) and (b, 0) pairs for the nearest color search, padded to a
+	// multiple of 4 entries with colors too far to ever be picked
+	//
+	GD_WORD PaletteRG[2 * GCT_MAX_SIZE];
+	GD_WORD PaletteB[2 * GCT_MAX_SIZE];
+	size_t PaddedCount;
+
+	// Nearest palette entry of each lookup cell, GD_QUANT_UNKNOWN until first needed
+	GD_WORD Lookup[1 << (3 * GD_QUANT_LOOKUP_BITS)];
+
+	//
+	// Palette entries by color (the lowest index for repeated ones), and a bit for each
+	// lookup cell holding one. Palette colors map to their own entry, not the cell's
+	//
+	GD_COLOR_SET PaletteSet;
+	GD_BYTE PaletteCells[(1 << (3 * GD_QUANT_LOOKUP_BITS)) / 8];
+} GD_QUANTIZER, *GD_QUANTIZER_HANDLE;
+
+
+//
+// Reference-counted allocations, used for buffers that several frames can share
+//
+typedef union GD_SHARED_HEADER
+{
+	size_t RefCount;
+
+	// Keep the payload aligned for any type
+	long double AlignLongDouble;
+	GD_QWORD AlignQword;
+	void* AlignPointer;
+} GD_SHARED_HEADER;
+
+
+static void*
+GD_SharedAlloc(size_t Size)
+{
+	GD_SHARED_HEADER* Header = malloc(sizeof(GD_SHARED_HEADER) + Size);
+
+	if (!Header)
+		return NULL;
+
+	Header->RefCount = 1;
+
+	return Header + 1;
+}
+
+/// Only valid while the block is not shared yet, keeps it as is if realloc fails
+static void*
+GD_SharedShrink(void* Block, size_t Size)
+{
+	GD_SHARED_HEADER* Header = realloc((GD_SHARED_HEADER*)Block - 1, sizeof(GD_SHARED_HEADER) + Size);
+
+	return Header ? Header + 1 : Block;
+}
+
+static void*
+GD_SharedRetain(void* Block)
+{
+	if (Block)
+		++((GD_SHARED_HEADER*)Block - 1)->RefCount;
+
+	return Block;
+}
+
+static void
+GD_SharedRelease(void* Block)
+{
+	if (!Block)
+		return;
+
+	GD_SHARED_HEADER* Header = (GD_SHARED_HEADER*)Block - 1;
+
+	if (--Header->RefCount == 0)
+		free(Header);
+}
+
+#define HASH_PRIME1 0x9E3779B185EBCA87ULL
+#define HASH_PRIME2 0xC2B2AE3D27D4EB4FULL
+#define HASH_PRIME3 0x165667B19E3779F9ULL
+
+#define HASH_ROTL(x, r) (((x) << (r)) | ((x) >> (64 - (r))))
+
+static GD_QWORD
+GD_Hash64(const void* Data, size_t Size, GD_QWORD Seed)
+{
+	const GD_BYTE* p = (const GD_BYTE*)Data;
+	GD_QWORD h = Seed ^ (Size * HASH_PRIME1);
+
+	for (; Size >= 8; Size -= 8, p += 8)
+	{
+		GD_QWORD k;
+		memcpy(&k, p, 8);
+
+		h ^= HASH_ROTL(k * HASH_PRIME2, 31) * HASH_PRIME1;
+		h = HASH_ROTL(h, 27) * HASH_PRIME1 + HASH_PRIME3;
+	}
+
+	for (; Size; --Size, ++p)
+	{
+		h ^= *p * HASH_PRIME3;
+		h = HASH_ROTL(h, 11) * HASH_PRIME1;
+	}
+
+	h ^= h >> 33;
+	h *= HASH_PRIME2;
+	h ^= h >> 29;
+	h *= HASH_PRIME3;
+	h ^= h >> 32;
+
+	return h;
+}
+
 static void
 GD_DecoderLoadChunk(GD_DECODE_CONTEXT* Decoder)
 {
@@ -113,6 +549,14 @@ GD_InitDecodeContextStream(GD_DECODE_CONTEXT* Decoder, const char* Path)
 	Decoder->SourceMode = GD_FROM_STREAM;
 	Decoder->SourceEOF = GD_FALSE;
 	Decoder->DataStreamOffset = 0;
+	Decoder->HasPendingGraphics = GD_FALSE;
+	Decoder->Duplicates = NULL;
+	Decoder->DuplicateCapacity = 0;
+	Decoder->DuplicateCount = 0;
+	Decoder->Spans = NULL;
+	Decoder->SpanCapacity = 0;
+	Decoder->Scratch = NULL;
+	Decoder->ScratchCapacity = 0;
 
 	//
 	// Unused members
@@ -140,6 +584,14 @@ GD_InitDecodeContextMemory(GD_DECODE_CONTEXT* Decoder, const void* Buffer, size_
 	Decoder->SourceEnd = Decoder->MemoryBuffer + BufferSize;
 	Decoder->SourceEOF = GD_FALSE;
 	Decoder->DataStreamOffset = 0;
+	Decoder->HasPendingGraphics = GD_FALSE;
+	Decoder->Duplicates = NULL;
+	Decoder->DuplicateCapacity = 0;
+	Decoder->DuplicateCount = 0;
+	Decoder->Spans = NULL;
+	Decoder->SpanCapacity = 0;
+	Decoder->Scratch = NULL;
+	Decoder->ScratchCapacity = 0;
 
 	return GD_OK;
 }
@@ -181,10 +633,31 @@ GD_ReadByte(GD_DECODE_CONTEXT* Decoder)
 size_t
 GD_ReadBytes(GD_DECODE_CONTEXT* Decoder, GD_BYTE* Buffer, size_t Count)
 {
-	size_t read;
+	size_t read = 0;
+
+	while (read < Count && !Decoder->SourceEOF)
+	{
+		//
+		// Same count as reading byte by byte: the 0 GD_ReadByte returns at the end
+		// of the source is counted once
+		//
+		if (!GD_DecoderCanRead(Decoder))
+		{
+			Buffer[read++] = 0;
+			break;
+		}
+
+		size_t Available = (size_t)(Decoder->SourceEnd - Decoder->SourceBeg);
 
-	for (read = 0; read < Count && !Decoder->SourceEOF; ++read)
-		Buffer[read] = GD_ReadByte(Decoder);
+		if (Available > Count - read)
+			Available = Count - read;
+
+		memcpy(Buffer + read, Decoder->SourceBeg, Available);
+
+		Decoder->SourceBeg += Available;
+		Decoder->DataStreamOffset += Available;
+		read += Available;
+	}
 
 	return read;
 }
@@ -296,12 +769,39 @@ GD_IgnoreSubDataBlocks(GD_DECODE_CONTEXT* Decoder)
 	}
 }
 
+static GD_ERR
+GD_GrowBuffer(void** Buffer, size_t* Capacity, size_t Required, size_t ItemSize)
+{
+	if (Required <= *Capacity)
+		return GD_OK;
+
+	size_t NewCapacity = *Capacity ? *Capacity : 16;
+
+	while (NewCapacity < Required)
+		NewCapacity *= 2;
+
+	void* Tmp = realloc(*Buffer, NewCapacity * ItemSize);
+
+	if (!Tmp)
+		return GD_NOMEM;
+
+	*Buffer = Tmp;
+	*Capacity = NewCapacity;
+
+	return GD_OK;
+}
+
 GD_ERR
 GD_BlocksToLinearBuffer(GD_DECODE_CONTEXT* Decoder, GD_BYTE** Buffer, GD_DWORD* BufferSize)
 {
 	*Buffer = NULL;
 	*BufferSize = 0;
 
+	//
+	// Grown geometrically, sub-blocks are at most 255 bytes
+	//
+	size_t Capacity = 0;
+
 	for (GD_BYTE BSize = GD_ReadByte(Decoder);
 		 BSize != 0;
 		 BSize = GD_ReadByte(Decoder))
@@ -310,17 +810,12 @@ GD_BlocksToLinearBuffer(GD_DECODE_CONTEXT* Decoder, GD_BYTE** Buffer, GD_DWORD*
 		// Resize buffer
 		//
 		*BufferSize += BSize;
-		void* tmp = realloc(*Buffer, *BufferSize);
 
-		if (!tmp)
+		if (GD_GrowBuffer((void**)Buffer, &Capacity, *BufferSize, sizeof(GD_BYTE)) != GD_OK)
 		{
 			free(*Buffer);
 			return GD_NOMEM;
 		}
-		else
-		{
-			*Buffer = (GD_BYTE*)tmp;
-		}
 
 		//
 		// Append new block
@@ -333,93 +828,104 @@ GD_BlocksToLinearBuffer(GD_DECODE_CONTEXT* Decoder, GD_BYTE** Buffer, GD_DWORD*
 		}
 	}
 
-	return GD_OK;
-}
-
-GD_ERR
-GD_CreateBlock(GD_DECODE_CONTEXT* Decoder, GD_BYTE BSize, GD_DataBlock** OutputBlock)
-{
-	GD_DataBlock* Block = malloc(sizeof(GD_DataBlock));
-
-	if (!Block)
-		return GD_NOMEM;
-
-	if (GD_ReadBytes(Decoder, Block->Data, BSize) != BSize)
-	{
-		free(Block);
-		return GD_NOT_ENOUGH_DATA;
-	}
-
-	Block->EffectiveSize = BSize;
-	*OutputBlock = Block;
-
-	return GD_OK;
-}
-
-void
-GD_BlockListAppend(GD_DataBlockList* List, GD_DataBlock* Block)
-{
-	if (!List->BlockCount)
+	//
+	// The buffer is kept to recognize later copies of the image, give the unused part back
+	//
+	if (Capacity > *BufferSize)
 	{
-		Block->BLink = NULL;
-		Block->FLink = NULL;
+		void* tmp = realloc(*Buffer, *BufferSize);
 
-		List->Head = Block;
-		List->Tail = Block;
-	}
-	else
-	{
-		Block->FLink = NULL;
-		Block->BLink = List->Tail;
-		List->Tail->FLink = Block;
-		List->Tail = Block;
+		if (tmp)
+			*Buffer = (GD_BYTE*)tmp;
 	}
 
-	++List->BlockCount;
+	return GD_OK;
 }
 
 GD_ERR
-GD_BlockListBuild(GD_DECODE_CONTEXT* Decoder, GD_DataBlockList* List)
+GD_ReadSpans(GD_DECODE_CONTEXT* Decoder, GD_DATA_SPANS* Spans)
 {
-	if (!Decoder || !List)
-		return GD_UNEXPECTED_DATA;
-
-	List->Head = NULL;
-	List->Tail = NULL;
-	List->BlockCount = 0;
+	size_t SpanCount = 0;
+	size_t TotalSize = 0;
 
 	for (GD_BYTE BSize = GD_ReadByte(Decoder);
 	          BSize != 0;
 			  BSize = GD_ReadByte(Decoder))
 	{
-		GD_DataBlock* Block;
-
-		const GD_ERR ErrCode = GD_CreateBlock(Decoder, BSize, &Block);
+		GD_ERR ErrCode = GD_GrowBuffer((void**)&Decoder->Spans, &Decoder->SpanCapacity, SpanCount + 1, sizeof(GD_DATA_SPAN));
 
 		if (ErrCode != GD_OK)
 			return ErrCode;
 
-		GD_BlockListAppend(List, Block);
+		GD_DATA_SPAN* Span = &Decoder->Spans[SpanCount++];
+		Span->Size = BSize;
+
+		if (Decoder->SourceMode == GD_FROM_MEMORY)
+		{
+			//
+			// Point straight into the source buffer
+			//
+			if (Decoder->SourceEnd - Decoder->SourceBeg < BSize)
+				return GD_NOT_ENOUGH_DATA;
+
+			Span->Data = Decoder->SourceBeg;
+			GD_DecoderAdvance(Decoder, BSize);
+		}
+		else
+		{
+			ErrCode = GD_GrowBuffer((void**)&Decoder->Scratch, &Decoder->ScratchCapacity, TotalSize + BSize, sizeof(GD_BYTE));
+
+			if (ErrCode != GD_OK)
+				return ErrCode;
+
+			if (GD_ReadBytes(Decoder, Decoder->Scratch + TotalSize, BSize) != BSize)
+				return GD_NOT_ENOUGH_DATA;
+		}
+
+		TotalSize += BSize;
+	}
+
+	//
+	// The scratch buffer may have moved while growing, spans are pointed at it once complete
+	//
+	if (Decoder->SourceMode != GD_FROM_MEMORY)
+	{
+		const GD_BYTE* Data = Decoder->Scratch;
+
+		for (size_t i = 0; i < SpanCount; ++i)
+		{
+			Decoder->Spans[i].Data = Data;
+			Data += Decoder->Spans[i].Size;
+		}
 	}
 
+	Spans->Spans = Decoder->Spans;
+	Spans->SpanCount = SpanCount;
+	Spans->TotalSize = TotalSize;
+
 	return GD_OK;
 }
 
-void
-GD_BlockListDestroy(GD_DataBlockList* List)
+static void
+GD_FreeSpans(GD_DECODE_CONTEXT* Decoder)
 {
-	if (!List)
-		return;
+	free(Decoder->Spans);
+	free(Decoder->Scratch);
+
+	Decoder->Spans = NULL;
+	Decoder->SpanCapacity = 0;
+	Decoder->Scratch = NULL;
+	Decoder->ScratchCapacity = 0;
+}
 
-	GD_DataBlock* Next = NULL;
-	GD_DataBlock* Curr = List->Head;
+static GD_BOOL
+GD_AppRoutineWants(size_t RoutineIndex, const GD_EXT_APPLICATION* Extension)
+{
+	if (!ApplicationExtRoutines.Routines[RoutineIndex])
+		return GD_FALSE;
 
-	while (List->BlockCount--)
-	{
-		Next = Curr->FLink;
-		free(Curr);
-		Curr = Next;
-	}
+	return !ApplicationExtRoutines.AppIdFilter[RoutineIndex] ||
+	       !memcmp(ApplicationExtRoutines.AppIds[RoutineIndex], Extension->AppId, sizeof(Extension->AppId));
 }
 
 GD_ERR
@@ -442,7 +948,21 @@ GD_ReadExtApplication(GD_DECODE_CONTEXT* Decoder)
 	GD_ReadBytes(Decoder, ExData.AppId, sizeof(ExData.AppId));
 	GD_ReadBytes(Decoder, ExData.AppAuth, sizeof(ExData.AppAuth));
 
-	const GD_ERR ErrCode = GD_BlockListBuild(Decoder, &ExData.Blocks);
+	//
+	// Skip the data without reading it when every routine filters another application
+	//
+	GD_BOOL Wanted = GD_FALSE;
+
+	for (size_t i = 0; i < ApplicationExtRoutines.RegisteredCount && !Wanted; ++i)
+		Wanted = GD_AppRoutineWants(i, &ExData);
+
+	if (!Wanted)
+	{
+		GD_IgnoreSubDataBlocks(Decoder);
+		return GD_OK;
+	}
+
+	const GD_ERR ErrCode = GD_ReadSpans(Decoder, &ExData.Blocks);
 
 	if (ErrCode != GD_OK)
 		return ErrCode;
@@ -452,12 +972,10 @@ GD_ReadExtApplication(GD_DECODE_CONTEXT* Decoder)
 		//
 		// Call registered callback routines
 		//
-		if (ApplicationExtRoutines.Routines[i] != NULL)
+		if (GD_AppRoutineWants(i, &ExData))
 			((GD_EXT_ROUTINE_APPLICATION)ApplicationExtRoutines.Routines[i])(&ExData);
 	}
 
-	GD_BlockListDestroy(&ExData.Blocks);
-
 	return GD_OK;
 }
 
@@ -484,7 +1002,7 @@ GD_ReadExtPlainText(GD_DECODE_CONTEXT* Decoder)
 	ExData.FgColorIndex = GD_ReadByte(Decoder);
 	ExData.BgColorIndex = GD_ReadByte(Decoder);
 
-	const GD_ERR ErrCode = GD_BlockListBuild(Decoder, &ExData.Blocks);
+	const GD_ERR ErrCode = GD_ReadSpans(Decoder, &ExData.Blocks);
 
 	if (ErrCode != GD_OK)
 		return ErrCode;
@@ -495,20 +1013,15 @@ GD_ReadExtPlainText(GD_DECODE_CONTEXT* Decoder)
 			((GD_EXT_ROUTINE_PLAINTEXT)PlaintextExtRoutines.Routines[i])(&ExData);
 	}
 
-	GD_BlockListDestroy(&ExData.Blocks);
-
 	return GD_OK;
 }
 
 GD_ERR
 GD_ReadExtGraphics(GD_DECODE_CONTEXT* Decoder)
 {
-	if (!GraphicsExtRoutines.RegisteredCount)
-	{
-		GD_IgnoreSubDataBlocks(Decoder);
-		return GD_OK;
-	}
-
+	//
+	// Always parsed, the compositor needs the disposal and transparency of every frame
+	//
 	GD_EXT_GRAPHICS ExData;
 
 	// Consume useless size byte
@@ -524,6 +1037,9 @@ GD_ReadExtGraphics(GD_DECODE_CONTEXT* Decoder)
 			((GD_EXT_ROUTINE_GRAPHICS)GraphicsExtRoutines.Routines[i])(&ExData);
 	}
 
+	Decoder->PendingGraphics = ExData;
+	Decoder->HasPendingGraphics = GD_TRUE;
+
 	// Consume block terminator
 	GD_ReadByte(Decoder);
 
@@ -541,7 +1057,7 @@ GD_ReadExtComment(GD_DECODE_CONTEXT* Decoder)
 
 	GD_EXT_COMMENT ExData;
 
-	const GD_ERR ErrCode = GD_BlockListBuild(Decoder, &ExData.Blocks);
+	const GD_ERR ErrCode = GD_ReadSpans(Decoder, &ExData.Blocks);
 
 	if (ErrCode != GD_OK)
 		return ErrCode;
@@ -552,8 +1068,6 @@ GD_ReadExtComment(GD_DECODE_CONTEXT* Decoder)
 			((GD_EXT_ROUTINE_COMMENT)CommentExtRoutines.Routines[i])(&ExData);
 	}
 
-	GD_BlockListDestroy(&ExData.Blocks);
-
 	return GD_OK;
 }
 
@@ -572,65 +1086,203 @@ GD_ReadExtension(GD_DECODE_CONTEXT* Decoder)
 	}
 }
 
-typedef struct LZW_TABLE_ENTRY
+/// Nanoseconds from a monotonic clock. Wall time rather than processor time, which
+/// would also count the other threads of the process
+static GD_QWORD
+GD_Now(void)
 {
-	GD_WORD Length;
-	GD_WORD Prefix;
-	GD_BYTE Suffix;
-} LZW_TABLE_ENTRY;
+#if defined(_WIN32)
+	LARGE_INTEGER Counter, Frequency;
+	QueryPerformanceCounter(&Counter);
+	QueryPerformanceFrequency(&Frequency);
 
-typedef struct LZW_CONTEXT
+	const GD_QWORD Ticks = (GD_QWORD)Counter.QuadPart;
+	const GD_QWORD PerSecond = (GD_QWORD)Frequency.QuadPart;
+
+	return Ticks / PerSecond * 1000000000 + Ticks % PerSecond * 1000000000 / PerSecond;
+#else
+	struct timespec Now;
+	clock_gettime(CLOCK_MONOTONIC, &Now);
+
+	return (GD_QWORD)Now.tv_sec * 1000000000 + (GD_QWORD)Now.tv_nsec;
+#endif
+}
+
+//
+// Runs Routine(Argument) on a thread of its own. GD_TaskStart returns GD_FALSE when
+// no thread could be started, or when built with GD_NO_THREADS: the caller then
+// runs the routine itself
+//
+typedef struct GD_TASK
 {
-	LZW_TABLE_ENTRY Dictionary[1 << (LZW_MAX_CODEWIDTH + 1)];
-	GD_WORD DictIndex;
-	GD_WORD DictCount;
-	GD_BYTE CodeWidth;
-	GD_WORD CodeClear;
-	GD_WORD CodeBreak;
-} LZW_CONTEXT;
+	void (*Routine)(void*);
+	void* Argument;
+
+#if defined(GD_NO_THREADS)
+#elif defined(_WIN32)
+	HANDLE Thread;
+#else
+	pthread_t Thread;
+#endif
+} GD_TASK;
+
+#if !defined(GD_NO_THREADS)
+#if defined(_WIN32)
+static DWORD WINAPI
+GD_TaskEntry(LPVOID Argument)
+{
+	GD_TASK* Task = (GD_TASK*)Argument;
+	Task->Routine(Task->Argument);
+	return 0;
+}
+#else
+static void*
+GD_TaskEntry(void* Argument)
+{
+	GD_TASK* Task = (GD_TASK*)Argument;
+	Task->Routine(Task->Argument);
+	return NULL;
+}
+#endif
+#endif
 
+static GD_BOOL
+GD_TaskStart(GD_TASK* Task)
+{
+#if defined(GD_NO_THREADS)
+	(void)Task;
+	return GD_FALSE;
+#elif defined(_WIN32)
+	Task->Thread = CreateThread(NULL, 0, GD_TaskEntry, Task, 0, NULL);
+	return Task->Thread ? GD_TRUE : GD_FALSE;
+#else
+	return pthread_create(&Task->Thread, NULL, GD_TaskEntry, Task) == 0 ? GD_TRUE : GD_FALSE;
+#endif
+}
 
-GD_WORD
-GD_LzwUnpackCode(GD_BYTE LzwCodeWidth, GD_BYTE** CompressedData, GD_DWORD* CompressedDataLength, GD_WORD* Mask)
+static void
+GD_TaskJoin(GD_TASK* Task)
 {
-	///
-	/// For example, 10-bits code 11'1001'0100 was packed into:
-	///      8-bits: 1001'0100
-	///      8-bits: xxxx'xx11
-	///
-	/// This unpacks the 16-bits word: 1001'0100'xxxx'xx11
-	/// Into the original value 11'1001'0100
-	///
+#if defined(GD_NO_THREADS)
+	(void)Task;
+#elif defined(_WIN32)
+	WaitForSingleObject(Task->Thread, INFINITE);
+	CloseHandle(Task->Thread);
+#else
+	pthread_join(Task->Thread, NULL);
+#endif
+}
 
-	// TODO: this can very clearly be optimized:
-	//       Code = *CompressedData
-	//       if (LzwCodeWidth <= 8) return Code
-	//       ++CompressedData, --CompressedDataLength
-	//       Code |= ((*CompressedData & (remaining byte mask)) << 8) ?
-	//
+//
+// Runs Routine over RowCount rows in bands of about GD_BAND_BYTES, handed out in turn
+// to up to Threads threads. Small images stay on the calling thread
+//
+typedef void (*GD_BAND_ROUTINE)(void* Context, size_t FirstRow, size_t RowCount);
+
+typedef struct GD_BAND_JOB
+{
+	GD_BAND_ROUTINE Routine;
+	void* Context;
+	size_t RowCount;
+	size_t BandRows;
+	size_t FirstBand;
+	size_t BandStep;
+} GD_BAND_JOB;
 
-	GD_WORD Code = 0;
+static void
+GD_BandRunJob(void* Argument)
+{
+	const GD_BAND_JOB* Job = (const GD_BAND_JOB*)Argument;
 
-	for (GD_BYTE i = 0; i <= LzwCodeWidth; ++i)
+	for (size_t Band = Job->FirstBand; Band * Job->BandRows < Job->RowCount; Band += Job->BandStep)
 	{
-		GD_BOOL bit = (**CompressedData & *Mask) ? GD_TRUE : GD_FALSE;
+		const size_t FirstRow = Band * Job->BandRows;
+		const size_t Rows = Job->RowCount - FirstRow;
 
-		*Mask <<= 1;
+		Job->Routine(Job->Context, FirstRow, Rows < Job->BandRows ? Rows : Job->BandRows);
+	}
+}
 
-		if (*Mask == 0x100)
-		{
-			// We consumed every bit of the first byte, move to next one
-			*Mask = 1;
-			++*CompressedData;
-			--CompressedDataLength;
-		}
+static void
+GD_RunBands(GD_BAND_ROUTINE Routine, void* Context, size_t RowCount, size_t RowPixels, GD_DWORD Threads)
+{
+	if (!RowCount || !RowPixels)
+		return;
+
+	size_t JobCount = RowCount * RowPixels / GD_PARALLEL_MIN_PIXELS;
+
+	if (JobCount > Threads)
+		JobCount = Threads;
+
+	if (JobCount > GD_MAX_THREADS)
+		JobCount = GD_MAX_THREADS;
+
+	size_t BandRows = GD_BAND_BYTES / (RowPixels * sizeof(GD_GIF_COLOR));
+
+	if (BandRows == 0)
+		BandRows = 1;
+
+	const size_t BandCount = (RowCount + BandRows - 1) / BandRows;
+
+	if (JobCount > BandCount)
+		JobCount = BandCount;
 
-		Code |= (bit << i);
+	if (JobCount < 2)
+	{
+		Routine(Context, 0, RowCount);
+		return;
+	}
+
+	GD_BAND_JOB Jobs[GD_MAX_THREADS];
+	GD_TASK Tasks[GD_MAX_THREADS];
+	GD_BOOL Started[GD_MAX_THREADS];
+
+	for (size_t i = 0; i < JobCount; ++i)
+	{
+		Jobs[i].Routine   = Routine;
+		Jobs[i].Context   = Context;
+		Jobs[i].RowCount  = RowCount;
+		Jobs[i].BandRows  = BandRows;
+		Jobs[i].FirstBand = i;
+		Jobs[i].BandStep  = JobCount;
+	}
+
+	for (size_t i = 1; i < JobCount; ++i)
+	{
+		Tasks[i].Routine = GD_BandRunJob;
+		Tasks[i].Argument = &Jobs[i];
+		Started[i] = GD_TaskStart(&Tasks[i]);
 	}
 
-	return Code;
+	GD_BandRunJob(&Jobs[0]);
+
+	for (size_t i = 1; i < JobCount; ++i)
+	{
+		if (Started[i])
+			GD_TaskJoin(&Tasks[i]);
+		else
+			GD_BandRunJob(&Jobs[i]);
+	}
 }
 
+typedef struct LZW_TABLE_ENTRY
+{
+	GD_WORD Length;
+	GD_WORD Prefix;
+	GD_BYTE Suffix;
+} LZW_TABLE_ENTRY;
+
+typedef struct LZW_CONTEXT
+{
+	LZW_TABLE_ENTRY Dictionary[1 << LZW_MAX_CODEWIDTH];
+	GD_WORD DictIndex;
+	GD_WORD DictCount;
+	GD_BYTE CodeWidth;
+	GD_WORD CodeClear;
+	GD_WORD CodeBreak;
+} LZW_CONTEXT;
+
+
 void
 GD_LzwInitContext(LZW_CONTEXT* Lzw, GD_BYTE CodeWidth)
 {
@@ -650,400 +1302,6108 @@ GD_LzwInitContext(LZW_CONTEXT* Lzw, GD_BYTE CodeWidth)
 	Lzw->DictIndex += 2;
 }
 
-GD_ERR
-GD_LzwDecompressIndexStream(GD_BYTE InitialCodeWidth,
-							GD_BYTE* CompressedData,
-							GD_DWORD CompressedDataLength,
-							GD_BYTE* IndexStream)
+//
+// Strings of the in-memory decompressor are not rebuilt from prefixes: every entry
+// is a string already written to the output, the previous one plus the first index
+// of the one after it. Codes are expanded with a single forward copy
+//
+typedef struct LZW_RUN
 {
-	if (InitialCodeWidth > LZW_MAX_CODEWIDTH)
-		return GD_UNEXPECTED_DATA;
+	GD_DWORD Offset;
+	GD_WORD Length;
+} LZW_RUN;
 
-	LZW_CONTEXT Lzw;
+//
+// One run of the in-memory decompressor, from a bit of the compressed data where the
+// dictionary is empty (the start of the raster or right after a clear code)
+//
+typedef struct LZW_JOB
+{
+	GD_BYTE InitialCodeWidth;
+	const GD_BYTE* Data;
+	const GD_BYTE* DataEnd;
+
+	// Bits of the first byte already used by the previous codes
+	GD_BYTE Shift;
+
+	GD_BYTE* Output;
+	size_t OutputLength;
+
+	//
+	// Nothing is written past it: the end of the buffer's slack, or where the output
+	// of the next job starts when jobs run in parallel
+	//
+	const GD_BYTE* WriteLimit;
+
+	const GD_QWORD* Deadline;
+	GD_ERR Result;
+} LZW_JOB;
+
+static GD_FORCEINLINE void
+GD_LzwCopyRun(GD_BYTE* Output, const GD_BYTE* Source, GD_WORD Length, const GD_BYTE* WriteLimit)
+{
+	//
+	// Source ends at or before Output. Short strings are moved with one 8-byte
+	// load and store when there is room for it
+	//
+	if (Length <= sizeof(GD_QWORD) && Output + sizeof(GD_QWORD) <= WriteLimit)
+	{
+		GD_QWORD Chunk;
+		memcpy(&Chunk, Source, sizeof(Chunk));
+		memcpy(Output, &Chunk, sizeof(Chunk));
+	}
+	else
+	{
+		memcpy(Output, Source, Length);
+	}
+}
+
+//
+// The in-memory decompressor, one kernel for every initial code width. The current
+// width, its mask and the next growth point are locals, and once the dictionary is
+// full the 12-bit codes are read by a loop that never adds entries
+//
+static GD_ERR
+GD_LzwKernel(const LZW_JOB* Job)
+{
+	const GD_BYTE InitialCodeWidth = Job->InitialCodeWidth;
+	const GD_WORD CodeClear = (GD_WORD)(1 << InitialCodeWidth);
+	const GD_WORD CodeBreak = CodeClear + 1;
+	const GD_WORD FirstFree = CodeClear + 2;
+
+	// Entries from FirstFree, root codes are their own index
+	LZW_RUN Runs[1 << LZW_MAX_CODEWIDTH];
 
 	// Normally GIFs should have a clear code at the start of the raster but let's make sure anyway
-	GD_LzwInitContext(&Lzw, InitialCodeWidth);
+	GD_WORD DictIndex = FirstFree;
+	GD_BYTE Width = InitialCodeWidth + 1;
+	GD_WORD WidthEnd = (GD_WORD)(1 << Width);
 
 	GD_WORD PrevCode = LZW_INVALID_CODE;
+	LZW_RUN Prev = { 0, 0 };
+	GD_BOOL Ended = GD_FALSE;
+
+	//
+	// Bits not consumed yet, codes are packed least significant bit first
+	//
+	GD_DWORD Bits = 0;
+	GD_BYTE BitCount = 0;
+
+	const GD_BYTE* CompressedData = Job->Data;
+	const GD_BYTE* CompressedDataEnd = Job->DataEnd;
+
+	if (Job->Shift && CompressedData < CompressedDataEnd)
+	{
+		Bits = *CompressedData++ >> Job->Shift;
+		BitCount = 8 - Job->Shift;
+	}
 
-	GD_WORD Mask = 1;
+	GD_BYTE* IndexStream = Job->Output;
+	GD_BYTE* const Base = IndexStream;
+	const GD_BYTE* IndexStreamEnd = IndexStream + Job->OutputLength;
+	const GD_BYTE* WriteLimit = Job->WriteLimit;
+	const GD_QWORD* Deadline = Job->Deadline;
+	size_t NextBudgetCheck = GD_BUDGET_CHECK_INTERVAL;
 
-	while (CompressedDataLength)
+	while (IndexStream < IndexStreamEnd)
 	{
-		GD_WORD Code = GD_LzwUnpackCode(Lzw.CodeWidth, &CompressedData, &CompressedDataLength, &Mask);
+		if (Deadline && (size_t)(IndexStream - Base) >= NextBudgetCheck)
+		{
+			if (GD_Now() > *Deadline)
+				return GD_LIMIT_TIME;
+
+			NextBudgetCheck = (size_t)(IndexStream - Base) + GD_BUDGET_CHECK_INTERVAL;
+		}
 
-		if (Code == Lzw.CodeClear)
+		while (BitCount <= 24 && CompressedData < CompressedDataEnd)
 		{
-			GD_LzwInitContext(&Lzw, InitialCodeWidth);
-			PrevCode = 0xFFFF;
-			continue;
+			Bits |= (GD_DWORD)*CompressedData++ << BitCount;
+			BitCount += 8;
 		}
-		else if (Code == Lzw.CodeBreak)
+
+		// Data ended without an end code
+		if (BitCount < Width)
 			break;
 
-		if (PrevCode != LZW_INVALID_CODE && Lzw.CodeWidth < LZW_MAX_CODEWIDTH)
+		const GD_WORD Code = (GD_WORD)(Bits & (WidthEnd - 1u));
+		Bits >>= Width;
+		BitCount -= Width;
+
+		if (Code == CodeClear)
 		{
-			int ptr = (Code == Lzw.DictIndex) ? PrevCode : Code;
+			DictIndex = FirstFree;
+			Width = InitialCodeWidth + 1;
+			WidthEnd = (GD_WORD)(1 << Width);
+			PrevCode = LZW_INVALID_CODE;
+			continue;
+		}
+		else if (Code == CodeBreak)
+			break;
+
+		//
+		// A code can only reference the dictionary or the entry it is about to create.
+		// Anything else is corrupt data, keep what was decoded so far
+		//
+		if (Code > DictIndex || (Code == DictIndex && PrevCode == LZW_INVALID_CODE))
+			break;
+
+		//
+		// Bounds are only checked once per code: a string is at most LZW_OUTPUT_SLACK
+		// long and we only start one inside the buffer
+		//
+		LZW_RUN Current;
+		Current.Offset = (GD_DWORD)(IndexStream - Base);
 
-			while (Lzw.Dictionary[ptr].Prefix != 0xFFFF)
-				ptr = Lzw.Dictionary[ptr].Prefix;
+		if (Code < CodeClear)
+		{
+			*IndexStream = (GD_BYTE)Code;
+			Current.Length = 1;
+		}
+		else if (Code < DictIndex)
+		{
+			GD_LzwCopyRun(IndexStream, Base + Runs[Code].Offset, Runs[Code].Length, WriteLimit);
+			Current.Length = Runs[Code].Length;
+		}
+		else
+		{
+			// Previous string followed by its own first index
+			GD_LzwCopyRun(IndexStream, Base + Prev.Offset, Prev.Length, WriteLimit);
+			IndexStream[Prev.Length] = Base[Prev.Offset];
+			Current.Length = Prev.Length + 1;
+		}
 
-			Lzw.Dictionary[Lzw.DictIndex].Suffix = Lzw.Dictionary[ptr].Suffix;
-			Lzw.Dictionary[Lzw.DictIndex].Prefix = PrevCode;
-			Lzw.Dictionary[Lzw.DictIndex].Length = Lzw.Dictionary[PrevCode].Length + 1;
-			++Lzw.DictIndex;
+		if (PrevCode != LZW_INVALID_CODE && DictIndex < (1 << LZW_MAX_CODEWIDTH))
+		{
+			// The previous string and the index that follows it in the output
+			Runs[DictIndex].Offset = Prev.Offset;
+			Runs[DictIndex].Length = Prev.Length + 1;
+			++DictIndex;
 
-			if (Lzw.DictIndex == (1 << (Lzw.CodeWidth + 1)) && Lzw.CodeWidth < 11)
+			if (DictIndex == WidthEnd && Width < LZW_MAX_CODEWIDTH)
 			{
-				++Lzw.CodeWidth;
-				Lzw.DictCount = 1 << Lzw.CodeWidth;
+				++Width;
+				WidthEnd <<= 1;
 			}
 		}
 
 		PrevCode = Code;
+		Prev = Current;
 
-		GD_WORD Copied = Lzw.Dictionary[Code].Length;
+		IndexStream += Current.Length;
 
-		while (Code != LZW_INVALID_CODE)
+		if (DictIndex < (1 << LZW_MAX_CODEWIDTH))
+			continue;
+
+		//
+		// Dictionary full: every code is 12 bits and valid, nothing is added until the
+		// next clear code. Large images spend most of their time here
+		//
+		while (IndexStream < IndexStreamEnd)
 		{
-			const LZW_TABLE_ENTRY* Entry = &Lzw.Dictionary[Code];
+			if (Deadline && (size_t)(IndexStream - Base) >= NextBudgetCheck)
+			{
+				if (GD_Now() > *Deadline)
+					return GD_LIMIT_TIME;
+
+				NextBudgetCheck = (size_t)(IndexStream - Base) + GD_BUDGET_CHECK_INTERVAL;
+			}
+
+			while (BitCount <= 24 && CompressedData < CompressedDataEnd)
+			{
+				Bits |= (GD_DWORD)*CompressedData++ << BitCount;
+				BitCount += 8;
+			}
 
-			IndexStream[Entry->Length - 1] = Entry->Suffix;
+			if (BitCount < LZW_MAX_CODEWIDTH)
+				break;
 
-			// Prevent infinite loop
-			if (Entry->Prefix == Code)
-				return GD_UNEXPECTED_DATA;
+			const GD_WORD FullCode = (GD_WORD)(Bits & ((1u << LZW_MAX_CODEWIDTH) - 1));
+			Bits >>= LZW_MAX_CODEWIDTH;
+			BitCount -= LZW_MAX_CODEWIDTH;
 
-			Code = Entry->Prefix;
+			if (FullCode == CodeClear)
+			{
+				DictIndex = FirstFree;
+				Width = InitialCodeWidth + 1;
+				WidthEnd = (GD_WORD)(1 << Width);
+				PrevCode = LZW_INVALID_CODE;
+				break;
+			}
+			else if (FullCode == CodeBreak)
+			{
+				Ended = GD_TRUE;
+				break;
+			}
+
+			if (FullCode < CodeClear)
+			{
+				*IndexStream++ = (GD_BYTE)FullCode;
+			}
+			else
+			{
+				GD_LzwCopyRun(IndexStream, Base + Runs[FullCode].Offset, Runs[FullCode].Length, WriteLimit);
+				IndexStream += Runs[FullCode].Length;
+			}
 		}
 
-		IndexStream += Copied;
+		// End code, or the output or the data ran out while the dictionary was full
+		if (Ended || DictIndex == (1 << LZW_MAX_CODEWIDTH))
+			break;
 	}
 
+	// Truncated data, the missing pixels use index 0
+	if (IndexStream < IndexStreamEnd)
+		memset(IndexStream, 0, IndexStreamEnd - IndexStream);
+
 	return GD_OK;
 }
 
-GD_ERR
-GD_AppendFrame(GD_GIF_HANDLE Gif, GD_IMAGE_DESCRIPTOR* ImageDescriptor, GD_BYTE* IndexStream)
+static void
+GD_LzwRunJob(void* Argument)
 {
-	if (Gif->FrameCount > 0)
-	{
-		GD_FRAME* Tmp = (GD_FRAME*)realloc(Gif->Frames, (Gif->FrameCount + 1) * sizeof(GD_FRAME));
-
-		if (!Tmp)
-			return GD_NOMEM;
-
-		Gif->Frames = Tmp;
-	}
-	else
-	{
-		Gif->Frames = (GD_FRAME*)malloc(sizeof(GD_FRAME));
+	LZW_JOB* Job = (LZW_JOB*)Argument;
 
-		if (!Gif->Frames)
-			return GD_NOMEM;
-	}
+	Job->Result = GD_LzwKernel(Job);
+}
 
-	GD_FRAME* Back = &Gif->Frames[Gif->FrameCount];
-	++Gif->FrameCount;
+//
+// Where the dictionary starts over, the decoder can pick up from there on its own
+//
+typedef struct LZW_SEGMENT
+{
+	const GD_BYTE* Data;
+	GD_BYTE Shift;
+	size_t Output;
+} LZW_SEGMENT;
+
+/// Find the clear codes among the codes producing the first IndexStreamLength indices,
+/// and the output offset of the codes after them. The decoder runs on string lengths
+/// only, following the same rules as GD_LzwKernel. Segments[0] is the raster start
+static GD_ERR
+GD_LzwFindSegments(GD_BYTE InitialCodeWidth, const GD_BYTE* CompressedData, GD_DWORD CompressedDataLength,
+                   size_t IndexStreamLength, LZW_SEGMENT** Segments, size_t* SegmentCount)
+{
+	const GD_WORD CodeClear = (GD_WORD)(1 << InitialCodeWidth);
+	const GD_WORD CodeBreak = CodeClear + 1;
+	const GD_WORD FirstFree = CodeClear + 2;
 
-	memcpy(&Back->Descriptor, ImageDescriptor, sizeof(GD_IMAGE_DESCRIPTOR));
+	GD_WORD Lengths[1 << LZW_MAX_CODEWIDTH];
 
-	Back->Buffer = malloc(sizeof(GD_GIF_COLOR) * ImageDescriptor->Width * ImageDescriptor->Height);
+	GD_WORD DictIndex = FirstFree;
+	GD_BYTE Width = InitialCodeWidth + 1;
+	GD_WORD WidthEnd = (GD_WORD)(1 << Width);
+	GD_WORD PrevCode = LZW_INVALID_CODE;
+	GD_WORD PrevLength = 0;
 
-	if (!Back->Buffer)
-		return GD_NOMEM;
+	GD_DWORD Bits = 0;
+	GD_BYTE BitCount = 0;
 
-	for (size_t i = 0; i < ImageDescriptor->Height * ImageDescriptor->Width; ++i)
-		Back->Buffer[i] = Gif->ActivePalette->Internal[IndexStream[i]];
+	const GD_BYTE* Data = CompressedData;
+	const GD_BYTE* DataEnd = CompressedData + CompressedDataLength;
 
-	return GD_OK;
-}
+	size_t Capacity = 0;
+	size_t Output = 0;
 
-GD_ERR
-GD_ProcessImageRaster(GD_DECODE_CONTEXT* Decoder, GD_GIF_HANDLE Gif, GD_IMAGE_DESCRIPTOR* ImageDescriptor)
-{
-	const GD_BYTE LzwCodeWidth = GD_ReadByte(Decoder);
+	*Segments = NULL;
+	*SegmentCount = 0;
 
-	GD_BYTE* CompressedData = NULL;
-	GD_DWORD CompressedDataLength = 0;
-	GD_ERR ErrorCode = GD_BlocksToLinearBuffer(Decoder, &CompressedData, &CompressedDataLength);
+	GD_ERR ErrorCode = GD_GrowBuffer((void**)Segments, &Capacity, 1, sizeof(LZW_SEGMENT));
 
 	if (ErrorCode != GD_OK)
 		return ErrorCode;
 
-	const GD_DWORD DecompressedDataLength = ImageDescriptor->Height * ImageDescriptor->Width;
-	GD_BYTE* DecompressedData = malloc(sizeof(GD_BYTE) * DecompressedDataLength);
+	(*Segments)[0].Data = CompressedData;
+	(*Segments)[0].Shift = 0;
+	(*Segments)[0].Output = 0;
+	*SegmentCount = 1;
 
-	ErrorCode = GD_LzwDecompressIndexStream(LzwCodeWidth, CompressedData, CompressedDataLength, DecompressedData);
+	while (Output < IndexStreamLength)
+	{
+		while (BitCount <= 24 && Data < DataEnd)
+		{
+			Bits |= (GD_DWORD)*Data++ << BitCount;
+			BitCount += 8;
+		}
 
-	free(CompressedData);
+		if (BitCount < Width)
+			break;
 
-	if (!GD_SUCCESS(ErrorCode))
-	{
-		free(DecompressedData);
-		return ErrorCode;
-	}
+		const GD_WORD Code = (GD_WORD)(Bits & (WidthEnd - 1u));
+		Bits >>= Width;
+		BitCount -= Width;
 
-	ErrorCode = GD_AppendFrame(Gif, ImageDescriptor, DecompressedData);
+		if (Code == CodeClear)
+		{
+			DictIndex = FirstFree;
+			Width = InitialCodeWidth + 1;
+			WidthEnd = (GD_WORD)(1 << Width);
+			PrevCode = LZW_INVALID_CODE;
+
+			//
+			// Bit position of the next code, a clear code right after another one
+			// moves the segment instead of adding an empty one
+			//
+			const size_t Position = (size_t)(Data - CompressedData) * 8 - BitCount;
+
+			if ((*Segments)[*SegmentCount - 1].Output != Output)
+			{
+				ErrorCode = GD_GrowBuffer((void**)Segments, &Capacity, *SegmentCount + 1, sizeof(LZW_SEGMENT));
 
-	free(DecompressedData);
+				if (ErrorCode != GD_OK)
+				{
+					free(*Segments);
+					*Segments = NULL;
+					return ErrorCode;
+				}
 
-	return ErrorCode;
-}
+				++*SegmentCount;
+			}
 
-GD_ERR
-GD_ReadImage(GD_DECODE_CONTEXT* Decoder, GD_GIF_HANDLE Gif)
-{
-	GD_IMAGE_DESCRIPTOR ImageDescriptor;
+			LZW_SEGMENT* Segment = &(*Segments)[*SegmentCount - 1];
 
-	ImageDescriptor.PositionLeft = GD_ReadWord(Decoder);
-	ImageDescriptor.PositionTop  = GD_ReadWord(Decoder);
-	ImageDescriptor.Width        = GD_ReadWord(Decoder);
-	ImageDescriptor.Height       = GD_ReadWord(Decoder);
-	ImageDescriptor.PackedFields = GD_ReadByte(Decoder);
+			Segment->Data = CompressedData + Position / 8;
+			Segment->Shift = (GD_BYTE)(Position % 8);
+			Segment->Output = Output;
+			continue;
+		}
+		else if (Code == CodeBreak)
+			break;
 
-	if ((ImageDescriptor.PositionLeft + ImageDescriptor.Width > Gif->ScreenDesc.LogicalWidth) ||
-		(ImageDescriptor.PositionTop + ImageDescriptor.Height > Gif->ScreenDesc.LogicalHeight))
-		return GD_UNEXPECTED_DATA;
+		if (Code > DictIndex || (Code == DictIndex && PrevCode == LZW_INVALID_CODE))
+			break;
 
-	Gif->ActivePalette = NULL;
+		const GD_WORD Length = (Code < CodeClear) ? 1 : (Code < DictIndex) ? Lengths[Code] : PrevLength + 1;
 
-	if (ImageDescriptor.PackedFields & MASK_TABLE_PRESENT)
-	{
-		GD_ReadColorTable(Decoder, &Gif->PaletteLocal, ImageDescriptor.PackedFields);
-		Gif->ActivePalette = &Gif->PaletteLocal;
-	}
-	else if (Gif->ScreenDesc.PackedFields & MASK_TABLE_PRESENT)
-		Gif->ActivePalette = &Gif->PaletteGlobal;
+		if (PrevCode != LZW_INVALID_CODE && DictIndex < (1 << LZW_MAX_CODEWIDTH))
+		{
+			Lengths[DictIndex] = PrevLength + 1;
+			++DictIndex;
 
-	if (!Gif->ActivePalette)
-		return GD_NO_COLOR_TABLE;
+			if (DictIndex == WidthEnd && Width < LZW_MAX_CODEWIDTH)
+			{
+				++Width;
+				WidthEnd <<= 1;
+			}
+		}
 
-	return GD_ProcessImageRaster(Decoder, Gif, &ImageDescriptor);
+		PrevCode = Code;
+		PrevLength = Length;
+		Output += Length;
+	}
+
+	return GD_OK;
 }
 
+/// Stops once IndexStreamLength indices were produced, the rest of the data is not decoded.
+/// IndexStream must have LZW_OUTPUT_SLACK more bytes, the last string is written entirely.
+/// Deadline is optional, it is checked every GD_BUDGET_CHECK_INTERVAL indices.
+/// Large images are split at clear codes and decoded on up to Threads threads
 GD_ERR
-GD_RegisterExRoutine(GD_EXTENSION_TYPE RoutineType, void* UserRoutine)
+GD_LzwDecompressIndexStream(GD_BYTE InitialCodeWidth,
+							GD_BYTE* CompressedData,
+							GD_DWORD CompressedDataLength,
+							GD_BYTE* IndexStream,
+							size_t IndexStreamLength,
+							const GD_QWORD* Deadline,
+							GD_DWORD Threads)
 {
-	GD_EXT_ROUTINES* Routines = NULL;
+	if (InitialCodeWidth >= LZW_MAX_CODEWIDTH)
+		return GD_UNEXPECTED_DATA;
 
-	switch (RoutineType)
-	{
-		case GD_APPLICATION: Routines = &ApplicationExtRoutines; break;
-		case GD_GRAPHICS:    Routines = &GraphicsExtRoutines;    break;
-		case GD_PLAINTEXT:   Routines = &PlaintextExtRoutines;   break;
-		case GD_COMMENT:     Routines = &CommentExtRoutines;     break;
+	LZW_JOB Jobs[GD_MAX_THREADS];
 
-		default:
-			return GD_UNEXPECTED_DATA;
+	Jobs[0].InitialCodeWidth = InitialCodeWidth;
+	Jobs[0].Data         = CompressedData;
+	Jobs[0].DataEnd      = CompressedData + CompressedDataLength;
+	Jobs[0].Shift        = 0;
+	Jobs[0].Output       = IndexStream;
+	Jobs[0].OutputLength = IndexStreamLength;
+	Jobs[0].WriteLimit   = IndexStream + IndexStreamLength + LZW_OUTPUT_SLACK;
+	Jobs[0].Deadline     = Deadline;
+	Jobs[0].Result       = GD_OK;
+
+	size_t JobCount = IndexStreamLength / GD_PARALLEL_MIN_INDICES;
+
+	if (JobCount > Threads)
+		JobCount = Threads;
+
+	if (JobCount > GD_MAX_THREADS)
+		JobCount = GD_MAX_THREADS;
+
+	if (JobCount < 2)
+		return GD_LzwKernel(&Jobs[0]);
+
+	LZW_SEGMENT* Segments;
+	size_t SegmentCount;
+
+	GD_ERR ErrorCode = GD_LzwFindSegments(InitialCodeWidth, CompressedData, CompressedDataLength, IndexStreamLength, &Segments, &SegmentCount);
+
+	if (ErrorCode != GD_OK)
+		return ErrorCode;
+
+	//
+	// Jobs start at the first segment past each share of the output, the last one
+	// also handles the end of the raster (end code, truncation)
+	//
+	size_t Count = 1;
+
+	for (size_t i = 1; i < SegmentCount && Count < JobCount; ++i)
+	{
+		if (Segments[i].Output < IndexStreamLength / JobCount * Count)
+			continue;
+
+		LZW_JOB* Job = &Jobs[Count++];
+
+		*Job = Jobs[0];
+		Job->Data   = Segments[i].Data;
+		Job->Shift  = Segments[i].Shift;
+		Job->Output = IndexStream + Segments[i].Output;
 	}
 
-	if (Routines->RegisteredCount >= MAX_REGISTERED_ROUTINES)
-		return GD_MAX_REGISTERED_ROUTINE;
+	free(Segments);
 
-	Routines->Routines[Routines->RegisteredCount++] = UserRoutine;
+	for (size_t i = 0; i + 1 < Count; ++i)
+	{
+		Jobs[i].OutputLength = (size_t)(Jobs[i + 1].Output - Jobs[i].Output);
+		Jobs[i].WriteLimit = Jobs[i + 1].Output;
+	}
+
+	Jobs[Count - 1].OutputLength = (size_t)(IndexStream + IndexStreamLength - Jobs[Count - 1].Output);
+
+	GD_TASK Tasks[GD_MAX_THREADS];
+	GD_BOOL Started[GD_MAX_THREADS];
+
+	for (size_t i = 1; i < Count; ++i)
+	{
+		Tasks[i].Routine = GD_LzwRunJob;
+		Tasks[i].Argument = &Jobs[i];
+		Started[i] = GD_TaskStart(&Tasks[i]);
+	}
+
+	GD_LzwRunJob(&Jobs[0]);
+
+	for (size_t i = 1; i < Count; ++i)
+	{
+		if (Started[i])
+			GD_TaskJoin(&Tasks[i]);
+		else
+			GD_LzwRunJob(&Jobs[i]);
+	}
+
+	for (size_t i = 0; i < Count; ++i)
+	{
+		if (Jobs[i].Result != GD_OK)
+			return Jobs[i].Result;
+	}
 
 	return GD_OK;
 }
 
-void
-GD_ClearExRoutines(GD_EXTENSION_TYPE RoutineType)
+//
+// Resumable decompressor reading the sub-blocks straight from the decoder,
+// used when images are streamed in strips instead of decoded at once
+//
+typedef struct LZW_STREAM
 {
-	GD_EXT_ROUTINES* Routines = NULL;
+	LZW_CONTEXT Lzw;
+	GD_DECODE_CONTEXT* Decoder;
+	GD_BYTE InitialCodeWidth;
+	GD_WORD PrevCode;
 
-	switch (RoutineType)
-	{
-		case GD_APPLICATION: Routines = &ApplicationExtRoutines; break;
-		case GD_GRAPHICS:    Routines = &GraphicsExtRoutines;    break;
-		case GD_PLAINTEXT:   Routines = &PlaintextExtRoutines;   break;
-		case GD_COMMENT:     Routines = &CommentExtRoutines;     break;
+	//
+	// Bits not consumed yet, refilled a byte at a time from the current sub-block
+	//
+	GD_DWORD Bits;
+	GD_BYTE BitCount;
+	GD_BYTE BlockRemaining;
+	GD_BOOL BlocksEnded;
+	GD_BOOL Ended;
+	size_t Consumed;
 
-		default: return;
-	}
+	//
+	// End of the last string, which did not fit in the output
+	//
+	GD_BYTE Pending[1 << LZW_MAX_CODEWIDTH];
+	GD_WORD PendingStart;
+	GD_WORD PendingEnd;
+} LZW_STREAM;
 
-	for (size_t i = 0; i < Routines->RegisteredCount; ++i)
-		Routines->Routines[i] = NULL;
 
-	Routines->RegisteredCount = 0;
+static void
+GD_LzwStreamInit(LZW_STREAM* Stream, GD_DECODE_CONTEXT* Decoder, GD_BYTE InitialCodeWidth)
+{
+	Stream->Decoder = Decoder;
+	Stream->InitialCodeWidth = InitialCodeWidth;
+	Stream->PrevCode = LZW_INVALID_CODE;
+	Stream->Bits = 0;
+	Stream->BitCount = 0;
+	Stream->BlockRemaining = 0;
+	Stream->BlocksEnded = GD_FALSE;
+	Stream->Consumed = 0;
+	Stream->Ended = GD_FALSE;
+	Stream->PendingStart = 0;
+	Stream->PendingEnd = 0;
+
+	if (InitialCodeWidth >= LZW_MAX_CODEWIDTH)
+		Stream->Ended = GD_TRUE;
+	else
+		GD_LzwInitContext(&Stream->Lzw, InitialCodeWidth);
 }
 
-void
-GGD_ClearAllExRoutines()
+static GD_BOOL
+GD_LzwStreamFetch(LZW_STREAM* Stream, GD_WORD* Code)
 {
-	GD_ClearExRoutines(GD_APPLICATION);
-	GD_ClearExRoutines(GD_GRAPHICS);
-	GD_ClearExRoutines(GD_PLAINTEXT);
-	GD_ClearExRoutines(GD_COMMENT);
+	const GD_BYTE Width = Stream->Lzw.CodeWidth + 1;
+
+	while (Stream->BitCount < Width)
+	{
+		if (!Stream->BlockRemaining)
+		{
+			if (Stream->BlocksEnded)
+				return GD_FALSE;
+
+			Stream->BlockRemaining = GD_ReadByte(Stream->Decoder);
+
+			if (!Stream->BlockRemaining)
+			{
+				Stream->BlocksEnded = GD_TRUE;
+				return GD_FALSE;
+			}
+		}
+
+		Stream->Bits |= (GD_DWORD)GD_ReadByte(Stream->Decoder) << Stream->BitCount;
+		Stream->BitCount += 8;
+		--Stream->BlockRemaining;
+		++Stream->Consumed;
+	}
+
+	*Code = (GD_WORD)(Stream->Bits & ((1u << Width) - 1));
+	Stream->Bits >>= Width;
+	Stream->BitCount -= Width;
+
+	return GD_TRUE;
 }
 
-void
-GD_UnregisterExRoutine(GD_EXTENSION_TYPE RoutineType, void* UserRoutine)
+/// Returns how many indices were written, less than Count once the image data ended
+static size_t
+GD_LzwStreamRead(LZW_STREAM* Stream, GD_BYTE* Output, size_t Count)
 {
-	GD_EXT_ROUTINES* Routines = NULL;
+	LZW_CONTEXT* Lzw = &Stream->Lzw;
+	size_t Produced = 0;
 
-	switch (RoutineType)
+	if (Stream->PendingStart < Stream->PendingEnd)
 	{
-		case GD_APPLICATION: Routines = &ApplicationExtRoutines; break;
-		case GD_GRAPHICS:    Routines = &GraphicsExtRoutines;    break;
-		case GD_PLAINTEXT:   Routines = &PlaintextExtRoutines;   break;
-		case GD_COMMENT:     Routines = &CommentExtRoutines;     break;
+		const size_t Available = Stream->PendingEnd - Stream->PendingStart;
+		Produced = (Available < Count) ? Available : Count;
 
-		default:
-			return;
+		memcpy(Output, Stream->Pending + Stream->PendingStart, Produced);
+		Stream->PendingStart += (GD_WORD)Produced;
 	}
 
-	//
-	// Find and shift
-	//
-	for (size_t i = 0; i < Routines->RegisteredCount; ++i)
+	while (Produced < Count && !Stream->Ended)
 	{
-		if (Routines->Routines[i] == UserRoutine)
+		GD_WORD Code;
+
+		if (!GD_LzwStreamFetch(Stream, &Code) || Code == Lzw->CodeBreak)
 		{
-			for (size_t j = i; j < Routines->RegisteredCount - 1; ++j)
-				Routines->Routines[j] = Routines->Routines[j + 1];
+			Stream->Ended = GD_TRUE;
+			break;
+		}
 
-			--Routines->RegisteredCount;
+		if (Code == Lzw->CodeClear)
+		{
+			GD_LzwInitContext(Lzw, Stream->InitialCodeWidth);
+			Stream->PrevCode = LZW_INVALID_CODE;
+			continue;
+		}
+
+		if (Code > Lzw->DictIndex || (Code == Lzw->DictIndex && Stream->PrevCode == LZW_INVALID_CODE))
+		{
+			Stream->Ended = GD_TRUE;
 			break;
 		}
+
+		if (Stream->PrevCode != LZW_INVALID_CODE && Lzw->DictIndex < (1 << LZW_MAX_CODEWIDTH))
+		{
+			GD_WORD First = (Code == Lzw->DictIndex) ? Stream->PrevCode : Code;
+
+			while (Lzw->Dictionary[First].Prefix != LZW_INVALID_CODE)
+				First = Lzw->Dictionary[First].Prefix;
+
+			Lzw->Dictionary[Lzw->DictIndex].Suffix = Lzw->Dictionary[First].Suffix;
+			Lzw->Dictionary[Lzw->DictIndex].Prefix = Stream->PrevCode;
+			Lzw->Dictionary[Lzw->DictIndex].Length = Lzw->Dictionary[Stream->PrevCode].Length + 1;
+			++Lzw->DictIndex;
+
+			if (Lzw->DictIndex == (1 << (Lzw->CodeWidth + 1)) && Lzw->CodeWidth < 11)
+			{
+				++Lzw->CodeWidth;
+				Lzw->DictCount = 1 << Lzw->CodeWidth;
+			}
+		}
+
+		Stream->PrevCode = Code;
+
+		//
+		// Strings are built backwards, the last one goes through Pending when it does not fit
+		//
+		const GD_WORD Length = Lzw->Dictionary[Code].Length;
+		const size_t Room = Count - Produced;
+		GD_BYTE* Target = (Length <= Room) ? Output + Produced : Stream->Pending;
+
+		while (Code != LZW_INVALID_CODE)
+		{
+			const LZW_TABLE_ENTRY* Entry = &Lzw->Dictionary[Code];
+
+			Target[Entry->Length - 1] = Entry->Suffix;
+			Code = Entry->Prefix;
+		}
+
+		if (Target == Stream->Pending)
+		{
+			memcpy(Output + Produced, Stream->Pending, Room);
+			Stream->PendingStart = (GD_WORD)Room;
+			Stream->PendingEnd = Length;
+			Produced = Count;
+		}
+		else
+		{
+			Produced += Length;
+		}
 	}
+
+	return Produced;
 }
 
-GD_GIF_HANDLE
-GD_DecodeInternal(GD_DECODE_CONTEXT* Decoder, GD_ERR* ErrorCode)
+static void
+GD_LzwStreamFinish(LZW_STREAM* Stream)
 {
 	//
-	// Allocate the GIF structure
+	// Skip whatever follows the end code, up to the block terminator
 	//
-	GD_GIF_HANDLE Gif = malloc(sizeof(GD_GIF));
+	if (Stream->BlocksEnded)
+		return;
 
-	if (!Gif)
+	if (GD_DecoderAdvance(Stream->Decoder, Stream->BlockRemaining) == GD_OK)
+		GD_IgnoreSubDataBlocks(Stream->Decoder);
+}
+
+//
+// Interlaced images store rows in 4 passes: every 8th row from 0, every 8th row from 4,
+// every 4th row from 2, then every odd row
+//
+static const GD_BYTE InterlacePassStart[4] = { 0, 4, 2, 1 };
+static const GD_BYTE InterlacePassStep[4]  = { 8, 8, 4, 2 };
+
+static size_t
+GD_StoredRow(GD_WORD Row, GD_WORD Height, GD_BOOL Interlaced)
+{
+	if (!Interlaced)
+		return Row;
+
+	size_t Stored = 0;
+
+	for (int Pass = 0; Pass < 4; ++Pass)
 	{
-		*ErrorCode = GD_NOMEM;
-		return NULL;
+		const GD_WORD Start = InterlacePassStart[Pass];
+		const GD_WORD Step = InterlacePassStep[Pass];
+
+		if (Row >= Start && (Row - Start) % Step == 0)
+			return Stored + (Row - Start) / Step;
+
+		if (Height > Start)
+			Stored += (Height - Start + Step - 1) / Step;
 	}
 
-	Gif->Frames = NULL;
-	Gif->FrameCount = 0;
-	Gif->ActivePalette = NULL;
+	return Stored;
+}
 
-	//
-	// Verify header's signature and version
-	//
-	*ErrorCode = GD_ValidateHeader(Decoder, &Gif->Version);
+static void
+GD_ClipToSource(GD_GIF_HANDLE Gif, const GD_IMAGE_DESCRIPTOR* ImageDescriptor, GD_RECT* Visible)
+{
+	const GD_RECT* Source = &Gif->SourceRect;
 
-	if (*ErrorCode != GD_OK)
+	const GD_DWORD ImageRight  = (GD_DWORD)ImageDescriptor->PositionLeft + ImageDescriptor->Width;
+	const GD_DWORD ImageBottom = (GD_DWORD)ImageDescriptor->PositionTop + ImageDescriptor->Height;
+	const GD_DWORD SourceRight  = (GD_DWORD)Source->Left + Source->Width;
+	const GD_DWORD SourceBottom = (GD_DWORD)Source->Top + Source->Height;
+
+	const GD_DWORD Left   = (ImageDescriptor->PositionLeft > Source->Left) ? ImageDescriptor->PositionLeft : Source->Left;
+	const GD_DWORD Top    = (ImageDescriptor->PositionTop > Source->Top) ? ImageDescriptor->PositionTop : Source->Top;
+	const GD_DWORD Right  = (ImageRight < SourceRight) ? ImageRight : SourceRight;
+	const GD_DWORD Bottom = (ImageBottom < SourceBottom) ? ImageBottom : SourceBottom;
+
+	if (Right <= Left || Bottom <= Top)
 	{
-		free(Gif);
-		return NULL;
+		Visible->Left = Visible->Top = Visible->Width = Visible->Height = 0;
+		return;
 	}
 
-	//
-	// Read Logical Screen Descriptor
-	//
-	GD_ReadScreenDescriptor(Decoder, &Gif->ScreenDesc);
+	Visible->Left   = (GD_WORD)Left;
+	Visible->Top    = (GD_WORD)Top;
+	Visible->Width  = (GD_WORD)(Right - Left);
+	Visible->Height = (GD_WORD)(Bottom - Top);
+}
 
+static size_t
+GD_IndicesNeeded(const GD_IMAGE_DESCRIPTOR* ImageDescriptor, const GD_RECT* Visible)
+{
 	//
-	// Read the GCT immediately after if bit is set in LOGICAL_SCREEN_DESCRIPTOR.PackedFields
+	// Length of the index stream prefix holding every visible row. Interlaced rows
+	// are spread over the passes, the last one needed is not always the bottom one
 	//
-	if (Gif->ScreenDesc.PackedFields & MASK_TABLE_PRESENT)
-		GD_ReadColorTable(Decoder, &Gif->PaletteGlobal, Gif->ScreenDesc.PackedFields);
+	const GD_BOOL Interlaced = (ImageDescriptor->PackedFields & MASK_INTERLACED) ? GD_TRUE : GD_FALSE;
+	const GD_WORD FirstRow = Visible->Top - ImageDescriptor->PositionTop;
+	size_t Rows = 0;
 
-	//
-	// Process blocks
-	//
-	GD_BYTE b;
-	while ((b = GD_ReadByte(Decoder)) != TRAILER)
+	for (GD_WORD y = FirstRow; y < FirstRow + Visible->Height; ++y)
 	{
-		switch (b)
-		{
-			case BLOCK_INTRODUCER_EXT:
-				*ErrorCode = GD_ReadExtension(Decoder);
-				break;
-
-			case BLOCK_INTRODUCER_IMG:
-				*ErrorCode = GD_ReadImage(Decoder, Gif);
-				break;
-
-			default:
-				*ErrorCode = GD_UNEXPECTED_DATA;
-				break;
-		}
+		const size_t Stored = GD_StoredRow(y, ImageDescriptor->Height, Interlaced) + 1;
 
-		if (*ErrorCode != GD_OK)
-		{
-			free(Gif);
-			return NULL;
-		}
+		if (Stored > Rows)
+			Rows = Stored;
 	}
 
-	return Gif;
+	return Rows * ImageDescriptor->Width;
 }
 
-GD_GIF_HANDLE
-GD_OpenGif(const char* Path, GD_ERR* ErrorCode, size_t* ErrorBytePos)
+static void
+GD_ExtractVisible(const GD_BYTE* IndexStream, GD_BYTE* Output, const GD_IMAGE_DESCRIPTOR* ImageDescriptor, const GD_RECT* Visible)
 {
-	GD_DECODE_CONTEXT Decoder;
+	//
+	// Deinterlaces and crops in the same pass
+	//
+	const GD_BOOL Interlaced = (ImageDescriptor->PackedFields & MASK_INTERLACED) ? GD_TRUE : GD_FALSE;
+	const GD_WORD FirstRow = Visible->Top - ImageDescriptor->PositionTop;
+	const GD_WORD FirstColumn = Visible->Left - ImageDescriptor->PositionLeft;
 
-	*ErrorCode = GD_InitDecodeContextStream(&Decoder, Path);
+	for (size_t y = 0; y < Visible->Height; ++y)
+	{
+		const size_t Stored = GD_StoredRow((GD_WORD)(FirstRow + y), ImageDescriptor->Height, Interlaced);
 
-	if (*ErrorCode != GD_OK)
-		return NULL;
+		memcpy(Output + y * Visible->Width, IndexStream + Stored * ImageDescriptor->Width + FirstColumn, Visible->Width);
+	}
+}
 
-	GD_GIF_HANDLE Gif = GD_DecodeInternal(&Decoder, ErrorCode);
+static void
+GD_ComputeOpaqueRect(const GD_FRAME* Frame, const GD_BYTE* IndexStream, const GD_RECT* Visible, GD_RECT* OpaqueRect)
+{
+	*OpaqueRect = *Visible;
 
-	if (!Gif && ErrorBytePos)
-		*ErrorBytePos = Decoder.DataStreamOffset;
+	if (!Frame->HasTransparency)
+		return;
 
-	free(Decoder.StreamFd);
+	GD_WORD MinX = Visible->Width, MaxX = 0;
+	GD_WORD MinY = Visible->Height, MaxY = 0;
 
-	return Gif;
-}
+	for (GD_WORD y = 0; y < Visible->Height; ++y)
+	{
+		const GD_BYTE* Row = IndexStream + (size_t)y * Visible->Width;
 
-GD_GIF_HANDLE
-GD_FromMemory(const void* Buffer, size_t BufferSize, GD_ERR* ErrorCode, size_t* ErrorBytePos)
-{
-	GD_DECODE_CONTEXT Decoder;
+		GD_WORD x = 0;
+		while (x < Visible->Width && Row[x] == Frame->TransparentIndex)
+			++x;
 
-	*ErrorCode = GD_InitDecodeContextMemory(&Decoder, Buffer, BufferSize);
+		if (x == Visible->Width)
+			continue;
 
-	if (*ErrorCode != GD_OK)
-		return NULL;
+		GD_WORD Last = Visible->Width - 1;
+		while (Row[Last] == Frame->TransparentIndex)
+			--Last;
 
-	GD_GIF_HANDLE Gif = GD_DecodeInternal(&Decoder, ErrorCode);
+		if (x < MinX) MinX = x;
+		if (Last > MaxX) MaxX = Last;
+		if (y < MinY) MinY = y;
+		MaxY = y;
+	}
 
-	if (!Gif && ErrorBytePos)
-		*ErrorBytePos = Decoder.DataStreamOffset;
+	if (MinY == Visible->Height)
+	{
+		OpaqueRect->Width  = 0;
+		OpaqueRect->Height = 0;
+		return;
+	}
 
-	return Gif;
+	OpaqueRect->Left   = Visible->Left + MinX;
+	OpaqueRect->Top    = Visible->Top + MinY;
+	OpaqueRect->Width  = MaxX - MinX + 1;
+	OpaqueRect->Height = MaxY - MinY + 1;
 }
 
-void
-GD_CloseGif(GD_GIF_HANDLE Gif)
+static void
+GD_MapToCanvas(GD_GIF_HANDLE Gif, const GD_RECT* Source, GD_RECT* Canvas)
 {
-	for (GD_DWORD FrameIndex = 0; FrameIndex < Gif->FrameCount; ++FrameIndex)
+	if (!Source->Width || !Source->Height)
 	{
-		GD_FRAME* Current = &Gif->Frames[FrameIndex];
-		free(Current->Buffer);
+		Canvas->Left = Canvas->Top = Canvas->Width = Canvas->Height = 0;
+		return;
 	}
 
-	free(Gif->Frames);
+	const GD_WORD Left = Source->Left - Gif->SourceRect.Left;
+	const GD_WORD Top = Source->Top - Gif->SourceRect.Top;
 
-	free(Gif);
+	if (!Gif->Scaled)
+	{
+		Canvas->Left   = Left;
+		Canvas->Top    = Top;
+		Canvas->Width  = Source->Width;
+		Canvas->Height = Source->Height;
+		return;
+	}
+
+	//
+	// Canvas pixels touched by the source rectangle, even partially
+	//
+	Canvas->Left   = Gif->ScaleMapX[Left];
+	Canvas->Top    = Gif->ScaleMapY[Top];
+	Canvas->Width  = Gif->ScaleMapX[Left + Source->Width - 1] - Canvas->Left + 1;
+	Canvas->Height = Gif->ScaleMapY[Top + Source->Height - 1] - Canvas->Top + 1;
 }
 
-GD_DWORD
-GD_FrameCount(GD_GIF_HANDLE Gif)
+//
+// Accumulates GD_FRAME_STATS row by row, while the rows are expanded
+//
+typedef struct GD_STATS_BUILDER
 {
-	return Gif->FrameCount;
-}
+	GD_FRAME_STATS* Stats;
+	const GD_GIF_COLOR* Colors;
+	GD_WORD Width;
+	GD_WORD Height;
 
-GD_FRAME*
-GD_GetFrame(GD_GIF_HANDLE Gif, GD_DWORD FrameIndex)
+	//
+	// Luma and opacity of each index, both 0 for the transparent one
+	//
+	GD_DWORD Luma[GCT_MAX_SIZE];
+	GD_BYTE Opaque[GCT_MAX_SIZE];
+
+	// Columns [BlockStart[x], BlockStart[x + 1]) fall in block column x
+	GD_DWORD BlockStart[9];
+	GD_QWORD BlockLuma[64];
+	GD_DWORD BlockCount[64];
+} GD_STATS_BUILDER;
+
+
+static void
+GD_StatsBegin(GD_STATS_BUILDER* Builder, GD_GIF_HANDLE Gif, GD_FRAME* Frame, GD_WORD Width, GD_WORD Height)
 {
-	if (!Gif || FrameIndex >= Gif->FrameCount)
-		return NULL;
+	memset(Builder, 0, sizeof(GD_STATS_BUILDER));
+	memset(Frame->Stats, 0, sizeof(GD_FRAME_STATS));
+
+	Builder->Stats = Frame->Stats;
+	Builder->Colors = Gif->ActivePalette->Expanded;
+	Builder->Width = Width;
+	Builder->Height = Height;
+
+	//
+	// Luma is worked out once per palette entry, YCbCr colors already carry it
+	//
+	for (int i = 0; i < GCT_MAX_SIZE; ++i)
+	{
+		const GD_GIF_COLOR Color = Builder->Colors[i];
+
+		Builder->Luma[i] = (Gif->Options.ColorSpace == GD_COLOR_SPACE_YCBCR) ? Color.r : (77 * Color.r + 150 * Color.g + 29 * Color.b) >> 8;
+		Builder->Opaque[i] = 1;
+	}
+
+	if (Frame->HasTransparency)
+	{
+		Builder->Luma[Frame->TransparentIndex] = 0;
+		Builder->Opaque[Frame->TransparentIndex] = 0;
+	}
+
+	for (int x = 0; x <= 8; ++x)
+		Builder->BlockStart[x] = (GD_DWORD)x * Width / 8;
+}
+
+/// Out is optional, it receives the expanded row
+static void
+GD_StatsRow(GD_STATS_BUILDER* Builder, const GD_BYTE* Row, GD_WORD y, GD_GIF_COLOR* Out)
+{
+	GD_DWORD* Histogram = Builder->Stats->Histogram;
+	const size_t BlockRow = ((size_t)y * 8 / Builder->Height) * 8;
+
+	for (int BlockX = 0; BlockX < 8; ++BlockX)
+	{
+		GD_QWORD Luma = 0;
+		GD_DWORD Count = 0;
+
+		const GD_DWORD End = Builder->BlockStart[BlockX + 1];
+
+		if (Out)
+		{
+			for (GD_DWORD x = Builder->BlockStart[BlockX]; x < End; ++x)
+			{
+				const GD_BYTE Index = Row[x];
+
+				Out[x] = Builder->Colors[Index];
+				++Histogram[Index];
+				Luma += Builder->Luma[Index];
+				Count += Builder->Opaque[Index];
+			}
+		}
+		else
+		{
+			for (GD_DWORD x = Builder->BlockStart[BlockX]; x < End; ++x)
+			{
+				const GD_BYTE Index = Row[x];
+
+				++Histogram[Index];
+				Luma += Builder->Luma[Index];
+				Count += Builder->Opaque[Index];
+			}
+		}
+
+		Builder->BlockLuma[BlockRow + BlockX] += Luma;
+		Builder->BlockCount[BlockRow + BlockX] += Count;
+	}
+}
+
+static void
+GD_StatsEnd(GD_STATS_BUILDER* Builder)
+{
+	GD_FRAME_STATS* Stats = Builder->Stats;
+
+	//
+	// The mean color only depends on how many times each entry is used
+	//
+	GD_QWORD Sum[3] = { 0, 0, 0 };
+
+	for (int i = 0; i < GCT_MAX_SIZE; ++i)
+	{
+		const GD_QWORD Count = (GD_QWORD)Stats->Histogram[i] * Builder->Opaque[i];
+
+		Sum[0] += Count * Builder->Colors[i].r;
+		Sum[1] += Count * Builder->Colors[i].g;
+		Sum[2] += Count * Builder->Colors[i].b;
+		Stats->OpaqueCount += (GD_DWORD)Count;
+	}
+
+	if (Stats->OpaqueCount)
+	{
+		Stats->MeanColor.r = (GD_BYTE)((Sum[0] + Stats->OpaqueCount / 2) / Stats->OpaqueCount);
+		Stats->MeanColor.g = (GD_BYTE)((Sum[1] + Stats->OpaqueCount / 2) / Stats->OpaqueCount);
+		Stats->MeanColor.b = (GD_BYTE)((Sum[2] + Stats->OpaqueCount / 2) / Stats->OpaqueCount);
+	}
+
+	GD_DWORD BlockMean[64];
+	GD_QWORD Total = 0;
+
+	for (int i = 0; i < 64; ++i)
+	{
+		BlockMean[i] = Builder->BlockCount[i] ? (GD_DWORD)(Builder->BlockLuma[i] / Builder->BlockCount[i]) : 0;
+		Total += BlockMean[i];
+	}
+
+	for (int i = 0; i < 64; ++i)
+	{
+		if ((GD_QWORD)BlockMean[i] * 64 > Total)
+			Stats->AverageHash |= (GD_QWORD)1 << i;
+	}
+}
+
+static GD_ERR
+GD_ExpandFrameScaled(GD_GIF_HANDLE Gif, GD_FRAME* Frame, const GD_BYTE* IndexStream, const GD_RECT* Visible,
+                     GD_STATS_BUILDER* Builder)
+{
+	const GD_RECT* Region = &Frame->Region;
+	const GD_GIF_COLOR* Colors = Gif->ActivePalette->Expanded;
+	const size_t RegionSize = (size_t)Region->Width * Region->Height;
+
+	Frame->Buffer = GD_SharedAlloc(sizeof(GD_GIF_COLOR) * RegionSize);
+	Frame->Alpha = GD_SharedAlloc(RegionSize);
+
+	//
+	// Sums of one canvas row: r, g, b and the number of opaque source pixels
+	//
+	GD_DWORD* Sums = calloc((size_t)Region->Width * 4, sizeof(GD_DWORD));
+
+	if (!Frame->Buffer || !Frame->Alpha || !Sums)
+	{
+		free(Sums);
+		return GD_NOMEM;
+	}
+
+	const GD_WORD* MapX = Gif->ScaleMapX + (Visible->Left - Gif->SourceRect.Left);
+	const GD_WORD* MapY = Gif->ScaleMapY + (Visible->Top - Gif->SourceRect.Top);
+	const int Transparent = Frame->HasTransparency ? Frame->TransparentIndex : -1;
+	GD_BOOL Opaque = GD_TRUE;
+
+	for (size_t y = 0; y < Visible->Height; ++y)
+	{
+		const GD_BYTE* Row = IndexStream + y * Visible->Width;
+
+		if (Builder)
+			GD_StatsRow(Builder, Row, (GD_WORD)y, NULL);
+
+		for (size_t x = 0; x < Visible->Width; ++x)
+		{
+			if (Row[x] == Transparent)
+				continue;
+
+			GD_DWORD* Sum = Sums + (MapX[x] - Region->Left) * 4;
+			const GD_GIF_COLOR Color = Colors[Row[x]];
+
+			Sum[0] += Color.r;
+			Sum[1] += Color.g;
+			Sum[2] += Color.b;
+			Sum[3] += 1;
+		}
+
+		//
+		// Flush the canvas row once its last source row is accumulated
+		//
+		const GD_WORD CanvasY = MapY[y];
+
+		if (y + 1 < Visible->Height && MapY[y + 1] == CanvasY)
+			continue;
+
+		GD_GIF_COLOR* Out = Frame->Buffer + (size_t)(CanvasY - Region->Top) * Region->Width;
+		GD_BYTE* OutAlpha = Frame->Alpha + (size_t)(CanvasY - Region->Top) * Region->Width;
+
+		for (size_t x = 0; x < Region->Width; ++x)
+		{
+			GD_DWORD* Sum = Sums + x * 4;
+			const GD_DWORD Count = Sum[3];
+			const GD_DWORD Area = (GD_DWORD)Gif->ScaleSpanX[Region->Left + x] * Gif->ScaleSpanY[CanvasY];
+
+			if (Count)
+			{
+				Out[x].r = (GD_BYTE)((Sum[0] + Count / 2) / Count);
+				Out[x].g = (GD_BYTE)((Sum[1] + Count / 2) / Count);
+				Out[x].b = (GD_BYTE)((Sum[2] + Count / 2) / Count);
+			}
+			else
+			{
+				Out[x].r = Out[x].g = Out[x].b = 0;
+			}
+
+			OutAlpha[x] = (GD_BYTE)((Count * 255 + Area / 2) / Area);
+
+			if (Count != Area)
+				Opaque = GD_FALSE;
+
+			Sum[0] = Sum[1] = Sum[2] = Sum[3] = 0;
+		}
+	}
+
+	free(Sums);
+
+	if (Opaque)
+	{
+		GD_SharedRelease(Frame->Alpha);
+		Frame->Alpha = NULL;
+	}
+
+	return GD_OK;
+}
+
+static size_t
+GD_PackBound(size_t Size)
+{
+	return Size + Size / 255 + 16;
+}
+
+static GD_BYTE*
+GD_PackLength(GD_BYTE* Output, size_t Length)
+{
+	//
+	// Lengths that do not fit a token nibble continue in bytes, 255 meaning more follow
+	//
+	for (; Length >= 255; Length -= 255)
+		*Output++ = 255;
+
+	*Output++ = (GD_BYTE)Length;
+
+	return Output;
+}
+
+static GD_BYTE*
+GD_PackSequence(GD_BYTE* Output, const GD_BYTE* Literals, size_t LiteralCount, size_t Offset, size_t MatchLength)
+{
+	//
+	// Token: literal count in the high nibble, match length - GD_PACK_MIN_MATCH in the low one.
+	// The last sequence has no match, the unpacker knows the size and stops before it
+	//
+	const size_t MatchCode = MatchLength ? MatchLength - GD_PACK_MIN_MATCH : 0;
+
+	*Output++ = (GD_BYTE)(((LiteralCount < 15 ? LiteralCount : 15) << 4) | (MatchCode < 15 ? MatchCode : 15));
+
+	if (LiteralCount >= 15)
+		Output = GD_PackLength(Output, LiteralCount - 15);
+
+	memcpy(Output, Literals, LiteralCount);
+	Output += LiteralCount;
+
+	if (!MatchLength)
+		return Output;
+
+	*Output++ = (GD_BYTE)(Offset & 0xFF);
+	*Output++ = (GD_BYTE)(Offset >> 8);
+
+	if (MatchCode >= 15)
+		Output = GD_PackLength(Output, MatchCode - 15);
+
+	return Output;
+}
+
+/// Output must hold GD_PackBound(Size) bytes, returns the packed size
+static size_t
+GD_PackIndices(const GD_BYTE* Input, size_t Size, GD_BYTE* Output)
+{
+	// Position + 1 of the last occurrence of each hashed 4-byte sequence, 0 when none
+	GD_DWORD Table[1 << GD_PACK_HASH_BITS];
+	memset(Table, 0, sizeof(Table));
+
+	GD_BYTE* Out = Output;
+	size_t Anchor = 0, Position = 0, Misses = 0;
+
+	const size_t Limit = Size > GD_PACK_MIN_MATCH ? Size - GD_PACK_MIN_MATCH : 0;
+
+	while (Position < Limit)
+	{
+		GD_DWORD Sequence;
+		memcpy(&Sequence, Input + Position, sizeof(Sequence));
+
+		const GD_DWORD Hash = (GD_DWORD)(Sequence * 2654435761u) >> (32 - GD_PACK_HASH_BITS);
+		const size_t Candidate = Table[Hash];
+
+		Table[Hash] = (GD_DWORD)(Position + 1);
+
+		if (Candidate && Position - (Candidate - 1) <= GD_PACK_MAX_OFFSET &&
+			memcmp(Input + Candidate - 1, &Sequence, sizeof(Sequence)) == 0)
+		{
+			const size_t Match = Candidate - 1;
+			size_t Length = GD_PACK_MIN_MATCH;
+
+			while (Position + Length < Size && Input[Match + Length] == Input[Position + Length])
+				++Length;
+
+			Out = GD_PackSequence(Out, Input + Anchor, Position - Anchor, Position - Match, Length);
+
+			Position += Length;
+			Anchor = Position;
+			Misses = 0;
+		}
+		else
+		{
+			//
+			// Step faster through data that does not compress, noise and dithering
+			//
+			Position += 1 + (Misses++ >> 5);
+		}
+	}
+
+	Out = GD_PackSequence(Out, Input + Anchor, Size - Anchor, 0, 0);
+
+	return (size_t)(Out - Output);
+}
+
+static size_t
+GD_UnpackLength(const GD_BYTE** Input)
+{
+	size_t Length = 0;
+	GD_BYTE b;
+
+	do
+	{
+		b = *(*Input)++;
+		Length += b;
+	} while (b == 255);
+
+	return Length;
+}
+
+/// Output receives exactly Size indices, Input must come from GD_PackIndices
+static void
+GD_UnpackIndices(const GD_BYTE* Input, GD_BYTE* Output, size_t Size)
+{
+	GD_BYTE* const End = Output + Size;
+
+	while (Output < End)
+	{
+		const GD_BYTE Token = *Input++;
+
+		size_t Count = Token >> 4;
+
+		if (Count == 15)
+			Count += GD_UnpackLength(&Input);
+
+		memcpy(Output, Input, Count);
+		Output += Count;
+		Input += Count;
+
+		if (Output >= End)
+			break;
+
+		const size_t Offset = Input[0] | ((size_t)Input[1] << 8);
+		Input += 2;
+
+		Count = Token & 15;
+
+		if (Count == 15)
+			Count += GD_UnpackLength(&Input);
+
+		Count += GD_PACK_MIN_MATCH;
+
+		//
+		// Matches may overlap what they produce, a run of one index is the common case
+		//
+		const GD_BYTE* Match = Output - Offset;
+
+		if (Offset == 1)
+			memset(Output, *Match, Count);
+		else if (Offset >= Count)
+			memcpy(Output, Match, Count);
+		else
+			for (size_t i = 0; i < Count; ++i)
+				Output[i] = Match[i];
+
+		Output += Count;
+	}
+}
+
+static GD_ERR
+GD_StoreFrame(GD_GIF_HANDLE Gif, GD_DWORD FrameIndex, const GD_BYTE* IndexStream, size_t PixelCount)
+{
+	GD_BYTE* Packed = GD_SharedAlloc(GD_PackBound(PixelCount));
+
+	if (!Packed)
+		return GD_NOMEM;
+
+	const size_t PackedSize = GD_PackIndices(IndexStream, PixelCount, Packed);
+
+	Gif->Stored[FrameIndex].Packed = GD_SharedShrink(Packed, PackedSize);
+	Gif->Stored[FrameIndex].PackedSize = PackedSize;
+
+	if (PixelCount > Gif->UnpackedSize)
+		Gif->UnpackedSize = PixelCount;
+
+	return GD_OK;
+}
+
+GD_FRAME_CACHE_HANDLE
+GD_CreateFrameCache(size_t ByteBudget, GD_DWORD MaxFrames)
+{
+	GD_FRAME_CACHE_HANDLE Cache = calloc(1, sizeof(GD_FRAME_CACHE));
+
+	if (!Cache)
+		return NULL;
+
+	Cache->ByteBudget = ByteBudget;
+	Cache->MaxFrames = MaxFrames;
+
+	return Cache;
+}
+
+void
+GD_DestroyFrameCache(GD_FRAME_CACHE_HANDLE Cache)
+{
+	free(Cache);
+}
+
+static void
+GD_CacheUnlink(GD_FRAME_CACHE* Cache, GD_CACHE_NODE* Node)
+{
+	if (Node->Newer)
+		Node->Newer->Older = Node->Older;
+	else
+		Cache->Newest = Node->Older;
+
+	if (Node->Older)
+		Node->Older->Newer = Node->Newer;
+	else
+		Cache->Oldest = Node->Newer;
+}
+
+static void
+GD_CachePushNewest(GD_FRAME_CACHE* Cache, GD_CACHE_NODE* Node)
+{
+	Node->Newer = NULL;
+	Node->Older = Cache->Newest;
+
+	if (Cache->Newest)
+		Cache->Newest->Newer = Node;
+	else
+		Cache->Oldest = Node;
+
+	Cache->Newest = Node;
+}
+
+/// Drop an expanded frame, it is unpacked again the next time it is asked for
+static void
+GD_CacheRemove(GD_FRAME_CACHE* Cache, GD_CACHE_NODE* Node)
+{
+	GD_FRAME* Frame = &Node->Gif->Frames[Node->FrameIndex];
+
+	GD_SharedRelease(Frame->Buffer);
+	GD_SharedRelease(Frame->Indices);
+
+	Frame->Buffer = NULL;
+	Frame->Indices = NULL;
+
+	Node->Gif->Stored[Node->FrameIndex].Node = NULL;
+
+	GD_CacheUnlink(Cache, Node);
+
+	Cache->Size -= Node->Size;
+	--Cache->FrameCount;
+
+	free(Node);
+}
+
+static void
+GD_CacheInsert(GD_FRAME_CACHE* Cache, GD_CACHE_NODE* Node)
+{
+	//
+	// Make room from the least recently used end. A frame larger than the whole
+	// budget is still kept, alone, until the next one comes in
+	//
+	while (Cache->Oldest &&
+		   ((Cache->ByteBudget && Cache->Size + Node->Size > Cache->ByteBudget) ||
+		    (Cache->MaxFrames && Cache->FrameCount >= Cache->MaxFrames)))
+	{
+		GD_CacheRemove(Cache, Cache->Oldest);
+		++Cache->Evictions;
+	}
+
+	GD_CachePushNewest(Cache, Node);
+
+	Cache->Size += Node->Size;
+	++Cache->FrameCount;
+}
+
+/// Fill Buffer (and Indices when the frame keeps them) of a packed frame and
+/// hand it to the cache
+static GD_ERR
+GD_ExpandStoredFrame(GD_GIF_HANDLE Gif, GD_DWORD FrameIndex)
+{
+	GD_FRAME* Frame = &Gif->Frames[FrameIndex];
+	GD_STORED_FRAME* Stored = &Gif->Stored[FrameIndex];
+
+	const GD_BOOL KeepIndices = (Frame->HasTransparency || (Gif->Options.Flags & GD_DECODE_KEEP_INDICES)) ? GD_TRUE : GD_FALSE;
+	const size_t PixelCount = (size_t)Frame->Region.Width * Frame->Region.Height;
+
+	GD_CACHE_NODE* Node = malloc(sizeof(GD_CACHE_NODE));
+	GD_BYTE* Indices = GD_SharedAlloc(sizeof(GD_BYTE) * PixelCount);
+	GD_GIF_COLOR* Buffer = GD_SharedAlloc(sizeof(GD_GIF_COLOR) * PixelCount);
+
+	if (!Node || !Indices || !Buffer)
+	{
+		free(Node);
+		GD_SharedRelease(Indices);
+		GD_SharedRelease(Buffer);
+		return GD_NOMEM;
+	}
+
+	const GD_QWORD Start = GD_Now();
+
+	GD_UnpackIndices(Stored->Packed, Indices, PixelCount);
+
+	const GD_GIF_COLOR* Colors = Gif->Palettes[Frame->PaletteIndex]->Expanded;
+
+	for (size_t i = 0; i < PixelCount; ++i)
+		Buffer[i] = Colors[Indices[i]];
+
+	Stored->ExpandTime = (GD_DWORD)((GD_Now() - Start) / 1000);
+	++Gif->Cache->Misses;
+
+	Frame->Buffer = Buffer;
+
+	if (KeepIndices)
+		Frame->Indices = Indices;
+	else
+		GD_SharedRelease(Indices);
+
+	Node->Gif = Gif;
+	Node->FrameIndex = FrameIndex;
+	Node->Size = PixelCount * (sizeof(GD_GIF_COLOR) + (KeepIndices ? 1 : 0));
+
+	GD_CacheInsert(Gif->Cache, Node);
+	Stored->Node = Node;
+
+	return GD_OK;
+}
+
+static GD_ERR
+GD_PushFrame(GD_GIF_HANDLE Gif, const GD_IMAGE_DESCRIPTOR* ImageDescriptor, const GD_EXT_GRAPHICS* Graphics, GD_FRAME** Frame)
+{
+	if (Gif->FrameCount > 0)
+	{
+		GD_FRAME* Tmp = (GD_FRAME*)realloc(Gif->Frames, (Gif->FrameCount + 1) * sizeof(GD_FRAME));
+
+		if (!Tmp)
+			return GD_NOMEM;
+
+		Gif->Frames = Tmp;
+	}
+	else
+	{
+		Gif->Frames = (GD_FRAME*)malloc(sizeof(GD_FRAME));
+
+		if (!Gif->Frames)
+			return GD_NOMEM;
+	}
+
+	if (Gif->PackFrames)
+	{
+		GD_STORED_FRAME* Stored = realloc(Gif->Stored, (Gif->FrameCount + 1) * sizeof(GD_STORED_FRAME));
+
+		if (!Stored)
+			return GD_NOMEM;
+
+		Gif->Stored = Stored;
+		memset(&Gif->Stored[Gif->FrameCount], 0, sizeof(GD_STORED_FRAME));
+	}
+
+	GD_FRAME* Back = &Gif->Frames[Gif->FrameCount];
+
+	memcpy(&Back->Descriptor, ImageDescriptor, sizeof(GD_IMAGE_DESCRIPTOR));
+
+	Back->Buffer           = NULL;
+	Back->DisposalMethod   = GD_DISPOSAL_UNSPECIFIED;
+	Back->DelayTime        = 0;
+	Back->HasTransparency  = GD_FALSE;
+	Back->TransparentIndex = 0;
+	Back->Palette          = &Gif->ActivePalette->Table;
+	Back->PaletteIndex     = Gif->ActivePalette->Index;
+	Back->Indices          = NULL;
+	Back->Alpha            = NULL;
+	Back->Stats            = NULL;
+	Back->DuplicateOf      = Gif->FrameCount;
+
+	GD_RECT Visible;
+	GD_ClipToSource(Gif, ImageDescriptor, &Visible);
+	GD_MapToCanvas(Gif, &Visible, &Back->Region);
+	Back->OpaqueRect = Back->Region;
+
+	if (Graphics)
+	{
+		Back->DisposalMethod   = (GD_DISPOSAL_METHOD)GRAPHICS_DISPOSAL(Graphics->PackedFields);
+		Back->DelayTime        = Graphics->DelayTime;
+		Back->HasTransparency  = (Graphics->PackedFields & MASK_TRANSPARENCY) ? GD_TRUE : GD_FALSE;
+		Back->TransparentIndex = Graphics->TransparentColorIndex;
+	}
+
+	++Gif->FrameCount;
+	*Frame = Back;
+
+	return GD_OK;
+}
+
+typedef struct GD_EXPAND_CONTEXT
+{
+	const GD_BYTE* Indices;
+	GD_GIF_COLOR* Pixels;
+	const GD_GIF_COLOR* Colors;
+	size_t Width;
+} GD_EXPAND_CONTEXT;
+
+static void
+GD_ExpandBand(void* Argument, size_t FirstRow, size_t RowCount)
+{
+	const GD_EXPAND_CONTEXT* Context = (const GD_EXPAND_CONTEXT*)Argument;
+
+	const size_t Start = FirstRow * Context->Width;
+	const size_t End = Start + RowCount * Context->Width;
+
+	for (size_t i = Start; i < End; ++i)
+		Context->Pixels[i] = Context->Colors[Context->Indices[i]];
+}
+
+/// Takes ownership of IndexStream, which must come from GD_SharedAlloc and only
+/// hold the part of the image inside the decoded region
+GD_ERR
+GD_AppendFrame(GD_GIF_HANDLE Gif, GD_IMAGE_DESCRIPTOR* ImageDescriptor, const GD_EXT_GRAPHICS* Graphics, GD_BYTE* IndexStream)
+{
+	GD_FRAME* Back;
+
+	GD_ERR ErrorCode = GD_PushFrame(Gif, ImageDescriptor, Graphics, &Back);
+
+	if (ErrorCode != GD_OK)
+	{
+		GD_SharedRelease(IndexStream);
+		return ErrorCode;
+	}
+
+	GD_RECT Visible, OpaqueRect;
+	GD_ClipToSource(Gif, ImageDescriptor, &Visible);
+	GD_ComputeOpaqueRect(Back, IndexStream, &Visible, &OpaqueRect);
+	GD_MapToCanvas(Gif, &OpaqueRect, &Back->OpaqueRect);
+
+	GD_STATS_BUILDER Builder;
+	GD_STATS_BUILDER* Stats = NULL;
+
+	if (Gif->Options.Flags & GD_DECODE_FRAME_STATS)
+	{
+		Back->Stats = GD_SharedAlloc(sizeof(GD_FRAME_STATS));
+
+		if (!Back->Stats)
+		{
+			GD_SharedRelease(IndexStream);
+			return GD_NOMEM;
+		}
+
+		Stats = &Builder;
+		GD_StatsBegin(Stats, Gif, Back, Visible.Width, Visible.Height);
+	}
+
+	if (Gif->Scaled)
+	{
+		ErrorCode = GD_ExpandFrameScaled(Gif, Back, IndexStream, &Visible, Stats);
+
+		if (Stats && ErrorCode == GD_OK)
+			GD_StatsEnd(Stats);
+
+		GD_SharedRelease(IndexStream);
+		return ErrorCode;
+	}
+
+	const size_t PixelCount = (size_t)Visible.Width * Visible.Height;
+
+	if (Gif->PackFrames)
+	{
+		//
+		// Nothing is expanded until the frame is asked for
+		//
+		if (Stats)
+		{
+			for (GD_WORD y = 0; y < Visible.Height; ++y)
+				GD_StatsRow(Stats, IndexStream + (size_t)y * Visible.Width, y, NULL);
+
+			GD_StatsEnd(Stats);
+		}
+
+		ErrorCode = GD_StoreFrame(Gif, Gif->FrameCount - 1, IndexStream, PixelCount);
+
+		GD_SharedRelease(IndexStream);
+		return ErrorCode;
+	}
+
+	Back->Buffer = GD_SharedAlloc(sizeof(GD_GIF_COLOR) * PixelCount);
+
+	if (!Back->Buffer)
+	{
+		GD_SharedRelease(IndexStream);
+		return GD_NOMEM;
+	}
+
+	const GD_GIF_COLOR* Colors = Gif->ActivePalette->Expanded;
+
+	if (Stats)
+	{
+		//
+		// Analytics ride along the expansion, row by row
+		//
+		for (GD_WORD y = 0; y < Visible.Height; ++y)
+			GD_StatsRow(Stats, IndexStream + (size_t)y * Visible.Width, y, Back->Buffer + (size_t)y * Visible.Width);
+
+		GD_StatsEnd(Stats);
+	}
+	else
+	{
+		GD_EXPAND_CONTEXT Context;
+
+		Context.Indices = IndexStream;
+		Context.Pixels  = Back->Buffer;
+		Context.Colors  = Colors;
+		Context.Width   = Visible.Width;
+
+		GD_RunBands(GD_ExpandBand, &Context, Visible.Height, Visible.Width, Gif->Options.Threads);
+	}
+
+	//
+	// The compositor needs the indices to tell transparent pixels apart
+	//
+	if (Back->HasTransparency || (Gif->Options.Flags & GD_DECODE_KEEP_INDICES))
+		Back->Indices = IndexStream;
+	else
+		GD_SharedRelease(IndexStream);
+
+	return GD_OK;
+}
+
+static GD_ERR
+GD_AppendDuplicateFrame(GD_GIF_HANDLE Gif, GD_IMAGE_DESCRIPTOR* ImageDescriptor, const GD_EXT_GRAPHICS* Graphics, GD_DWORD OriginalIndex)
+{
+	GD_FRAME* Back;
+
+	const GD_ERR ErrorCode = GD_PushFrame(Gif, ImageDescriptor, Graphics, &Back);
+
+	if (ErrorCode != GD_OK)
+		return ErrorCode;
+
+	const GD_FRAME* Original = &Gif->Frames[OriginalIndex];
+
+	Back->DuplicateOf = OriginalIndex;
+	Back->Buffer  = GD_SharedRetain(Original->Buffer);
+	Back->Indices = GD_SharedRetain(Original->Indices);
+	Back->Alpha   = GD_SharedRetain(Original->Alpha);
+	Back->Stats   = GD_SharedRetain(Original->Stats);
+
+	if (Gif->PackFrames)
+	{
+		Gif->Stored[Gif->FrameCount - 1].Packed = GD_SharedRetain(Gif->Stored[OriginalIndex].Packed);
+		Gif->Stored[Gif->FrameCount - 1].PackedSize = Gif->Stored[OriginalIndex].PackedSize;
+	}
+
+	//
+	// Same pixels, only the position on the screen may differ
+	//
+	Back->OpaqueRect = Original->OpaqueRect;
+	Back->OpaqueRect.Left += ImageDescriptor->PositionLeft - Original->Descriptor.PositionLeft;
+	Back->OpaqueRect.Top  += ImageDescriptor->PositionTop - Original->Descriptor.PositionTop;
+
+	return GD_OK;
+}
+
+static void
+GD_MakeFrameKey(GD_GIF_HANDLE Gif, GD_FRAME_KEY* Key, const GD_IMAGE_DESCRIPTOR* ImageDescriptor,
+                const GD_EXT_GRAPHICS* Graphics, GD_BYTE LzwCodeWidth, const GD_RECT* Visible)
+{
+	//
+	// Keys are compared with memcmp, padding must be zero. Palettes are interned so
+	// comparing their address is enough
+	//
+	memset(Key, 0, sizeof(GD_FRAME_KEY));
+
+	Key->Palette      = Gif->ActivePalette;
+	Key->Width        = ImageDescriptor->Width;
+	Key->Height       = ImageDescriptor->Height;
+	Key->Interlaced   = (ImageDescriptor->PackedFields & MASK_INTERLACED) ? 1 : 0;
+	Key->LzwCodeWidth = LzwCodeWidth;
+
+	//
+	// Decoded pixels depend on which part of the image survives the region clip,
+	// relative to the image so that moved copies still match
+	//
+	Key->VisibleLeft   = (GD_WORD)(Visible->Left - ImageDescriptor->PositionLeft);
+	Key->VisibleTop    = (GD_WORD)(Visible->Top - ImageDescriptor->PositionTop);
+	Key->VisibleWidth  = Visible->Width;
+	Key->VisibleHeight = Visible->Height;
+
+	//
+	// Downscaled pixels also depend on how the image lines up with the canvas grid
+	//
+	if (Gif->Scaled)
+	{
+		Key->PositionLeft = ImageDescriptor->PositionLeft;
+		Key->PositionTop  = ImageDescriptor->PositionTop;
+	}
+
+	if (Graphics && (Graphics->PackedFields & MASK_TRANSPARENCY))
+	{
+		Key->HasTransparency  = 1;
+		Key->TransparentIndex = Graphics->TransparentColorIndex;
+	}
+}
+
+static GD_DUPLICATE_ENTRY*
+GD_FindDuplicateSlot(GD_DECODE_CONTEXT* Decoder, GD_QWORD Hash, const GD_FRAME_KEY* Key,
+                     const GD_BYTE* CompressedData, GD_DWORD CompressedDataLength)
+{
+	const size_t Mask = Decoder->DuplicateCapacity - 1;
+
+	for (size_t Slot = Hash & Mask; ; Slot = (Slot + 1) & Mask)
+	{
+		GD_DUPLICATE_ENTRY* Entry = &Decoder->Duplicates[Slot];
+
+		if (!Entry->CompressedData)
+			return Entry;
+
+		//
+		// Never trust the hash alone, a collision would silently show the wrong image
+		//
+		if (Entry->Hash == Hash &&
+		    Entry->CompressedDataLength == CompressedDataLength &&
+		    memcmp(&Entry->Key, Key, sizeof(GD_FRAME_KEY)) == 0 &&
+		    memcmp(Entry->CompressedData, CompressedData, CompressedDataLength) == 0)
+		{
+			return Entry;
+		}
+	}
+}
+
+static GD_ERR
+GD_GrowDuplicates(GD_DECODE_CONTEXT* Decoder)
+{
+	const size_t OldCapacity = Decoder->DuplicateCapacity;
+	GD_DUPLICATE_ENTRY* OldEntries = Decoder->Duplicates;
+
+	const size_t NewCapacity = OldCapacity ? OldCapacity * 2 : 16;
+	GD_DUPLICATE_ENTRY* NewEntries = calloc(NewCapacity, sizeof(GD_DUPLICATE_ENTRY));
+
+	if (!NewEntries)
+		return GD_NOMEM;
+
+	Decoder->Duplicates = NewEntries;
+	Decoder->DuplicateCapacity = NewCapacity;
+
+	for (size_t i = 0; i < OldCapacity; ++i)
+	{
+		if (!OldEntries[i].CompressedData)
+			continue;
+
+		const size_t Mask = NewCapacity - 1;
+		size_t Slot = OldEntries[i].Hash & Mask;
+
+		while (NewEntries[Slot].CompressedData)
+			Slot = (Slot + 1) & Mask;
+
+		NewEntries[Slot] = OldEntries[i];
+	}
+
+	free(OldEntries);
+
+	return GD_OK;
+}
+
+/// Takes ownership of CompressedData
+static void
+GD_RememberFrame(GD_DECODE_CONTEXT* Decoder, GD_QWORD Hash, const GD_FRAME_KEY* Key,
+                 GD_BYTE* CompressedData, GD_DWORD CompressedDataLength, GD_DWORD FrameIndex)
+{
+	//
+	// Keep the load factor under 1/2. Failing here only means later copies get decoded again
+	//
+	if ((Decoder->DuplicateCount + 1) * 2 > Decoder->DuplicateCapacity && GD_GrowDuplicates(Decoder) != GD_OK)
+	{
+		free(CompressedData);
+		return;
+	}
+
+	GD_DUPLICATE_ENTRY* Entry = GD_FindDuplicateSlot(Decoder, Hash, Key, CompressedData, CompressedDataLength);
+
+	//
+	// An entry refused by the region check stays, later copies still match the first one
+	//
+	if (Entry->CompressedData)
+	{
+		free(CompressedData);
+		return;
+	}
+
+	Entry->Hash = Hash;
+	Entry->FrameIndex = FrameIndex;
+	Entry->Key = *Key;
+	Entry->CompressedData = CompressedData;
+	Entry->CompressedDataLength = CompressedDataLength;
+
+	++Decoder->DuplicateCount;
+}
+
+static void
+GD_FreeDuplicates(GD_DECODE_CONTEXT* Decoder)
+{
+	for (size_t i = 0; i < Decoder->DuplicateCapacity; ++i)
+		free(Decoder->Duplicates[i].CompressedData);
+
+	free(Decoder->Duplicates);
+
+	Decoder->Duplicates = NULL;
+	Decoder->DuplicateCapacity = 0;
+	Decoder->DuplicateCount = 0;
+}
+
+static GD_ERR
+GD_ChargeDecode(GD_DECODE_CONTEXT* Decoder, GD_GIF_HANDLE Gif, size_t Decompressed, size_t ImageDecompressed, size_t ImageCompressed)
+{
+	//
+	// Decompressed is what is about to be produced, the ratio applies to the image so far
+	//
+	const GD_DECODE_OPTIONS* Options = &Gif->Options;
+
+	Decoder->DecodedBytes += Decompressed;
+
+	if (Options->MaxTotalBytes && Decoder->DecodedBytes > Options->MaxTotalBytes)
+		return GD_LIMIT_TOTAL_BYTES;
+
+	if (Options->MaxCompressionRatio && ImageDecompressed > (GD_QWORD)ImageCompressed * Options->MaxCompressionRatio)
+		return GD_LIMIT_RATIO;
+
+	if (Decoder->HasDeadline && GD_Now() > Decoder->Deadline)
+		return GD_LIMIT_TIME;
+
+	return GD_OK;
+}
+
+static GD_ERR
+GD_StreamImageRaster(GD_DECODE_CONTEXT* Decoder, GD_GIF_HANDLE Gif, GD_IMAGE_DESCRIPTOR* ImageDescriptor,
+                     const GD_EXT_GRAPHICS* Graphics, GD_BYTE LzwCodeWidth)
+{
+	GD_FRAME* Back;
+	GD_ERR ErrorCode = GD_PushFrame(Gif, ImageDescriptor, Graphics, &Back);
+
+	if (ErrorCode != GD_OK)
+		return ErrorCode;
+
+	const GD_WORD Width = ImageDescriptor->Width;
+	const GD_WORD Height = ImageDescriptor->Height;
+	const GD_WORD BandHeight = Gif->Options.StripHeight ? Gif->Options.StripHeight : GD_DEFAULT_STRIP_HEIGHT;
+	const size_t BandSize = (size_t)Width * BandHeight;
+
+	LZW_STREAM* Stream = malloc(sizeof(LZW_STREAM));
+	GD_BYTE* Indices = malloc(BandSize ? BandSize : 1);
+	GD_GIF_COLOR* Pixels = malloc(sizeof(GD_GIF_COLOR) * (BandSize ? BandSize : 1));
+
+	if (!Stream || !Indices || !Pixels)
+	{
+		free(Stream);
+		free(Indices);
+		free(Pixels);
+		return GD_NOMEM;
+	}
+
+	GD_LzwStreamInit(Stream, Decoder, LzwCodeWidth);
+
+	GD_STATS_BUILDER Builder;
+	GD_STATS_BUILDER* Stats = NULL;
+
+	if (Gif->Options.Flags & GD_DECODE_FRAME_STATS)
+	{
+		Back->Stats = GD_SharedAlloc(sizeof(GD_FRAME_STATS));
+
+		if (!Back->Stats)
+		{
+			free(Stream);
+			free(Indices);
+			free(Pixels);
+			return GD_NOMEM;
+		}
+
+		Stats = &Builder;
+		GD_StatsBegin(Stats, Gif, Back, Width, Height);
+	}
+
+	GD_STRIP Strip;
+	Strip.FrameIndex = Gif->FrameCount - 1;
+	Strip.Frame = Back;
+	Strip.Width = Width;
+	Strip.Pixels = Pixels;
+	Strip.Indices = Indices;
+
+	const GD_BOOL Interlaced = (ImageDescriptor->PackedFields & MASK_INTERLACED) ? GD_TRUE : GD_FALSE;
+	const int PassCount = Interlaced ? 4 : 1;
+	const GD_GIF_COLOR* Colors = Gif->ActivePalette->Expanded;
+
+	size_t Decompressed = 0;
+
+	for (int Pass = 0; Pass < PassCount && Width && ErrorCode == GD_OK; ++Pass)
+	{
+		const GD_WORD Start = Interlaced ? InterlacePassStart[Pass] : 0;
+		const GD_WORD Step = Interlaced ? InterlacePassStep[Pass] : 1;
+
+		for (GD_DWORD Row = Start; Row < Height; Row += (GD_DWORD)Step * BandHeight)
+		{
+			const GD_DWORD RowsLeft = (Height - Row + Step - 1) / Step;
+			const GD_WORD RowCount = (RowsLeft < BandHeight) ? (GD_WORD)RowsLeft : BandHeight;
+			const size_t Count = (size_t)RowCount * Width;
+
+			//
+			// Truncated image data leaves the rest of the image at index 0
+			//
+			const size_t Produced = GD_LzwStreamRead(Stream, Indices, Count);
+			memset(Indices + Produced, 0, Count - Produced);
+
+			Decompressed += Produced;
+			ErrorCode = GD_ChargeDecode(Decoder, Gif, Produced, Decompressed, Stream->Consumed);
+
+			if (ErrorCode != GD_OK)
+				break;
+
+			if (Stats)
+			{
+				for (GD_WORD r = 0; r < RowCount; ++r)
+					GD_StatsRow(Stats, Indices + (size_t)r * Width, (GD_WORD)(Row + r * Step), Pixels + (size_t)r * Width);
+			}
+			else
+			{
+				for (size_t i = 0; i < Count; ++i)
+					Pixels[i] = Colors[Indices[i]];
+			}
+
+			Strip.FirstRow = (GD_WORD)Row;
+			Strip.RowStep = Step;
+			Strip.RowCount = RowCount;
+
+			Gif->Options.StripRoutine(&Strip, Gif->Options.StripUserData);
+		}
+	}
+
+	GD_LzwStreamFinish(Stream);
+
+	if (Stats && ErrorCode == GD_OK)
+		GD_StatsEnd(Stats);
+
+	free(Stream);
+	free(Indices);
+	free(Pixels);
+
+	return ErrorCode;
+}
+
+GD_ERR
+GD_ProcessImageRaster(GD_DECODE_CONTEXT* Decoder, GD_GIF_HANDLE Gif, GD_IMAGE_DESCRIPTOR* ImageDescriptor)
+{
+	const GD_BYTE LzwCodeWidth = GD_ReadByte(Decoder);
+
+	const GD_EXT_GRAPHICS* Graphics = Decoder->HasPendingGraphics ? &Decoder->PendingGraphics : NULL;
+	Decoder->HasPendingGraphics = GD_FALSE;
+
+	if (Gif->Options.StripRoutine)
+		return GD_StreamImageRaster(Decoder, Gif, ImageDescriptor, Graphics, LzwCodeWidth);
+
+	//
+	// Part of the image inside the decoded region, in screen coordinates
+	//
+	GD_RECT Visible;
+	GD_ClipToSource(Gif, ImageDescriptor, &Visible);
+
+	if (!Visible.Width || !Visible.Height)
+	{
+		//
+		// Nothing to decode, the frame is kept for its timing and disposal
+		//
+		GD_FRAME* Back;
+		GD_IgnoreSubDataBlocks(Decoder);
+
+		return GD_PushFrame(Gif, ImageDescriptor, Graphics, &Back);
+	}
+
+	GD_BYTE* CompressedData = NULL;
+	GD_DWORD CompressedDataLength = 0;
+	GD_ERR ErrorCode = GD_BlocksToLinearBuffer(Decoder, &CompressedData, &CompressedDataLength);
+
+	if (ErrorCode != GD_OK)
+		return ErrorCode;
+
+	const GD_BOOL Clipped = (Visible.Width != ImageDescriptor->Width || Visible.Height != ImageDescriptor->Height) ? GD_TRUE : GD_FALSE;
+	const GD_BOOL Interlaced = (ImageDescriptor->PackedFields & MASK_INTERLACED) ? GD_TRUE : GD_FALSE;
+
+	//
+	// Images repeated in the data stream (static holds, ping-pong loops, ...) share
+	// the buffers of their first occurrence instead of being decoded again
+	//
+	GD_FRAME_KEY Key;
+	GD_MakeFrameKey(Gif, &Key, ImageDescriptor, Graphics, LzwCodeWidth, &Visible);
+
+	const GD_QWORD Hash = GD_Hash64(CompressedData, CompressedDataLength, GD_Hash64(&Key, sizeof(Key), 0));
+
+	if (Decoder->DuplicateCount)
+	{
+		const GD_DUPLICATE_ENTRY* Entry = GD_FindDuplicateSlot(Decoder, Hash, &Key, CompressedData, CompressedDataLength);
+
+		//
+		// The shared buffers are only valid if they cover as many canvas pixels as
+		// this image would, a mismatch means the key missed something
+		//
+		GD_RECT Region;
+		GD_MapToCanvas(Gif, &Visible, &Region);
+
+		if (Entry->CompressedData &&
+		    Gif->Frames[Entry->FrameIndex].Region.Width == Region.Width &&
+		    Gif->Frames[Entry->FrameIndex].Region.Height == Region.Height)
+		{
+			free(CompressedData);
+			return GD_AppendDuplicateFrame(Gif, ImageDescriptor, Graphics, Entry->FrameIndex);
+		}
+	}
+
+	//
+	// Only decode up to the last row needed, the remaining codes are never unpacked
+	//
+	const size_t DecompressedDataLength = GD_IndicesNeeded(ImageDescriptor, &Visible);
+
+	ErrorCode = GD_ChargeDecode(Decoder, Gif, DecompressedDataLength, DecompressedDataLength, CompressedDataLength);
+
+	if (ErrorCode != GD_OK)
+	{
+		free(CompressedData);
+		return ErrorCode;
+	}
+
+	GD_BYTE* DecompressedData = GD_SharedAlloc(sizeof(GD_BYTE) * (DecompressedDataLength + LZW_OUTPUT_SLACK));
+
+	if (!DecompressedData)
+	{
+		free(CompressedData);
+		return GD_NOMEM;
+	}
+
+	ErrorCode = GD_LzwDecompressIndexStream(LzwCodeWidth, CompressedData, CompressedDataLength, DecompressedData, DecompressedDataLength,
+	                                        Decoder->HasDeadline ? &Decoder->Deadline : NULL, Gif->Options.Threads);
+
+	if (!GD_SUCCESS(ErrorCode))
+	{
+		free(CompressedData);
+		GD_SharedRelease(DecompressedData);
+		return ErrorCode;
+	}
+
+	if (!Clipped && !Interlaced)
+	{
+		// The frame may keep the buffer, give the slack back
+		DecompressedData = GD_SharedShrink(DecompressedData, DecompressedDataLength);
+	}
+	else
+	{
+		GD_BYTE* Extracted = GD_SharedAlloc(sizeof(GD_BYTE) * Visible.Width * Visible.Height);
+
+		if (!Extracted)
+		{
+			free(CompressedData);
+			GD_SharedRelease(DecompressedData);
+			return GD_NOMEM;
+		}
+
+		GD_ExtractVisible(DecompressedData, Extracted, ImageDescriptor, &Visible);
+
+		GD_SharedRelease(DecompressedData);
+		DecompressedData = Extracted;
+	}
+
+	ErrorCode = GD_AppendFrame(Gif, ImageDescriptor, Graphics, DecompressedData);
+
+	if (ErrorCode != GD_OK)
+	{
+		free(CompressedData);
+		return ErrorCode;
+	}
+
+	GD_RememberFrame(Decoder, Hash, &Key, CompressedData, CompressedDataLength, Gif->FrameCount - 1);
+
+	return GD_OK;
+}
+
+static GD_GIF_COLOR
+GD_RgbToYCbCr(GD_GIF_COLOR Color)
+{
+	//
+	// BT.601 limited range, 8-bit fixed point
+	//
+	const int r = Color.r, g = Color.g, b = Color.b;
+
+	GD_GIF_COLOR YCbCr;
+
+	YCbCr.r = (GD_BYTE)(((66 * r + 129 * g + 25 * b + 128) >> 8) + 16);
+	YCbCr.g = (GD_BYTE)(((-38 * r - 74 * g + 112 * b + 128) >> 8) + 128);
+	YCbCr.b = (GD_BYTE)(((112 * r - 94 * g - 18 * b + 128) >> 8) + 128);
+
+	return YCbCr;
+}
+
+static GD_GIF_COLOR
+GD_ToColorSpace(GD_GIF_HANDLE Gif, GD_GIF_COLOR Color)
+{
+	if (Gif->Options.ColorSpace == GD_COLOR_SPACE_YCBCR)
+		return GD_RgbToYCbCr(Color);
+
+	return Color;
+}
+
+static GD_ERR
+GD_GrowPaletteSlots(GD_GIF_HANDLE Gif)
+{
+	const size_t SlotCount = Gif->PaletteSlotCount ? Gif->PaletteSlotCount * 2 : 16;
+	GD_DWORD* Slots = calloc(SlotCount, sizeof(GD_DWORD));
+
+	if (!Slots)
+		return GD_NOMEM;
+
+	for (GD_DWORD i = 0; i < Gif->PaletteCount; ++i)
+	{
+		size_t Slot = Gif->Palettes[i]->Hash & (SlotCount - 1);
+
+		while (Slots[Slot])
+			Slot = (Slot + 1) & (SlotCount - 1);
+
+		Slots[Slot] = i + 1;
+	}
+
+	free(Gif->PaletteSlots);
+
+	Gif->PaletteSlots = Slots;
+	Gif->PaletteSlotCount = SlotCount;
+
+	return GD_OK;
+}
+
+static GD_ERR
+GD_InternPalette(GD_GIF_HANDLE Gif, const GD_COLOR_TABLE* Table, GD_PALETTE** Palette)
+{
+	//
+	// Entries past Count are zeroed so out of range indices always read black
+	//
+	GD_COLOR_TABLE Normalized;
+
+	memset(&Normalized, 0, sizeof(Normalized));
+	Normalized.Count = Table->Count;
+	memcpy(Normalized.Internal, Table->Internal, sizeof(GD_GIF_COLOR) * Table->Count);
+
+	const GD_QWORD Hash = GD_Hash64(&Normalized, sizeof(Normalized), 0);
+
+	if ((Gif->PaletteCount + 1) * 2 > Gif->PaletteSlotCount)
+	{
+		const GD_ERR ErrorCode = GD_GrowPaletteSlots(Gif);
+
+		if (ErrorCode != GD_OK)
+			return ErrorCode;
+	}
+
+	const size_t Mask = Gif->PaletteSlotCount - 1;
+	size_t Slot = Hash & Mask;
+
+	for (; Gif->PaletteSlots[Slot]; Slot = (Slot + 1) & Mask)
+	{
+		GD_PALETTE* Candidate = Gif->Palettes[Gif->PaletteSlots[Slot] - 1];
+
+		if (Candidate->Hash == Hash && memcmp(&Candidate->Table, &Normalized, sizeof(Normalized)) == 0)
+		{
+			*Palette = Candidate;
+			return GD_OK;
+		}
+	}
+
+	GD_PALETTE** Palettes = realloc(Gif->Palettes, (Gif->PaletteCount + 1) * sizeof(GD_PALETTE*));
+
+	if (!Palettes)
+		return GD_NOMEM;
+
+	Gif->Palettes = Palettes;
+
+	GD_PALETTE* NewPalette = malloc(sizeof(GD_PALETTE));
+
+	if (!NewPalette)
+		return GD_NOMEM;
+
+	NewPalette->Table = Normalized;
+	NewPalette->Hash  = Hash;
+	NewPalette->Index = Gif->PaletteCount;
+
+	for (size_t i = 0; i < GCT_MAX_SIZE; ++i)
+		NewPalette->Expanded[i] = GD_ToColorSpace(Gif, Normalized.Internal[i]);
+
+	Gif->Palettes[Gif->PaletteCount++] = NewPalette;
+	Gif->PaletteSlots[Slot] = Gif->PaletteCount;
+
+	*Palette = NewPalette;
+
+	return GD_OK;
+}
+
+GD_ERR
+GD_ReadImage(GD_DECODE_CONTEXT* Decoder, GD_GIF_HANDLE Gif)
+{
+	GD_IMAGE_DESCRIPTOR ImageDescriptor;
+
+	ImageDescriptor.PositionLeft = GD_ReadWord(Decoder);
+	ImageDescriptor.PositionTop  = GD_ReadWord(Decoder);
+	ImageDescriptor.Width        = GD_ReadWord(Decoder);
+	ImageDescriptor.Height       = GD_ReadWord(Decoder);
+	ImageDescriptor.PackedFields = GD_ReadByte(Decoder);
+
+	if ((ImageDescriptor.PositionLeft + ImageDescriptor.Width > Gif->ScreenDesc.LogicalWidth) ||
+		(ImageDescriptor.PositionTop + ImageDescriptor.Height > Gif->ScreenDesc.LogicalHeight))
+		return GD_UNEXPECTED_DATA;
+
+	const GD_DECODE_OPTIONS* Options = &Gif->Options;
+
+	if (Options->MaxFrames && Gif->FrameCount >= Options->MaxFrames)
+		return GD_LIMIT_FRAMES;
+
+	if (Decoder->HasDeadline && GD_Now() > Decoder->Deadline)
+		return GD_LIMIT_TIME;
+
+	if (Options->MaxFramePixels && (GD_QWORD)ImageDescriptor.Width * ImageDescriptor.Height > Options->MaxFramePixels)
+		return GD_LIMIT_PIXELS;
+
+	Gif->ActivePalette = NULL;
+
+	if (ImageDescriptor.PackedFields & MASK_TABLE_PRESENT)
+	{
+		GD_COLOR_TABLE PaletteLocal;
+		GD_ReadColorTable(Decoder, &PaletteLocal, ImageDescriptor.PackedFields);
+
+		const GD_ERR ErrorCode = GD_InternPalette(Gif, &PaletteLocal, &Gif->ActivePalette);
+
+		if (ErrorCode != GD_OK)
+			return ErrorCode;
+	}
+	else
+		Gif->ActivePalette = Gif->PaletteGlobal;
+
+	if (!Gif->ActivePalette)
+		return GD_NO_COLOR_TABLE;
+
+	return GD_ProcessImageRaster(Decoder, Gif, &ImageDescriptor);
+}
+
+GD_ERR
+GD_RegisterExRoutine(GD_EXTENSION_TYPE RoutineType, void* UserRoutine)
+{
+	GD_EXT_ROUTINES* Routines = NULL;
+
+	switch (RoutineType)
+	{
+		case GD_APPLICATION: Routines = &ApplicationExtRoutines; break;
+		case GD_GRAPHICS:    Routines = &GraphicsExtRoutines;    break;
+		case GD_PLAINTEXT:   Routines = &PlaintextExtRoutines;   break;
+		case GD_COMMENT:     Routines = &CommentExtRoutines;     break;
+
+		default:
+			return GD_UNEXPECTED_DATA;
+	}
+
+	if (Routines->RegisteredCount >= MAX_REGISTERED_ROUTINES)
+		return GD_MAX_REGISTERED_ROUTINE;
+
+	Routines->AppIdFilter[Routines->RegisteredCount] = GD_FALSE;
+	Routines->Routines[Routines->RegisteredCount++] = UserRoutine;
+
+	return GD_OK;
+}
+
+GD_ERR
+GD_RegisterAppExRoutine(const char* AppId, GD_EXT_ROUTINE_APPLICATION UserRoutine)
+{
+	GD_EXT_ROUTINES* Routines = &ApplicationExtRoutines;
+
+	if (!AppId)
+		return GD_UNEXPECTED_DATA;
+
+	if (Routines->RegisteredCount >= MAX_REGISTERED_ROUTINES)
+		return GD_MAX_REGISTERED_ROUTINE;
+
+	//
+	// Shorter identifiers are padded with zeroes
+	//
+	GD_BYTE* Id = Routines->AppIds[Routines->RegisteredCount];
+	memset(Id, 0, sizeof(Routines->AppIds[0]));
+
+	for (size_t i = 0; i < sizeof(Routines->AppIds[0]) && AppId[i]; ++i)
+		Id[i] = (GD_BYTE)AppId[i];
+
+	Routines->AppIdFilter[Routines->RegisteredCount] = GD_TRUE;
+	Routines->Routines[Routines->RegisteredCount++] = (void*)UserRoutine;
+
+	return GD_OK;
+}
+
+void
+GD_ClearExRoutines(GD_EXTENSION_TYPE RoutineType)
+{
+	GD_EXT_ROUTINES* Routines = NULL;
+
+	switch (RoutineType)
+	{
+		case GD_APPLICATION: Routines = &ApplicationExtRoutines; break;
+		case GD_GRAPHICS:    Routines = &GraphicsExtRoutines;    break;
+		case GD_PLAINTEXT:   Routines = &PlaintextExtRoutines;   break;
+		case GD_COMMENT:     Routines = &CommentExtRoutines;     break;
+
+		default: return;
+	}
+
+	for (size_t i = 0; i < Routines->RegisteredCount; ++i)
+	{
+		Routines->Routines[i] = NULL;
+		Routines->AppIdFilter[i] = GD_FALSE;
+	}
+
+	Routines->RegisteredCount = 0;
+}
+
+void
+GGD_ClearAllExRoutines()
+{
+	GD_ClearExRoutines(GD_APPLICATION);
+	GD_ClearExRoutines(GD_GRAPHICS);
+	GD_ClearExRoutines(GD_PLAINTEXT);
+	GD_ClearExRoutines(GD_COMMENT);
+}
+
+void
+GD_UnregisterExRoutine(GD_EXTENSION_TYPE RoutineType, void* UserRoutine)
+{
+	GD_EXT_ROUTINES* Routines = NULL;
+
+	switch (RoutineType)
+	{
+		case GD_APPLICATION: Routines = &ApplicationExtRoutines; break;
+		case GD_GRAPHICS:    Routines = &GraphicsExtRoutines;    break;
+		case GD_PLAINTEXT:   Routines = &PlaintextExtRoutines;   break;
+		case GD_COMMENT:     Routines = &CommentExtRoutines;     break;
+
+		default:
+			return;
+	}
+
+	//
+	// Find and shift
+	//
+	for (size_t i = 0; i < Routines->RegisteredCount; ++i)
+	{
+		if (Routines->Routines[i] == UserRoutine)
+		{
+			for (size_t j = i; j < Routines->RegisteredCount - 1; ++j)
+			{
+				Routines->Routines[j] = Routines->Routines[j + 1];
+				Routines->AppIdFilter[j] = Routines->AppIdFilter[j + 1];
+				memcpy(Routines->AppIds[j], Routines->AppIds[j + 1], sizeof(Routines->AppIds[j]));
+			}
+
+			--Routines->RegisteredCount;
+			break;
+		}
+	}
+}
+
+static GD_ERR
+GD_BuildScaleMap(GD_WORD SourceSize, GD_WORD TargetSize, GD_WORD** Map, GD_WORD** Span)
+{
+	*Map = malloc(sizeof(GD_WORD) * SourceSize);
+	*Span = calloc(TargetSize, sizeof(GD_WORD));
+
+	if (!*Map || !*Span)
+		return GD_NOMEM;
+
+	for (GD_DWORD i = 0; i < SourceSize; ++i)
+	{
+		(*Map)[i] = (GD_WORD)((i * TargetSize) / SourceSize);
+		++(*Span)[(*Map)[i]];
+	}
+
+	return GD_OK;
+}
+
+static GD_ERR
+GD_SetupCanvasSize(GD_GIF_HANDLE Gif)
+{
+	const GD_RECT* Region = &Gif->Options.Region;
+	GD_RECT* Source = &Gif->SourceRect;
+
+	Source->Left = 0;
+	Source->Top = 0;
+	Source->Width = Gif->ScreenDesc.LogicalWidth;
+	Source->Height = Gif->ScreenDesc.LogicalHeight;
+
+	if (Region->Width && Region->Height && !Gif->Options.StripRoutine)
+	{
+		//
+		// Keep the part of the requested region that is on the screen
+		//
+		if (Region->Left >= Source->Width || Region->Top >= Source->Height)
+			return GD_UNEXPECTED_DATA;
+
+		Source->Left = Region->Left;
+		Source->Top = Region->Top;
+		Source->Width = ((GD_DWORD)Region->Left + Region->Width > Source->Width) ? Source->Width - Region->Left : Region->Width;
+		Source->Height = ((GD_DWORD)Region->Top + Region->Height > Source->Height) ? Source->Height - Region->Top : Region->Height;
+	}
+
+	const GD_WORD Width = Source->Width;
+	const GD_WORD Height = Source->Height;
+
+	GD_DWORD TargetWidth = Gif->Options.TargetWidth;
+	GD_DWORD TargetHeight = Gif->Options.TargetHeight;
+
+	Gif->CanvasWidth = Width;
+	Gif->CanvasHeight = Height;
+
+	if ((!TargetWidth && !TargetHeight) || !Width || !Height || Gif->Options.StripRoutine)
+		return GD_OK;
+
+	//
+	// Follow the aspect ratio for a missing dimension, and only ever shrink
+	//
+	if (!TargetWidth)
+		TargetWidth = (Width * TargetHeight + Height / 2) / Height;
+
+	if (!TargetHeight)
+		TargetHeight = (Height * TargetWidth + Width / 2) / Width;
+
+	if (TargetWidth > Width || !TargetWidth)
+		TargetWidth = TargetWidth ? Width : 1;
+
+	if (TargetHeight > Height || !TargetHeight)
+		TargetHeight = TargetHeight ? Height : 1;
+
+	if (TargetWidth == Width && TargetHeight == Height)
+		return GD_OK;
+
+	Gif->CanvasWidth = (GD_WORD)TargetWidth;
+	Gif->CanvasHeight = (GD_WORD)TargetHeight;
+	Gif->Scaled = GD_TRUE;
+
+	const GD_ERR ErrorCode = GD_BuildScaleMap(Width, Gif->CanvasWidth, &Gif->ScaleMapX, &Gif->ScaleSpanX);
+
+	if (ErrorCode != GD_OK)
+		return ErrorCode;
+
+	return GD_BuildScaleMap(Height, Gif->CanvasHeight, &Gif->ScaleMapY, &Gif->ScaleSpanY);
+}
+
+void
+GD_InitDecodeOptions(GD_DECODE_OPTIONS* Options)
+{
+	Options->Flags = 0;
+	Options->ColorSpace = GD_COLOR_SPACE_RGB;
+	Options->TargetWidth = 0;
+	Options->TargetHeight = 0;
+	Options->ScaleFilter = GD_FILTER_BOX;
+	memset(&Options->Region, 0, sizeof(GD_RECT));
+	Options->StripRoutine = NULL;
+	Options->StripUserData = NULL;
+	Options->StripHeight = 0;
+	Options->MaxFramePixels = 0;
+	Options->MaxTotalBytes = 0;
+	Options->MaxFrames = 0;
+	Options->MaxCompressionRatio = 0;
+	Options->TimeBudget = 0;
+	Options->WorkingSet = 0;
+	Options->CacheBudget = 0;
+	Options->FrameCache = NULL;
+	Options->Threads = 0;
+}
+
+GD_GIF_HANDLE
+GD_DecodeInternal(GD_DECODE_CONTEXT* Decoder, const GD_DECODE_OPTIONS* Options, GD_ERR* ErrorCode)
+{
+	//
+	// Allocate the GIF structure
+	//
+	GD_GIF_HANDLE Gif = malloc(sizeof(GD_GIF));
+
+	if (!Gif)
+	{
+		*ErrorCode = GD_NOMEM;
+		return NULL;
+	}
+
+	Gif->Frames = NULL;
+	Gif->FrameCount = 0;
+	Gif->PaletteGlobal = NULL;
+	Gif->ActivePalette = NULL;
+	Gif->Palettes = NULL;
+	Gif->PaletteCount = 0;
+	Gif->PaletteSlots = NULL;
+	Gif->PaletteSlotCount = 0;
+	Gif->Scaled = GD_FALSE;
+	Gif->ScaleMapX = NULL;
+	Gif->ScaleMapY = NULL;
+	Gif->ScaleSpanX = NULL;
+	Gif->ScaleSpanY = NULL;
+
+	if (Options)
+		Gif->Options = *Options;
+	else
+		GD_InitDecodeOptions(&Gif->Options);
+
+	Gif->Canvas = NULL;
+	Gif->CanvasBackup = NULL;
+	Gif->CanvasNext = 0;
+	Gif->DisposalPending = GD_FALSE;
+	Gif->Checkpoints = NULL;
+	Gif->CheckpointCount = 0;
+	Gif->CheckpointInterval = 0;
+	Gif->DirtyCount = 0;
+	Gif->PackFrames = GD_FALSE;
+	Gif->Stored = NULL;
+	Gif->Cache = NULL;
+	Gif->OwnsCache = GD_FALSE;
+	Gif->Unpacked = NULL;
+	Gif->UnpackedSize = 0;
+
+	Decoder->DecodedBytes = 0;
+	Decoder->HasDeadline = Gif->Options.TimeBudget ? GD_TRUE : GD_FALSE;
+
+	if (Decoder->HasDeadline)
+		Decoder->Deadline = GD_Now() + (GD_QWORD)Gif->Options.TimeBudget * 1000000;
+
+	//
+	// Verify header's signature and version
+	//
+	*ErrorCode = GD_ValidateHeader(Decoder, &Gif->Version);
+
+	if (*ErrorCode != GD_OK)
+	{
+		free(Gif);
+		return NULL;
+	}
+
+	//
+	// Read Logical Screen Descriptor
+	//
+	GD_ReadScreenDescriptor(Decoder, &Gif->ScreenDesc);
+
+	if (Gif->Options.MaxFramePixels &&
+		(GD_QWORD)Gif->ScreenDesc.LogicalWidth * Gif->ScreenDesc.LogicalHeight > Gif->Options.MaxFramePixels)
+		*ErrorCode = GD_LIMIT_PIXELS;
+	else
+		*ErrorCode = GD_SetupCanvasSize(Gif);
+
+	if (*ErrorCode != GD_OK)
+	{
+		GD_CloseGif(Gif);
+		return NULL;
+	}
+
+	//
+	// Downscaled frames are blended, they have no index stream to pack
+	//
+	if ((Gif->Options.Flags & GD_DECODE_COMPRESS_FRAMES) && !Gif->Options.StripRoutine && !Gif->Scaled)
+	{
+		Gif->PackFrames = GD_TRUE;
+		Gif->Cache = Gif->Options.FrameCache;
+
+		if (!Gif->Cache)
+		{
+			const GD_DWORD MaxFrames = Gif->Options.WorkingSet ? Gif->Options.WorkingSet :
+			                           Gif->Options.CacheBudget ? 0 : GD_DEFAULT_WORKING_SET;
+
+			Gif->Cache = GD_CreateFrameCache(Gif->Options.CacheBudget, MaxFrames);
+			Gif->OwnsCache = GD_TRUE;
+
+			if (!Gif->Cache)
+			{
+				*ErrorCode = GD_NOMEM;
+				GD_CloseGif(Gif);
+				return NULL;
+			}
+		}
+	}
+
+	//
+	// Read the GCT immediately after if bit is set in LOGICAL_SCREEN_DESCRIPTOR.PackedFields
+	//
+	if (Gif->ScreenDesc.PackedFields & MASK_TABLE_PRESENT)
+	{
+		GD_COLOR_TABLE PaletteGlobal;
+		GD_ReadColorTable(Decoder, &PaletteGlobal, Gif->ScreenDesc.PackedFields);
+
+		*ErrorCode = GD_InternPalette(Gif, &PaletteGlobal, &Gif->PaletteGlobal);
+
+		if (*ErrorCode != GD_OK)
+		{
+			GD_CloseGif(Gif);
+			return NULL;
+		}
+	}
+
+	//
+	// Process blocks
+	//
+	GD_BYTE b;
+	while ((b = GD_ReadByte(Decoder)) != TRAILER)
+	{
+		switch (b)
+		{
+			case BLOCK_INTRODUCER_EXT:
+				*ErrorCode = GD_ReadExtension(Decoder);
+				break;
+
+			case BLOCK_INTRODUCER_IMG:
+				*ErrorCode = GD_ReadImage(Decoder, Gif);
+				break;
+
+			default:
+				*ErrorCode = GD_UNEXPECTED_DATA;
+				break;
+		}
+
+		if (*ErrorCode != GD_OK)
+		{
+			GD_FreeDuplicates(Decoder);
+			GD_FreeSpans(Decoder);
+			GD_CloseGif(Gif);
+			return NULL;
+		}
+	}
+
+	GD_FreeDuplicates(Decoder);
+	GD_FreeSpans(Decoder);
+
+	return Gif;
+}
+
+GD_GIF_HANDLE
+GD_OpenGif(const char* Path, GD_ERR* ErrorCode, size_t* ErrorBytePos)
+{
+	return GD_OpenGifEx(Path, NULL, ErrorCode, ErrorBytePos);
+}
+
+GD_GIF_HANDLE
+GD_OpenGifEx(const char* Path, const GD_DECODE_OPTIONS* Options, GD_ERR* ErrorCode, size_t* ErrorBytePos)
+{
+	GD_DECODE_CONTEXT Decoder;
+
+	*ErrorCode = GD_InitDecodeContextStream(&Decoder, Path);
+
+	if (*ErrorCode != GD_OK)
+		return NULL;
+
+	GD_GIF_HANDLE Gif = GD_DecodeInternal(&Decoder, Options, ErrorCode);
+
+	if (!Gif && ErrorBytePos)
+		*ErrorBytePos = Decoder.DataStreamOffset;
+
+	fclose(Decoder.StreamFd);
+
+	return Gif;
+}
+
+GD_GIF_HANDLE
+GD_FromMemory(const void* Buffer, size_t BufferSize, GD_ERR* ErrorCode, size_t* ErrorBytePos)
+{
+	return GD_FromMemoryEx(Buffer, BufferSize, NULL, ErrorCode, ErrorBytePos);
+}
+
+GD_GIF_HANDLE
+GD_FromMemoryEx(const void* Buffer, size_t BufferSize, const GD_DECODE_OPTIONS* Options, GD_ERR* ErrorCode, size_t* ErrorBytePos)
+{
+	GD_DECODE_CONTEXT Decoder;
+
+	*ErrorCode = GD_InitDecodeContextMemory(&Decoder, Buffer, BufferSize);
+
+	if (*ErrorCode != GD_OK)
+		return NULL;
+
+	GD_GIF_HANDLE Gif = GD_DecodeInternal(&Decoder, Options, ErrorCode);
+
+	if (!Gif && ErrorBytePos)
+		*ErrorBytePos = Decoder.DataStreamOffset;
+
+	return Gif;
+}
+
+static void
+GD_FreeCheckpoints(GD_GIF_HANDLE Gif)
+{
+	for (GD_DWORD i = 0; i < Gif->CheckpointCount; ++i)
+		free(Gif->Checkpoints[i]);
+
+	free(Gif->Checkpoints);
+
+	Gif->Checkpoints = NULL;
+	Gif->CheckpointCount = 0;
+}
+
+void
+GD_CloseGif(GD_GIF_HANDLE Gif)
+{
+	//
+	// A shared cache outlives the handle, take its frames out first
+	//
+	for (GD_DWORD FrameIndex = 0; Gif->Stored && FrameIndex < Gif->FrameCount; ++FrameIndex)
+	{
+		if (Gif->Stored[FrameIndex].Node)
+			GD_CacheRemove(Gif->Cache, Gif->Stored[FrameIndex].Node);
+	}
+
+	for (GD_DWORD FrameIndex = 0; FrameIndex < Gif->FrameCount; ++FrameIndex)
+	{
+		GD_FRAME* Current = &Gif->Frames[FrameIndex];
+		GD_SharedRelease(Current->Buffer);
+		GD_SharedRelease(Current->Indices);
+		GD_SharedRelease(Current->Alpha);
+		GD_SharedRelease(Current->Stats);
+
+		if (Gif->Stored)
+			GD_SharedRelease(Gif->Stored[FrameIndex].Packed);
+	}
+
+	free(Gif->Frames);
+	free(Gif->Stored);
+	free(Gif->Unpacked);
+
+	if (Gif->OwnsCache)
+		GD_DestroyFrameCache(Gif->Cache);
+
+	for (GD_DWORD i = 0; i < Gif->PaletteCount; ++i)
+		free(Gif->Palettes[i]);
+
+	free(Gif->Palettes);
+	free(Gif->PaletteSlots);
+
+	free(Gif->ScaleMapX);
+	free(Gif->ScaleMapY);
+	free(Gif->ScaleSpanX);
+	free(Gif->ScaleSpanY);
+
+	GD_FreeCheckpoints(Gif);
+	free(Gif->Canvas);
+	free(Gif->CanvasBackup);
+
+	free(Gif);
+}
+
+GD_DWORD
+GD_FrameCount(GD_GIF_HANDLE Gif)
+{
+	return Gif->FrameCount;
+}
+
+GD_FRAME*
+GD_GetFrame(GD_GIF_HANDLE Gif, GD_DWORD FrameIndex)
+{
+	if (!Gif || FrameIndex >= Gif->FrameCount)
+		return NULL;
+
+	GD_FRAME* Frame = &Gif->Frames[FrameIndex];
+
+	if (Gif->Stored && Gif->Stored[FrameIndex].Packed)
+	{
+		GD_CACHE_NODE* Node = Gif->Stored[FrameIndex].Node;
+
+		if (Node)
+		{
+			GD_CacheUnlink(Gif->Cache, Node);
+			GD_CachePushNewest(Gif->Cache, Node);
+			++Gif->Cache->Hits;
+		}
+		else if (GD_ExpandStoredFrame(Gif, FrameIndex) != GD_OK)
+		{
+			return NULL;
+		}
+	}
+
+	return Frame;
+}
+
+GD_ERR
+GD_GetFrameCost(GD_GIF_HANDLE Gif, GD_DWORD FrameIndex, GD_FRAME_COST* Cost)
+{
+	if (!Gif || !Cost)
+		return GD_UNEXPECTED_DATA;
+
+	if (FrameIndex >= Gif->FrameCount)
+		return GD_INVALID_IMG_INDEX;
+
+	const GD_FRAME* Frame = &Gif->Frames[FrameIndex];
+	const size_t PixelCount = (size_t)Frame->Region.Width * Frame->Region.Height;
+
+	memset(Cost, 0, sizeof(GD_FRAME_COST));
+
+	if (Gif->Stored && Gif->Stored[FrameIndex].Packed)
+	{
+		const GD_STORED_FRAME* Stored = &Gif->Stored[FrameIndex];
+		const GD_BOOL KeepIndices = (Frame->HasTransparency || (Gif->Options.Flags & GD_DECODE_KEEP_INDICES)) ? GD_TRUE : GD_FALSE;
+
+		Cost->ExpandedSize = PixelCount * (sizeof(GD_GIF_COLOR) + (KeepIndices ? 1 : 0));
+		Cost->PackedSize   = Stored->PackedSize;
+		Cost->ExpandTime   = Stored->ExpandTime;
+		Cost->Resident     = Stored->Node ? GD_TRUE : GD_FALSE;
+
+		return GD_OK;
+	}
+
+	if (Frame->Buffer)
+	{
+		Cost->ExpandedSize = PixelCount * (sizeof(GD_GIF_COLOR) + (Frame->Indices ? 1 : 0) + (Frame->Alpha ? 1 : 0));
+		Cost->Resident     = GD_TRUE;
+	}
+
+	return GD_OK;
+}
+
+GD_FRAME_CACHE_HANDLE
+GD_GetFrameCache(GD_GIF_HANDLE Gif)
+{
+	if (!Gif)
+		return NULL;
+
+	return Gif->Cache;
+}
+
+GD_ERR
+GD_GetFrameCacheStats(GD_FRAME_CACHE_HANDLE Cache, GD_FRAME_CACHE_STATS* Stats)
+{
+	if (!Cache || !Stats)
+		return GD_UNEXPECTED_DATA;
+
+	Stats->Size       = Cache->Size;
+	Stats->FrameCount = Cache->FrameCount;
+	Stats->Hits       = Cache->Hits;
+	Stats->Misses     = Cache->Misses;
+	Stats->Evictions  = Cache->Evictions;
+
+	return GD_OK;
+}
+
+const GD_LOGICAL_SCREEN_DESCRIPTOR*
+GD_GetScreenDescriptor(GD_GIF_HANDLE Gif)
+{
+	if (!Gif)
+		return NULL;
+
+	return &Gif->ScreenDesc;
+}
+
+GD_ERR
+GD_GetCanvasSize(GD_GIF_HANDLE Gif, GD_WORD* Width, GD_WORD* Height)
+{
+	if (!Gif || !Width || !Height)
+		return GD_UNEXPECTED_DATA;
+
+	*Width = Gif->CanvasWidth;
+	*Height = Gif->CanvasHeight;
+
+	return GD_OK;
+}
+
+GD_DWORD
+GD_PaletteCount(GD_GIF_HANDLE Gif)
+{
+	return Gif->PaletteCount;
+}
+
+const GD_COLOR_TABLE*
+GD_GetPalette(GD_GIF_HANDLE Gif, GD_DWORD PaletteIndex)
+{
+	if (!Gif || PaletteIndex >= Gif->PaletteCount)
+		return NULL;
+
+	return &Gif->Palettes[PaletteIndex]->Table;
+}
+
+static size_t
+GD_CanvasSize(GD_GIF_HANDLE Gif)
+{
+	return (size_t)Gif->CanvasWidth * Gif->CanvasHeight;
+}
+
+static size_t
+GD_RectArea(const GD_RECT* Rect)
+{
+	return (size_t)Rect->Width * Rect->Height;
+}
+
+static GD_RECT
+GD_RectUnion(const GD_RECT* a, const GD_RECT* b)
+{
+	const GD_DWORD Left   = a->Left < b->Left ? a->Left : b->Left;
+	const GD_DWORD Top    = a->Top < b->Top ? a->Top : b->Top;
+	const GD_DWORD Right  = (a->Left + a->Width > b->Left + b->Width) ? a->Left + a->Width : b->Left + b->Width;
+	const GD_DWORD Bottom = (a->Top + a->Height > b->Top + b->Height) ? a->Top + a->Height : b->Top + b->Height;
+
+	GD_RECT Union = { (GD_WORD)Left, (GD_WORD)Top, (GD_WORD)(Right - Left), (GD_WORD)(Bottom - Top) };
+
+	return Union;
+}
+
+static void
+GD_DirtyAdd(GD_GIF_HANDLE Gif, const GD_RECT* Rect)
+{
+	if (!GD_RectArea(Rect))
+		return;
+
+	//
+	// Fold the rectangle into an existing one when the bounding box does not cost more
+	// than uploading both, or when we are out of slots
+	//
+	size_t BestGrowth = (size_t)-1;
+	GD_DWORD Best = 0;
+
+	for (GD_DWORD i = 0; i < Gif->DirtyCount; ++i)
+	{
+		const GD_RECT Union = GD_RectUnion(&Gif->DirtyRects[i], Rect);
+		const size_t Growth = GD_RectArea(&Union) - GD_RectArea(&Gif->DirtyRects[i]);
+
+		if (Growth <= GD_RectArea(Rect))
+		{
+			Gif->DirtyRects[i] = Union;
+			return;
+		}
+
+		if (Growth < BestGrowth)
+		{
+			BestGrowth = Growth;
+			Best = i;
+		}
+	}
+
+	if (Gif->DirtyCount < GD_MAX_DIRTY_RECTS)
+		Gif->DirtyRects[Gif->DirtyCount++] = *Rect;
+	else
+		Gif->DirtyRects[Best] = GD_RectUnion(&Gif->DirtyRects[Best], Rect);
+}
+
+static void
+GD_DirtyAll(GD_GIF_HANDLE Gif)
+{
+	Gif->DirtyRects[0].Left   = 0;
+	Gif->DirtyRects[0].Top    = 0;
+	Gif->DirtyRects[0].Width  = Gif->CanvasWidth;
+	Gif->DirtyRects[0].Height = Gif->CanvasHeight;
+
+	Gif->DirtyCount = 1;
+}
+
+static void
+GD_CanvasClear(GD_GIF_HANDLE Gif)
+{
+	const size_t PixelCount = GD_CanvasSize(Gif);
+
+	for (size_t i = 0; i < PixelCount; ++i)
+		Gif->Canvas[i] = Gif->CanvasBackground;
+
+	Gif->CanvasNext = 0;
+	Gif->DisposalPending = GD_FALSE;
+
+	GD_DirtyAll(Gif);
+}
+
+static GD_ERR
+GD_CanvasInit(GD_GIF_HANDLE Gif)
+{
+	if (Gif->Canvas)
+		return GD_OK;
+
+	const size_t PixelCount = GD_CanvasSize(Gif);
+
+	Gif->Canvas = malloc(sizeof(GD_GIF_COLOR) * PixelCount);
+	Gif->CanvasBackup = malloc(sizeof(GD_GIF_COLOR) * PixelCount);
+
+	if (Gif->UnpackedSize && !Gif->Unpacked)
+		Gif->Unpacked = malloc(sizeof(GD_BYTE) * Gif->UnpackedSize);
+
+	if (!Gif->Canvas || !Gif->CanvasBackup || (Gif->UnpackedSize && !Gif->Unpacked))
+	{
+		free(Gif->Canvas);
+		free(Gif->CanvasBackup);
+		free(Gif->Unpacked);
+
+		Gif->Canvas = NULL;
+		Gif->CanvasBackup = NULL;
+		Gif->Unpacked = NULL;
+
+		return GD_NOMEM;
+	}
+
+	//
+	// The background color is only meaningful with a global color table
+	//
+	const GD_BYTE BgIndex = Gif->ScreenDesc.BgColorIndex;
+
+	const GD_GIF_COLOR Black = { 0, 0, 0 };
+
+	Gif->CanvasBackground = GD_ToColorSpace(Gif, Black);
+
+	if (Gif->PaletteGlobal && BgIndex < Gif->PaletteGlobal->Table.Count)
+		Gif->CanvasBackground = Gif->PaletteGlobal->Expanded[BgIndex];
+
+	GD_CanvasClear(Gif);
+
+	return GD_OK;
+}
+
+static void
+GD_CanvasDispose(GD_GIF_HANDLE Gif)
+{
+	const GD_FRAME* Frame = &Gif->Frames[Gif->CanvasNext - 1];
+	const GD_RECT* Region = &Frame->Region;
+
+	for (size_t y = 0; y < Region->Height; ++y)
+	{
+		GD_GIF_COLOR* Row = Gif->Canvas + (Region->Top + y) * Gif->CanvasWidth + Region->Left;
+
+		if (Frame->DisposalMethod == GD_DISPOSAL_BACKGROUND)
+		{
+			for (size_t x = 0; x < Region->Width; ++x)
+				Row[x] = Gif->CanvasBackground;
+		}
+		else if (Frame->DisposalMethod == GD_DISPOSAL_PREVIOUS)
+		{
+			memcpy(Row, Gif->CanvasBackup + y * Region->Width, sizeof(GD_GIF_COLOR) * Region->Width);
+		}
+	}
+
+	//
+	// Restoring the background also repaints what showed through transparent pixels,
+	// restoring the previous canvas only undoes what the frame actually drew
+	//
+	if (Frame->DisposalMethod == GD_DISPOSAL_BACKGROUND)
+		GD_DirtyAdd(Gif, Region);
+	else if (Frame->DisposalMethod == GD_DISPOSAL_PREVIOUS)
+		GD_DirtyAdd(Gif, &Frame->OpaqueRect);
+
+	Gif->DisposalPending = GD_FALSE;
+}
+
+/// Draw Width pixels over Row except where Indices holds the transparent index. Pixels
+/// come from Src, or from Colors when Src is NULL (packed frames)
+static GD_FORCEINLINE void
+GD_DrawRowTransparent(GD_GIF_COLOR* Row, const GD_GIF_COLOR* Src, const GD_GIF_COLOR* Colors,
+					  const GD_BYTE* Indices, size_t Width, GD_BYTE TransparentIndex)
+{
+	size_t x = 0;
+
+#if defined(GD_SSE2)
+	//
+	// Sixteen indices at a time: fully transparent runs are skipped, fully opaque
+	// ones drawn without testing each pixel
+	//
+	const __m128i Key = _mm_set1_epi8((char)TransparentIndex);
+
+	for (; x + 16 <= Width; x += 16)
+	{
+		const __m128i Chunk = _mm_loadu_si128((const __m128i*)(Indices + x));
+		const int Transparent = _mm_movemask_epi8(_mm_cmpeq_epi8(Chunk, Key));
+
+		if (Transparent == 0xFFFF)
+			continue;
+
+		if (Transparent == 0)
+		{
+			if (Src)
+				memcpy(Row + x, Src + x, 16 * sizeof(GD_GIF_COLOR));
+			else
+			{
+				for (size_t i = x; i < x + 16; ++i)
+					Row[i] = Colors[Indices[i]];
+			}
+
+			continue;
+		}
+
+		for (size_t i = 0; i < 16; ++i)
+		{
+			if (!(Transparent & (1 << i)))
+				Row[x + i] = Src ? Src[x + i] : Colors[Indices[x + i]];
+		}
+	}
+#endif
+
+	for (; x < Width; ++x)
+	{
+		if (Indices[x] != TransparentIndex)
+			Row[x] = Src ? Src[x] : Colors[Indices[x]];
+	}
+}
+
+typedef struct GD_DRAW_CONTEXT
+{
+	GD_GIF_HANDLE Gif;
+	const GD_FRAME* Frame;
+	const GD_GIF_COLOR* Colors;
+} GD_DRAW_CONTEXT;
+
+static void
+GD_CanvasDrawPackedBand(void* Argument, size_t FirstRow, size_t RowCount)
+{
+	const GD_DRAW_CONTEXT* Context = (const GD_DRAW_CONTEXT*)Argument;
+	const GD_GIF_HANDLE Gif = Context->Gif;
+	const GD_FRAME* Frame = Context->Frame;
+	const GD_RECT* Region = &Frame->Region;
+	const GD_GIF_COLOR* Colors = Context->Colors;
+
+	for (size_t y = FirstRow; y < FirstRow + RowCount; ++y)
+	{
+		GD_GIF_COLOR* Row = Gif->Canvas + (Region->Top + y) * Gif->CanvasWidth + Region->Left;
+		const GD_BYTE* Indices = Gif->Unpacked + y * Region->Width;
+
+		if (Frame->HasTransparency)
+		{
+			GD_DrawRowTransparent(Row, NULL, Colors, Indices, Region->Width, Frame->TransparentIndex);
+		}
+		else
+		{
+			for (size_t x = 0; x < Region->Width; ++x)
+				Row[x] = Colors[Indices[x]];
+		}
+	}
+}
+
+static void
+GD_CanvasDrawBand(void* Argument, size_t FirstRow, size_t RowCount)
+{
+	const GD_DRAW_CONTEXT* Context = (const GD_DRAW_CONTEXT*)Argument;
+	const GD_GIF_HANDLE Gif = Context->Gif;
+	const GD_FRAME* Frame = Context->Frame;
+	const GD_RECT* Region = &Frame->Region;
+
+	for (size_t y = FirstRow; y < FirstRow + RowCount; ++y)
+	{
+		GD_GIF_COLOR* Row = Gif->Canvas + (Region->Top + y) * Gif->CanvasWidth + Region->Left;
+		const GD_GIF_COLOR* Src = Frame->Buffer + y * Region->Width;
+
+		if (Frame->Alpha)
+		{
+			//
+			// Downscaled frame, blend by how much of each pixel the frame covers
+			//
+			const GD_BYTE* Alpha = Frame->Alpha + y * Region->Width;
+
+			for (size_t x = 0; x < Region->Width; ++x)
+			{
+				const int a = Alpha[x];
+
+				Row[x].r = (GD_BYTE)(Row[x].r + ((Src[x].r - Row[x].r) * a) / 255);
+				Row[x].g = (GD_BYTE)(Row[x].g + ((Src[x].g - Row[x].g) * a) / 255);
+				Row[x].b = (GD_BYTE)(Row[x].b + ((Src[x].b - Row[x].b) * a) / 255);
+			}
+		}
+		else if (Frame->HasTransparency && Frame->Indices)
+		{
+			GD_DrawRowTransparent(Row, Src, NULL, Frame->Indices + y * Region->Width, Region->Width, Frame->TransparentIndex);
+		}
+		else
+		{
+			memcpy(Row, Src, sizeof(GD_GIF_COLOR) * Region->Width);
+		}
+	}
+}
+
+static void
+GD_CanvasDraw(GD_GIF_HANDLE Gif, const GD_FRAME* Frame)
+{
+	const GD_RECT* Region = &Frame->Region;
+
+	GD_DRAW_CONTEXT Context;
+
+	Context.Gif = Gif;
+	Context.Frame = Frame;
+	Context.Colors = NULL;
+
+	//
+	// Frames of a compressed store that are not expanded are drawn from their packed indices
+	//
+	if (Gif->Stored && !Frame->Buffer)
+	{
+		const GD_BYTE* Packed = Gif->Stored[Frame - Gif->Frames].Packed;
+
+		if (Packed)
+		{
+			Context.Colors = Gif->Palettes[Frame->PaletteIndex]->Expanded;
+
+			GD_UnpackIndices(Packed, Gif->Unpacked, (size_t)Region->Width * Region->Height);
+			GD_RunBands(GD_CanvasDrawPackedBand, &Context, Region->Height, Region->Width, Gif->Options.Threads);
+		}
+
+		return;
+	}
+
+	if (!Frame->Buffer)
+		return;
+
+	GD_RunBands(GD_CanvasDrawBand, &Context, Region->Height, Region->Width, Gif->Options.Threads);
+}
+
+/// Draw the next frame, Snapshot is cleared once the canvas may not hold the exact
+/// result of the frames before it (some were skipped)
+static void
+GD_CanvasStep(GD_GIF_HANDLE Gif, GD_BOOL Snapshot)
+{
+	const GD_DWORD FrameIndex = Gif->CanvasNext;
+	const GD_FRAME* Frame = &Gif->Frames[FrameIndex];
+	const GD_RECT* Region = &Frame->Region;
+
+	if (Gif->DisposalPending)
+		GD_CanvasDispose(Gif);
+
+	//
+	// Snapshot the canvas the first time we go through a checkpoint. Running out of
+	// memory here is not an error, seeking just gets slower
+	//
+	if (Snapshot && Gif->CheckpointInterval && FrameIndex && FrameIndex % Gif->CheckpointInterval == 0)
+	{
+		const GD_DWORD Slot = FrameIndex / Gif->CheckpointInterval - 1;
+
+		if (Slot < Gif->CheckpointCount && !Gif->Checkpoints[Slot])
+		{
+			const size_t CanvasBytes = sizeof(GD_GIF_COLOR) * GD_CanvasSize(Gif);
+
+			Gif->Checkpoints[Slot] = malloc(CanvasBytes);
+
+			if (Gif->Checkpoints[Slot])
+				memcpy(Gif->Checkpoints[Slot], Gif->Canvas, CanvasBytes);
+		}
+	}
+
+	if (Frame->DisposalMethod == GD_DISPOSAL_PREVIOUS)
+	{
+		for (size_t y = 0; y < Region->Height; ++y)
+		{
+			const GD_GIF_COLOR* Row = Gif->Canvas + (Region->Top + y) * Gif->CanvasWidth + Region->Left;
+			memcpy(Gif->CanvasBackup + y * Region->Width, Row, sizeof(GD_GIF_COLOR) * Region->Width);
+		}
+	}
+
+	GD_CanvasDraw(Gif, Frame);
+	GD_DirtyAdd(Gif, &Frame->OpaqueRect);
+
+	Gif->CanvasNext = FrameIndex + 1;
+	Gif->DisposalPending = GD_TRUE;
+}
+
+/// Go past the next frame without drawing it, see GD_PlanSkips
+static void
+GD_CanvasSkip(GD_GIF_HANDLE Gif)
+{
+	const GD_FRAME* Frame = &Gif->Frames[Gif->CanvasNext];
+
+	if (Gif->DisposalPending)
+		GD_CanvasDispose(Gif);
+
+	//
+	// Drawing then restoring the previous canvas changes nothing, clearing to the
+	// background does not depend on what was drawn
+	//
+	Gif->CanvasNext += 1;
+	Gif->DisposalPending = (Frame->DisposalMethod == GD_DISPOSAL_PREVIOUS) ? GD_FALSE : GD_TRUE;
+}
+
+/// Move the canvas back to the closest state from which FrameIndex can be reached
+static void
+GD_CanvasRewind(GD_GIF_HANDLE Gif, GD_DWORD FrameIndex)
+{
+	//
+	// Find the closest checkpoint before the requested frame, frame 0 always is one
+	//
+	GD_DWORD Restart = 0;
+	GD_DWORD Slot = Gif->CheckpointInterval ? FrameIndex / Gif->CheckpointInterval : 0;
+
+	while (Slot > 0)
+	{
+		if (Slot <= Gif->CheckpointCount && Gif->Checkpoints[Slot - 1])
+		{
+			Restart = Slot * Gif->CheckpointInterval;
+			break;
+		}
+
+		--Slot;
+	}
+
+	//
+	// Only rewind when moving forward from the current canvas would replay more frames
+	//
+	if (Gif->CanvasNext > FrameIndex || Gif->CanvasNext < Restart)
+	{
+		if (Restart == 0)
+		{
+			GD_CanvasClear(Gif);
+		}
+		else
+		{
+			memcpy(Gif->Canvas, Gif->Checkpoints[Slot - 1], sizeof(GD_GIF_COLOR) * GD_CanvasSize(Gif));
+
+			Gif->CanvasNext = Restart;
+			Gif->DisposalPending = GD_FALSE;
+
+			GD_DirtyAll(Gif);
+		}
+	}
+}
+
+const GD_GIF_COLOR*
+GD_ComposeFrame(GD_GIF_HANDLE Gif, GD_DWORD FrameIndex, GD_ERR* ErrorCode)
+{
+	GD_ERR Dummy;
+
+	if (!ErrorCode)
+		ErrorCode = &Dummy;
+
+	if (!Gif || FrameIndex >= Gif->FrameCount)
+	{
+		*ErrorCode = GD_INVALID_IMG_INDEX;
+		return NULL;
+	}
+
+	// Frames were handed to the strip routine and not kept
+	if (Gif->Options.StripRoutine)
+	{
+		*ErrorCode = GD_NOT_SUPPORTED;
+		return NULL;
+	}
+
+	*ErrorCode = GD_CanvasInit(Gif);
+
+	if (*ErrorCode != GD_OK)
+		return NULL;
+
+	//
+	// GD_CanvasInit may have marked the whole canvas dirty, keep that for this call
+	//
+	if (Gif->CanvasNext || Gif->DisposalPending)
+		Gif->DirtyCount = 0;
+
+	if (Gif->DisposalPending && Gif->CanvasNext == FrameIndex + 1)
+		return Gif->Canvas;
+
+	GD_CanvasRewind(Gif, FrameIndex);
+
+	while (Gif->CanvasNext <= FrameIndex)
+		GD_CanvasStep(Gif, GD_TRUE);
+
+	return Gif->Canvas;
+}
+
+GD_ERR
+GD_GetDirtyRects(GD_GIF_HANDLE Gif, GD_RECT* Rects, GD_DWORD RectCapacity, GD_DWORD* RectCount)
+{
+	if (!Gif || !Rects || !RectCapacity || !RectCount)
+		return GD_UNEXPECTED_DATA;
+
+	const GD_DWORD Count = Gif->DirtyCount < RectCapacity ? Gif->DirtyCount : RectCapacity;
+
+	memcpy(Rects, Gif->DirtyRects, sizeof(GD_RECT) * Count);
+
+	//
+	// The last slot takes in the rectangles that do not fit
+	//
+	for (GD_DWORD i = Count; i < Gif->DirtyCount; ++i)
+		Rects[Count - 1] = GD_RectUnion(&Rects[Count - 1], &Gif->DirtyRects[i]);
+
+	*RectCount = Count;
+
+	return GD_OK;
+}
+
+GD_ERR
+GD_SetCheckpointPolicy(GD_GIF_HANDLE Gif, GD_DWORD Interval, size_t MemoryBudget)
+{
+	if (!Gif)
+		return GD_UNEXPECTED_DATA;
+
+	GD_FreeCheckpoints(Gif);
+	Gif->CheckpointInterval = 0;
+
+	if (Gif->FrameCount < 2)
+		return GD_OK;
+
+	if (MemoryBudget)
+	{
+		//
+		// Snapshots land on frames Interval, 2 * Interval, ... < FrameCount,
+		// widen the interval until they fit in the budget
+		//
+		const size_t MaxSnapshots = MemoryBudget / (sizeof(GD_GIF_COLOR) * GD_CanvasSize(Gif));
+
+		if (!MaxSnapshots)
+			return GD_OK;
+
+		const size_t MinInterval = (Gif->FrameCount - 1) / (MaxSnapshots + 1) + 1;
+
+		if (Interval < MinInterval)
+			Interval = (GD_DWORD)MinInterval;
+	}
+
+	if (!Interval)
+		return GD_OK;
+
+	const GD_DWORD Count = (Gif->FrameCount - 1) / Interval;
+
+	if (!Count)
+		return GD_OK;
+
+	Gif->Checkpoints = calloc(Count, sizeof(GD_GIF_COLOR*));
+
+	if (!Gif->Checkpoints)
+		return GD_NOMEM;
+
+	Gif->CheckpointCount = Count;
+	Gif->CheckpointInterval = Interval;
+
+	return GD_OK;
+}
+
+size_t
+GD_Yuv420Size(GD_WORD Width, GD_WORD Height)
+{
+	const size_t ChromaSize = (size_t)((Width + 1) / 2) * ((Height + 1) / 2);
+
+	return (size_t)Width * Height + 2 * ChromaSize;
+}
+
+static void
+GD_SubsampleChroma(const GD_BYTE* Row0, const GD_BYTE* Row1, size_t ChromaWidth, GD_BYTE* Output)
+{
+	//
+	// Average 2x2 blocks, rows are padded to an even width by the caller
+	//
+	size_t x = 0;
+
+#ifdef GD_SSE2
+	const __m128i LowBytes = _mm_set1_epi16(0x00FF);
+	const __m128i Rounding = _mm_set1_epi16(2);
+
+	for (; x + 8 <= ChromaWidth; x += 8)
+	{
+		const __m128i a = _mm_loadu_si128((const __m128i*)(Row0 + 2 * x));
+		const __m128i b = _mm_loadu_si128((const __m128i*)(Row1 + 2 * x));
+
+		__m128i Sum = _mm_add_epi16(_mm_and_si128(a, LowBytes), _mm_srli_epi16(a, 8));
+		Sum = _mm_add_epi16(Sum, _mm_and_si128(b, LowBytes));
+		Sum = _mm_add_epi16(Sum, _mm_srli_epi16(b, 8));
+		Sum = _mm_srli_epi16(_mm_add_epi16(Sum, Rounding), 2);
+
+		_mm_storel_epi64((__m128i*)(Output + x), _mm_packus_epi16(Sum, Sum));
+	}
+#endif
+
+	for (; x < ChromaWidth; ++x)
+		Output[x] = (GD_BYTE)((Row0[2 * x] + Row0[2 * x + 1] + Row1[2 * x] + Row1[2 * x + 1] + 2) >> 2);
+}
+
+GD_ERR
+GD_PackYuv420(const GD_GIF_COLOR* Pixels, GD_WORD Width, GD_WORD Height, GD_YUV_LAYOUT Layout, GD_BYTE* Output)
+{
+	if (!Pixels || !Output || (Layout != GD_YUV420P && Layout != GD_NV12))
+		return GD_UNEXPECTED_DATA;
+
+	const size_t ChromaWidth  = (Width + 1) / 2;
+	const size_t ChromaHeight = (Height + 1) / 2;
+	const size_t PaddedWidth  = ChromaWidth * 2;
+
+	//
+	// Cb and Cr of two source rows, deinterleaved
+	//
+	GD_BYTE* Scratch = malloc(PaddedWidth * 4 + ChromaWidth * 2);
+
+	if (!Scratch)
+		return GD_NOMEM;
+
+	GD_BYTE* Cb[2] = { Scratch, Scratch + PaddedWidth };
+	GD_BYTE* Cr[2] = { Scratch + PaddedWidth * 2, Scratch + PaddedWidth * 3 };
+	GD_BYTE* SubCb = Scratch + PaddedWidth * 4;
+	GD_BYTE* SubCr = SubCb + ChromaWidth;
+
+	GD_BYTE* PlaneY  = Output;
+	GD_BYTE* PlaneCb = Output + (size_t)Width * Height;
+	GD_BYTE* PlaneCr = PlaneCb + ChromaWidth * ChromaHeight;
+
+	for (size_t cy = 0; cy < ChromaHeight; ++cy)
+	{
+		for (size_t Half = 0; Half < 2; ++Half)
+		{
+			//
+			// The last row is repeated for odd heights
+			//
+			size_t y = cy * 2 + Half;
+
+			if (y >= Height)
+				y = Height - 1;
+
+			const GD_GIF_COLOR* Row = Pixels + y * Width;
+			GD_BYTE* RowY = PlaneY + y * Width;
+
+			for (size_t x = 0; x < Width; ++x)
+			{
+				RowY[x] = Row[x].r;
+				Cb[Half][x] = Row[x].g;
+				Cr[Half][x] = Row[x].b;
+			}
+
+			if (PaddedWidth != Width)
+			{
+				Cb[Half][Width] = Cb[Half][Width - 1];
+				Cr[Half][Width] = Cr[Half][Width - 1];
+			}
+		}
+
+		if (Layout == GD_YUV420P)
+		{
+			GD_SubsampleChroma(Cb[0], Cb[1], ChromaWidth, PlaneCb + cy * ChromaWidth);
+			GD_SubsampleChroma(Cr[0], Cr[1], ChromaWidth, PlaneCr + cy * ChromaWidth);
+		}
+		else
+		{
+			GD_SubsampleChroma(Cb[0], Cb[1], ChromaWidth, SubCb);
+			GD_SubsampleChroma(Cr[0], Cr[1], ChromaWidth, SubCr);
+
+			GD_BYTE* PlaneCbCr = PlaneCb + cy * ChromaWidth * 2;
+			size_t x = 0;
+
+#ifdef GD_SSE2
+			for (; x + 8 <= ChromaWidth; x += 8)
+			{
+				const __m128i u = _mm_loadl_epi64((const __m128i*)(SubCb + x));
+				const __m128i v = _mm_loadl_epi64((const __m128i*)(SubCr + x));
+
+				_mm_storeu_si128((__m128i*)(PlaneCbCr + 2 * x), _mm_unpacklo_epi8(u, v));
+			}
+#endif
+
+			for (; x < ChromaWidth; ++x)
+			{
+				PlaneCbCr[2 * x]     = SubCb[x];
+				PlaneCbCr[2 * x + 1] = SubCr[x];
+			}
+		}
+	}
+
+	free(Scratch);
+
+	return GD_OK;
+}
+
+static GD_WORD
+GD_EffectiveDelay(const GD_FRAME* Frame)
+{
+	//
+	// Browsers play frames with a delay under 2/100s at 1/10s, files rely on it
+	//
+	return Frame->DelayTime < 2 ? 10 : Frame->DelayTime;
+}
+
+static GD_DWORD
+GD_Gcd(GD_DWORD a, GD_DWORD b)
+{
+	while (b)
+	{
+		const GD_DWORD t = a % b;
+		a = b;
+		b = t;
+	}
+
+	return a;
+}
+
+GD_ERR
+GD_WriteY4m(GD_GIF_HANDLE Gif, FILE* Output)
+{
+	if (!Gif || !Output)
+		return GD_UNEXPECTED_DATA;
+
+	const GD_WORD Width = Gif->CanvasWidth;
+	const GD_WORD Height = Gif->CanvasHeight;
+
+	//
+	// Y4M has a constant frame rate, use the largest tick dividing every delay
+	//
+	GD_DWORD Tick = 0;
+
+	for (GD_DWORD i = 0; i < Gif->FrameCount; ++i)
+		Tick = GD_Gcd(GD_EffectiveDelay(&Gif->Frames[i]), Tick);
+
+	if (!Tick)
+		Tick = 10;
+
+	//
+	// Pixel aspect ratio is stored as (Ratio + 15) / 64
+	//
+	const GD_BYTE Aspect = Gif->ScreenDesc.PixelAspectRatio;
+
+	if (Aspect)
+		fprintf(Output, "YUV4MPEG2 W%u H%u F100:%u Ip A%u:64 C420jpeg XCOLORRANGE=LIMITED\n", Width, Height, Tick, Aspect + 15);
+	else
+		fprintf(Output, "YUV4MPEG2 W%u H%u F100:%u Ip A1:1 C420jpeg XCOLORRANGE=LIMITED\n", Width, Height, Tick);
+
+	const size_t PixelCount = (size_t)Width * Height;
+	const size_t FrameSize = GD_Yuv420Size(Width, Height);
+
+	GD_BYTE* Planes = malloc(FrameSize);
+	GD_GIF_COLOR* Converted = NULL;
+
+	if (!Planes)
+		return GD_NOMEM;
+
+	if (Gif->Options.ColorSpace != GD_COLOR_SPACE_YCBCR)
+	{
+		Converted = malloc(sizeof(GD_GIF_COLOR) * PixelCount);
+
+		if (!Converted)
+		{
+			free(Planes);
+			return GD_NOMEM;
+		}
+	}
+
+	GD_ERR ErrorCode = GD_OK;
+
+	for (GD_DWORD i = 0; i < Gif->FrameCount && ErrorCode == GD_OK; ++i)
+	{
+		const GD_GIF_COLOR* Canvas = GD_ComposeFrame(Gif, i, &ErrorCode);
+
+		if (!Canvas)
+			break;
+
+		if (Converted)
+		{
+			for (size_t p = 0; p < PixelCount; ++p)
+				Converted[p] = GD_RgbToYCbCr(Canvas[p]);
+
+			Canvas = Converted;
+		}
+
+		ErrorCode = GD_PackYuv420(Canvas, Width, Height, GD_YUV420P, Planes);
+
+		for (GD_DWORD Repeat = GD_EffectiveDelay(&Gif->Frames[i]) / Tick; Repeat && ErrorCode == GD_OK; --Repeat)
+		{
+			if (fputs("FRAME\n", Output) < 0 || fwrite(Planes, 1, FrameSize, Output) != FrameSize)
+				ErrorCode = GD_IOFAIL;
+		}
+	}
+
+	free(Converted);
+	free(Planes);
+
+	return ErrorCode;
+}
+
+size_t
+GD_MipChainSize(GD_WORD Width, GD_WORD Height, GD_DWORD* LevelCount)
+{
+	size_t Size = 0;
+	GD_DWORD Count = 0;
+
+	while (Width && Height)
+	{
+		Size += (size_t)Width * Height * 4;
+		++Count;
+
+		if (Width == 1 && Height == 1)
+			break;
+
+		Width  = Width > 1 ? Width / 2 : 1;
+		Height = Height > 1 ? Height / 2 : 1;
+	}
+
+	if (LevelCount)
+		*LevelCount = Count;
+
+	return Size;
+}
+
+static void
+GD_MipDownsampleRow(const GD_BYTE* Row0, const GD_BYTE* Row1, size_t SourceWidth, size_t Width, GD_BYTE* Output)
+{
+	//
+	// Average 2x2 RGBA pixels, a source one pixel wide is averaged with itself
+	//
+	size_t x = 0;
+
+#ifdef GD_SSE2
+	const __m128i Zero = _mm_setzero_si128();
+	const __m128i Rounding = _mm_set1_epi16(2);
+
+	for (; x + 2 <= Width && 2 * x + 4 <= SourceWidth; x += 2)
+	{
+		const __m128i a = _mm_loadu_si128((const __m128i*)(Row0 + 8 * x));
+		const __m128i b = _mm_loadu_si128((const __m128i*)(Row1 + 8 * x));
+
+		//
+		// Vertical sums of pixels 0, 1 then 2, 3, adding the halves pairs them up
+		//
+		const __m128i Low  = _mm_add_epi16(_mm_unpacklo_epi8(a, Zero), _mm_unpacklo_epi8(b, Zero));
+		const __m128i High = _mm_add_epi16(_mm_unpackhi_epi8(a, Zero), _mm_unpackhi_epi8(b, Zero));
+
+		__m128i Sum = _mm_add_epi16(_mm_unpacklo_epi64(Low, High), _mm_unpackhi_epi64(Low, High));
+		Sum = _mm_srli_epi16(_mm_add_epi16(Sum, Rounding), 2);
+
+		_mm_storel_epi64((__m128i*)(Output + 4 * x), _mm_packus_epi16(Sum, Sum));
+	}
+#endif
+
+	for (; x < Width; ++x)
+	{
+		const size_t x0 = 2 * x * 4;
+		const size_t x1 = (2 * x + 1 < SourceWidth) ? x0 + 4 : x0;
+
+		for (size_t c = 0; c < 4; ++c)
+			Output[4 * x + c] = (GD_BYTE)((Row0[x0 + c] + Row0[x1 + c] + Row1[x0 + c] + Row1[x1 + c] + 2) >> 2);
+	}
+}
+
+GD_ERR
+GD_BuildMipChain(const GD_GIF_COLOR* Pixels, GD_WORD Width, GD_WORD Height, GD_BYTE* Output)
+{
+	if (!Pixels || !Output || !Width || !Height)
+		return GD_UNEXPECTED_DATA;
+
+	//
+	// A 16 bit size has at most 16 levels
+	//
+	GD_BYTE* Levels[16];
+	size_t Widths[16];
+	size_t Heights[16];
+	GD_DWORD LevelCount = 0;
+
+	for (size_t w = Width, h = Height, Offset = 0;; w = w > 1 ? w / 2 : 1, h = h > 1 ? h / 2 : 1)
+	{
+		Levels[LevelCount] = Output + Offset;
+		Widths[LevelCount] = w;
+		Heights[LevelCount] = h;
+		++LevelCount;
+
+		Offset += w * h * 4;
+
+		if (w == 1 && h == 1)
+			break;
+	}
+
+	for (size_t y = 0; y < Height; ++y)
+	{
+		const GD_GIF_COLOR* Row = Pixels + y * Width;
+		GD_BYTE* Rgba = Levels[0] + y * Width * 4;
+
+		for (size_t x = 0; x < Width; ++x)
+		{
+			Rgba[4 * x]     = Row[x].r;
+			Rgba[4 * x + 1] = Row[x].g;
+			Rgba[4 * x + 2] = Row[x].b;
+			Rgba[4 * x + 3] = 0xFF;
+		}
+
+		//
+		// Each row completing a pair of the level above gives a row of the next one, down
+		// the chain as far as it goes, while those rows are still hot
+		//
+		size_t Source = y;
+
+		for (GD_DWORD Level = 0; Level + 1 < LevelCount; ++Level)
+		{
+			const size_t Target = Source / 2;
+			const size_t LastRow = Heights[Level] - 1;
+
+			if (Target >= Heights[Level + 1] || Source != (2 * Target + 1 < LastRow ? 2 * Target + 1 : LastRow))
+				break;
+
+			const size_t Stride = Widths[Level] * 4;
+
+			GD_MipDownsampleRow(Levels[Level] + 2 * Target * Stride, Levels[Level] + Source * Stride, Widths[Level],
+			                    Widths[Level + 1], Levels[Level + 1] + Target * Widths[Level + 1] * 4);
+
+			Source = Target;
+		}
+	}
+
+	return GD_OK;
+}
+
+GD_ERR
+GD_ComposeMipChain(GD_GIF_HANDLE Gif, GD_DWORD FrameIndex, GD_BYTE* Output)
+{
+	if (!Gif || !Output)
+		return GD_UNEXPECTED_DATA;
+
+	GD_ERR ErrorCode;
+
+	const GD_GIF_COLOR* Canvas = GD_ComposeFrame(Gif, FrameIndex, &ErrorCode);
+
+	if (!Canvas)
+		return ErrorCode;
+
+	return GD_BuildMipChain(Canvas, Gif->CanvasWidth, Gif->CanvasHeight, Output);
+}
+
+static void
+GD_AtlasLayout(GD_DWORD CellCount, GD_WORD CellWidth, GD_WORD CellHeight, GD_DWORD* Columns, GD_DWORD* Rows)
+{
+	//
+	// Fewest columns giving the smallest longer side, i.e. the grid closest to a square
+	//
+	size_t BestSide = (size_t)-1;
+
+	*Columns = 1;
+	*Rows = CellCount;
+
+	for (GD_DWORD c = 1; c <= CellCount; ++c)
+	{
+		const GD_DWORD r = (CellCount + c - 1) / c;
+		const size_t Width = (size_t)c * CellWidth;
+		const size_t Height = (size_t)r * CellHeight;
+		const size_t Side = Width > Height ? Width : Height;
+
+		if (Side < BestSide)
+		{
+			BestSide = Side;
+			*Columns = c;
+			*Rows = r;
+		}
+	}
+}
+
+GD_ERR
+GD_DecodeToAtlas(GD_GIF_HANDLE Gif, GD_DWORD Flags, GD_ATLAS* Atlas)
+{
+	if (!Gif || !Atlas)
+		return GD_UNEXPECTED_DATA;
+
+	memset(Atlas, 0, sizeof(GD_ATLAS));
+
+	if (Gif->Options.StripRoutine)
+		return GD_NOT_SUPPORTED;
+
+	if (!Gif->FrameCount)
+		return GD_INVALID_IMG_INDEX;
+
+	GD_RECT Trim = { 0, 0, Gif->CanvasWidth, Gif->CanvasHeight };
+
+	if (Flags & GD_ATLAS_TRIM)
+	{
+		GD_BOOL Found = GD_FALSE;
+
+		for (GD_DWORD i = 0; i < Gif->FrameCount; ++i)
+		{
+			const GD_RECT* Region = &Gif->Frames[i].Region;
+
+			if (!Region->Width || !Region->Height)
+				continue;
+
+			Trim = Found ? GD_RectUnion(&Trim, Region) : *Region;
+			Found = GD_TRUE;
+		}
+
+		//
+		// Nothing is ever drawn, keep one pixel of background
+		//
+		if (!Found)
+		{
+			Trim.Width = 1;
+			Trim.Height = 1;
+		}
+	}
+
+	GD_AtlasLayout(Gif->FrameCount, Trim.Width, Trim.Height, &Atlas->Columns, &Atlas->Rows);
+
+	const size_t Width = (size_t)Atlas->Columns * Trim.Width;
+	const size_t Height = (size_t)Atlas->Rows * Trim.Height;
+
+	if (Width > 0xFFFFFFFF || Height > 0xFFFFFFFF || Height > (size_t)-1 / sizeof(GD_GIF_COLOR) / Width)
+		return GD_NOMEM;
+
+	Atlas->Width = (GD_DWORD)Width;
+	Atlas->Height = (GD_DWORD)Height;
+	Atlas->CellWidth = Trim.Width;
+	Atlas->CellHeight = Trim.Height;
+	Atlas->Pixels = malloc(sizeof(GD_GIF_COLOR) * Width * Height);
+	Atlas->Cells = malloc(sizeof(GD_ATLAS_CELL) * Gif->FrameCount);
+
+	if (!Atlas->Pixels || !Atlas->Cells)
+	{
+		GD_FreeAtlas(Atlas);
+		return GD_NOMEM;
+	}
+
+	Atlas->CellCount = Gif->FrameCount;
+
+	GD_ERR ErrorCode = GD_OK;
+
+	for (GD_DWORD i = 0; i < Gif->FrameCount; ++i)
+	{
+		GD_ATLAS_CELL* Cell = &Atlas->Cells[i];
+
+		Cell->X = (i % Atlas->Columns) * Trim.Width;
+		Cell->Y = (i / Atlas->Columns) * Trim.Height;
+		Cell->OffsetX = Trim.Left;
+		Cell->OffsetY = Trim.Top;
+		Cell->U0 = (float)Cell->X / Atlas->Width;
+		Cell->V0 = (float)Cell->Y / Atlas->Height;
+		Cell->U1 = (float)(Cell->X + Trim.Width) / Atlas->Width;
+		Cell->V1 = (float)(Cell->Y + Trim.Height) / Atlas->Height;
+		Cell->DelayTime = Gif->Frames[i].DelayTime;
+
+		//
+		// Going through the frames in order, each call only draws one frame over the
+		// canvas, which then lands in the cell with the stride of the atlas
+		//
+		const GD_GIF_COLOR* Canvas = GD_ComposeFrame(Gif, i, &ErrorCode);
+
+		if (!Canvas)
+		{
+			GD_FreeAtlas(Atlas);
+			return ErrorCode;
+		}
+
+		for (size_t y = 0; y < Trim.Height; ++y)
+		{
+			memcpy(Atlas->Pixels + (Cell->Y + y) * Width + Cell->X,
+			       Canvas + (Trim.Top + y) * Gif->CanvasWidth + Trim.Left,
+			       sizeof(GD_GIF_COLOR) * Trim.Width);
+		}
+	}
+
+	//
+	// Blank the cells left over in the last row
+	//
+	for (GD_DWORD i = Gif->FrameCount; i < Atlas->Columns * Atlas->Rows; ++i)
+	{
+		const size_t X = (i % Atlas->Columns) * (size_t)Trim.Width;
+		const size_t Y = (i / Atlas->Columns) * (size_t)Trim.Height;
+
+		for (size_t y = 0; y < Trim.Height; ++y)
+			memset(Atlas->Pixels + (Y + y) * Width + X, 0, sizeof(GD_GIF_COLOR) * Trim.Width);
+	}
+
+	return GD_OK;
+}
+
+void
+GD_FreeAtlas(GD_ATLAS* Atlas)
+{
+	if (!Atlas)
+		return;
+
+	free(Atlas->Pixels);
+	free(Atlas->Cells);
+
+	memset(Atlas, 0, sizeof(GD_ATLAS));
+}
+
+//
+// Bilinear resampling into float planes. Source rows are resampled horizontally once,
+// through the normalization tables, and the two last ones are kept for the vertical pass
+//
+typedef struct GD_TENSOR_CONTEXT
+{
+	float Lut[3][256];
+
+	size_t SourceWidth;
+	size_t SourceHeight;
+	size_t Width;
+	size_t Height;
+
+	size_t* Left;
+	float* Weight;
+
+	float* Rows[2];
+	size_t RowIndex[2];
+} GD_TENSOR_CONTEXT;
+
+static void
+GD_TensorCoordinate(size_t Index, size_t SourceSize, size_t Size, size_t* First, float* Weight)
+{
+	//
+	// Centers of output pixels map to centers of source pixels, edges are clamped
+	//
+	double Position = ((double)Index + 0.5) * (double)SourceSize / (double)Size - 0.5;
+
+	if (Position < 0)
+		Position = 0;
+
+	*First = (size_t)Position;
+	*Weight = (float)(Position - (double)*First);
+
+	if (*First >= SourceSize - 1)
+	{
+		*First = SourceSize - 1;
+		*Weight = 0;
+	}
+}
+
+static GD_ERR
+GD_TensorBegin(GD_TENSOR_CONTEXT* Context, GD_WORD SourceWidth, GD_WORD SourceHeight, const GD_TENSOR_OPTIONS* Options)
+{
+	if (!SourceWidth || !SourceHeight || !Options->Width || !Options->Height)
+		return GD_UNEXPECTED_DATA;
+
+	for (size_t c = 0; c < 3; ++c)
+	{
+		if (Options->Std[c] == 0)
+			return GD_UNEXPECTED_DATA;
+
+		for (size_t v = 0; v < 256; ++v)
+			Context->Lut[c][v] = ((float)v / 255.0f - Options->Mean[c]) / Options->Std[c];
+	}
+
+	Context->SourceWidth = SourceWidth;
+	Context->SourceHeight = SourceHeight;
+	Context->Width = Options->Width;
+	Context->Height = Options->Height;
+
+	GD_BYTE* Block = malloc(Context->Width * (sizeof(size_t) + sizeof(float) * 7));
+
+	if (!Block)
+		return GD_NOMEM;
+
+	Context->Left = (size_t*)Block;
+	Context->Weight = (float*)(Block + Context->Width * sizeof(size_t));
+	Context->Rows[0] = Context->Weight + Context->Width;
+	Context->Rows[1] = Context->Rows[0] + Context->Width * 3;
+
+	for (size_t x = 0; x < Context->Width; ++x)
+		GD_TensorCoordinate(x, SourceWidth, Context->Width, &Context->Left[x], &Context->Weight[x]);
+
+	return GD_OK;
+}
+
+static void
+GD_TensorEnd(GD_TENSOR_CONTEXT* Context)
+{
+	free(Context->Left);
+}
+
+/// Source row y resampled to the output width, as three planes. Keep is the slot the
+/// caller still needs
+static const float*
+GD_TensorRow(GD_TENSOR_CONTEXT* Context, const GD_GIF_COLOR* Pixels, size_t y, int Keep)
+{
+	for (int Slot = 0; Slot < 2; ++Slot)
+	{
+		if (Context->RowIndex[Slot] == y)
+			return Context->Rows[Slot];
+	}
+
+	const int Slot = Keep == 0 ? 1 : 0;
+
+	const GD_GIF_COLOR* Row = Pixels + y * Context->SourceWidth;
+	const size_t Last = Context->SourceWidth - 1;
+	const size_t Width = Context->Width;
+
+	float* R = Context->Rows[Slot];
+	float* G = R + Width;
+	float* B = G + Width;
+
+	for (size_t x = 0; x < Width; ++x)
+	{
+		const GD_GIF_COLOR p = Row[Context->Left[x]];
+		const GD_GIF_COLOR q = Row[Context->Left[x] < Last ? Context->Left[x] + 1 : Last];
+		const float w = Context->Weight[x];
+
+		R[x] = Context->Lut[0][p.r] + (Context->Lut[0][q.r] - Context->Lut[0][p.r]) * w;
+		G[x] = Context->Lut[1][p.g] + (Context->Lut[1][q.g] - Context->Lut[1][p.g]) * w;
+		B[x] = Context->Lut[2][p.b] + (Context->Lut[2][q.b] - Context->Lut[2][p.b]) * w;
+	}
+
+	Context->RowIndex[Slot] = y;
+
+	return Context->Rows[Slot];
+}
+
+static void
+GD_TensorImage(GD_TENSOR_CONTEXT* Context, const GD_GIF_COLOR* Pixels, float* Output)
+{
+	const size_t Width = Context->Width;
+	const size_t PlaneSize = Width * Context->Height;
+
+	Context->RowIndex[0] = (size_t)-1;
+	Context->RowIndex[1] = (size_t)-1;
+
+	for (size_t y = 0; y < Context->Height; ++y)
+	{
+		size_t Top;
+		float w;
+
+		GD_TensorCoordinate(y, Context->SourceHeight, Context->Height, &Top, &w);
+
+		const float* a = GD_TensorRow(Context, Pixels, Top, -1);
+		const int Keep = (a == Context->Rows[0]) ? 0 : 1;
+		const float* b = (w != 0) ? GD_TensorRow(Context, Pixels, Top + 1, Keep) : a;
+
+		for (size_t c = 0; c < 3; ++c)
+		{
+			const float* RowA = a + c * Width;
+			const float* RowB = b + c * Width;
+			float* Out = Output + c * PlaneSize + y * Width;
+			size_t x = 0;
+
+#ifdef GD_SSE2
+			const __m128 Weight = _mm_set1_ps(w);
+
+			for (; x + 4 <= Width; x += 4)
+			{
+				const __m128 va = _mm_loadu_ps(RowA + x);
+				const __m128 vb = _mm_loadu_ps(RowB + x);
+
+				_mm_storeu_ps(Out + x, _mm_add_ps(va, _mm_mul_ps(_mm_sub_ps(vb, va), Weight)));
+			}
+#endif
+
+			for (; x < Width; ++x)
+				Out[x] = RowA[x] + (RowB[x] - RowA[x]) * w;
+		}
+	}
+}
+
+GD_ERR
+GD_PixelsToTensor(const GD_GIF_COLOR* Pixels, GD_WORD Width, GD_WORD Height, const GD_TENSOR_OPTIONS* Options, float* Output)
+{
+	if (!Pixels || !Options || !Output)
+		return GD_UNEXPECTED_DATA;
+
+	GD_TENSOR_CONTEXT Context;
+
+	const GD_ERR ErrorCode = GD_TensorBegin(&Context, Width, Height, Options);
+
+	if (ErrorCode != GD_OK)
+		return ErrorCode;
+
+	GD_TensorImage(&Context, Pixels, Output);
+	GD_TensorEnd(&Context);
+
+	return GD_OK;
+}
+
+GD_ERR
+GD_ComposeToTensor(GD_GIF_HANDLE Gif, const GD_DWORD* FrameIndices, GD_DWORD Count, const GD_TENSOR_OPTIONS* Options, float* Output)
+{
+	if (!Gif || !FrameIndices || !Options || !Output)
+		return GD_UNEXPECTED_DATA;
+
+	GD_TENSOR_CONTEXT Context;
+
+	GD_ERR ErrorCode = GD_TensorBegin(&Context, Gif->CanvasWidth, Gif->CanvasHeight, Options);
+
+	if (ErrorCode != GD_OK)
+		return ErrorCode;
+
+	const size_t ImageSize = 3 * (size_t)Options->Width * Options->Height;
+
+	for (GD_DWORD i = 0; i < Count; ++i)
+	{
+		const GD_GIF_COLOR* Canvas = GD_ComposeFrame(Gif, FrameIndices[i], &ErrorCode);
+
+		if (!Canvas)
+			break;
+
+		GD_TensorImage(&Context, Canvas, Output + i * ImageSize);
+	}
+
+	GD_TensorEnd(&Context);
+
+	return ErrorCode;
+}
+
+static GD_BOOL
+GD_RectContains(const GD_RECT* Outer, const GD_RECT* Inner)
+{
+	return (Inner->Left >= Outer->Left && Inner->Top >= Outer->Top &&
+	        Inner->Left + Inner->Width <= Outer->Left + Outer->Width &&
+	        Inner->Top + Inner->Height <= Outer->Top + Outer->Height) ? GD_TRUE : GD_FALSE;
+}
+
+static void
+GD_PlanSkips(GD_GIF_HANDLE Gif, GD_DWORD First, GD_DWORD Target, GD_BYTE* Skip)
+{
+	//
+	// Walk back from the target, keeping the largest region known to be overwritten before
+	// it is shown: the region of an opaque frame drawn after, or of a frame disposed to the
+	// background. Whatever a frame draws inside of it never reaches the target. Frames
+	// restoring the previous canvas are not covers, they bring back what was under them
+	//
+	GD_RECT Cover = { 0, 0, 0, 0 };
+
+	const GD_FRAME* Last = &Gif->Frames[Target];
+
+	if (!Last->HasTransparency && !Last->Alpha && Last->DisposalMethod != GD_DISPOSAL_PREVIOUS)
+		Cover = Last->Region;
+
+	for (GD_DWORD FrameIndex = Target; FrameIndex-- > First;)
+	{
+		const GD_FRAME* Frame = &Gif->Frames[FrameIndex];
+		const GD_RECT* Drawn = &Frame->OpaqueRect;
+
+		//
+		// Frames disposed before the target are undone or wiped whatever they draw
+		//
+		Skip[FrameIndex - First] = (Frame->DisposalMethod == GD_DISPOSAL_PREVIOUS ||
+		                            Frame->DisposalMethod == GD_DISPOSAL_BACKGROUND ||
+		                            !GD_RectArea(Drawn) || GD_RectContains(&Cover, Drawn)) ? 1 : 0;
+
+		const GD_BOOL Covers = (Frame->DisposalMethod == GD_DISPOSAL_BACKGROUND ||
+		                        (!Frame->HasTransparency && !Frame->Alpha && Frame->DisposalMethod != GD_DISPOSAL_PREVIOUS)) ? GD_TRUE : GD_FALSE;
+
+		if (Covers && GD_RectArea(&Frame->Region) > GD_RectArea(&Cover))
+			Cover = Frame->Region;
+	}
+}
+
+GD_ERR
+GD_SampleFrames(GD_GIF_HANDLE Gif, const GD_DWORD* Timestamps, GD_DWORD Count, GD_SAMPLE_ROUTINE Routine, void* UserData)
+{
+	if (!Gif || !Routine || (Count && !Timestamps))
+		return GD_UNEXPECTED_DATA;
+
+	if (Gif->Options.StripRoutine)
+		return GD_NOT_SUPPORTED;
+
+	if (!Count)
+		return GD_OK;
+
+	if (!Gif->FrameCount)
+		return GD_INVALID_IMG_INDEX;
+
+	GD_ERR ErrorCode = GD_CanvasInit(Gif);
+
+	if (ErrorCode != GD_OK)
+		return ErrorCode;
+
+	//
+	// End[i] is when frame i stops being shown, in milliseconds
+	//
+	GD_QWORD* End = malloc(sizeof(GD_QWORD) * Gif->FrameCount);
+	GD_BYTE* Skip = malloc(sizeof(GD_BYTE) * Gif->FrameCount);
+
+	if (!End || !Skip)
+	{
+		free(End);
+		free(Skip);
+		return GD_NOMEM;
+	}
+
+	GD_QWORD Elapsed = 0;
+
+	for (GD_DWORD i = 0; i < Gif->FrameCount; ++i)
+	{
+		Elapsed += GD_EffectiveDelay(&Gif->Frames[i]) * 10;
+		End[i] = Elapsed;
+	}
+
+	for (GD_DWORD SampleIndex = 0; SampleIndex < Count; ++SampleIndex)
+	{
+		//
+		// Frame on screen at the timestamp, the last one past the end of the animation
+		//
+		GD_DWORD Low = 0, High = Gif->FrameCount - 1;
+
+		while (Low < High)
+		{
+			const GD_DWORD Middle = Low + (High - Low) / 2;
+
+			if (End[Middle] > Timestamps[SampleIndex])
+				High = Middle;
+			else
+				Low = Middle + 1;
+		}
+
+		const GD_DWORD Target = Low;
+
+		if (Gif->CanvasNext || Gif->DisposalPending)
+			Gif->DirtyCount = 0;
+
+		if (!Gif->DisposalPending || Gif->CanvasNext != Target + 1)
+		{
+			GD_CanvasRewind(Gif, Target);
+
+			const GD_DWORD First = Gif->CanvasNext;
+			GD_PlanSkips(Gif, First, Target, Skip);
+
+			//
+			// Once a frame is skipped the canvas is only exact again at the target,
+			// no snapshot is taken on the way
+			//
+			GD_BOOL Snapshot = GD_TRUE;
+
+			while (Gif->CanvasNext < Target)
+			{
+				if (Skip[Gif->CanvasNext - First])
+				{
+					GD_CanvasSkip(Gif);
+					Snapshot = GD_FALSE;
+				}
+				else
+				{
+					GD_CanvasStep(Gif, Snapshot);
+				}
+			}
+
+			GD_CanvasStep(Gif, Snapshot);
+		}
+
+		GD_SAMPLE Sample;
+
+		Sample.SampleIndex = SampleIndex;
+		Sample.Timestamp   = Timestamps[SampleIndex];
+		Sample.FrameIndex  = Target;
+		Sample.Pixels      = Gif->Canvas;
+
+		Routine(&Sample, UserData);
+	}
+
+	free(End);
+	free(Skip);
+
+	return GD_OK;
+}
+
+//
+// LZW compression of one frame. The string table maps (prefix code, index) to a code with
+// linear probing, keys are stored plus one so that 0 marks an empty slot. Each thread has
+// a table of its own, and a scratch one to try out a clear before emitting it
+//
+typedef struct LZW_ENCODER
+{
+	GD_DWORD Keys[1 << LZW_HASH_BITS];
+	GD_WORD Codes[1 << LZW_HASH_BITS];
+
+	GD_DWORD ScratchKeys[1 << LZW_HASH_BITS];
+	GD_WORD ScratchCodes[1 << LZW_HASH_BITS];
+
+	const GD_ENCODER_FRAME* Frame;
+	GD_BYTE MinCodeWidth;
+	GD_BOOL Thorough;
+
+	GD_BYTE* Output;
+	size_t Size;
+	GD_ERR Result;
+} LZW_ENCODER;
+
+/// Slot of Key in the table, or the empty slot where it would go
+static GD_FORCEINLINE GD_DWORD
+GD_LzwFind(const GD_DWORD* Keys, GD_DWORD Key)
+{
+	const GD_DWORD Mask = (1 << LZW_HASH_BITS) - 1;
+
+	GD_DWORD Slot = (Key * 2654435761u) >> (32 - LZW_HASH_BITS);
+
+	while (Keys[Slot] && Keys[Slot] != Key)
+		Slot = (Slot + 1) & Mask;
+
+	return Slot;
+}
+
+static GD_FORCEINLINE void
+GD_LzwEmit(GD_BYTE* Output, size_t* Size, GD_DWORD* Bits, GD_BYTE* BitCount, GD_WORD Code, GD_BYTE Width)
+{
+	*Bits |= (GD_DWORD)Code << *BitCount;
+	*BitCount += Width;
+
+	while (*BitCount >= 8)
+	{
+		Output[(*Size)++] = (GD_BYTE)*Bits;
+		*Bits >>= 8;
+		*BitCount -= 8;
+	}
+}
+
+/// Bits taken by Indices with the full table as it is
+static size_t
+GD_LzwMeasureFull(const LZW_ENCODER* Lzw, const GD_BYTE* Indices, size_t Count)
+{
+	size_t Codes = 1;
+	GD_WORD Prefix = Indices[0];
+
+	for (size_t i = 1; i < Count; ++i)
+	{
+		const GD_DWORD Slot = GD_LzwFind(Lzw->Keys, (((GD_DWORD)Prefix << 8) | Indices[i]) + 1);
+
+		if (Lzw->Keys[Slot])
+		{
+			Prefix = Lzw->Codes[Slot];
+		}
+		else
+		{
+			++Codes;
+			Prefix = Indices[i];
+		}
+	}
+
+	return Codes * LZW_MAX_CODEWIDTH;
+}
+
+/// Bits taken by Indices after a clear code, built up in the scratch table
+static size_t
+GD_LzwMeasureCleared(LZW_ENCODER* Lzw, const GD_BYTE* Indices, size_t Count)
+{
+	const GD_WORD CodeClear = (GD_WORD)(1 << Lzw->MinCodeWidth);
+
+	// The clear code itself goes out with the full width
+	size_t Bits = LZW_MAX_CODEWIDTH;
+
+	GD_BYTE Width = Lzw->MinCodeWidth + 1;
+	GD_WORD Next = CodeClear + 2;
+	GD_WORD Prefix = Indices[0];
+
+	memset(Lzw->ScratchKeys, 0, sizeof(Lzw->ScratchKeys));
+
+	for (size_t i = 1; i < Count; ++i)
+	{
+		const GD_DWORD Key = (((GD_DWORD)Prefix << 8) | Indices[i]) + 1;
+		const GD_DWORD Slot = GD_LzwFind(Lzw->ScratchKeys, Key);
+
+		if (Lzw->ScratchKeys[Slot])
+		{
+			Prefix = Lzw->ScratchCodes[Slot];
+			continue;
+		}
+
+		Bits += Width;
+
+		if (Next >= (1 << Width) && Width < LZW_MAX_CODEWIDTH)
+			++Width;
+
+		if (Next < (1 << LZW_MAX_CODEWIDTH))
+		{
+			Lzw->ScratchKeys[Slot] = Key;
+			Lzw->ScratchCodes[Slot] = Next++;
+		}
+
+		Prefix = Indices[i];
+	}
+
+	return Bits + Width;
+}
+
+/// Compress the frame to Output. With KeepFull, a full table is kept while it does better
+/// than a cleared one, otherwise it is cleared right away as most encoders do
+static size_t
+GD_LzwEncode(LZW_ENCODER* Lzw, GD_BOOL KeepFull, GD_BYTE* Output)
+{
+	const GD_BYTE* Indices = Lzw->Frame->Indices;
+	const size_t Count = (size_t)Lzw->Frame->Width * Lzw->Frame->Height;
+	const GD_BYTE MinCodeWidth = Lzw->MinCodeWidth;
+	const GD_WORD CodeClear = (GD_WORD)(1 << MinCodeWidth);
+	const GD_WORD CodeEnd = CodeClear + 1;
+
+	size_t Size = 0;
+	GD_DWORD Bits = 0;
+	GD_BYTE BitCount = 0;
+	GD_BYTE Width = MinCodeWidth + 1;
+	GD_WORD Next = CodeClear + 2;
+
+	// Once the table is full, where to decide again whether to keep it
+	size_t Checkpoint = 0;
+
+	memset(Lzw->Keys, 0, sizeof(Lzw->Keys));
+	GD_LzwEmit(Output, &Size, &Bits, &BitCount, CodeClear, Width);
+
+	if (Count)
+	{
+		GD_WORD Prefix = Indices[0];
+
+		for (size_t i = 1; i < Count; ++i)
+		{
+			const GD_BYTE Index = Indices[i];
+			const GD_DWORD Key = (((GD_DWORD)Prefix << 8) | Index) + 1;
+			const GD_DWORD Slot = GD_LzwFind(Lzw->Keys, Key);
+
+			if (Lzw->Keys[Slot])
+			{
+				Prefix = Lzw->Codes[Slot];
+				continue;
+			}
+
+			GD_LzwEmit(Output, &Size, &Bits, &BitCount, Prefix, Width);
+
+			//
+			// Codes widen once the next free one no longer fits
+			//
+			if (Next >= (1 << Width) && Width < LZW_MAX_CODEWIDTH)
+				++Width;
+
+			GD_BOOL Clear = GD_FALSE;
+
+			if (!KeepFull)
+			{
+				//
+				// Clear instead of taking the last code
+				//
+				if (Next < (1 << LZW_MAX_CODEWIDTH) - 1)
+				{
+					Lzw->Keys[Slot] = Key;
+					Lzw->Codes[Slot] = Next++;
+				}
+				else
+				{
+					Clear = GD_TRUE;
+				}
+			}
+			else if (Next < (1 << LZW_MAX_CODEWIDTH))
+			{
+				Lzw->Keys[Slot] = Key;
+				Lzw->Codes[Slot] = Next++;
+				Checkpoint = i;
+			}
+			else if (i >= Checkpoint)
+			{
+				//
+				// Compress the next indices both ways without output, starting over
+				// has to save more than a tenth to be worth losing the table
+				//
+				const size_t Window = (Count - i < LZW_CHECK_GAP) ? Count - i : LZW_CHECK_GAP;
+
+				if (GD_LzwMeasureCleared(Lzw, Indices + i, Window) * 10 < GD_LzwMeasureFull(Lzw, Indices + i, Window) * 11)
+					Clear = GD_TRUE;
+				else
+					Checkpoint = i + Window;
+			}
+
+			if (Clear)
+			{
+				GD_LzwEmit(Output, &Size, &Bits, &BitCount, CodeClear, Width);
+
+				memset(Lzw->Keys, 0, sizeof(Lzw->Keys));
+				Next = CodeClear + 2;
+				Width = MinCodeWidth + 1;
+			}
+
+			Prefix = Index;
+		}
+
+		GD_LzwEmit(Output, &Size, &Bits, &BitCount, Prefix, Width);
+
+		if (Next >= (1 << Width) && Width < LZW_MAX_CODEWIDTH)
+			++Width;
+	}
+
+	GD_LzwEmit(Output, &Size, &Bits, &BitCount, CodeEnd, Width);
+
+	if (BitCount)
+		Output[Size++] = (GD_BYTE)Bits;
+
+	return Size;
+}
+
+static void
+GD_LzwCompress(void* Argument)
+{
+	LZW_ENCODER* Lzw = (LZW_ENCODER*)Argument;
+
+	const GD_BYTE* Indices = Lzw->Frame->Indices;
+	const size_t Count = (size_t)Lzw->Frame->Width * Lzw->Frame->Height;
+	const GD_WORD CodeClear = (GD_WORD)(1 << Lzw->MinCodeWidth);
+
+	for (size_t i = 0; i < Count; ++i)
+	{
+		if (Indices[i] >= CodeClear)
+		{
+			Lzw->Result = GD_UNEXPECTED_DATA;
+			return;
+		}
+	}
+
+	//
+	// Every code stands for at least one index and takes at most 12 bits, add a clear
+	// code per table fill and the first clear and end codes
+	//
+	const size_t Capacity = (Count + Count / 2048 + 4) * 2;
+
+	Lzw->Output = malloc(Capacity);
+
+	if (!Lzw->Output)
+	{
+		Lzw->Result = GD_NOMEM;
+		return;
+	}
+
+	Lzw->Size = GD_LzwEncode(Lzw, GD_FALSE, Lzw->Output);
+	Lzw->Result = GD_OK;
+
+	//
+	// Neither way of placing clear codes always wins, try the other one too
+	//
+	if (Lzw->Thorough)
+	{
+		GD_BYTE* Output = malloc(Capacity);
+
+		if (!Output)
+			return;
+
+		const size_t Size = GD_LzwEncode(Lzw, GD_TRUE, Output);
+
+		if (Size < Lzw->Size)
+		{
+			free(Lzw->Output);
+			Lzw->Output = Output;
+			Lzw->Size = Size;
+		}
+		else
+		{
+			free(Output);
+		}
+	}
+}
+
+static void
+GD_EncoderWrite(GD_ENCODER* Encoder, const void* Bytes, size_t Count)
+{
+	if (Encoder->Error != GD_OK)
+		return;
+
+	Encoder->Error = GD_GrowBuffer((void**)&Encoder->Data, &Encoder->Capacity, Encoder->Size + Count, 1);
+
+	if (Encoder->Error != GD_OK)
+		return;
+
+	memcpy(Encoder->Data + Encoder->Size, Bytes, Count);
+	Encoder->Size += Count;
+}
+
+static void
+GD_EncoderWriteByte(GD_ENCODER* Encoder, GD_BYTE Byte)
+{
+	GD_EncoderWrite(Encoder, &Byte, 1);
+}
+
+static void
+GD_EncoderWriteWord(GD_ENCODER* Encoder, GD_WORD Word)
+{
+	const GD_BYTE Bytes[2] = { (GD_BYTE)Word, (GD_BYTE)(Word >> 8) };
+
+	GD_EncoderWrite(Encoder, Bytes, 2);
+}
+
+/// Data cut in sub-blocks, followed by the block terminator
+static void
+GD_EncoderWriteBlocks(GD_ENCODER* Encoder, const GD_BYTE* Data, size_t Size)
+{
+	while (Size)
+	{
+		const GD_BYTE Length = (GD_BYTE)(Size < SUB_BLOCK_MAX_SIZE ? Size : SUB_BLOCK_MAX_SIZE);
+
+		GD_EncoderWriteByte(Encoder, Length);
+		GD_EncoderWrite(Encoder, Data, Length);
+
+		Data += Length;
+		Size -= Length;
+	}
+
+	GD_EncoderWriteByte(Encoder, 0);
+}
+
+/// Bits per entry of a color table, 0 when it cannot be written
+static GD_BYTE
+GD_EncoderTableBits(const GD_COLOR_TABLE* Table)
+{
+	if (!Table || !Table->Count || Table->Count > GCT_MAX_SIZE)
+		return 0;
+
+	GD_BYTE Bits = 1;
+
+	while ((1u << Bits) < Table->Count)
+		++Bits;
+
+	return Bits;
+}
+
+/// The table padded with black to 2^Bits entries
+static void
+GD_EncoderWriteTable(GD_ENCODER* Encoder, const GD_COLOR_TABLE* Table, GD_BYTE Bits)
+{
+	for (size_t i = 0; i < ((size_t)1 << Bits); ++i)
+	{
+		const GD_GIF_COLOR Black = { 0, 0, 0 };
+		const GD_GIF_COLOR Color = (i < Table->Count) ? Table->Internal[i] : Black;
+
+		GD_EncoderWrite(Encoder, &Color, 3);
+	}
+}
+
+GD_ENCODER_HANDLE
+GD_EncoderCreate(const GD_ENCODER_OPTIONS* Options, GD_ERR* ErrorCode)
+{
+	GD_ERR Dummy;
+
+	if (!ErrorCode)
+		ErrorCode = &Dummy;
+
+	if (!Options || (Options->GlobalPalette && !GD_EncoderTableBits(Options->GlobalPalette)))
+	{
+		*ErrorCode = GD_UNEXPECTED_DATA;
+		return NULL;
+	}
+
+	GD_ENCODER_HANDLE Encoder = calloc(1, sizeof(GD_ENCODER));
+
+	if (!Encoder)
+	{
+		*ErrorCode = GD_NOMEM;
+		return NULL;
+	}
+
+	Encoder->Options = *Options;
+	Encoder->GlobalBits = GD_EncoderTableBits(Options->GlobalPalette);
+
+	GD_EncoderWrite(Encoder, "GIF89a", HEADER_SIZE);
+	GD_EncoderWriteWord(Encoder, Options->Width);
+	GD_EncoderWriteWord(Encoder, Options->Height);
+
+	//
+	// 8 bits of color resolution, the table is not sorted
+	//
+	if (Encoder->GlobalBits)
+		GD_EncoderWriteByte(Encoder, (GD_BYTE)(MASK_TABLE_PRESENT | 0x70 | (Encoder->GlobalBits - 1)));
+	else
+		GD_EncoderWriteByte(Encoder, 0x70);
+
+	GD_EncoderWriteByte(Encoder, Options->BgColorIndex);
+	GD_EncoderWriteByte(Encoder, 0);
+
+	if (Encoder->GlobalBits)
+		GD_EncoderWriteTable(Encoder, Options->GlobalPalette, Encoder->GlobalBits);
+
+	*ErrorCode = Encoder->Error;
+
+	if (*ErrorCode != GD_OK)
+	{
+		GD_EncoderDestroy(Encoder);
+		return NULL;
+	}
+
+	return Encoder;
+}
+
+GD_ERR
+GD_EncoderSetLoopCount(GD_ENCODER_HANDLE Encoder, GD_WORD LoopCount)
+{
+	if (!Encoder || Encoder->Finished || Encoder->FrameCount)
+		return GD_UNEXPECTED_DATA;
+
+	const GD_BYTE Netscape[] = { BLOCK_INTRODUCER_EXT, EXT_LABEL_APPLICATION, 11,
+	                             'N', 'E', 'T', 'S', 'C', 'A', 'P', 'E', '2', '.', '0', 3, 1 };
+
+	GD_EncoderWrite(Encoder, Netscape, sizeof(Netscape));
+	GD_EncoderWriteWord(Encoder, LoopCount);
+	GD_EncoderWriteByte(Encoder, 0);
+
+	return Encoder->Error;
+}
+
+GD_ERR
+GD_EncoderAddComment(GD_ENCODER_HANDLE Encoder, const char* Text)
+{
+	if (!Encoder || !Text || Encoder->Finished)
+		return GD_UNEXPECTED_DATA;
+
+	GD_EncoderWriteByte(Encoder, BLOCK_INTRODUCER_EXT);
+	GD_EncoderWriteByte(Encoder, EXT_LABEL_COMMENT);
+	GD_EncoderWriteBlocks(Encoder, (const GD_BYTE*)Text, strlen(Text));
+
+	return Encoder->Error;
+}
+
+static void
+GD_EncoderWriteFrame(GD_ENCODER* Encoder, const GD_ENCODER_FRAME* Frame, const LZW_ENCODER* Lzw)
+{
+	const GD_BYTE Graphics[] = { BLOCK_INTRODUCER_EXT, EXT_LABEL_GRAPHICS, 4,
+	                             (GD_BYTE)(((Frame->DisposalMethod & 7) << 2) | (Frame->HasTransparency ? MASK_TRANSPARENCY : 0)) };
+
+	GD_EncoderWrite(Encoder, Graphics, sizeof(Graphics));
+	GD_EncoderWriteWord(Encoder, Frame->DelayTime);
+	GD_EncoderWriteByte(Encoder, Frame->HasTransparency ? Frame->TransparentIndex : 0);
+	GD_EncoderWriteByte(Encoder, 0);
+
+	const GD_BYTE LocalBits = GD_EncoderTableBits(Frame->Palette);
+
+	GD_EncoderWriteByte(Encoder, BLOCK_INTRODUCER_IMG);
+	GD_EncoderWriteWord(Encoder, Frame->Left);
+	GD_EncoderWriteWord(Encoder, Frame->Top);
+	GD_EncoderWriteWord(Encoder, Frame->Width);
+	GD_EncoderWriteWord(Encoder, Frame->Height);
+	GD_EncoderWriteByte(Encoder, LocalBits ? (GD_BYTE)(MASK_TABLE_PRESENT | (LocalBits - 1)) : 0);
+
+	if (LocalBits)
+		GD_EncoderWriteTable(Encoder, Frame->Palette, LocalBits);
+
+	GD_EncoderWriteByte(Encoder, Lzw->MinCodeWidth);
+	GD_EncoderWriteBlocks(Encoder, Lzw->Output, Lzw->Size);
+}
+
+GD_ERR
+GD_EncoderAddFrames(GD_ENCODER_HANDLE Encoder, const GD_ENCODER_FRAME* Frames, GD_DWORD Count)
+{
+	if (!Encoder || !Frames || Encoder->Finished)
+		return GD_UNEXPECTED_DATA;
+
+	if (Encoder->Error != GD_OK)
+		return Encoder->Error;
+
+	for (GD_DWORD i = 0; i < Count; ++i)
+	{
+		if (!Frames[i].Indices || !Frames[i].Width || !Frames[i].Height)
+			return GD_UNEXPECTED_DATA;
+
+		if (Frames[i].Palette ? !GD_EncoderTableBits(Frames[i].Palette) : !Encoder->GlobalBits)
+			return GD_NO_COLOR_TABLE;
+	}
+
+	GD_DWORD JobCount = Encoder->Options.Threads;
+
+	if (JobCount > Count)
+		JobCount = Count;
+
+	if (JobCount > GD_MAX_THREADS)
+		JobCount = GD_MAX_THREADS;
+
+	if (JobCount < 1)
+		JobCount = 1;
+
+	LZW_ENCODER* Jobs = malloc(sizeof(LZW_ENCODER) * JobCount);
+
+	if (!Jobs)
+		return GD_NOMEM;
+
+	//
+	// Frames are compressed JobCount at a time, then written in order before the next
+	// ones so that only one batch of compressed data is held at once
+	//
+	GD_ERR ErrorCode = GD_OK;
+
+	for (GD_DWORD First = 0; First < Count && ErrorCode == GD_OK; First += JobCount)
+	{
+		const GD_DWORD Batch = (Count - First < JobCount) ? Count - First : JobCount;
+
+		GD_TASK Tasks[GD_MAX_THREADS];
+		GD_BOOL Started[GD_MAX_THREADS];
+
+		for (GD_DWORD i = 0; i < Batch; ++i)
+		{
+			const GD_ENCODER_FRAME* Frame = &Frames[First + i];
+			const GD_BYTE Bits = Frame->Palette ? GD_EncoderTableBits(Frame->Palette) : Encoder->GlobalBits;
+
+			Jobs[i].Frame = Frame;
+			Jobs[i].MinCodeWidth = Bits < 2 ? 2 : Bits;
+			Jobs[i].Thorough = Encoder->Options.Thorough;
+			Jobs[i].Output = NULL;
+			Jobs[i].Result = GD_OK;
+		}
+
+		for (GD_DWORD i = 1; i < Batch; ++i)
+		{
+			Tasks[i].Routine = GD_LzwCompress;
+			Tasks[i].Argument = &Jobs[i];
+			Started[i] = GD_TaskStart(&Tasks[i]);
+		}
+
+		GD_LzwCompress(&Jobs[0]);
+
+		for (GD_DWORD i = 1; i < Batch; ++i)
+		{
+			if (Started[i])
+				GD_TaskJoin(&Tasks[i]);
+			else
+				GD_LzwCompress(&Jobs[i]);
+		}
+
+		for (GD_DWORD i = 0; i < Batch && ErrorCode == GD_OK; ++i)
+			ErrorCode = Jobs[i].Result;
+
+		for (GD_DWORD i = 0; i < Batch && ErrorCode == GD_OK; ++i)
+		{
+			GD_EncoderWriteFrame(Encoder, Jobs[i].Frame, &Jobs[i]);
+			ErrorCode = Encoder->Error;
+			++Encoder->FrameCount;
+		}
+
+		for (GD_DWORD i = 0; i < Batch; ++i)
+			free(Jobs[i].Output);
+	}
+
+	free(Jobs);
+
+	return ErrorCode;
+}
+
+GD_ERR
+GD_EncoderAddFrame(GD_ENCODER_HANDLE Encoder, const GD_ENCODER_FRAME* Frame)
+{
+	return GD_EncoderAddFrames(Encoder, Frame, 1);
+}
+
+GD_ERR
+GD_EncoderFinish(GD_ENCODER_HANDLE Encoder, const GD_BYTE** Data, size_t* Size)
+{
+	if (!Encoder || !Data || !Size)
+		return GD_UNEXPECTED_DATA;
+
+	if (!Encoder->Finished)
+	{
+		GD_EncoderWriteByte(Encoder, TRAILER);
+		Encoder->Finished = GD_TRUE;
+	}
+
+	*Data = Encoder->Data;
+	*Size = Encoder->Size;
+
+	return Encoder->Error;
+}
+
+void
+GD_EncoderDestroy(GD_ENCODER_HANDLE Encoder)
+{
+	if (!Encoder)
+		return;
+
+	free(Encoder->Data);
+	free(Encoder);
+}
+
+static GD_FORCEINLINE GD_BOOL
+GD_SameColor(GD_GIF_COLOR a, GD_GIF_COLOR b)
+{
+	return (a.r == b.r && a.g == b.g && a.b == b.b) ? GD_TRUE : GD_FALSE;
+}
+
+static GD_FORCEINLINE GD_DWORD
+GD_ColorSetFind(const GD_COLOR_SET* Set, GD_GIF_COLOR Color)
+{
+	const GD_DWORD Key = (((GD_DWORD)Color.r << 16) | ((GD_DWORD)Color.g << 8) | Color.b) + 1;
+
+	GD_DWORD Slot = (Key * 2654435761u) >> (32 - GD_COLOR_SET_BITS);
+
+	while (Set->Keys[Slot] && Set->Keys[Slot] != Key)
+		Slot = (Slot + 1) & (GD_COLOR_SET_SLOTS - 1);
+
+	return Slot;
+}
+
+/// Index of Color in Table, added to both if missing. GD_FALSE once Table is full
+static GD_BOOL
+GD_ColorSetAdd(GD_COLOR_SET* Set, GD_COLOR_TABLE* Table, GD_GIF_COLOR Color, GD_BYTE* Index)
+{
+	const GD_DWORD Slot = GD_ColorSetFind(Set, Color);
+
+	if (!Set->Keys[Slot])
+	{
+		if (Table->Count == GCT_MAX_SIZE)
+			return GD_FALSE;
+
+		Set->Keys[Slot] = (((GD_DWORD)Color.r << 16) | ((GD_DWORD)Color.g << 8) | Color.b) + 1;
+		Set->Values[Slot] = (GD_BYTE)Table->Count;
+		Table->Internal[Table->Count++] = Color;
+	}
+
+	*Index = Set->Values[Slot];
+
+	return GD_TRUE;
+}
+
+GD_QUANTIZER_HANDLE
+GD_QuantizerCreate(void)
+{
+	return calloc(1, sizeof(GD_QUANTIZER));
+}
+
+void
+GD_QuantizerDestroy(GD_QUANTIZER_HANDLE Quantizer)
+{
+	free(Quantizer);
+}
+
+GD_ERR
+GD_QuantizerAddPixels(GD_QUANTIZER_HANDLE Quantizer, const GD_GIF_COLOR* Pixels, size_t Count)
+{
+	if (!Quantizer || (!Pixels && Count))
+		return GD_UNEXPECTED_DATA;
+
+	const int Shift = 8 - GD_QUANT_HISTOGRAM_BITS;
+
+	for (size_t i = 0; i < Count; ++i)
+	{
+		const GD_GIF_COLOR c = Pixels[i];
+		GD_QUANT_CELL* Cell = &Quantizer->Histogram[((size_t)(c.r >> Shift) << (2 * GD_QUANT_HISTOGRAM_BITS)) |
+		                                            ((size_t)(c.g >> Shift) << GD_QUANT_HISTOGRAM_BITS) | (c.b >> Shift)];
+
+		Cell->Count  += 1;
+		Cell->Sum[0] += c.r;
+		Cell->Sum[1] += c.g;
+		Cell->Sum[2] += c.b;
+	}
+
+	//
+	// Runs of one color are only looked up once, and nothing is once there are too many
+	//
+	for (size_t i = 0; i < Count && !Quantizer->ExactOverflow; ++i)
+	{
+		GD_BYTE Index;
+
+		if (i && GD_SameColor(Pixels[i], Pixels[i - 1]))
+			continue;
+
+		if (!GD_ColorSetAdd(&Quantizer->ExactSet, &Quantizer->Exact, Pixels[i], &Index))
+			Quantizer->ExactOverflow = GD_TRUE;
+	}
+
+	Quantizer->PixelCount += Count;
+
+	return GD_OK;
+}
+
+/// Prepare the palette for the nearest color search and forget every cached lookup
+static void
+GD_QuantizerLoadPalette(GD_QUANTIZER* Quantizer)
+{
+	const GD_COLOR_TABLE* Palette = &Quantizer->Palette;
+
+	Quantizer->PaddedCount = (Palette->Count + 3) & ~(size_t)3;
+
+	for (size_t i = 0; i < Quantizer->PaddedCount; ++i)
+	{
+		const GD_BOOL Used = (i < Palette->Count) ? GD_TRUE : GD_FALSE;
+
+		Quantizer->PaletteRG[2 * i]     = Used ? Palette->Internal[i].r : 1000;
+		Quantizer->PaletteRG[2 * i + 1] = Used ? Palette->Internal[i].g : 1000;
+		Quantizer->PaletteB[2 * i]      = Used ? Palette->Internal[i].b : 1000;
+		Quantizer->PaletteB[2 * i + 1]  = 0;
+	}
+
+	memset(Quantizer->Lookup, 0xFF, sizeof(Quantizer->Lookup));
+	memset(&Quantizer->PaletteSet, 0, sizeof(Quantizer->PaletteSet));
+	memset(Quantizer->PaletteCells, 0, sizeof(Quantizer->PaletteCells));
+
+	const int Shift = 8 - GD_QUANT_LOOKUP_BITS;
+
+	for (size_t i = 0; i < Palette->Count; ++i)
+	{
+		const GD_GIF_COLOR c = Palette->Internal[i];
+		const GD_DWORD Slot = GD_ColorSetFind(&Quantizer->PaletteSet, c);
+		const size_t Cell = ((size_t)(c.r >> Shift) << (2 * GD_QUANT_LOOKUP_BITS)) | ((size_t)(c.g >> Shift) << GD_QUANT_LOOKUP_BITS) | (c.b >> Shift);
+
+		if (!Quantizer->PaletteSet.Keys[Slot])
+		{
+			Quantizer->PaletteSet.Keys[Slot] = (((GD_DWORD)c.r << 16) | ((GD_DWORD)c.g << 8) | c.b) + 1;
+			Quantizer->PaletteSet.Values[Slot] = (GD_BYTE)i;
+		}
+
+		Quantizer->PaletteCells[Cell >> 3] |= (GD_BYTE)(1 << (Cell & 7));
+	}
+}
+
+/// Start the histogram and the exact colors over
+static void
+GD_QuantizerClearHistogram(GD_QUANTIZER* Quantizer)
+{
+	memset(Quantizer->Histogram, 0, sizeof(Quantizer->Histogram));
+	memset(&Quantizer->ExactSet, 0, sizeof(Quantizer->ExactSet));
+
+	Quantizer->Exact.Count = 0;
+	Quantizer->ExactOverflow = GD_FALSE;
+	Quantizer->PixelCount = 0;
+}
+
+/// Palette entry closest to (r, g, b), the lowest index on ties
+static GD_BYTE
+GD_QuantizerNearest(const GD_QUANTIZER* Quantizer, int r, int g, int b)
+{
+#ifdef GD_SSE2
+	//
+	// Four entries at a time: squared differences of (r, g) and (b, 0) pairs are
+	// summed by _mm_madd_epi16 into 32 bit distances
+	//
+	const __m128i ColorRG = _mm_set_epi16((short)g, (short)r, (short)g, (short)r, (short)g, (short)r, (short)g, (short)r);
+	const __m128i ColorB = _mm_set_epi16(0, (short)b, 0, (short)b, 0, (short)b, 0, (short)b);
+	const __m128i Four = _mm_set1_epi32(4);
+
+	__m128i Best = _mm_set1_epi32(0x7FFFFFFF);
+	__m128i BestIndex = _mm_setzero_si128();
+	__m128i Index = _mm_set_epi32(3, 2, 1, 0);
+
+	for (size_t i = 0; i < Quantizer->PaddedCount; i += 4)
+	{
+		const __m128i dRG = _mm_sub_epi16(_mm_loadu_si128((const __m128i*)(Quantizer->PaletteRG + 2 * i)), ColorRG);
+		const __m128i dB = _mm_sub_epi16(_mm_loadu_si128((const __m128i*)(Quantizer->PaletteB + 2 * i)), ColorB);
+		const __m128i Distance = _mm_add_epi32(_mm_madd_epi16(dRG, dRG), _mm_madd_epi16(dB, dB));
+		const __m128i Closer = _mm_cmplt_epi32(Distance, Best);
+
+		Best = _mm_or_si128(_mm_and_si128(Closer, Distance), _mm_andnot_si128(Closer, Best));
+		BestIndex = _mm_or_si128(_mm_and_si128(Closer, Index), _mm_andnot_si128(Closer, BestIndex));
+		Index = _mm_add_epi32(Index, Four);
+	}
+
+	GD_DWORD Distances[4];
+	GD_DWORD Indices[4];
+
+	_mm_storeu_si128((__m128i*)Distances, Best);
+	_mm_storeu_si128((__m128i*)Indices, BestIndex);
+
+	size_t Lane = 0;
+
+	for (size_t i = 1; i < 4; ++i)
+	{
+		if (Distances[i] < Distances[Lane] || (Distances[i] == Distances[Lane] && Indices[i] < Indices[Lane]))
+			Lane = i;
+	}
+
+	return (GD_BYTE)Indices[Lane];
+#else
+	GD_DWORD BestDistance = 0xFFFFFFFF;
+	GD_BYTE Best = 0;
+
+	for (size_t i = 0; i < Quantizer->Palette.Count; ++i)
+	{
+		const int dr = Quantizer->PaletteRG[2 * i] - r;
+		const int dg = Quantizer->PaletteRG[2 * i + 1] - g;
+		const int db = Quantizer->PaletteB[2 * i] - b;
+		const GD_DWORD Distance = (GD_DWORD)(dr * dr + dg * dg + db * db);
+
+		if (Distance < BestDistance)
+		{
+			BestDistance = Distance;
+			Best = (GD_BYTE)i;
+		}
+	}
+
+	return Best;
+#endif
+}
+
+//
+// Median cut works on the non-empty histogram cells, each one standing for its pixels
+// at their average color. A box is a range of them
+//
+typedef struct GD_QUANT_POINT
+{
+	GD_BYTE Color[3];
+	GD_DWORD Cell;
+	GD_QWORD Count;
+} GD_QUANT_POINT;
+
+typedef struct GD_QUANT_BOX
+{
+	size_t Begin;
+	size_t End;
+
+	// Channel with the largest spread, and the sum of squared distances to the mean along it
+	int Channel;
+	double Score;
+} GD_QUANT_BOX;
+
+static int GD_QuantCompareR(const void* a, const void* b) { return ((const GD_QUANT_POINT*)a)->Color[0] - ((const GD_QUANT_POINT*)b)->Color[0]; }
+static int GD_QuantCompareG(const void* a, const void* b) { return ((const GD_QUANT_POINT*)a)->Color[1] - ((const GD_QUANT_POINT*)b)->Color[1]; }
+static int GD_QuantCompareB(const void* a, const void* b) { return ((const GD_QUANT_POINT*)a)->Color[2] - ((const GD_QUANT_POINT*)b)->Color[2]; }
+
+static void
+GD_QuantBoxMeasure(const GD_QUANT_POINT* Points, GD_QUANT_BOX* Box)
+{
+	GD_QWORD Count = 0;
+	GD_QWORD Sum[3] = { 0, 0, 0 };
+	GD_QWORD Squares[3] = { 0, 0, 0 };
+
+	for (size_t i = Box->Begin; i < Box->End; ++i)
+	{
+		Count += Points[i].Count;
+
+		for (int c = 0; c < 3; ++c)
+		{
+			Sum[c] += Points[i].Count * Points[i].Color[c];
+			Squares[c] += Points[i].Count * Points[i].Color[c] * Points[i].Color[c];
+		}
+	}
+
+	Box->Channel = 0;
+	Box->Score = 0;
+
+	if (Box->End - Box->Begin < 2)
+		return;
+
+	for (int c = 0; c < 3; ++c)
+	{
+		//
+		// Count times the variance, i.e. the squared error of the box along the channel
+		//
+		const double Score = (double)Squares[c] - (double)Sum[c] * (double)Sum[c] / (double)Count;
+
+		if (Score > Box->Score)
+		{
+			Box->Score = Score;
+			Box->Channel = c;
+		}
+	}
+}
+
+GD_ERR
+GD_QuantizerBuildPalette(GD_QUANTIZER_HANDLE Quantizer, GD_DWORD MaxColors, GD_COLOR_TABLE* Palette)
+{
+	if (!Quantizer || !Palette || !MaxColors || MaxColors > GCT_MAX_SIZE)
+		return GD_UNEXPECTED_DATA;
+
+	if (!Quantizer->PixelCount)
+		return GD_NOT_ENOUGH_DATA;
+
+	//
+	// Few enough colors to keep every one of them as it is
+	//
+	if (!Quantizer->ExactOverflow && Quantizer->Exact.Count <= MaxColors)
+	{
+		Quantizer->Palette = Quantizer->Exact;
+		GD_QuantizerLoadPalette(Quantizer);
+		GD_QuantizerClearHistogram(Quantizer);
+
+		*Palette = Quantizer->Palette;
+
+		return GD_OK;
+	}
+
+	const size_t CellCount = (size_t)1 << (3 * GD_QUANT_HISTOGRAM_BITS);
+
+	size_t PointCount = 0;
+
+	for (size_t i = 0; i < CellCount; ++i)
+		PointCount += Quantizer->Histogram[i].Count ? 1 : 0;
+
+	GD_QUANT_POINT* Points = malloc(sizeof(GD_QUANT_POINT) * PointCount);
+
+	if (!Points)
+		return GD_NOMEM;
+
+	PointCount = 0;
+
+	for (size_t i = 0; i < CellCount; ++i)
+	{
+		const GD_QUANT_CELL* Cell = &Quantizer->Histogram[i];
+
+		if (!Cell->Count)
+			continue;
+
+		GD_QUANT_POINT* Point = &Points[PointCount++];
+
+		for (int c = 0; c < 3; ++c)
+			Point->Color[c] = (GD_BYTE)((Cell->Sum[c] + Cell->Count / 2) / Cell->Count);
+
+		Point->Cell = (GD_DWORD)i;
+		Point->Count = Cell->Count;
+	}
+
+	//
+	// Median cut: keep splitting the box with the largest error at the weighted median
+	// of its widest channel
+	//
+	int (*const Compare[3])(const void*, const void*) = { GD_QuantCompareR, GD_QuantCompareG, GD_QuantCompareB };
+
+	GD_QUANT_BOX Boxes[GCT_MAX_SIZE];
+	size_t BoxCount = 1;
+
+	Boxes[0].Begin = 0;
+	Boxes[0].End = PointCount;
+	GD_QuantBoxMeasure(Points, &Boxes[0]);
+
+	while (BoxCount < MaxColors)
+	{
+		size_t Widest = 0;
+
+		for (size_t i = 1; i < BoxCount; ++i)
+		{
+			if (Boxes[i].Score > Boxes[Widest].Score)
+				Widest = i;
+		}
+
+		GD_QUANT_BOX* Box = &Boxes[Widest];
+
+		if (Box->Score <= 0)
+			break;
+
+		qsort(Points + Box->Begin, Box->End - Box->Begin, sizeof(GD_QUANT_POINT), Compare[Box->Channel]);
+
+		GD_QWORD Total = 0;
+
+		for (size_t i = Box->Begin; i < Box->End; ++i)
+			Total += Points[i].Count;
+
+		GD_QWORD Half = 0;
+		size_t Split = Box->Begin;
+
+		while (Split < Box->End - 1 && (Half += Points[Split].Count) < Total / 2)
+			++Split;
+
+		++Split;
+
+		if (Split >= Box->End)
+			Split = Box->End - 1;
+
+		GD_QUANT_BOX* Upper = &Boxes[BoxCount++];
+
+		Upper->Begin = Split;
+		Upper->End = Box->End;
+		Box->End = Split;
+
+		GD_QuantBoxMeasure(Points, Box);
+		GD_QuantBoxMeasure(Points, Upper);
+	}
+
+	//
+	// Start from the averages of the boxes, then move entries to the average of the
+	// cells closest to them
+	//
+	GD_QWORD (*Sums)[4] = malloc(sizeof(GD_QWORD[4]) * BoxCount);
+
+	if (!Sums)
+	{
+		free(Points);
+		return GD_NOMEM;
+	}
+
+	memset(Sums, 0, sizeof(GD_QWORD[4]) * BoxCount);
+
+	for (size_t b = 0; b < BoxCount; ++b)
+	{
+		for (size_t i = Boxes[b].Begin; i < Boxes[b].End; ++i)
+		{
+			const GD_QUANT_CELL* Cell = &Quantizer->Histogram[Points[i].Cell];
+
+			Sums[b][0] += Cell->Sum[0];
+			Sums[b][1] += Cell->Sum[1];
+			Sums[b][2] += Cell->Sum[2];
+			Sums[b][3] += Cell->Count;
+		}
+	}
+
+	Quantizer->Palette.Count = BoxCount;
+
+	for (int Round = 0; Round <= GD_QUANT_KMEANS_ROUNDS; ++Round)
+	{
+		for (size_t b = 0; b < BoxCount; ++b)
+		{
+			if (!Sums[b][3])
+				continue;
+
+			Quantizer->Palette.Internal[b].r = (GD_BYTE)((Sums[b][0] + Sums[b][3] / 2) / Sums[b][3]);
+			Quantizer->Palette.Internal[b].g = (GD_BYTE)((Sums[b][1] + Sums[b][3] / 2) / Sums[b][3]);
+			Quantizer->Palette.Internal[b].b = (GD_BYTE)((Sums[b][2] + Sums[b][3] / 2) / Sums[b][3]);
+		}
+
+		GD_QuantizerLoadPalette(Quantizer);
+
+		if (Round == GD_QUANT_KMEANS_ROUNDS)
+			break;
+
+		memset(Sums, 0, sizeof(GD_QWORD[4]) * BoxCount);
+
+		for (size_t i = 0; i < PointCount; ++i)
+		{
+			const GD_QUANT_CELL* Cell = &Quantizer->Histogram[Points[i].Cell];
+			const GD_BYTE Nearest = GD_QuantizerNearest(Quantizer, Points[i].Color[0], Points[i].Color[1], Points[i].Color[2]);
+
+			Sums[Nearest][0] += Cell->Sum[0];
+			Sums[Nearest][1] += Cell->Sum[1];
+			Sums[Nearest][2] += Cell->Sum[2];
+			Sums[Nearest][3] += Cell->Count;
+		}
+	}
+
+	free(Sums);
+	free(Points);
+
+	GD_QuantizerClearHistogram(Quantizer);
+
+	*Palette = Quantizer->Palette;
+
+	return GD_OK;
+}
+
+GD_ERR
+GD_QuantizerSetPalette(GD_QUANTIZER_HANDLE Quantizer, const GD_COLOR_TABLE* Palette)
+{
+	if (!Quantizer || !Palette || !Palette->Count || Palette->Count > GCT_MAX_SIZE)
+		return GD_UNEXPECTED_DATA;
+
+	Quantizer->Palette = *Palette;
+	GD_QuantizerLoadPalette(Quantizer);
+
+	return GD_OK;
+}
+
+static GD_FORCEINLINE GD_BYTE
+GD_QuantizerLookup(GD_QUANTIZER* Quantizer, GD_BYTE r, GD_BYTE g, GD_BYTE b)
+{
+	const int Shift = 8 - GD_QUANT_LOOKUP_BITS;
+	const size_t Cell = ((size_t)(r >> Shift) << (2 * GD_QUANT_LOOKUP_BITS)) | ((size_t)(g >> Shift) << GD_QUANT_LOOKUP_BITS) | (b >> Shift);
+
+	//
+	// A palette color maps to its own entry even when another one shares the cell
+	//
+	if (Quantizer->PaletteCells[Cell >> 3] & (1 << (Cell & 7)))
+	{
+		const GD_GIF_COLOR Color = { r, g, b };
+		const GD_DWORD Slot = GD_ColorSetFind(&Quantizer->PaletteSet, Color);
+
+		if (Quantizer->PaletteSet.Keys[Slot])
+			return Quantizer->PaletteSet.Values[Slot];
+	}
+
+	GD_WORD Index = Quantizer->Lookup[Cell];
+
+	if (Index == GD_QUANT_UNKNOWN)
+	{
+		//
+		// Nearest to the center of the cell
+		//
+		const int Mask = 0xFF << Shift;
+		const int Center = 1 << (Shift - 1);
+
+		Index = GD_QuantizerNearest(Quantizer, (r & Mask) + Center, (g & Mask) + Center, (b & Mask) + Center);
+		Quantizer->Lookup[Cell] = Index;
+	}
+
+	return (GD_BYTE)Index;
+}
+
+static const GD_BYTE GD_Bayer8[8][8] =
+{
+	{  0, 32,  8, 40,  2, 34, 10, 42 },
+	{ 48, 16, 56, 24, 50, 18, 58, 26 },
+	{ 12, 44,  4, 36, 14, 46,  6, 38 },
+	{ 60, 28, 52, 20, 62, 30, 54, 22 },
+	{  3, 35, 11, 43,  1, 33,  9, 41 },
+	{ 51, 19, 59, 27, 49, 17, 57, 25 },
+	{ 15, 47,  7, 39, 13, 45,  5, 37 },
+	{ 63, 31, 55, 23, 61, 29, 53, 21 }
+};
+
+static void
+GD_QuantizerRemapOrdered(GD_QUANTIZER* Quantizer, const GD_GIF_COLOR* Pixels, size_t Width, size_t Height, GD_BYTE* Indices, GD_GIF_COLOR* Scratch)
+{
+	//
+	// The matrix spans about the distance between two palette colors: 256 / cbrt(Count)
+	//
+	int Side = 1;
+
+	while ((size_t)((Side + 1) * (Side + 1) * (Side + 1)) <= Quantizer->Palette.Count)
+		++Side;
+
+	const int Spread = 256 / Side;
+
+	//
+	// Biases split in what to add and what to subtract with saturation, 16 pixels (48
+	// bytes, the same bias on the three channels) per row of the matrix
+	//
+	GD_BYTE Add[8][48];
+	GD_BYTE Subtract[8][48];
+
+	for (size_t y = 0; y < 8; ++y)
+	{
+		for (size_t i = 0; i < 48; ++i)
+		{
+			const int Bias = ((2 * GD_Bayer8[y][(i / 3) % 8] - 63) * Spread) / 128;
+
+			Add[y][i] = (GD_BYTE)(Bias > 0 ? Bias : 0);
+			Subtract[y][i] = (GD_BYTE)(Bias < 0 ? -Bias : 0);
+		}
+	}
+
+	for (size_t y = 0; y < Height; ++y)
+	{
+		const GD_BYTE* Source = (const GD_BYTE*)(Pixels + y * Width);
+		GD_BYTE* Dithered = (GD_BYTE*)Scratch;
+		const GD_BYTE* RowAdd = Add[y % 8];
+		const GD_BYTE* RowSubtract = Subtract[y % 8];
+		const size_t Bytes = Width * 3;
+		size_t i = 0;
+
+#ifdef GD_SSE2
+		for (; i + 48 <= Bytes; i += 48)
+		{
+			for (size_t k = 0; k < 48; k += 16)
+			{
+				__m128i v = _mm_loadu_si128((const __m128i*)(Source + i + k));
+
+				v = _mm_adds_epu8(v, _mm_loadu_si128((const __m128i*)(RowAdd + k)));
+				v = _mm_subs_epu8(v, _mm_loadu_si128((const __m128i*)(RowSubtract + k)));
+
+				_mm_storeu_si128((__m128i*)(Dithered + i + k), v);
+			}
+		}
+#endif
+
+		for (; i < Bytes; ++i)
+		{
+			int v = Source[i] + RowAdd[i % 48] - RowSubtract[i % 48];
+
+			Dithered[i] = (GD_BYTE)(v < 0 ? 0 : v > 255 ? 255 : v);
+		}
+
+		GD_BYTE* Row = Indices + y * Width;
+
+		for (size_t x = 0; x < Width; ++x)
+			Row[x] = GD_QuantizerLookup(Quantizer, Scratch[x].r, Scratch[x].g, Scratch[x].b);
+	}
+}
+
+static void
+GD_QuantizerRemapDiffused(GD_QUANTIZER* Quantizer, const GD_GIF_COLOR* Pixels, size_t Width, size_t Height, GD_BYTE* Indices, int* Errors)
+{
+	//
+	// Errors of the current and next rows in sixteenths, with a pixel of margin on both
+	// sides. 7/16 go right, 3/16 down left, 5/16 down, 1/16 down right
+	//
+	const size_t Stride = (Width + 2) * 3;
+
+	memset(Errors, 0, sizeof(int) * Stride * 2);
+
+	for (size_t y = 0; y < Height; ++y)
+	{
+		int* Current = Errors + (y % 2) * Stride;
+		int* Next = Errors + ((y + 1) % 2) * Stride;
+
+		memset(Next, 0, sizeof(int) * Stride);
+
+		const GD_GIF_COLOR* Row = Pixels + y * Width;
+		GD_BYTE* Out = Indices + y * Width;
+
+		for (size_t x = 0; x < Width; ++x)
+		{
+			int Value[3] = { Row[x].r, Row[x].g, Row[x].b };
+
+			for (int c = 0; c < 3; ++c)
+			{
+				Value[c] += Current[(x + 1) * 3 + c] / 16;
+				Value[c] = Value[c] < 0 ? 0 : Value[c] > 255 ? 255 : Value[c];
+			}
+
+			const GD_BYTE Index = GD_QuantizerLookup(Quantizer, (GD_BYTE)Value[0], (GD_BYTE)Value[1], (GD_BYTE)Value[2]);
+			const GD_GIF_COLOR Chosen = Quantizer->Palette.Internal[Index];
+			const int Error[3] = { Value[0] - Chosen.r, Value[1] - Chosen.g, Value[2] - Chosen.b };
+
+			Out[x] = Index;
+
+			for (int c = 0; c < 3; ++c)
+			{
+				Current[(x + 2) * 3 + c] += Error[c] * 7;
+				Next[x * 3 + c]          += Error[c] * 3;
+				Next[(x + 1) * 3 + c]    += Error[c] * 5;
+				Next[(x + 2) * 3 + c]    += Error[c];
+			}
+		}
+	}
+}
+
+GD_ERR
+GD_QuantizerRemap(GD_QUANTIZER_HANDLE Quantizer, const GD_GIF_COLOR* Pixels, GD_WORD Width, GD_WORD Height, GD_DITHER Dither, GD_BYTE* Indices)
+{
+	if (!Quantizer || !Pixels || !Indices)
+		return GD_UNEXPECTED_DATA;
+
+	if (!Quantizer->Palette.Count)
+		return GD_NO_COLOR_TABLE;
+
+	if (Dither == GD_DITHER_NONE)
+	{
+		const size_t PixelCount = (size_t)Width * Height;
+
+		for (size_t i = 0; i < PixelCount; ++i)
+			Indices[i] = GD_QuantizerLookup(Quantizer, Pixels[i].r, Pixels[i].g, Pixels[i].b);
+
+		return GD_OK;
+	}
+
+	if (Dither == GD_DITHER_ORDERED)
+	{
+		GD_GIF_COLOR* Scratch = malloc(sizeof(GD_GIF_COLOR) * (Width ? Width : 1));
+
+		if (!Scratch)
+			return GD_NOMEM;
+
+		GD_QuantizerRemapOrdered(Quantizer, Pixels, Width, Height, Indices, Scratch);
+		free(Scratch);
+
+		return GD_OK;
+	}
+
+	if (Dither == GD_DITHER_FLOYD_STEINBERG)
+	{
+		int* Errors = malloc(sizeof(int) * ((size_t)Width + 2) * 3 * 2);
+
+		if (!Errors)
+			return GD_NOMEM;
+
+		GD_QuantizerRemapDiffused(Quantizer, Pixels, Width, Height, Indices, Errors);
+		free(Errors);
+
+		return GD_OK;
+	}
+
+	return GD_UNEXPECTED_DATA;
+}
+
+//
+// Frame written by GD_Optimize: the changed rectangle of the canvas, with indices into
+// Table. Table.Count stands for the pixels left transparent when HasTransparency is set
+//
+typedef struct GD_OPTIMIZED_FRAME
+{
+	GD_RECT Rect;
+	GD_BYTE* Indices;
+	GD_COLOR_TABLE Table;
+	GD_BOOL HasTransparency;
+	GD_BOOL Global;
+} GD_OPTIMIZED_FRAME;
+
+/// Smallest rectangle of Bounds where Canvas and Previous differ, empty if they do not
+static GD_RECT
+GD_CanvasDifference(const GD_GIF_COLOR* Canvas, const GD_GIF_COLOR* Previous, size_t CanvasWidth, const GD_RECT* Bounds)
+{
+	GD_RECT Rect = { 0, 0, 0, 0 };
+
+	size_t Left = (size_t)Bounds->Left + Bounds->Width, Right = 0;
+	size_t Top = (size_t)Bounds->Top + Bounds->Height, Bottom = 0;
+
+	for (size_t y = Bounds->Top; y < (size_t)Bounds->Top + Bounds->Height; ++y)
+	{
+		const GD_GIF_COLOR* Row = Canvas + y * CanvasWidth;
+		const GD_GIF_COLOR* Before = Previous + y * CanvasWidth;
+
+		size_t First = Bounds->Left;
+		size_t Last = (size_t)Bounds->Left + Bounds->Width;
+
+		if (!memcmp(Row + First, Before + First, sizeof(GD_GIF_COLOR) * (Last - First)))
+			continue;
+
+		while (GD_SameColor(Row[First], Before[First]))
+			++First;
+
+		while (GD_SameColor(Row[Last - 1], Before[Last - 1]))
+			--Last;
+
+		Left = First < Left ? First : Left;
+		Right = Last > Right ? Last : Right;
+		Top = y < Top ? y : Top;
+		Bottom = y + 1;
+	}
+
+	if (Right)
+	{
+		Rect.Left = (GD_WORD)Left;
+		Rect.Top = (GD_WORD)Top;
+		Rect.Width = (GD_WORD)(Right - Left);
+		Rect.Height = (GD_WORD)(Bottom - Top);
+	}
+
+	return Rect;
+}
+
+/// Fill Frame with the pixels of its rectangle, unchanged ones made transparent when
+/// Transparency is set. GD_NOT_SUPPORTED when they need more colors than a table holds
+static GD_ERR
+GD_OptimizeFrame(GD_OPTIMIZED_FRAME* Frame, const GD_GIF_COLOR* Canvas, const GD_GIF_COLOR* Previous,
+				 size_t CanvasWidth, GD_BOOL Transparency, GD_COLOR_SET* Set)
+{
+	const GD_RECT* Rect = &Frame->Rect;
+
+	memset(Set->Keys, 0, sizeof(Set->Keys));
+
+	Frame->Table.Count = 0;
+	Frame->HasTransparency = GD_FALSE;
+
+	for (size_t y = 0; y < Rect->Height; ++y)
+	{
+		const size_t Offset = (Rect->Top + y) * CanvasWidth + Rect->Left;
+		GD_BYTE* Indices = Frame->Indices + y * Rect->Width;
+
+		for (size_t x = 0; x < Rect->Width; ++x)
+		{
+			//
+			// Transparent pixels get their index once the number of colors is known
+			//
+			if (Transparency && GD_SameColor(Canvas[Offset + x], Previous[Offset + x]))
+			{
+				Frame->HasTransparency = GD_TRUE;
+				continue;
+			}
+
+			if (!GD_ColorSetAdd(Set, &Frame->Table, Canvas[Offset + x], &Indices[x]))
+				return GD_NOT_SUPPORTED;
+		}
+	}
+
+	if (!Frame->HasTransparency)
+		return GD_OK;
+
+	if (Frame->Table.Count == GCT_MAX_SIZE)
+		return GD_NOT_SUPPORTED;
+
+	for (size_t y = 0; y < Rect->Height; ++y)
+	{
+		const size_t Offset = (Rect->Top + y) * CanvasWidth + Rect->Left;
+		GD_BYTE* Indices = Frame->Indices + y * Rect->Width;
+
+		for (size_t x = 0; x < Rect->Width; ++x)
+		{
+			if (GD_SameColor(Canvas[Offset + x], Previous[Offset + x]))
+				Indices[x] = (GD_BYTE)Frame->Table.Count;
+		}
+	}
+
+	return GD_OK;
+}
+
+static void
+GD_FreeOptimizedFrames(GD_OPTIMIZED_FRAME* Frames, GD_DWORD Count)
+{
+	if (!Frames)
+		return;
+
+	for (GD_DWORD i = 0; i < Count; ++i)
+		free(Frames[i].Indices);
+
+	free(Frames);
+}
+
+/// Diff the canvases of every frame with the one before, see GD_Optimize
+static GD_ERR
+GD_OptimizeFrames(GD_GIF_HANDLE Gif, GD_OPTIMIZED_FRAME* Frames, GD_COLOR_SET* Set)
+{
+	const size_t CanvasWidth = Gif->CanvasWidth;
+	GD_ERR ErrorCode = GD_OK;
+
+	GD_GIF_COLOR* Previous = malloc(sizeof(GD_GIF_COLOR) * GD_CanvasSize(Gif));
+
+	if (!Previous)
+		return GD_NOMEM;
+
+	for (GD_DWORD i = 0; i < Gif->FrameCount && ErrorCode == GD_OK; ++i)
+	{
+		const GD_GIF_COLOR* Canvas = GD_ComposeFrame(Gif, i, &ErrorCode);
+
+		if (!Canvas)
+			break;
+
+		//
+		// Only the dirty rectangles can differ from the previous canvas. The first canvas
+		// is written whole: browsers start from a transparent canvas rather than from the
+		// background color, so no pixel of it may be left out or transparent
+		//
+		GD_RECT Dirty = { 0, 0, Gif->CanvasWidth, Gif->CanvasHeight };
+
+		if (i && Gif->DirtyCount)
+		{
+			Dirty = Gif->DirtyRects[0];
+
+			for (GD_DWORD r = 1; r < Gif->DirtyCount; ++r)
+				Dirty = GD_RectUnion(&Dirty, &Gif->DirtyRects[r]);
+		}
+		else if (i)
+		{
+			Dirty.Width = Dirty.Height = 0;
+		}
+
+		GD_OPTIMIZED_FRAME* Frame = &Frames[i];
+
+		Frame->Rect = (i == 0) ? Dirty : GD_CanvasDifference(Canvas, Previous, CanvasWidth, &Dirty);
+
+		//
+		// A frame still has to be there for its delay, one unchanged pixel will do
+		//
+		GD_BOOL Transparency = (i != 0);
+
+		if (!GD_RectArea(&Frame->Rect))
+		{
+			Frame->Rect.Left = Frame->Rect.Top = 0;
+			Frame->Rect.Width = Frame->Rect.Height = 1;
+			Transparency = GD_FALSE;
+		}
+
+		Frame->Indices = malloc(GD_RectArea(&Frame->Rect));
+
+		if (!Frame->Indices)
+		{
+			ErrorCode = GD_NOMEM;
+			break;
+		}
+
+		ErrorCode = GD_OptimizeFrame(Frame, Canvas, Previous, CanvasWidth, Transparency, Set);
+
+		//
+		// Too many colors with the transparent index, unchanged pixels may have colors
+		// the frame uses anyway
+		//
+		if (ErrorCode == GD_NOT_SUPPORTED && Transparency)
+			ErrorCode = GD_OptimizeFrame(Frame, Canvas, Previous, CanvasWidth, GD_FALSE, Set);
+
+		for (size_t y = Dirty.Top; y < (size_t)Dirty.Top + Dirty.Height; ++y)
+			memcpy(Previous + y * CanvasWidth + Dirty.Left, Canvas + y * CanvasWidth + Dirty.Left, sizeof(GD_GIF_COLOR) * Dirty.Width);
+	}
+
+	free(Previous);
+
+	return ErrorCode;
+}
+
+/// Write Frames to a new encoder, NULL on failure
+static GD_ENCODER_HANDLE
+GD_OptimizeEncode(GD_GIF_HANDLE Gif, const GD_OPTIMIZE_OPTIONS* Options, const GD_COLOR_TABLE* Global,
+				  GD_BYTE BgColorIndex, const GD_ENCODER_FRAME* Frames, GD_ERR* ErrorCode)
+{
+	GD_ENCODER_OPTIONS EncoderOptions;
+
+	memset(&EncoderOptions, 0, sizeof(EncoderOptions));
+
+	EncoderOptions.Width = Gif->ScreenDesc.LogicalWidth;
+	EncoderOptions.Height = Gif->ScreenDesc.LogicalHeight;
+	EncoderOptions.GlobalPalette = Global;
+	EncoderOptions.BgColorIndex = BgColorIndex;
+	EncoderOptions.Threads = Options ? Options->Threads : 0;
+	EncoderOptions.Thorough = GD_TRUE;
+
+	GD_ENCODER_HANDLE Encoder = GD_EncoderCreate(&EncoderOptions, ErrorCode);
+
+	if (!Encoder)
+		return NULL;
+
+	if (Options && Options->HasLoopCount)
+		*ErrorCode = GD_EncoderSetLoopCount(Encoder, Options->LoopCount);
+
+	if (*ErrorCode == GD_OK)
+		*ErrorCode = GD_EncoderAddFrames(Encoder, Frames, Gif->FrameCount);
+
+	if (*ErrorCode == GD_OK)
+	{
+		const GD_BYTE* Data;
+		size_t Size;
+
+		*ErrorCode = GD_EncoderFinish(Encoder, &Data, &Size);
+	}
+
+	if (*ErrorCode != GD_OK)
+	{
+		GD_EncoderDestroy(Encoder);
+		return NULL;
+	}
+
+	return Encoder;
+}
+
+/// Frames cropped to what changes on the canvas, see GD_Optimize
+static GD_ENCODER_HANDLE
+GD_OptimizeDiff(GD_GIF_HANDLE Gif, const GD_OPTIMIZE_OPTIONS* Options, GD_ERR* ErrorCode)
+{
+	GD_OPTIMIZED_FRAME* Frames = calloc(Gif->FrameCount, sizeof(GD_OPTIMIZED_FRAME));
+	GD_ENCODER_FRAME* Output = calloc(Gif->FrameCount, sizeof(GD_ENCODER_FRAME));
+	GD_COLOR_SET* Set = malloc(sizeof(GD_COLOR_SET));
+	GD_COLOR_SET* GlobalSet = malloc(sizeof(GD_COLOR_SET));
+	GD_COLOR_TABLE* Global = malloc(sizeof(GD_COLOR_TABLE));
+
+	GD_ENCODER_HANDLE Encoder = NULL;
+
+	*ErrorCode = (Frames && Output && Set && GlobalSet && Global) ? GD_OK : GD_NOMEM;
+
+	if (*ErrorCode == GD_OK)
+		*ErrorCode = GD_OptimizeFrames(Gif, Frames, Set);
+
+	if (*ErrorCode == GD_OK)
+	{
+		//
+		// The background comes first for BgColorIndex 0 to name the same color, then the
+		// colors of the frames in order for as long as the table has room for them and
+		// for a transparent index
+		//
+		GD_BYTE Index;
+		GD_BOOL Transparency = GD_FALSE;
+
+		memset(GlobalSet->Keys, 0, sizeof(GlobalSet->Keys));
+		Global->Count = 0;
+
+		GD_ColorSetAdd(GlobalSet, Global, Gif->CanvasBackground, &Index);
+
+		for (GD_DWORD i = 0; i < Gif->FrameCount; ++i)
+		{
+			GD_OPTIMIZED_FRAME* Frame = &Frames[i];
+
+			size_t Missing = 0;
+
+			for (size_t c = 0; c < Frame->Table.Count; ++c)
+				Missing += GlobalSet->Keys[GD_ColorSetFind(GlobalSet, Frame->Table.Internal[c])] ? 0 : 1;
+
+			if (Global->Count + Missing >= GCT_MAX_SIZE)
+				continue;
+
+			for (size_t c = 0; c < Frame->Table.Count; ++c)
+				GD_ColorSetAdd(GlobalSet, Global, Frame->Table.Internal[c], &Index);
+
+			Frame->Global = GD_TRUE;
+			Transparency = Frame->HasTransparency ? GD_TRUE : Transparency;
+		}
+
+		const GD_BYTE GlobalTransparent = (GD_BYTE)Global->Count;
+		const GD_GIF_COLOR Black = { 0, 0, 0 };
+
+		if (Transparency)
+			Global->Internal[Global->Count++] = Black;
+
+		for (GD_DWORD i = 0; i < Gif->FrameCount; ++i)
+		{
+			GD_OPTIMIZED_FRAME* Frame = &Frames[i];
+			GD_ENCODER_FRAME* Written = &Output[i];
+
+			Written->Left = Frame->Rect.Left;
+			Written->Top = Frame->Rect.Top;
+			Written->Width = Frame->Rect.Width;
+			Written->Height = Frame->Rect.Height;
+			Written->Indices = Frame->Indices;
+			Written->DisposalMethod = GD_DISPOSAL_NONE;
+			Written->DelayTime = Gif->Frames[i].DelayTime;
+			Written->HasTransparency = Frame->HasTransparency;
+
+			if (Frame->Global)
+			{
+				GD_BYTE Map[GCT_MAX_SIZE + 1];
+
+				for (size_t c = 0; c < Frame->Table.Count; ++c)
+					Map[c] = GlobalSet->Values[GD_ColorSetFind(GlobalSet, Frame->Table.Internal[c])];
+
+				Map[Frame->Table.Count] = GlobalTransparent;
+
+				for (size_t p = 0; p < GD_RectArea(&Frame->Rect); ++p)
+					Frame->Indices[p] = Map[Frame->Indices[p]];
+
+				Written->Palette = NULL;
+				Written->TransparentIndex = GlobalTransparent;
+			}
+			else
+			{
+				Written->TransparentIndex = (GD_BYTE)Frame->Table.Count;
+
+				if (Frame->HasTransparency)
+					Frame->Table.Internal[Frame->Table.Count++] = Black;
+
+				Written->Palette = &Frame->Table;
+			}
+		}
+
+		Encoder = GD_OptimizeEncode(Gif, Options, Global, 0, Output, ErrorCode);
+	}
+
+	GD_FreeOptimizedFrames(Frames, Gif->FrameCount);
+	free(Output);
+	free(Set);
+	free(GlobalSet);
+	free(Global);
+
+	return Encoder;
+}
+
+/// Frames as they are in the file, only compressed again. GD_NOT_SUPPORTED when a frame
+/// is not fully on the canvas
+static GD_ENCODER_HANDLE
+GD_OptimizeKeep(GD_GIF_HANDLE Gif, const GD_OPTIMIZE_OPTIONS* Options, GD_ERR* ErrorCode)
+{
+	GD_ENCODER_FRAME* Output = calloc(Gif->FrameCount, sizeof(GD_ENCODER_FRAME));
+	GD_COLOR_SET* Set = malloc(sizeof(GD_COLOR_SET));
+
+	GD_ENCODER_HANDLE Encoder = NULL;
+
+	*ErrorCode = (Output && Set) ? GD_OK : GD_NOMEM;
+
+	const GD_COLOR_TABLE* Global = Gif->PaletteGlobal ? &Gif->PaletteGlobal->Table : NULL;
+
+	for (GD_DWORD i = 0; i < Gif->FrameCount && *ErrorCode == GD_OK; ++i)
+	{
+		//
+		// Indices are copied out, a compressed store may release them again
+		//
+		const GD_FRAME* Frame = GD_GetFrame(Gif, i);
+		const GD_RECT* Region = &Frame->Region;
+		const size_t PixelCount = GD_RectArea(Region);
+
+		if (!Frame->Buffer || !Frame->Palette || Region->Left != Frame->Descriptor.PositionLeft || Region->Top != Frame->Descriptor.PositionTop ||
+			Region->Width != Frame->Descriptor.Width || Region->Height != Frame->Descriptor.Height)
+		{
+			*ErrorCode = GD_NOT_SUPPORTED;
+			break;
+		}
+
+		GD_BYTE* Indices = malloc(PixelCount);
+
+		if (!Indices)
+		{
+			*ErrorCode = GD_NOMEM;
+			break;
+		}
+
+		if (Frame->Indices)
+		{
+			memcpy(Indices, Frame->Indices, PixelCount);
+		}
+		else
+		{
+			//
+			// Back from colors to indices, the first of equal palette entries will do
+			//
+			memset(Set->Keys, 0, sizeof(Set->Keys));
+
+			for (size_t c = Frame->Palette->Count; c-- > 0;)
+			{
+				const GD_GIF_COLOR Color = Frame->Palette->Internal[c];
+				const GD_DWORD Slot = GD_ColorSetFind(Set, Color);
+
+				Set->Keys[Slot] = (((GD_DWORD)Color.r << 16) | ((GD_DWORD)Color.g << 8) | Color.b) + 1;
+				Set->Values[Slot] = (GD_BYTE)c;
+			}
+
+			for (size_t p = 0; p < PixelCount && *ErrorCode == GD_OK; ++p)
+			{
+				const GD_DWORD Slot = GD_ColorSetFind(Set, Frame->Buffer[p]);
+
+				// Out of range indices are drawn with a color the table does not have
+				if (!Set->Keys[Slot])
+					*ErrorCode = GD_NOT_SUPPORTED;
+
+				Indices[p] = Set->Values[Slot];
+			}
+		}
+
+		GD_ENCODER_FRAME* Written = &Output[i];
+
+		Written->Indices = Indices;
+
+		if (*ErrorCode != GD_OK)
+			break;
+
+		Written->Left = Region->Left;
+		Written->Top = Region->Top;
+		Written->Width = Region->Width;
+		Written->Height = Region->Height;
+		Written->Palette = (Frame->Palette == Global) ? NULL : Frame->Palette;
+		Written->DisposalMethod = Frame->DisposalMethod;
+		Written->DelayTime = Frame->DelayTime;
+		Written->HasTransparency = Frame->HasTransparency;
+		Written->TransparentIndex = Frame->TransparentIndex;
+	}
+
+	if (*ErrorCode == GD_OK)
+		Encoder = GD_OptimizeEncode(Gif, Options, Global, Gif->ScreenDesc.BgColorIndex, Output, ErrorCode);
+
+	for (GD_DWORD i = 0; Output && i < Gif->FrameCount; ++i)
+		free((GD_BYTE*)Output[i].Indices);
+
+	free(Output);
+	free(Set);
+
+	return Encoder;
+}
+
+GD_ENCODER_HANDLE
+GD_Optimize(GD_GIF_HANDLE Gif, const GD_OPTIMIZE_OPTIONS* Options, GD_ERR* ErrorCode)
+{
+	GD_ERR Dummy;
+
+	if (!ErrorCode)
+		ErrorCode = &Dummy;
+
+	if (!Gif)
+	{
+		*ErrorCode = GD_UNEXPECTED_DATA;
+		return NULL;
+	}
+
+	//
+	// Canvases have to hold the colors of the file, for the whole screen
+	//
+	if (Gif->Options.StripRoutine || Gif->Options.ColorSpace != GD_COLOR_SPACE_RGB || Gif->Scaled ||
+		Gif->CanvasWidth != Gif->ScreenDesc.LogicalWidth || Gif->CanvasHeight != Gif->ScreenDesc.LogicalHeight)
+	{
+		*ErrorCode = GD_NOT_SUPPORTED;
+		return NULL;
+	}
+
+	if (!Gif->FrameCount)
+	{
+		*ErrorCode = GD_NOT_ENOUGH_DATA;
+		return NULL;
+	}
+
+	//
+	// Diffing the canvases does not pay off for files that already crop their frames
+	// and use transparency well, the original frames are compressed again as well and
+	// the smaller file wins
+	//
+	GD_ERR DiffError, KeepError;
+
+	GD_ENCODER_HANDLE Diff = GD_OptimizeDiff(Gif, Options, &DiffError);
+
+	if (DiffError == GD_NOMEM)
+	{
+		*ErrorCode = DiffError;
+		return NULL;
+	}
+
+	GD_ENCODER_HANDLE Keep = GD_OptimizeKeep(Gif, Options, &KeepError);
+
+	if (!Diff || !Keep)
+	{
+		*ErrorCode = Diff ? GD_OK : Keep ? GD_OK : (KeepError == GD_NOMEM) ? KeepError : DiffError;
+		return Diff ? Diff : Keep;
+	}
+
+	*ErrorCode = GD_OK;
+
+	if (Keep->Size < Diff->Size)
+	{
+		GD_EncoderDestroy(Diff);
+		return Keep;
+	}
+
+	GD_EncoderDestroy(Keep);
 
-	return &Gif->Frames[FrameIndex];
+	return Diff;
 }
 
 const char*
@@ -1060,6 +7420,12 @@ GD_ErrorAsString(GD_ERR Error)
 		case GD_INVALID_SIGNATURE: return "GD_INVALID_SIGNATURE";
 		case GD_INVALID_IMG_INDEX: return "GD_INVALID_IMG_INDEX";
 		case GD_MAX_REGISTERED_ROUTINE: return "GD_MAX_REGISTERED_ROUTINE";
+		case GD_NOT_SUPPORTED: return "GD_NOT_SUPPORTED";
+		case GD_LIMIT_PIXELS: return "GD_LIMIT_PIXELS";
+		case GD_LIMIT_TOTAL_BYTES: return "GD_LIMIT_TOTAL_BYTES";
+		case GD_LIMIT_FRAMES: return "GD_LIMIT_FRAMES";
+		case GD_LIMIT_RATIO: return "GD_LIMIT_RATIO";
+		case GD_LIMIT_TIME: return "GD_LIMIT_TIME";
 
 		default:
 			return "<unknown error code>";
@@ -35,6 +35,7 @@
 typedef uint8_t  GD_BYTE;
 typedef uint16_t GD_WORD;
 typedef uint32_t GD_DWORD;
+typedef uint64_t GD_QWORD;
 
 
 typedef enum GD_BOOL
@@ -55,7 +56,13 @@ typedef enum GD_ERR
 	GD_UNEXPECTED_DATA,
 	GD_INVALID_SIGNATURE,
 	GD_INVALID_IMG_INDEX,
-	GD_MAX_REGISTERED_ROUTINE
+	GD_MAX_REGISTERED_ROUTINE,
+	GD_NOT_SUPPORTED,
+	GD_LIMIT_PIXELS,
+	GD_LIMIT_TOTAL_BYTES,
+	GD_LIMIT_FRAMES,
+	GD_LIMIT_RATIO,
+	GD_LIMIT_TIME
 } GD_ERR;
 
 #define GD_SUCCESS(ErrCode) (ErrCode == GD_OK)
@@ -103,10 +110,104 @@ typedef struct GD_GLOBAL_COLOR_TABLE
 } GD_COLOR_TABLE;
 
 
+typedef struct GD_RECT
+{
+	GD_WORD Left;
+	GD_WORD Top;
+	GD_WORD Width;
+	GD_WORD Height;
+} GD_RECT;
+
+
+/// Disposal method of a frame, taken from its Graphic Control Extension
+typedef enum GD_DISPOSAL_METHOD
+{
+	GD_DISPOSAL_UNSPECIFIED = 0,
+	GD_DISPOSAL_NONE        = 1,
+	GD_DISPOSAL_BACKGROUND  = 2,
+	GD_DISPOSAL_PREVIOUS    = 3
+} GD_DISPOSAL_METHOD;
+
+
+//
+// Per-frame analytics, computed over the decoded part of the image while it is expanded
+// when decoding with GD_DECODE_FRAME_STATS
+//
+typedef struct GD_FRAME_STATS
+{
+	// Number of pixels using each palette index, transparent ones included
+	GD_DWORD Histogram[GCT_MAX_SIZE];
+
+	// Average color of the non-transparent pixels, in the handle's color space
+	GD_GIF_COLOR MeanColor;
+	GD_DWORD OpaqueCount;
+
+	//
+	// Average hash: the image is split in 8x8 blocks, bit (y * 8 + x) is set when the
+	// mean luma of block (x, y) is above the mean of the 64 blocks. Transparent pixels
+	// are left out, a block without any counts as black
+	//
+	GD_QWORD AverageHash;
+} GD_FRAME_STATS;
+
+
 typedef struct GD_FRAME
 {
 	GD_IMAGE_DESCRIPTOR Descriptor;
+
+	//
+	// Region.Width * Region.Height pixels, Region is where they go on the canvas.
+	// It matches the descriptor unless the handle was decoded to another size or
+	// to a region of the screen. NULL with an empty Region for frames outside of it.
+	// When decoding with GD_DECODE_COMPRESS_FRAMES it is only filled by GD_GetFrame,
+	// and released again once the frame cache evicts it
+	//
 	GD_GIF_COLOR* Buffer;
+	GD_RECT Region;
+
+	//
+	// Coverage of each pixel of Buffer for downscaled frames, NULL when fully opaque
+	//
+	GD_BYTE* Alpha;
+
+	//
+	// Graphic Control Extension preceding the image, zeroed if there was none
+	//
+	GD_DISPOSAL_METHOD DisposalMethod;
+	GD_WORD DelayTime;
+	GD_BOOL HasTransparency;
+	GD_BYTE TransparentIndex;
+
+	//
+	// Color table the frame was decoded with. Identical tables are interned, so
+	// frames using the same colors point to the same table and share PaletteIndex
+	//
+	const GD_COLOR_TABLE* Palette;
+	GD_DWORD PaletteIndex;
+
+	//
+	// Index stream of the frame, only kept when HasTransparency is set
+	// or when decoding with GD_DECODE_KEEP_INDICES. Follows Buffer in a compressed store
+	//
+	GD_BYTE* Indices;
+
+	//
+	// Index of the first frame with the same image data, Buffer and Indices are
+	// shared with it. Equal to the frame's own index when it is not a duplicate
+	//
+	GD_DWORD DuplicateOf;
+
+	//
+	// Only computed when decoding with GD_DECODE_FRAME_STATS, NULL otherwise
+	//
+	GD_FRAME_STATS* Stats;
+
+	//
+	// Smallest rectangle of the canvas holding every non-transparent pixel,
+	// Width and Height are 0 for a fully transparent frame
+	//
+	GD_RECT OpaqueRect;
+
 } GD_FRAME;
 
 
@@ -116,6 +217,10 @@ typedef struct GD_FRAME
 struct GD_GIF;
 typedef struct GD_GIF* GD_GIF_HANDLE;
 
+/// Expanded frames of compressed stores, see GD_DECODE_OPTIONS::FrameCache
+struct GD_FRAME_CACHE;
+typedef struct GD_FRAME_CACHE* GD_FRAME_CACHE_HANDLE;
+
 
 /// \brief Obtain a GIF handle from a file
 /// \param Path GIF file path
@@ -136,6 +241,153 @@ GD_GIF_HANDLE
 GD_FromMemory(const void* Buffer, size_t BufferSize, GD_ERR* ErrorCode, size_t* ErrorBytePos);
 
 
+/// Keep the index stream of every frame in GD_FRAME::Indices
+#define GD_DECODE_KEEP_INDICES 0x00000001
+
+/// Fill GD_FRAME::Stats while expanding each frame
+#define GD_DECODE_FRAME_STATS  0x00000002
+
+/// Keep frames as compressed index streams, see GD_DECODE_OPTIONS::FrameCache
+#define GD_DECODE_COMPRESS_FRAMES 0x00000004
+
+
+typedef enum GD_COLOR_SPACE
+{
+	GD_COLOR_SPACE_RGB,
+
+	/// BT.601 limited range, frame and canvas pixels hold (Y, Cb, Cr) in their (r, g, b) members
+	GD_COLOR_SPACE_YCBCR
+} GD_COLOR_SPACE;
+
+
+typedef enum GD_SCALE_FILTER
+{
+	/// Area average, every source pixel lands in exactly one destination pixel
+	GD_FILTER_BOX
+} GD_SCALE_FILTER;
+
+
+//
+// Band of decoded rows handed to a GD_STRIP_ROUTINE. Rows are image rows (relative to
+// Frame->Descriptor), FirstRow + i * RowStep for i < RowCount. RowStep is 1 unless the
+// image is interlaced, bands then follow the passes and never span two of them
+//
+typedef struct GD_STRIP
+{
+	GD_DWORD FrameIndex;
+	const GD_FRAME* Frame;
+
+	GD_WORD FirstRow;
+	GD_WORD RowStep;
+	GD_WORD RowCount;
+	GD_WORD Width;
+
+	// RowCount * Width values, only valid during the call
+	const GD_GIF_COLOR* Pixels;
+	const GD_BYTE* Indices;
+} GD_STRIP;
+
+typedef void(*GD_STRIP_ROUTINE)(const GD_STRIP* Strip, void* UserData);
+
+
+typedef struct GD_DECODE_OPTIONS
+{
+	GD_DWORD Flags;
+	GD_COLOR_SPACE ColorSpace;
+
+	//
+	// Downscale the logical screen to this size while decoding, 0 keeps the source size
+	// or follows the aspect ratio when the other dimension is set. Never upscales.
+	// Frames are scaled straight from their index stream, no full size buffer is built
+	// and GD_DECODE_KEEP_INDICES is ignored
+	//
+	GD_WORD TargetWidth;
+	GD_WORD TargetHeight;
+	GD_SCALE_FILTER ScaleFilter;
+
+	//
+	// Only decode this rectangle of the logical screen, an empty rectangle decodes the
+	// whole screen. The canvas is the region (scaled to TargetWidth/TargetHeight if set),
+	// pixels outside of it are never expanded and LZW decoding of a frame stops once
+	// the last row needed is produced
+	//
+	GD_RECT Region;
+
+	//
+	// Deliver images in bands of StripHeight rows (16 if 0) as they are decompressed,
+	// instead of storing them. Memory use then depends on the image width, not its size.
+	// Frames keep their metadata but have no pixels, GD_ComposeFrame is not supported and
+	// Region, TargetWidth and TargetHeight are ignored
+	//
+	GD_STRIP_ROUTINE StripRoutine;
+	void* StripUserData;
+	GD_WORD StripHeight;
+
+	//
+	// Limits for untrusted input, 0 disables each of them. Decoding stops with the
+	// matching GD_LIMIT_* error as soon as one is exceeded:
+	//  - MaxFramePixels: width * height of the logical screen and of every image
+	//  - MaxTotalBytes: indices decompressed over all the images
+	//  - MaxFrames: number of images
+	//  - MaxCompressionRatio: indices decompressed per byte of image data
+	//  - TimeBudget: time the decoding call may take, in milliseconds of a monotonic
+	//    clock, whatever the other threads of the process do
+	//
+	GD_DWORD MaxFramePixels;
+	size_t MaxTotalBytes;
+	GD_DWORD MaxFrames;
+	GD_DWORD MaxCompressionRatio;
+	GD_DWORD TimeBudget;
+
+	//
+	// With GD_DECODE_COMPRESS_FRAMES, index streams are stored packed with a fast LZ
+	// codec instead of being expanded to colors. GD_GetFrame expands frames on demand and
+	// keeps the most recently used ones in FrameCache, shared between handles, or when it
+	// is NULL in a cache of the handle holding at most CacheBudget bytes and WorkingSet
+	// frames (0 for no limit, WorkingSet is 4 if both are 0). The compositor draws
+	// straight from the packed streams. Ignored when downscaling
+	//
+	GD_WORD WorkingSet;
+	size_t CacheBudget;
+	GD_FRAME_CACHE_HANDLE FrameCache;
+
+	//
+	// Decode large images on up to Threads threads (0 or 1 for the calling thread only),
+	// split where the encoder emitted clear codes. Expanding and drawing large frames
+	// is split in bands of rows the same way. Threads are not used when the library
+	// is built with GD_NO_THREADS
+	//
+	GD_DWORD Threads;
+} GD_DECODE_OPTIONS;
+
+
+/// \brief Fill Options with the defaults used by \ref GD_OpenGif and \ref GD_FromMemory
+/// \param Options
+void
+GD_InitDecodeOptions(GD_DECODE_OPTIONS* Options);
+
+
+/// \brief Same as \ref GD_OpenGif with decoding options
+/// \param Path GIF file path
+/// \param Options Can be NULL for defaults
+/// \param ErrorCode
+/// \param ErrorBytePos
+/// \return
+GD_GIF_HANDLE
+GD_OpenGifEx(const char* Path, const GD_DECODE_OPTIONS* Options, GD_ERR* ErrorCode, size_t* ErrorBytePos);
+
+
+/// \brief Same as \ref GD_FromMemory with decoding options
+/// \param Buffer
+/// \param BufferSize
+/// \param Options Can be NULL for defaults
+/// \param ErrorCode
+/// \param ErrorBytePos
+/// \return
+GD_GIF_HANDLE
+GD_FromMemoryEx(const void* Buffer, size_t BufferSize, const GD_DECODE_OPTIONS* Options, GD_ERR* ErrorCode, size_t* ErrorBytePos);
+
+
 /// \brief Close a GIF handle obtained by \ref GD_OpenGif or \ref GD_FromMemory
 /// \param Gif
 void
@@ -147,34 +399,634 @@ GD_ErrorAsString(GD_ERR Error);
 
 GD_DWORD GD_FrameCount(GD_GIF_HANDLE Gif);
 
+/// NULL for an invalid index, or when a compressed frame cannot be expanded.
+/// Expanded frames of a compressed store stay valid until the cache evicts them
 GD_FRAME* GD_GetFrame(GD_GIF_HANDLE Gif, GD_DWORD FrameIndex);
 
+const GD_LOGICAL_SCREEN_DESCRIPTOR* GD_GetScreenDescriptor(GD_GIF_HANDLE Gif);
+
+/// Size of the composited output, the logical screen unless decoded to another size
+GD_ERR GD_GetCanvasSize(GD_GIF_HANDLE Gif, GD_WORD* Width, GD_WORD* Height);
+
+/// Number of distinct color tables used by the frames
+GD_DWORD GD_PaletteCount(GD_GIF_HANDLE Gif);
+
+/// Interned color table, see GD_FRAME::PaletteIndex
+const GD_COLOR_TABLE* GD_GetPalette(GD_GIF_HANDLE Gif, GD_DWORD PaletteIndex);
+
 
 /////////////////////////////////////////////////////////////////
-///                   EXTENSION SUPPORT                        //
+///                      COMPOSITING                           //
 /////////////////////////////////////////////////////////////////
 
-#define SUB_BLOCK_MAX_SIZE 255
+/// \brief Render a frame as it appears on the logical screen, after applying
+///        the disposal and transparency of every frame that precedes it
+/// \param Gif
+/// \param FrameIndex
+/// \param ErrorCode Optional
+/// \return Canvas pixels (see \ref GD_GetCanvasSize) owned by the handle, valid until the next call.
+///         NULL with GD_NOT_SUPPORTED for handles decoded with a strip routine
+const GD_GIF_COLOR*
+GD_ComposeFrame(GD_GIF_HANDLE Gif, GD_DWORD FrameIndex, GD_ERR* ErrorCode);
+
+
+#define GD_MAX_DIRTY_RECTS 2
+
+/// \brief Regions of the canvas changed by the last call to \ref GD_ComposeFrame
+///
+/// Covers the disposal of the previous frame and the non-transparent part of the new one,
+/// relative to the canvas returned by the call before. The whole screen is reported when
+/// the compositor had to rewind, and nothing when the same frame was requested twice.
+///
+/// \param Gif
+/// \param Rects Receives up to RectCapacity rectangles, GD_MAX_DIRTY_RECTS is always enough.
+///        With fewer slots than rectangles the last slot bounds the ones that do not fit
+/// \param RectCapacity Number of rectangles Rects can hold, at least 1
+/// \param RectCount Receives the number of rectangles written
+/// \return
+GD_ERR
+GD_GetDirtyRects(GD_GIF_HANDLE Gif, GD_RECT* Rects, GD_DWORD RectCapacity, GD_DWORD* RectCount);
+
+
+/// \brief Configure the canvas snapshots kept by \ref GD_ComposeFrame
+///
+/// A snapshot is saved every Interval frames the first time the compositor goes through them,
+/// so seeking to any frame replays at most Interval frames. When MemoryBudget is non-zero the
+/// interval is widened until every snapshot fits in MemoryBudget bytes.
+/// Passing 0 for both disables snapshots (default).
+///
+/// \param Gif
+/// \param Interval
+/// \param MemoryBudget
+/// \return
+GD_ERR
+GD_SetCheckpointPolicy(GD_GIF_HANDLE Gif, GD_DWORD Interval, size_t MemoryBudget);
+
+
+/////////////////////////////////////////////////////////////////
+///                      FRAME CACHE                           //
+/////////////////////////////////////////////////////////////////
+
+/// \brief Create a cache that handles decoded with GD_DECODE_COMPRESS_FRAMES can share
+///
+/// Frames expanded by \ref GD_GetFrame are kept until the cache needs room, the least
+/// recently used one is then evicted and unpacked again the next time it is asked for.
+/// A single frame larger than the budget is still kept until the next one comes in.
+///
+/// \param ByteBudget Bytes of Buffer and Indices held at once, 0 for no limit
+/// \param MaxFrames Frames held at once, 0 for no limit
+/// \return NULL when out of memory
+GD_FRAME_CACHE_HANDLE
+GD_CreateFrameCache(size_t ByteBudget, GD_DWORD MaxFrames);
+
+
+/// \brief Free a cache created by \ref GD_CreateFrameCache, every handle using it must be closed first
+/// \param Cache
+void
+GD_DestroyFrameCache(GD_FRAME_CACHE_HANDLE Cache);
+
+
+/// Cache used by a handle, its own one or a shared one. NULL without a compressed store
+GD_FRAME_CACHE_HANDLE GD_GetFrameCache(GD_GIF_HANDLE Gif);
+
+
+typedef struct GD_FRAME_CACHE_STATS
+{
+	/// Bytes held by the expanded frames
+	size_t Size;
+	GD_DWORD FrameCount;
+
+	GD_QWORD Hits;
+	GD_QWORD Misses;
+	GD_QWORD Evictions;
+} GD_FRAME_CACHE_STATS;
+
+GD_ERR GD_GetFrameCacheStats(GD_FRAME_CACHE_HANDLE Cache, GD_FRAME_CACHE_STATS* Stats);
+
+
+typedef struct GD_FRAME_COST
+{
+	/// Bytes of Buffer, Indices and Alpha while the frame is expanded
+	size_t ExpandedSize;
+
+	/// Bytes of the packed index stream, shared with duplicates. 0 without a compressed store
+	size_t PackedSize;
+
+	/// Wall time of the last expansion in microseconds, 0 until the frame is expanded
+	GD_DWORD ExpandTime;
+
+	/// Whether Buffer is currently filled
+	GD_BOOL Resident;
+} GD_FRAME_COST;
+
+/// \brief Memory and time it takes to keep or bring back a frame, to drive caching decisions
+/// \param Gif
+/// \param FrameIndex
+/// \param Cost
+/// \return
+GD_ERR
+GD_GetFrameCost(GD_GIF_HANDLE Gif, GD_DWORD FrameIndex, GD_FRAME_COST* Cost);
+
+
+/////////////////////////////////////////////////////////////////
+///                      VIDEO OUTPUT                          //
+/////////////////////////////////////////////////////////////////
+
+typedef enum GD_YUV_LAYOUT
+{
+	/// Y plane, then Cb plane, then Cr plane
+	GD_YUV420P,
+
+	/// Y plane, then one plane of interleaved Cb/Cr
+	GD_NV12
+} GD_YUV_LAYOUT;
+
+
+/// \brief Size in bytes of a 4:2:0 image, chroma planes are rounded up for odd dimensions
+/// \param Width
+/// \param Height
+/// \return
+size_t
+GD_Yuv420Size(GD_WORD Width, GD_WORD Height);
+
+
+/// \brief Subsample YCbCr pixels, as decoded with GD_COLOR_SPACE_YCBCR, to a 4:2:0 layout
+/// \param Pixels Width * Height pixels
+/// \param Width
+/// \param Height
+/// \param Layout
+/// \param Output \ref GD_Yuv420Size bytes
+/// \return
+GD_ERR
+GD_PackYuv420(const GD_GIF_COLOR* Pixels, GD_WORD Width, GD_WORD Height, GD_YUV_LAYOUT Layout, GD_BYTE* Output);
+
+
+/// \brief Write every composited frame as a YUV4MPEG2 stream
+///
+/// Frame delays are honored by repeating frames at a constant rate, delays under 2/100s
+/// are played as 1/10s like web browsers do. Handles decoded with GD_COLOR_SPACE_YCBCR
+/// are written without any conversion.
+///
+/// \param Gif
+/// \param Output
+/// \return
+GD_ERR
+GD_WriteY4m(GD_GIF_HANDLE Gif, FILE* Output);
+
+
+/////////////////////////////////////////////////////////////////
+///                      TEXTURE OUTPUT                        //
+/////////////////////////////////////////////////////////////////
+
+/// \brief Size in bytes of an RGBA mip chain: Width x Height, then each level halving both
+/// dimensions (rounded down, at least 1) until 1x1, one after the other without padding
+/// \param Width
+/// \param Height
+/// \param LevelCount Optional, receives the number of levels
+/// \return
+size_t
+GD_MipChainSize(GD_WORD Width, GD_WORD Height, GD_DWORD* LevelCount);
+
+
+/// \brief Convert pixels to RGBA and box filter them down to a full mip chain
+///
+/// Every level averages 2x2 pixels of the one above, the last row or column of odd
+/// sizes is dropped. Levels are built while the rows they come from are still in the
+/// cache, the source is read once. Alpha is 255, values are averaged as they are stored
+/// (no gamma correction).
+///
+/// \param Pixels Width * Height pixels
+/// \param Width
+/// \param Height
+/// \param Output \ref GD_MipChainSize bytes
+/// \return
+GD_ERR
+GD_BuildMipChain(const GD_GIF_COLOR* Pixels, GD_WORD Width, GD_WORD Height, GD_BYTE* Output);
+
+
+/// \brief Composite a frame like \ref GD_ComposeFrame and write it with its mip chain,
+/// ready to be uploaded as one texture
+/// \param Gif
+/// \param FrameIndex
+/// \param Output \ref GD_MipChainSize bytes for the size given by \ref GD_GetCanvasSize
+/// \return
+GD_ERR
+GD_ComposeMipChain(GD_GIF_HANDLE Gif, GD_DWORD FrameIndex, GD_BYTE* Output);
+
+
+/////////////////////////////////////////////////////////////////
+///                      ATLAS OUTPUT                          //
+/////////////////////////////////////////////////////////////////
+
+/// Cells only cover the part of the canvas frames draw to, see GD_ATLAS_CELL::OffsetX
+#define GD_ATLAS_TRIM 0x00000001
+
+typedef struct GD_ATLAS_CELL
+{
+	/// Top-left corner of the cell in the atlas, in pixels
+	GD_DWORD X;
+	GD_DWORD Y;
+
+	/// Where the top-left corner of the cell goes on the canvas, 0 unless trimmed
+	GD_WORD OffsetX;
+	GD_WORD OffsetY;
+
+	/// Texture coordinates of the corners of the cell, from 0 to 1
+	float U0;
+	float V0;
+	float U1;
+	float V1;
+
+	/// Delay of the frame, as in the Graphic Control Extension
+	GD_WORD DelayTime;
+} GD_ATLAS_CELL;
+
+typedef struct GD_ATLAS
+{
+	GD_DWORD Width;
+	GD_DWORD Height;
+
+	/// Size of every cell, the canvas size unless trimmed
+	GD_WORD CellWidth;
+	GD_WORD CellHeight;
+
+	GD_DWORD Columns;
+	GD_DWORD Rows;
+
+	/// Width * Height pixels. Frames fill the grid left to right then top to bottom,
+	/// cells past the last frame are black
+	GD_GIF_COLOR* Pixels;
+
+	/// One per frame
+	GD_ATLAS_CELL* Cells;
+	GD_DWORD CellCount;
+} GD_ATLAS;
+
+
+/// \brief Composite every frame into one sprite sheet and describe where each one went
+///
+/// Cells of the same size are laid out on the grid closest to a square. With
+/// GD_ATLAS_TRIM they are cut down to the union of all frame regions, what lies outside
+/// of it is never drawn and stays the background. Frames are composited in order, each
+/// one only drawing itself. When decoding with GD_DECODE_COMPRESS_FRAMES they are drawn
+/// straight from the packed index streams, no frame buffer is ever allocated.
+///
+/// \param Gif
+/// \param Flags GD_ATLAS_TRIM or 0
+/// \param Atlas Release with \ref GD_FreeAtlas
+/// \return GD_NOT_SUPPORTED for handles decoded with a strip routine
+GD_ERR
+GD_DecodeToAtlas(GD_GIF_HANDLE Gif, GD_DWORD Flags, GD_ATLAS* Atlas);
+
+
+/// \brief Release the pixels and cells of an atlas filled by \ref GD_DecodeToAtlas
+/// \param Atlas
+void
+GD_FreeAtlas(GD_ATLAS* Atlas);
+
+
+/////////////////////////////////////////////////////////////////
+///                      TENSOR OUTPUT                         //
+/////////////////////////////////////////////////////////////////
+
+typedef struct GD_TENSOR_OPTIONS
+{
+	/// Size of every image in the tensor, frames are resized to it
+	GD_WORD Width;
+	GD_WORD Height;
+
+	/// Channels are scaled to 0..1, then become (Value - Mean) / Std. Std must not be 0
+	float Mean[3];
+	float Std[3];
+} GD_TENSOR_OPTIONS;
+
+
+/// \brief Resize and normalize pixels into one float32 CHW image
+///
+/// Resizing is bilinear with pixel centers aligned (no antialiasing). It is done straight
+/// from the pixels, normalization goes through a table per channel and the output is
+/// written once, without intermediate images. Handles decoded with GD_COLOR_SPACE_YCBCR
+/// give Y, Cb, Cr planes.
+///
+/// \param Pixels Width * Height pixels
+/// \param Width
+/// \param Height
+/// \param Options
+/// \param Output 3 * Options->Width * Options->Height floats, R plane then G then B
+/// \return
+GD_ERR
+GD_PixelsToTensor(const GD_GIF_COLOR* Pixels, GD_WORD Width, GD_WORD Height, const GD_TENSOR_OPTIONS* Options, float* Output);
+
+
+/// \brief Composite frames into an NCHW float32 batch, see \ref GD_PixelsToTensor
+/// \param Gif
+/// \param FrameIndices Frames to write, in increasing order they are composited incrementally
+/// \param Count Size of the batch
+/// \param Options
+/// \param Output Count * 3 * Options->Width * Options->Height floats
+/// \return
+GD_ERR
+GD_ComposeToTensor(GD_GIF_HANDLE Gif, const GD_DWORD* FrameIndices, GD_DWORD Count, const GD_TENSOR_OPTIONS* Options, float* Output);
+
 
-typedef struct GD_DataBlock
+/////////////////////////////////////////////////////////////////
+///                      SAMPLING                              //
+/////////////////////////////////////////////////////////////////
+
+typedef struct GD_SAMPLE
+{
+	GD_DWORD SampleIndex;
+	GD_DWORD Timestamp;
+
+	/// Frame on screen at Timestamp
+	GD_DWORD FrameIndex;
+
+	/// Composited canvas (see \ref GD_GetCanvasSize), only valid during the call.
+	/// \ref GD_GetDirtyRects reports what changed since the previous sample
+	const GD_GIF_COLOR* Pixels;
+} GD_SAMPLE;
+
+typedef void(*GD_SAMPLE_ROUTINE)(const GD_SAMPLE* Sample, void* UserData);
+
+
+/// \brief Composite the frames shown at given times, e.g. one per second
+///
+/// Frame times follow the delays of the Graphic Control Extensions, played like
+/// \ref GD_WriteY4m does. Timestamps past the end of the animation get the last frame.
+/// Frames between two samples are only drawn when they can show at the second one:
+/// frames disposed before it, or entirely overdrawn by an opaque frame or cleared to the
+/// background before it, are skipped, and frames of a compressed store are then never
+/// unpacked. Sorted timestamps make the most of it, others rewind like \ref GD_ComposeFrame.
+///
+/// \param Gif
+/// \param Timestamps In milliseconds from the start of the animation
+/// \param Count
+/// \param Routine Called once per timestamp, in order
+/// \param UserData
+/// \return GD_NOT_SUPPORTED for handles decoded with a strip routine
+GD_ERR
+GD_SampleFrames(GD_GIF_HANDLE Gif, const GD_DWORD* Timestamps, GD_DWORD Count, GD_SAMPLE_ROUTINE Routine, void* UserData);
+
+
+/////////////////////////////////////////////////////////////////
+///                      ENCODER                               //
+/////////////////////////////////////////////////////////////////
+
+/// Used as an opaque pointer, see \ref GD_EncoderCreate
+struct GD_ENCODER;
+typedef struct GD_ENCODER* GD_ENCODER_HANDLE;
+
+typedef struct GD_ENCODER_OPTIONS
 {
-	struct GD_DataBlock* BLink;
-	struct GD_DataBlock* FLink;
+	GD_WORD Width;
+	GD_WORD Height;
 
-	GD_BYTE Data[SUB_BLOCK_MAX_SIZE];
-	GD_BYTE EffectiveSize;
+	/// Global color table, NULL when every frame brings its own. 1 to 256 colors
+	const GD_COLOR_TABLE* GlobalPalette;
+	GD_BYTE BgColorIndex;
 
-} GD_DataBlock;
+	/// Frames added together by \ref GD_EncoderAddFrames are compressed on up to Threads
+	/// threads (0 or 1 for the calling thread only)
+	GD_DWORD Threads;
 
+	/// Compress every frame a second time, keeping the LZW string table once it is full for
+	/// as long as it does better than a cleared one, and write the smaller of the two
+	GD_BOOL Thorough;
+} GD_ENCODER_OPTIONS;
 
-typedef struct GD_DataBlockList
+typedef struct GD_ENCODER_FRAME
 {
-	GD_DataBlock* Head;
-	GD_DataBlock* Tail;
+	GD_WORD Left;
+	GD_WORD Top;
+	GD_WORD Width;
+	GD_WORD Height;
+
+	/// Width * Height palette indices, row by row
+	const GD_BYTE* Indices;
+
+	/// Local color table, NULL to use the global one
+	const GD_COLOR_TABLE* Palette;
 
-	size_t BlockCount;
+	//
+	// Written as a Graphic Control Extension before the image
+	//
+	GD_DISPOSAL_METHOD DisposalMethod;
+	GD_WORD DelayTime;
+	GD_BOOL HasTransparency;
+	GD_BYTE TransparentIndex;
+} GD_ENCODER_FRAME;
+
+
+/// \brief Start writing a GIF89a file in memory, the header is written right away
+/// \param Options
+/// \param ErrorCode
+/// \return NULL on failure
+GD_ENCODER_HANDLE
+GD_EncoderCreate(const GD_ENCODER_OPTIONS* Options, GD_ERR* ErrorCode);
 
-} GD_DataBlockList;
+
+/// \brief Write a NETSCAPE2.0 extension, must come before the first frame
+/// \param Encoder
+/// \param LoopCount 0 to loop forever
+/// \return
+GD_ERR
+GD_EncoderSetLoopCount(GD_ENCODER_HANDLE Encoder, GD_WORD LoopCount);
+
+
+/// \brief Write a Comment Extension
+/// \param Encoder
+/// \param Text Null terminated
+/// \return
+GD_ERR
+GD_EncoderAddComment(GD_ENCODER_HANDLE Encoder, const char* Text);
+
+
+/// \brief Compress and write frames, in order
+///
+/// The LZW string table is an open-addressing hash table, the dictionary is reset with a
+/// clear code when it is full (see GD_ENCODER_OPTIONS::Thorough). Frames are compressed on separate threads when the encoder
+/// was created with Threads, then written one after the other.
+///
+/// \param Encoder
+/// \param Frames
+/// \param Count
+/// \return GD_UNEXPECTED_DATA for an index outside of the frame's color table, the
+/// frames before it may already be written. GD_NO_COLOR_TABLE when a frame has no table
+GD_ERR
+GD_EncoderAddFrames(GD_ENCODER_HANDLE Encoder, const GD_ENCODER_FRAME* Frames, GD_DWORD Count);
+
+
+/// \brief Compress and write one frame, see \ref GD_EncoderAddFrames
+/// \param Encoder
+/// \param Frame
+/// \return
+GD_ERR
+GD_EncoderAddFrame(GD_ENCODER_HANDLE Encoder, const GD_ENCODER_FRAME* Frame);
+
+
+/// \brief Write the trailer and hand out the file, nothing can be added afterwards
+/// \param Encoder
+/// \param Data Valid until \ref GD_EncoderDestroy
+/// \param Size
+/// \return
+GD_ERR
+GD_EncoderFinish(GD_ENCODER_HANDLE Encoder, const GD_BYTE** Data, size_t* Size);
+
+
+/// \brief Free an encoder and the file it wrote
+/// \param Encoder
+void
+GD_EncoderDestroy(GD_ENCODER_HANDLE Encoder);
+
+
+/////////////////////////////////////////////////////////////////
+///                      QUANTIZER                             //
+/////////////////////////////////////////////////////////////////
+
+/// Used as an opaque pointer, see \ref GD_QuantizerCreate
+struct GD_QUANTIZER;
+typedef struct GD_QUANTIZER* GD_QUANTIZER_HANDLE;
+
+typedef enum GD_DITHER
+{
+	GD_DITHER_NONE,
+
+	/// 8x8 Bayer matrix. Pixels are dithered on their own, the same colors give the
+	/// same indices from one frame to the next
+	GD_DITHER_ORDERED,
+
+	/// Error diffusion, smoother gradients but the pattern moves between frames
+	GD_DITHER_FLOYD_STEINBERG
+} GD_DITHER;
+
+
+/// \brief Create a quantizer mapping RGB pixels to a palette of at most GCT_MAX_SIZE colors
+///
+/// Pixels of any number of frames go in a histogram (\ref GD_QuantizerAddPixels), the
+/// palette is built from it once (\ref GD_QuantizerBuildPalette) or given
+/// (\ref GD_QuantizerSetPalette), then every frame is mapped to that same palette
+/// (\ref GD_QuantizerRemap), which keeps colors stable across an animation.
+///
+/// \return NULL when out of memory
+GD_QUANTIZER_HANDLE
+GD_QuantizerCreate(void);
+
+
+/// \brief Count pixels in the histogram, 5 bits per channel
+/// \param Quantizer
+/// \param Pixels
+/// \param Count
+/// \return
+GD_ERR
+GD_QuantizerAddPixels(GD_QUANTIZER_HANDLE Quantizer, const GD_GIF_COLOR* Pixels, size_t Count);
+
+
+/// \brief Build a palette from the histogram, which then starts over
+///
+/// Median cut splits the histogram in up to MaxColors boxes, refined by a few rounds of
+/// k-means over the histogram cells. Palette colors are averages of the actual pixels.
+///
+/// \param Quantizer
+/// \param MaxColors 1 to GCT_MAX_SIZE, e.g. 255 to keep an index for transparency
+/// \param Palette Receives the palette, it also becomes the one used for remapping
+/// \return GD_NOT_ENOUGH_DATA when no pixel was added
+GD_ERR
+GD_QuantizerBuildPalette(GD_QUANTIZER_HANDLE Quantizer, GD_DWORD MaxColors, GD_COLOR_TABLE* Palette);
+
+
+/// \brief Remap to an existing palette, e.g. the global table of the first frame
+/// \param Quantizer
+/// \param Palette
+/// \return
+GD_ERR
+GD_QuantizerSetPalette(GD_QUANTIZER_HANDLE Quantizer, const GD_COLOR_TABLE* Palette);
+
+
+/// \brief Map pixels to indices of the current palette
+///
+/// Nearest colors are looked up in a table of 6 bits per channel, filled on first use and
+/// kept as long as the palette does, so later frames mostly hit it.
+///
+/// \param Quantizer
+/// \param Pixels Width * Height pixels
+/// \param Width
+/// \param Height
+/// \param Dither
+/// \param Indices Width * Height indices
+/// \return GD_NO_COLOR_TABLE when there is no palette yet
+GD_ERR
+GD_QuantizerRemap(GD_QUANTIZER_HANDLE Quantizer, const GD_GIF_COLOR* Pixels, GD_WORD Width, GD_WORD Height, GD_DITHER Dither, GD_BYTE* Indices);
+
+
+/// \brief Free a quantizer
+/// \param Quantizer
+void
+GD_QuantizerDestroy(GD_QUANTIZER_HANDLE Quantizer);
+
+
+/////////////////////////////////////////////////////////////////
+///                      OPTIMIZER                             //
+/////////////////////////////////////////////////////////////////
+
+typedef struct GD_OPTIMIZE_OPTIONS
+{
+	/// Frames are compressed on up to Threads threads, see \ref GD_ENCODER_OPTIONS
+	GD_DWORD Threads;
+
+	/// Written as a NETSCAPE2.0 extension when HasLoopCount is set. The decoder does not keep
+	/// it, it can be read with an application extension routine (see \ref GD_RegisterAppExRoutine)
+	GD_BOOL HasLoopCount;
+	GD_WORD LoopCount;
+} GD_OPTIMIZE_OPTIONS;
+
+
+/// \brief Re-encode a GIF so that it composes to the same canvases in fewer bytes
+///
+/// The first frame covers the whole screen without transparency, as viewers differ on the
+/// canvas they start from. Every other frame is cropped to the rectangle where its canvas
+/// differs from the previous one, the pixels inside that did not change are made
+/// transparent and nothing is disposed.
+/// The colors of the frames go to one global color table for as long as they fit, the
+/// other frames get a table of their own. The original frames are also compressed again
+/// as they are, and the smaller of the two files is kept. Frames are compressed with
+/// GD_ENCODER_OPTIONS::Thorough.
+///
+/// \param Gif Decoded in GD_COLOR_SPACE_RGB at its full size, without a region or strip routine
+/// \param Options NULL to use the calling thread only and write no loop count
+/// \param ErrorCode GD_NOT_SUPPORTED for handles decoded otherwise, or when neither file can
+/// be written (a frame changing pixels of more than 256 colors and another one partly off
+/// the screen). GD_NOT_ENOUGH_DATA without any frame
+/// \return A finished encoder, read the file with \ref GD_EncoderFinish. NULL on failure
+GD_ENCODER_HANDLE
+GD_Optimize(GD_GIF_HANDLE Gif, const GD_OPTIMIZE_OPTIONS* Options, GD_ERR* ErrorCode);
+
+
+/////////////////////////////////////////////////////////////////
+///                   EXTENSION SUPPORT                        //
+/////////////////////////////////////////////////////////////////
+
+#define SUB_BLOCK_MAX_SIZE 255
+
+//
+// View on one data sub-block. Data points into the source buffer when decoding from
+// memory, into a scratch buffer of the decoder otherwise. Only valid during the routine call
+//
+typedef struct GD_DATA_SPAN
+{
+	const GD_BYTE* Data;
+	GD_BYTE Size;
+} GD_DATA_SPAN;
+
+
+typedef struct GD_DATA_SPANS
+{
+	const GD_DATA_SPAN* Spans;
+	size_t SpanCount;
+
+	// Sum of the span sizes
+	size_t TotalSize;
+
+} GD_DATA_SPANS;
 
 
 typedef struct GD_EXT_GRAPHICS
@@ -187,7 +1039,7 @@ typedef struct GD_EXT_GRAPHICS
 
 typedef struct GD_EXT_COMMENT
 {
-	GD_DataBlockList Blocks;
+	GD_DATA_SPANS Blocks;
 } GD_EXT_COMMENT;
 
 
@@ -202,7 +1054,7 @@ typedef struct GD_EXT_PLAINTEXT
 	GD_BYTE FgColorIndex;
 	GD_BYTE BgColorIndex;
 
-	GD_DataBlockList Blocks;
+	GD_DATA_SPANS Blocks;
 
 } GD_EXT_PLAINTEXT;
 
@@ -212,7 +1064,7 @@ typedef struct GD_EXT_APPLICATION
 	GD_BYTE AppId[8];
 	GD_BYTE AppAuth[3];
 
-	GD_DataBlockList Blocks;
+	GD_DATA_SPANS Blocks;
 
 } GD_EXT_APPLICATION;
 
@@ -248,5 +1100,15 @@ void
 GD_UnregisterExRoutine(GD_EXTENSION_TYPE RoutineType, void* UserRoutine);
 
 
+/// \brief Register an application extension routine only called for one application
+///        identifier. Other application extensions are skipped without being read when
+///        no routine wants them
+/// \param AppId The 8 bytes identifier, ie: "NETSCAPE" or "XMP Data"
+/// \param UserRoutine
+/// \return
+GD_ERR
+GD_RegisterAppExRoutine(const char* AppId, GD_EXT_ROUTINE_APPLICATION UserRoutine);
+
+
 
 #endif //GIFDEC_GIFDEC_H
@@ -86,27 +86,23 @@ void test_from_memory()
 
 
 void
-DumpDataBlocks(GD_DataBlockList* Blocks)
+DumpDataBlocks(const GD_DATA_SPANS* Blocks)
 {
-	size_t BlockCount = Blocks->BlockCount;
+	printf("Data Blocks (%zu, %zu bytes):\n", Blocks->SpanCount, Blocks->TotalSize);
 
-	printf("Data Blocks (%zu):\n", BlockCount);
-
-	GD_DataBlock* Current = Blocks->Head;
-
-	for (size_t i = 0; i < BlockCount; ++i)
+	for (size_t i = 0; i < Blocks->SpanCount; ++i)
 	{
+		const GD_DATA_SPAN* Current = &Blocks->Spans[i];
+
 		printf("---- Block #%zu\n", i);
 
-		for (size_t j = 0; j < Current->EffectiveSize; ++j)
+		for (size_t j = 0; j < Current->Size; ++j)
 		{
 			printf("%02X ", Current->Data[j]);
 
 			if ((j + 1) % 16 == 0)
 				printf("\n");
 		}
-
-		Current = Current->FLink;
 	}
 
 	printf("\n");
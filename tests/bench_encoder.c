@@ -0,0 +1,101 @@
+#include "gd_test.h"
+
+//
+// Encoding speed in MB/s of indices, for 8 frames of 1024x1024 added together
+//
+
+#define BENCH_WIDTH  1024
+#define BENCH_HEIGHT 1024
+#define BENCH_FRAMES 8
+
+static double
+BenchEncode(const GD_ENCODER_OPTIONS* Options, const GD_ENCODER_FRAME* Frames, size_t* Size)
+{
+	size_t Runs = 0;
+	const double Start = TestNow();
+	double Elapsed;
+
+	do
+	{
+		GD_BYTE* File = TestEncode(Options, Frames, BENCH_FRAMES, Size);
+		TEST_CHECK(File != NULL);
+		free(File);
+
+		++Runs;
+		Elapsed = TestNow() - Start;
+	} while (Elapsed < 0.5);
+
+	return (double)BENCH_WIDTH * BENCH_HEIGHT * BENCH_FRAMES * Runs / Elapsed / 1e6;
+}
+
+int
+main(void)
+{
+	const size_t Pixels = (size_t)BENCH_WIDTH * BENCH_HEIGHT;
+	const GD_DWORD Colors[] = { 16, 256 };
+	const GD_DWORD RunLengths[] = { 1, 8 };
+
+	GD_BYTE* Indices = malloc(Pixels * BENCH_FRAMES);
+
+	if (!Indices)
+		return 1;
+
+	printf("%d frames of %dx%d, MB/s of indices (output ratio)\n", BENCH_FRAMES, BENCH_WIDTH, BENCH_HEIGHT);
+	printf("%-16s %18s %18s %18s\n", "", "default", "thorough", "4 threads");
+
+	for (size_t c = 0; c < sizeof(Colors) / sizeof(Colors[0]); ++c)
+	{
+		for (size_t r = 0; r < sizeof(RunLengths) / sizeof(RunLengths[0]); ++r)
+		{
+			GD_COLOR_TABLE Palette;
+			TestRandomPalette(&Palette, Colors[c]);
+
+			GD_BYTE Value = 0;
+
+			for (size_t i = 0; i < Pixels * BENCH_FRAMES; ++i)
+			{
+				if (TestRandom() % RunLengths[r] == 0)
+					Value = (GD_BYTE)(TestRandom() % Colors[c]);
+
+				Indices[i] = Value;
+			}
+
+			GD_ENCODER_FRAME Frames[BENCH_FRAMES];
+			memset(Frames, 0, sizeof(Frames));
+
+			for (int i = 0; i < BENCH_FRAMES; ++i)
+			{
+				Frames[i].Width = BENCH_WIDTH;
+				Frames[i].Height = BENCH_HEIGHT;
+				Frames[i].Indices = Indices + Pixels * i;
+			}
+
+			GD_ENCODER_OPTIONS Options;
+			memset(&Options, 0, sizeof(Options));
+			Options.Width = BENCH_WIDTH;
+			Options.Height = BENCH_HEIGHT;
+			Options.GlobalPalette = &Palette;
+
+			char Name[32];
+			snprintf(Name, sizeof(Name), "%u colors %s", (unsigned)Colors[c], RunLengths[r] == 1 ? "noise" : "runs/8");
+			printf("%-16s", Name);
+
+			for (int Mode = 0; Mode < 3; ++Mode)
+			{
+				Options.Thorough = Mode == 1 ? GD_TRUE : GD_FALSE;
+				Options.Threads = Mode == 2 ? 4 : 1;
+
+				size_t Size = 0;
+				const double Speed = BenchEncode(&Options, Frames, &Size);
+
+				printf(" %10.1f (%5.2f)", Speed, (double)Pixels * BENCH_FRAMES / (Size ? Size : 1));
+			}
+
+			printf("\n");
+		}
+	}
+
+	free(Indices);
+
+	return TestReport("bench_encoder");
+}
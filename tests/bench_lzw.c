@@ -0,0 +1,111 @@
+//
+// Decompression speed of the LZW decoder for each initial code width, on one thread.
+// Includes gd.c to reach the kernel directly, run.sh does not link it a second time
+//
+#include "gd.c"
+#include "gd_test.h"
+
+#define BENCH_WIDTH  1024
+#define BENCH_HEIGHT 1024
+
+/// Random indices, or runs of mean length RunLength
+static void
+BenchFill(GD_BYTE* Indices, size_t Count, GD_DWORD Colors, GD_DWORD RunLength)
+{
+	GD_BYTE Value = 0;
+
+	for (size_t i = 0; i < Count; ++i)
+	{
+		if (TestRandom() % RunLength == 0)
+			Value = (GD_BYTE)(TestRandom() % Colors);
+
+		Indices[i] = Value;
+	}
+}
+
+static double
+BenchDecode(GD_BYTE CodeWidth, GD_BYTE* Compressed, size_t CompressedSize, GD_BYTE* Output, size_t Count)
+{
+	LZW_JOB Job;
+	memset(&Job, 0, sizeof(Job));
+	Job.InitialCodeWidth = CodeWidth;
+	Job.Data             = Compressed;
+	Job.DataEnd          = Compressed + CompressedSize;
+	Job.Output           = Output;
+	Job.OutputLength     = Count;
+	Job.WriteLimit       = Output + Count + LZW_OUTPUT_SLACK;
+
+	size_t Runs = 0;
+	const double Start = TestNow();
+	double Elapsed;
+
+	do
+	{
+		GD_ERR ErrorCode = GD_LzwKernel(&Job);
+
+		if (!GD_SUCCESS(ErrorCode))
+		{
+			printf("decode failed: %s\n", GD_ErrorAsString(ErrorCode));
+			return 0;
+		}
+
+		++Runs;
+		Elapsed = TestNow() - Start;
+	} while (Elapsed < 0.25);
+
+	return (double)Count * Runs / Elapsed / 1e6;
+}
+
+int
+main(void)
+{
+	const size_t Count = (size_t)BENCH_WIDTH * BENCH_HEIGHT;
+	const GD_DWORD RunLengths[] = { 1, 4, 32 };
+
+	GD_BYTE* Indices = malloc(Count);
+	GD_BYTE* Output = malloc(Count + LZW_OUTPUT_SLACK);
+	LZW_ENCODER* Lzw = malloc(sizeof(LZW_ENCODER));
+
+	if (!Indices || !Output || !Lzw)
+		return 1;
+
+	printf("LZW decode, %dx%d indices, MB/s of indices\n", BENCH_WIDTH, BENCH_HEIGHT);
+	printf("width    noise   runs/4  runs/32\n");
+
+	for (GD_BYTE CodeWidth = 2; CodeWidth <= 8; ++CodeWidth)
+	{
+		printf("%5d ", CodeWidth);
+
+		for (size_t r = 0; r < sizeof(RunLengths) / sizeof(RunLengths[0]); ++r)
+		{
+			BenchFill(Indices, Count, 1u << CodeWidth, RunLengths[r]);
+
+			GD_ENCODER_FRAME Frame;
+			memset(&Frame, 0, sizeof(Frame));
+			Frame.Width = BENCH_WIDTH;
+			Frame.Height = BENCH_HEIGHT;
+			Frame.Indices = Indices;
+
+			memset(Lzw, 0, sizeof(LZW_ENCODER));
+			Lzw->Frame = &Frame;
+			Lzw->MinCodeWidth = CodeWidth;
+			GD_LzwCompress(Lzw);
+
+			if (Lzw->Result != GD_OK)
+				return 1;
+
+			printf(" %8.1f", BenchDecode(CodeWidth, Lzw->Output, Lzw->Size, Output, Count));
+			TEST_CHECK(memcmp(Output, Indices, Count) == 0);
+
+			free(Lzw->Output);
+		}
+
+		printf("\n");
+	}
+
+	free(Lzw);
+	free(Output);
+	free(Indices);
+
+	return TestReport("bench_lzw");
+}
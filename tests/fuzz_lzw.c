@@ -0,0 +1,368 @@
+#include "gd_test.h"
+
+//
+// Fuzz target for malformed LZW streams. Decompression only checks the output bounds once
+// per code and relies on LZW_OUTPUT_SLACK extra bytes for the last string, so any code
+// writing past them shows up as an AddressSanitizer error.
+//
+// Built with -DGD_LIBFUZZER the file only provides LLVMFuzzerTestOneInput, e.g.
+//   clang -DGD_LIBFUZZER -fsanitize=fuzzer,address -I.. ../gd.c fuzz_lzw.c
+// Otherwise main mutates generated files by itself: fuzz_lzw [iterations] [seed]
+//
+
+static void
+FuzzStripRoutine(const GD_STRIP* Strip, void* UserData)
+{
+	size_t* Sum = UserData;
+
+	for (size_t i = 0; i < (size_t)Strip->RowCount * Strip->Width; ++i)
+		*Sum += Strip->Indices[i];
+}
+
+static void
+FuzzDecode(const GD_BYTE* Data, size_t Size)
+{
+	size_t StripSum = 0;
+
+	for (int Variant = 0; Variant < 6; ++Variant)
+	{
+		GD_DECODE_OPTIONS Options;
+		GD_InitDecodeOptions(&Options);
+
+		//
+		// Keep what a hostile header can make us allocate reasonable
+		//
+		Options.MaxFramePixels = 1 << 22;
+		Options.MaxTotalBytes = (size_t)1 << 26;
+
+		switch (Variant)
+		{
+			case 1: Options.Flags = GD_DECODE_KEEP_INDICES | GD_DECODE_FRAME_STATS; Options.Threads = 4; break;
+			case 2: Options.Region.Left = 3; Options.Region.Top = 2; Options.Region.Width = 17; Options.Region.Height = 9; break;
+			case 3: Options.TargetWidth = 7; Options.TargetHeight = 5; break;
+			case 4: Options.Flags = GD_DECODE_COMPRESS_FRAMES; break;
+			case 5: Options.StripRoutine = FuzzStripRoutine; Options.StripUserData = &StripSum; Options.StripHeight = 3; break;
+			default: break;
+		}
+
+		GD_ERR ErrorCode;
+		size_t ErrorBytePos;
+		GD_GIF_HANDLE Gif = GD_FromMemoryEx(Data, Size, &Options, &ErrorCode, &ErrorBytePos);
+
+		if (!Gif)
+			continue;
+
+		if (!Options.StripRoutine)
+		{
+			for (GD_DWORD i = 0; i < GD_FrameCount(Gif); ++i)
+			{
+				GD_GetFrame(Gif, i);
+				GD_ComposeFrame(Gif, i, &ErrorCode);
+			}
+		}
+
+		GD_CloseGif(Gif);
+	}
+}
+
+int LLVMFuzzerTestOneInput(const GD_BYTE* Data, size_t Size);
+
+int
+LLVMFuzzerTestOneInput(const GD_BYTE* Data, size_t Size)
+{
+	FuzzDecode(Data, Size);
+	return 0;
+}
+
+
+#ifndef GD_LIBFUZZER
+
+/// Offset of the first image descriptor, 0 if there is none
+static size_t
+FuzzFindImage(const GD_BYTE* File, size_t Size)
+{
+	size_t Offset = 13;
+
+	if (Size < Offset)
+		return 0;
+
+	if (File[10] & 0x80)
+		Offset += 3 * ((size_t)2 << (File[10] & 7));
+
+	while (Offset < Size)
+	{
+		if (File[Offset] == 0x2C)
+			return Offset;
+
+		if (File[Offset] != 0x21 || Offset + 2 > Size)
+			return 0;
+
+		//
+		// Extension label, then sub-blocks up to the terminator
+		//
+		Offset += 2;
+
+		while (Offset < Size && File[Offset])
+			Offset += 1 + (size_t)File[Offset];
+
+		++Offset;
+	}
+
+	return 0;
+}
+
+/// One image of Width * Height pixels with a 2^CodeWidth global table, Payload split in sub-blocks
+static size_t
+FuzzWrapImage(GD_BYTE* File, GD_WORD Width, GD_WORD Height, GD_BYTE CodeWidth, GD_BOOL Interlaced,
+              const GD_BYTE* Payload, size_t PayloadSize)
+{
+	const GD_BYTE TableBits = (CodeWidth >= 2 && CodeWidth <= 8) ? CodeWidth : 8;
+	size_t Offset = 0;
+
+	memcpy(File, "GIF89a", 6);
+	Offset += 6;
+
+	File[Offset++] = (GD_BYTE)Width;
+	File[Offset++] = (GD_BYTE)(Width >> 8);
+	File[Offset++] = (GD_BYTE)Height;
+	File[Offset++] = (GD_BYTE)(Height >> 8);
+	File[Offset++] = (GD_BYTE)(0x80 | (TableBits - 1));
+	File[Offset++] = 0;
+	File[Offset++] = 0;
+
+	for (size_t i = 0; i < ((size_t)3 << TableBits); ++i)
+		File[Offset++] = (GD_BYTE)(i * 37);
+
+	File[Offset++] = 0x2C;
+	memset(&File[Offset], 0, 4);
+	Offset += 4;
+	File[Offset++] = (GD_BYTE)Width;
+	File[Offset++] = (GD_BYTE)(Width >> 8);
+	File[Offset++] = (GD_BYTE)Height;
+	File[Offset++] = (GD_BYTE)(Height >> 8);
+	File[Offset++] = Interlaced ? 0x40 : 0;
+	File[Offset++] = CodeWidth;
+
+	while (PayloadSize)
+	{
+		const size_t Block = PayloadSize < 255 ? PayloadSize : 255;
+		File[Offset++] = (GD_BYTE)Block;
+		memcpy(&File[Offset], Payload, Block);
+		Offset += Block;
+		Payload += Block;
+		PayloadSize -= Block;
+	}
+
+	File[Offset++] = 0;
+	File[Offset++] = 0x3B;
+
+	return Offset;
+}
+
+/// A few random frames through the encoder, so most of the stream starts out valid
+static GD_BYTE*
+FuzzEncodeRandom(size_t* Size)
+{
+	GD_COLOR_TABLE Palette;
+	TestRandomPalette(&Palette, 1 + TestRandom() % 256);
+
+	const GD_WORD Width = (GD_WORD)(1 + TestRandom() % 48);
+	const GD_WORD Height = (GD_WORD)(1 + TestRandom() % 48);
+	const GD_DWORD Count = 1 + TestRandom() % 3;
+
+	GD_ENCODER_FRAME Frames[3];
+	GD_BYTE* Indices = malloc((size_t)Width * Height * Count);
+	memset(Frames, 0, sizeof(Frames));
+
+	for (GD_DWORD i = 0; i < Count; ++i)
+	{
+		GD_BYTE* Frame = Indices + (size_t)Width * Height * i;
+		const GD_DWORD Runs = 1 + TestRandom() % 16;
+
+		for (size_t j = 0; j < (size_t)Width * Height; ++j)
+			Frame[j] = (GD_BYTE)((TestRandom() % Runs ? (j ? Frame[j - 1] : 0) : TestRandom()) % Palette.Count);
+
+		Frames[i].Width = Width;
+		Frames[i].Height = Height;
+		Frames[i].Indices = Frame;
+		Frames[i].DisposalMethod = (GD_DISPOSAL_METHOD)(TestRandom() % 4);
+		Frames[i].HasTransparency = (GD_BOOL)(TestRandom() % 2);
+		Frames[i].TransparentIndex = (GD_BYTE)(TestRandom() % Palette.Count);
+	}
+
+	GD_ENCODER_OPTIONS Options;
+	memset(&Options, 0, sizeof(Options));
+	Options.Width = Width;
+	Options.Height = Height;
+	Options.GlobalPalette = &Palette;
+
+	GD_BYTE* File = TestEncode(&Options, Frames, Count, Size);
+	free(Indices);
+
+	return File;
+}
+
+static void
+FuzzMutate(GD_BYTE* File, size_t* Size)
+{
+	const size_t Image = FuzzFindImage(File, *Size);
+
+	//
+	// Mostly hit the code width and the image data, sometimes the descriptor
+	//
+	const size_t First = (Image && TestRandom() % 4) ? Image + 9 : 6;
+
+	if (First >= *Size)
+		return;
+
+	const GD_DWORD Edits = 1 + TestRandom() % 8;
+
+	for (GD_DWORD i = 0; i < Edits; ++i)
+	{
+		const size_t At = First + TestRandom() % (*Size - First);
+
+		switch (TestRandom() % 4)
+		{
+			case 0: File[At] = (GD_BYTE)TestRandom(); break;
+			case 1: File[At] ^= (GD_BYTE)(1 << (TestRandom() % 8)); break;
+			case 2: File[At] = (GD_BYTE)(TestRandom() % 2 ? 0xFF : 0); break;
+			default: *Size = At + 1; return;
+		}
+	}
+}
+
+/// The longest strings a code can produce, cut short by the end of the image
+static void
+FuzzLongestStrings(void)
+{
+	const GD_WORD Width = 4096;
+	const GD_WORD Height = 2100;
+
+	GD_COLOR_TABLE Palette;
+	TestRandomPalette(&Palette, 2);
+
+	GD_BYTE* Indices = calloc((size_t)Width * Height, 1);
+
+	GD_ENCODER_FRAME Frame;
+	memset(&Frame, 0, sizeof(Frame));
+	Frame.Width = Width;
+	Frame.Height = Height;
+	Frame.Indices = Indices;
+
+	GD_ENCODER_OPTIONS EncoderOptions;
+	memset(&EncoderOptions, 0, sizeof(EncoderOptions));
+	EncoderOptions.Width = Width;
+	EncoderOptions.Height = Height;
+	EncoderOptions.GlobalPalette = &Palette;
+
+	size_t Size;
+	GD_BYTE* File = TestEncode(&EncoderOptions, &Frame, 1, &Size);
+	free(Indices);
+	TEST_CHECK(File != NULL);
+
+	const size_t Image = File ? FuzzFindImage(File, Size) : 0;
+	TEST_CHECK(Image != 0);
+
+	if (!Image)
+	{
+		free(File);
+		return;
+	}
+
+	//
+	// The first table fills up near 8.37M pixels, its last strings are ~4090 long.
+	// Narrowing the image a little each time makes it end at different points inside them
+	//
+	for (GD_DWORD k = 0; k < 8; ++k)
+	{
+		const GD_WORD RowWidth = (GD_WORD)(Width - 13 * k);
+		const GD_WORD Rows = (GD_WORD)((8300000 + 9000 * k) / RowWidth);
+
+		File[Image + 5] = (GD_BYTE)RowWidth;
+		File[Image + 6] = (GD_BYTE)(RowWidth >> 8);
+		File[Image + 7] = (GD_BYTE)Rows;
+		File[Image + 8] = (GD_BYTE)(Rows >> 8);
+
+		for (GD_DWORD Threads = 1; Threads <= 4; Threads += 3)
+		{
+			GD_DECODE_OPTIONS Options;
+			GD_InitDecodeOptions(&Options);
+			Options.Flags = GD_DECODE_KEEP_INDICES;
+			Options.Threads = Threads;
+
+			GD_ERR ErrorCode;
+			size_t ErrorBytePos;
+			GD_GIF_HANDLE Gif = GD_FromMemoryEx(File, Size, &Options, &ErrorCode, &ErrorBytePos);
+			TEST_CHECK(Gif != NULL);
+
+			if (Gif)
+			{
+				const GD_FRAME* Decoded = GD_GetFrame(Gif, 0);
+				size_t Zeros = 0;
+
+				for (size_t i = 0; i < (size_t)RowWidth * Rows; ++i)
+					Zeros += !Decoded->Indices[i];
+
+				TEST_CHECK(Zeros == (size_t)RowWidth * Rows);
+				GD_CloseGif(Gif);
+			}
+		}
+	}
+
+	free(File);
+}
+
+int
+main(int argc, char** argv)
+{
+	const GD_DWORD Iterations = argc > 1 ? (GD_DWORD)atol(argv[1]) : 400;
+	TestSeed = argc > 2 ? (GD_DWORD)atol(argv[2]) : 1;
+
+	FuzzLongestStrings();
+
+	GD_BYTE* Buffer = malloc(1 << 16);
+	GD_BYTE Payload[4096];
+
+	for (GD_DWORD Iteration = 0; Iteration < Iterations; ++Iteration)
+	{
+		size_t Size = 0;
+
+		if (TestRandom() % 2)
+		{
+			GD_BYTE* File = FuzzEncodeRandom(&Size);
+
+			if (!File || Size > (1 << 16))
+			{
+				free(File);
+				continue;
+			}
+
+			memcpy(Buffer, File, Size);
+			free(File);
+		}
+		else
+		{
+			//
+			// Random codes, biased towards low values so that strings get long
+			//
+			const size_t PayloadSize = TestRandom() % sizeof(Payload);
+
+			for (size_t i = 0; i < PayloadSize; ++i)
+				Payload[i] = (GD_BYTE)(TestRandom() % 3 ? TestRandom() % 4 : TestRandom());
+
+			Size = FuzzWrapImage(Buffer, (GD_WORD)(1 + TestRandom() % 300), (GD_WORD)(1 + TestRandom() % 300),
+			                     (GD_BYTE)(TestRandom() % 14), (GD_BOOL)(TestRandom() % 4 == 0), Payload, PayloadSize);
+		}
+
+		FuzzDecode(Buffer, Size);
+
+		FuzzMutate(Buffer, &Size);
+		FuzzDecode(Buffer, Size);
+	}
+
+	free(Buffer);
+
+	return TestReport("fuzz_lzw");
+}
+
+#endif
@@ -0,0 +1,290 @@
+#ifndef GD_TEST_H
+#define GD_TEST_H
+
+//
+// Helpers shared by the tests and benchmarks of this directory, see run.sh
+//
+
+#include "gd.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+
+static int TestFailures = 0;
+
+#define TEST_CHECK(Condition)                                                           \
+	do                                                                                  \
+	{                                                                                   \
+		if (!(Condition))                                                               \
+		{                                                                               \
+			fprintf(stderr, "%s:%d: check failed: %s\n", __FILE__, __LINE__, #Condition); \
+			++TestFailures;                                                             \
+		}                                                                               \
+	} while (0)
+
+
+static GD_DWORD TestSeed = 1;
+
+/// xorshift32, the same sequence on every platform
+static GD_DWORD
+TestRandom(void)
+{
+	TestSeed ^= TestSeed << 13;
+	TestSeed ^= TestSeed >> 17;
+	TestSeed ^= TestSeed << 5;
+
+	return TestSeed;
+}
+
+
+/// Wall clock time in seconds
+static double
+TestNow(void)
+{
+	struct timespec Now;
+	timespec_get(&Now, TIME_UTC);
+
+	return (double)Now.tv_sec + (double)Now.tv_nsec / 1e9;
+}
+
+
+static void
+TestRandomPalette(GD_COLOR_TABLE* Palette, GD_DWORD Count)
+{
+	Palette->Count = Count;
+
+	for (GD_DWORD i = 0; i < Count; ++i)
+	{
+		Palette->Internal[i].r = (GD_BYTE)TestRandom();
+		Palette->Internal[i].g = (GD_BYTE)TestRandom();
+		Palette->Internal[i].b = (GD_BYTE)TestRandom();
+	}
+}
+
+
+/// \brief Encode frames to a GIF file
+/// \return The file, to be released with free. NULL on failure
+static GD_BYTE*
+TestEncode(const GD_ENCODER_OPTIONS* Options, const GD_ENCODER_FRAME* Frames, GD_DWORD Count, size_t* Size)
+{
+	GD_ERR ErrorCode;
+	GD_ENCODER_HANDLE Encoder = GD_EncoderCreate(Options, &ErrorCode);
+
+	if (!Encoder)
+		return NULL;
+
+	const GD_BYTE* Data = NULL;
+	GD_BYTE* Copy = NULL;
+
+	if (GD_EncoderAddFrames(Encoder, Frames, Count) == GD_OK &&
+	    GD_EncoderFinish(Encoder, &Data, Size) == GD_OK)
+	{
+		Copy = malloc(*Size);
+
+		if (Copy)
+			memcpy(Copy, Data, *Size);
+	}
+
+	GD_EncoderDestroy(Encoder);
+
+	return Copy;
+}
+
+
+/// \brief Encode an animation of Count frames over random parts of the screen, with every
+///        disposal method, transparency, and now and then an opaque frame covering it all
+/// \return The file, to be released with free. NULL on failure
+static GD_BYTE*
+TestAnimation(GD_WORD Width, GD_WORD Height, GD_DWORD Count, size_t* Size)
+{
+	static const GD_DISPOSAL_METHOD Disposals[] =
+	{
+		GD_DISPOSAL_UNSPECIFIED, GD_DISPOSAL_NONE, GD_DISPOSAL_BACKGROUND, GD_DISPOSAL_PREVIOUS
+	};
+
+	GD_COLOR_TABLE Palette;
+	TestRandomPalette(&Palette, 16);
+
+	GD_ENCODER_FRAME* Frames = calloc(Count, sizeof(GD_ENCODER_FRAME));
+	GD_BYTE* Indices = malloc((size_t)Width * Height * Count);
+
+	if (!Frames || !Indices)
+	{
+		free(Frames);
+		free(Indices);
+		return NULL;
+	}
+
+	for (GD_DWORD i = 0; i < Count; ++i)
+	{
+		GD_ENCODER_FRAME* Frame = &Frames[i];
+
+		if (i && TestRandom() % 5 == 0)
+		{
+			Frame->Width = Width;
+			Frame->Height = Height;
+		}
+		else
+		{
+			Frame->Width = (GD_WORD)(1 + TestRandom() % Width);
+			Frame->Height = (GD_WORD)(1 + TestRandom() % Height);
+			Frame->Left = (GD_WORD)(TestRandom() % (Width - Frame->Width + 1));
+			Frame->Top = (GD_WORD)(TestRandom() % (Height - Frame->Height + 1));
+			Frame->HasTransparency = (GD_BOOL)(TestRandom() % 2);
+		}
+
+		Frame->DisposalMethod = Disposals[TestRandom() % 4];
+		Frame->DelayTime = (GD_WORD)(2 + TestRandom() % 20);
+		Frame->TransparentIndex = (GD_BYTE)(TestRandom() % Palette.Count);
+
+		//
+		// Runs of mean length 4, the transparent index as often as any other
+		//
+		GD_BYTE* FrameIndices = Indices + (size_t)Width * Height * i;
+		GD_BYTE Value = 0;
+
+		for (size_t p = 0; p < (size_t)Frame->Width * Frame->Height; ++p)
+		{
+			if (TestRandom() % 4 == 0)
+				Value = (GD_BYTE)(TestRandom() % Palette.Count);
+
+			FrameIndices[p] = Value;
+		}
+
+		//
+		// Some transparent frames only draw in their middle, what they draw is smaller
+		// than their region
+		//
+		if (Frame->HasTransparency && TestRandom() % 2)
+		{
+			const size_t MarginX = Frame->Width / 4;
+			const size_t MarginY = Frame->Height / 4;
+
+			for (size_t y = 0; y < Frame->Height; ++y)
+			{
+				for (size_t x = 0; x < Frame->Width; ++x)
+				{
+					if (y < MarginY || y + MarginY >= Frame->Height || x < MarginX || x + MarginX >= Frame->Width)
+						FrameIndices[y * Frame->Width + x] = Frame->TransparentIndex;
+				}
+			}
+		}
+
+		Frame->Indices = FrameIndices;
+	}
+
+	GD_ENCODER_OPTIONS Options;
+	memset(&Options, 0, sizeof(Options));
+	Options.Width = Width;
+	Options.Height = Height;
+	Options.GlobalPalette = &Palette;
+	Options.BgColorIndex = (GD_BYTE)(TestRandom() % Palette.Count);
+
+	GD_BYTE* File = TestEncode(&Options, Frames, Count, Size);
+
+	free(Indices);
+	free(Frames);
+
+	return File;
+}
+
+
+/// \brief Canvases of every frame of a handle, composed one after the other from frame 0
+/// \return FrameCount canvases, to be released with free. NULL on failure
+static GD_GIF_COLOR*
+TestReplay(GD_GIF_HANDLE Gif)
+{
+	GD_WORD Width, Height;
+
+	if (GD_GetCanvasSize(Gif, &Width, &Height) != GD_OK)
+		return NULL;
+
+	const size_t CanvasSize = (size_t)Width * Height;
+	GD_GIF_COLOR* Canvases = malloc(sizeof(GD_GIF_COLOR) * CanvasSize * GD_FrameCount(Gif));
+
+	for (GD_DWORD i = 0; Canvases && i < GD_FrameCount(Gif); ++i)
+	{
+		GD_ERR ErrorCode;
+		const GD_GIF_COLOR* Canvas = GD_ComposeFrame(Gif, i, &ErrorCode);
+
+		if (!Canvas)
+		{
+			free(Canvases);
+			return NULL;
+		}
+
+		memcpy(Canvases + CanvasSize * i, Canvas, sizeof(GD_GIF_COLOR) * CanvasSize);
+	}
+
+	return Canvases;
+}
+
+
+/// \brief Find the image data of the first image of a GIF file
+/// \param CodeWidth Receives the LZW minimum code size, can be NULL
+/// \return Offset of its first sub-block, 0 when File has no image
+static size_t
+TestFirstRaster(const GD_BYTE* File, size_t Size, GD_BYTE* CodeWidth)
+{
+	size_t Offset = 13;
+
+	if (Size < Offset)
+		return 0;
+
+	if (File[10] & 0x80)
+		Offset += 3 * (2 << (File[10] & 7));
+
+	while (Offset < Size)
+	{
+		const GD_BYTE Introducer = File[Offset++];
+
+		if (Introducer == 0x2C && Offset + 10 <= Size)
+		{
+			const GD_BYTE Fields = File[Offset + 8];
+			Offset += 9 + ((Fields & 0x80) ? 3 * (2 << (Fields & 7)) : 0);
+
+			if (Offset >= Size)
+				return 0;
+
+			if (CodeWidth)
+				*CodeWidth = File[Offset];
+
+			return Offset + 1;
+		}
+
+		if (Introducer != 0x21)
+			return 0;
+
+		//
+		// Extension label, then its sub-blocks
+		//
+		++Offset;
+
+		while (Offset < Size && File[Offset])
+			Offset += 1 + File[Offset];
+
+		++Offset;
+	}
+
+	return 0;
+}
+
+
+/// \brief Print the outcome of a test program
+/// \return Exit code of the program
+static int
+TestReport(const char* Name)
+{
+	if (TestFailures)
+	{
+		printf("%s: %d check(s) failed\n", Name, TestFailures);
+		return 1;
+	}
+
+	printf("%s: ok\n", Name);
+	return 0;
+}
+
+#endif
@@ -0,0 +1,52 @@
+#!/bin/sh
+#
+# Builds and runs the tests against ../gd.c, under AddressSanitizer and UndefinedBehaviorSanitizer,
+# once as is and once without the SSE2 paths.
+#
+#   ./run.sh          run every test_*.c and a short pass of every fuzz_*.c
+#   ./run.sh bench    build the bench_*.c programs with optimizations and run them
+#
+# Programs reaching internal routines include gd.c themselves and are not linked with it.
+# CC and CFLAGS can be overridden from the environment.
+#
+
+set -e
+
+cd "$(dirname "$0")"
+mkdir -p build
+
+CC=${CC:-cc}
+CFLAGS=${CFLAGS:-"-std=c11 -Wall -Wextra -Wno-unused-function"}
+LIBS="-lm -lpthread"
+
+if [ "$1" = "bench" ]; then
+	for Source in bench_*.c; do
+		Program=build/${Source%.c}
+
+		Library=../gd.c
+		grep -q '^#include "gd.c"' "$Source" && Library=
+
+		$CC $CFLAGS -O2 -DNDEBUG -I.. $Library "$Source" -o "$Program" $LIBS
+		"$Program"
+	done
+	exit 0
+fi
+
+SANITIZE="-O1 -g -fsanitize=address,undefined -fno-sanitize-recover=undefined"
+
+for Variant in default nosse2; do
+	Extra=
+	[ "$Variant" = "nosse2" ] && Extra="-U__SSE2__"
+
+	for Source in test_*.c fuzz_*.c; do
+		[ -f "$Source" ] || continue
+
+		Program=build/${Source%.c}-$Variant
+
+		Library=../gd.c
+		grep -q '^#include "gd.c"' "$Source" && Library=
+
+		$CC $CFLAGS $SANITIZE $Extra -I.. $Library "$Source" -o "$Program" $LIBS
+		"$Program"
+	done
+done
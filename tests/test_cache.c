@@ -0,0 +1,328 @@
+#include "gd_test.h"
+
+//
+// Handles decoded with GD_DECODE_COMPRESS_FRAMES share a GD_FRAME_CACHE: frames of both
+// count against one budget, the least recently used one goes first whatever handle holds
+// it, and closing a handle takes its frames out without counting them as evictions. The
+// frames handed out must be the ones of a handle decoded without a compressed store
+//
+
+#define SCREEN_WIDTH  40
+#define SCREEN_HEIGHT 30
+#define FRAME_COUNT   6
+
+#define PIXEL_COUNT ((size_t)SCREEN_WIDTH * SCREEN_HEIGHT)
+
+typedef struct CACHE_FILE
+{
+	GD_BYTE* File;
+	size_t Size;
+
+	// Decoded without a compressed store
+	GD_GIF_HANDLE Reference;
+} CACHE_FILE;
+
+/// Full screen opaque frames of noise, none of them a duplicate of another
+static GD_BOOL
+MakeFile(CACHE_FILE* File)
+{
+	GD_COLOR_TABLE Palette;
+	TestRandomPalette(&Palette, 16);
+
+	GD_ENCODER_FRAME Frames[FRAME_COUNT];
+	GD_BYTE* Indices = malloc(PIXEL_COUNT * FRAME_COUNT);
+
+	if (!Indices)
+		return GD_FALSE;
+
+	memset(Frames, 0, sizeof(Frames));
+
+	for (GD_DWORD i = 0; i < FRAME_COUNT; ++i)
+	{
+		for (size_t p = 0; p < PIXEL_COUNT; ++p)
+			Indices[PIXEL_COUNT * i + p] = (GD_BYTE)(TestRandom() % Palette.Count);
+
+		Frames[i].Width = SCREEN_WIDTH;
+		Frames[i].Height = SCREEN_HEIGHT;
+		Frames[i].Indices = Indices + PIXEL_COUNT * i;
+		Frames[i].DisposalMethod = GD_DISPOSAL_NONE;
+		Frames[i].DelayTime = 10;
+	}
+
+	GD_ENCODER_OPTIONS Options;
+	memset(&Options, 0, sizeof(Options));
+	Options.Width = SCREEN_WIDTH;
+	Options.Height = SCREEN_HEIGHT;
+	Options.GlobalPalette = &Palette;
+
+	File->File = TestEncode(&Options, Frames, FRAME_COUNT, &File->Size);
+	free(Indices);
+
+	if (!File->File)
+		return GD_FALSE;
+
+	GD_ERR ErrorCode;
+	size_t ErrorBytePos;
+	File->Reference = GD_FromMemory(File->File, File->Size, &ErrorCode, &ErrorBytePos);
+
+	return File->Reference ? GD_TRUE : GD_FALSE;
+}
+
+static GD_GIF_HANDLE
+Open(const CACHE_FILE* File, GD_DWORD Flags, GD_FRAME_CACHE_HANDLE Cache, size_t CacheBudget, GD_WORD WorkingSet)
+{
+	GD_DECODE_OPTIONS Options;
+	GD_InitDecodeOptions(&Options);
+	Options.Flags = GD_DECODE_COMPRESS_FRAMES | Flags;
+	Options.FrameCache = Cache;
+	Options.CacheBudget = CacheBudget;
+	Options.WorkingSet = WorkingSet;
+
+	GD_ERR ErrorCode;
+	size_t ErrorBytePos;
+	GD_GIF_HANDLE Gif = GD_FromMemoryEx(File->File, File->Size, &Options, &ErrorCode, &ErrorBytePos);
+	TEST_CHECK(Gif != NULL);
+
+	if (Gif)
+	{
+		TEST_CHECK(GD_FrameCount(Gif) == FRAME_COUNT);
+		TEST_CHECK(GD_GetFrameCache(Gif) != NULL);
+		TEST_CHECK(!Cache || GD_GetFrameCache(Gif) == Cache);
+	}
+
+	return Gif;
+}
+
+/// Ask Gif for a frame and compare it with the one of the reference handle
+static void
+Get(GD_GIF_HANDLE Gif, const CACHE_FILE* File, GD_DWORD FrameIndex)
+{
+	const GD_FRAME* Frame = GD_GetFrame(Gif, FrameIndex);
+	const GD_FRAME* Expected = GD_GetFrame(File->Reference, FrameIndex);
+	TEST_CHECK(Frame != NULL && Frame->Buffer != NULL);
+
+	if (Frame && Frame->Buffer && memcmp(Frame->Buffer, Expected->Buffer, sizeof(GD_GIF_COLOR) * PIXEL_COUNT))
+	{
+		fprintf(stderr, "frame %u: expanded buffer differs\n", (unsigned)FrameIndex);
+		TEST_CHECK(!"expanded frame differs");
+	}
+}
+
+static GD_BOOL
+Resident(GD_GIF_HANDLE Gif, GD_DWORD FrameIndex)
+{
+	GD_FRAME_COST Cost;
+	TEST_CHECK(GD_GetFrameCost(Gif, FrameIndex, &Cost) == GD_OK);
+
+	return Cost.Resident;
+}
+
+static void
+CheckStats(GD_FRAME_CACHE_HANDLE Cache, size_t FrameBytes, GD_DWORD FrameCount, GD_QWORD Hits, GD_QWORD Misses, GD_QWORD Evictions)
+{
+	GD_FRAME_CACHE_STATS Stats;
+	TEST_CHECK(GD_GetFrameCacheStats(Cache, &Stats) == GD_OK);
+
+	if (Stats.FrameCount != FrameCount || Stats.Size != FrameBytes * FrameCount ||
+	    Stats.Hits != Hits || Stats.Misses != Misses || Stats.Evictions != Evictions)
+	{
+		fprintf(stderr, "cache holds %u frames in %zu bytes, %llu hits %llu misses %llu evictions,"
+		        " expected %u frames %llu %llu %llu\n",
+		        (unsigned)Stats.FrameCount, Stats.Size, (unsigned long long)Stats.Hits,
+		        (unsigned long long)Stats.Misses, (unsigned long long)Stats.Evictions,
+		        (unsigned)FrameCount, (unsigned long long)Hits, (unsigned long long)Misses, (unsigned long long)Evictions);
+		TEST_CHECK(!"cache stats differ");
+	}
+}
+
+/// Two handles in a cache of three frames, going through a planned order of requests
+static void
+CheckShared(const CACHE_FILE* Files, GD_DWORD Flags)
+{
+	const size_t FrameBytes = PIXEL_COUNT * (sizeof(GD_GIF_COLOR) + ((Flags & GD_DECODE_KEEP_INDICES) ? 1 : 0));
+
+	GD_FRAME_CACHE_HANDLE Cache = GD_CreateFrameCache(3 * FrameBytes, 0);
+	TEST_CHECK(Cache != NULL);
+
+	if (!Cache)
+		return;
+
+	GD_GIF_HANDLE A = Open(&Files[0], Flags, Cache, 0, 0);
+	GD_GIF_HANDLE B = Open(&Files[1], Flags, Cache, 0, 0);
+
+	if (A && B)
+	{
+		// Nothing is expanded until asked for
+		CheckStats(Cache, FrameBytes, 0, 0, 0, 0);
+
+		Get(A, &Files[0], 0);
+		CheckStats(Cache, FrameBytes, 1, 0, 1, 0);
+
+		Get(A, &Files[0], 0);
+		CheckStats(Cache, FrameBytes, 1, 1, 1, 0);
+
+		Get(B, &Files[1], 0);
+		Get(B, &Files[1], 1);
+		CheckStats(Cache, FrameBytes, 3, 1, 3, 0);
+
+		//
+		// Full, the frame of A asked for first goes out before the ones of B
+		//
+		Get(A, &Files[0], 1);
+		CheckStats(Cache, FrameBytes, 3, 1, 4, 1);
+		TEST_CHECK(!Resident(A, 0) && Resident(B, 0) && Resident(B, 1) && Resident(A, 1));
+
+		Get(A, &Files[0], 0);
+		CheckStats(Cache, FrameBytes, 3, 1, 5, 2);
+		TEST_CHECK(!Resident(B, 0) && Resident(B, 1) && Resident(A, 1) && Resident(A, 0));
+
+		//
+		// A hit makes B1 the most recently used, A1 is the oldest now
+		//
+		Get(B, &Files[1], 1);
+		Get(B, &Files[1], 2);
+		CheckStats(Cache, FrameBytes, 3, 2, 6, 3);
+		TEST_CHECK(!Resident(A, 1) && Resident(A, 0) && Resident(B, 1) && Resident(B, 2));
+
+		//
+		// Closing B leaves A0 alone, and is not counted as evicting anything
+		//
+		GD_CloseGif(B);
+		B = NULL;
+		CheckStats(Cache, FrameBytes, 1, 2, 6, 3);
+		TEST_CHECK(Resident(A, 0));
+
+		//
+		// Every frame of A in turn, A0 is a hit and each one after A2 pushes one out
+		//
+		for (GD_DWORD i = 0; i < FRAME_COUNT; ++i)
+			Get(A, &Files[0], i);
+
+		CheckStats(Cache, FrameBytes, 3, 3, 6 + FRAME_COUNT - 1, 3 + FRAME_COUNT - 3);
+
+		GD_CloseGif(A);
+		A = NULL;
+		CheckStats(Cache, FrameBytes, 0, 3, 6 + FRAME_COUNT - 1, 3 + FRAME_COUNT - 3);
+	}
+
+	if (A)
+		GD_CloseGif(A);
+
+	if (B)
+		GD_CloseGif(B);
+
+	GD_DestroyFrameCache(Cache);
+}
+
+/// Both handles in a cache limited to MaxFrames frames, or to a budget of ByteBudget bytes,
+/// asked for random frames. Whatever goes in beyond the limit pushes one out
+static void
+CheckLimits(const CACHE_FILE* Files, size_t ByteBudget, GD_DWORD MaxFrames, GD_DWORD Held)
+{
+	const size_t FrameBytes = PIXEL_COUNT * sizeof(GD_GIF_COLOR);
+
+	GD_FRAME_CACHE_HANDLE Cache = GD_CreateFrameCache(ByteBudget, MaxFrames);
+	TEST_CHECK(Cache != NULL);
+
+	if (!Cache)
+		return;
+
+	GD_GIF_HANDLE Gifs[2];
+	Gifs[0] = Open(&Files[0], 0, Cache, 0, 0);
+	Gifs[1] = Open(&Files[1], 0, Cache, 0, 0);
+
+	if (Gifs[0] && Gifs[1])
+	{
+		GD_FRAME_CACHE_STATS Stats;
+
+		for (int i = 0; i < 20 * FRAME_COUNT; ++i)
+		{
+			const int h = (int)(TestRandom() % 2);
+			Get(Gifs[h], &Files[h], TestRandom() % FRAME_COUNT);
+
+			TEST_CHECK(GD_GetFrameCacheStats(Cache, &Stats) == GD_OK);
+			TEST_CHECK(Stats.FrameCount <= Held && Stats.Size == FrameBytes * Stats.FrameCount);
+			TEST_CHECK(Stats.Hits + Stats.Misses == (GD_QWORD)i + 1);
+			TEST_CHECK(Stats.Evictions + Stats.FrameCount == Stats.Misses);
+		}
+
+		TEST_CHECK(Stats.FrameCount == Held);
+		TEST_CHECK(Held == 2 * FRAME_COUNT || Stats.Evictions > 0);
+	}
+
+	for (int h = 0; h < 2; ++h)
+	{
+		if (Gifs[h])
+			GD_CloseGif(Gifs[h]);
+	}
+
+	GD_DestroyFrameCache(Cache);
+}
+
+/// Handle with a cache of its own, from CacheBudget and WorkingSet
+static void
+CheckOwnCache(const CACHE_FILE* File, size_t CacheBudget, GD_WORD WorkingSet, GD_DWORD Held)
+{
+	GD_GIF_HANDLE Gif = Open(File, 0, NULL, CacheBudget, WorkingSet);
+
+	if (!Gif)
+		return;
+
+	for (int Pass = 0; Pass < 2; ++Pass)
+	{
+		for (GD_DWORD i = 0; i < FRAME_COUNT; ++i)
+			Get(Gif, File, i);
+	}
+
+	//
+	// Going through all frames twice with fewer held, every request is a miss
+	//
+	const GD_QWORD Misses = (Held < FRAME_COUNT) ? 2 * FRAME_COUNT : FRAME_COUNT;
+	CheckStats(GD_GetFrameCache(Gif), PIXEL_COUNT * sizeof(GD_GIF_COLOR), Held, 2 * FRAME_COUNT - Misses, Misses, Misses - Held);
+
+	GD_CloseGif(Gif);
+}
+
+int
+main(void)
+{
+	const size_t FrameBytes = PIXEL_COUNT * sizeof(GD_GIF_COLOR);
+
+	CACHE_FILE Files[2];
+	memset(Files, 0, sizeof(Files));
+
+	const GD_BOOL Made = MakeFile(&Files[0]) && MakeFile(&Files[1]);
+	TEST_CHECK(Made);
+
+	if (Made)
+	{
+		// Without a compressed store there is no cache
+		TEST_CHECK(GD_GetFrameCache(Files[0].Reference) == NULL);
+
+		CheckShared(Files, 0);
+		CheckShared(Files, GD_DECODE_KEEP_INDICES);
+
+		CheckLimits(Files, 0, 2, 2);
+		CheckLimits(Files, 5 * FrameBytes, 0, 5);
+		CheckLimits(Files, 5 * FrameBytes - 1, 0, 4);
+		CheckLimits(Files, 0, 0, 2 * FRAME_COUNT);
+
+		// Each frame is over the budget, it is kept alone
+		CheckLimits(Files, FrameBytes / 2, 0, 1);
+
+		CheckOwnCache(&Files[0], 0, 0, 4);
+		CheckOwnCache(&Files[0], 0, 3, 3);
+		CheckOwnCache(&Files[0], 2 * FrameBytes, 0, 2);
+		CheckOwnCache(&Files[0], 0, FRAME_COUNT, FRAME_COUNT);
+	}
+
+	for (int i = 0; i < 2; ++i)
+	{
+		if (Files[i].Reference)
+			GD_CloseGif(Files[i].Reference);
+
+		free(Files[i].File);
+	}
+
+	return TestReport("cache");
+}
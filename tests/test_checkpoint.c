@@ -0,0 +1,215 @@
+//
+// Seeks of GD_ComposeFrame that restore a checkpoint must give what a replay from frame 0
+// gives: backwards, back and forth, and from checkpoints right after frames restoring the
+// previous canvas. Includes gd.c to check how many snapshots the memory budget allows
+//
+#include "gd.c"
+#include "gd_test.h"
+
+#define SCREEN_WIDTH  48
+#define SCREEN_HEIGHT 40
+#define FRAME_COUNT   50
+
+#define CANVAS_BYTES (sizeof(GD_GIF_COLOR) * SCREEN_WIDTH * SCREEN_HEIGHT)
+
+static void
+CheckSeek(GD_GIF_HANDLE Gif, const GD_GIF_COLOR* Canvases, GD_DWORD FrameIndex)
+{
+	GD_ERR ErrorCode;
+	const GD_GIF_COLOR* Canvas = GD_ComposeFrame(Gif, FrameIndex, &ErrorCode);
+	TEST_CHECK(Canvas != NULL);
+
+	if (Canvas && memcmp(Canvas, Canvases + (size_t)SCREEN_WIDTH * SCREEN_HEIGHT * FrameIndex, CANVAS_BYTES))
+	{
+		fprintf(stderr, "interval %u: seek to %u differs\n", (unsigned)Gif->CheckpointInterval, (unsigned)FrameIndex);
+		TEST_CHECK(!"seek differs from a replay");
+	}
+}
+
+/// Snapshots held by Gif
+static GD_DWORD
+CountSnapshots(GD_GIF_HANDLE Gif)
+{
+	GD_DWORD Count = 0;
+
+	for (GD_DWORD Slot = 0; Slot < Gif->CheckpointCount; ++Slot)
+		Count += Gif->Checkpoints[Slot] ? 1 : 0;
+
+	return Count;
+}
+
+static void
+CheckSeeks(GD_GIF_HANDLE Gif, const GD_GIF_COLOR* Canvases)
+{
+	//
+	// Backwards from the end, the first seek goes through every checkpoint
+	//
+	for (GD_DWORD i = FRAME_COUNT; i-- > 0;)
+		CheckSeek(Gif, Canvases, i);
+
+	TEST_CHECK(CountSnapshots(Gif) == Gif->CheckpointCount);
+
+	//
+	// Back and forth between both ends, closing in
+	//
+	for (GD_DWORD i = 0; i < FRAME_COUNT / 2; ++i)
+	{
+		CheckSeek(Gif, Canvases, i);
+		CheckSeek(Gif, Canvases, FRAME_COUNT - 1 - i);
+	}
+
+	//
+	// Each checkpoint, and the frames right before and after it. Frames at odd indices
+	// restore the previous canvas, many checkpoints are taken right after one
+	//
+	for (GD_DWORD Slot = Gif->CheckpointCount; Slot > 0; --Slot)
+	{
+		const GD_DWORD Checkpoint = Slot * Gif->CheckpointInterval;
+
+		CheckSeek(Gif, Canvases, Checkpoint);
+		CheckSeek(Gif, Canvases, Checkpoint - 1);
+
+		if (Checkpoint + 1 < FRAME_COUNT)
+			CheckSeek(Gif, Canvases, Checkpoint + 1);
+	}
+
+	for (int i = 0; i < 2 * FRAME_COUNT; ++i)
+		CheckSeek(Gif, Canvases, TestRandom() % FRAME_COUNT);
+}
+
+/// Animation where every frame at an odd index restores the previous canvas
+static GD_BYTE*
+MakeFile(size_t* Size)
+{
+	GD_BYTE* File = TestAnimation(SCREEN_WIDTH, SCREEN_HEIGHT, FRAME_COUNT, Size);
+
+	if (!File)
+		return NULL;
+
+	//
+	// Rewrite the disposal method of the Graphic Control Extensions in place, walking
+	// the blocks after the global color table
+	//
+	size_t Offset = 13 + ((File[10] & 0x80) ? 3 * (2 << (File[10] & 7)) : 0);
+	GD_DWORD FrameIndex = 0;
+
+	while (Offset < *Size && File[Offset] != 0x3B)
+	{
+		if (File[Offset] == 0x21)
+		{
+			if (File[Offset + 1] == 0xF9 && FrameIndex++ % 2)
+				File[Offset + 3] = (GD_BYTE)((File[Offset + 3] & ~0x1C) | (GD_DISPOSAL_PREVIOUS << 2));
+
+			Offset += 2;
+		}
+		else
+		{
+			const GD_BYTE Fields = File[Offset + 9];
+			Offset += 10 + ((Fields & 0x80) ? 3 * (2 << (Fields & 7)) : 0) + 1;
+		}
+
+		while (Offset < *Size && File[Offset])
+			Offset += 1 + File[Offset];
+
+		++Offset;
+	}
+
+	return File;
+}
+
+int
+main(void)
+{
+	const GD_DWORD FlagSets[] = { 0, GD_DECODE_COMPRESS_FRAMES };
+	const GD_DWORD Intervals[] = { 1, 2, 3, 7, FRAME_COUNT - 1 };
+
+	size_t Size;
+	GD_BYTE* File = MakeFile(&Size);
+	TEST_CHECK(File != NULL);
+
+	if (!File)
+		return TestReport("checkpoint");
+
+	for (size_t f = 0; f < sizeof(FlagSets) / sizeof(FlagSets[0]); ++f)
+	{
+		GD_DECODE_OPTIONS Options;
+		GD_InitDecodeOptions(&Options);
+		Options.Flags = FlagSets[f];
+
+		GD_ERR ErrorCode;
+		size_t ErrorBytePos;
+		GD_GIF_HANDLE Replayed = GD_FromMemoryEx(File, Size, &Options, &ErrorCode, &ErrorBytePos);
+		GD_GIF_COLOR* Canvases = Replayed ? TestReplay(Replayed) : NULL;
+		TEST_CHECK(Canvases != NULL);
+
+		if (Replayed)
+		{
+			TEST_CHECK(GD_FrameCount(Replayed) == FRAME_COUNT);
+			TEST_CHECK(GD_GetFrame(Replayed, 1)->DisposalMethod == GD_DISPOSAL_PREVIOUS);
+			GD_CloseGif(Replayed);
+		}
+
+		if (!Canvases)
+			continue;
+
+		for (size_t i = 0; i < sizeof(Intervals) / sizeof(Intervals[0]); ++i)
+		{
+			GD_GIF_HANDLE Gif = GD_FromMemoryEx(File, Size, &Options, &ErrorCode, &ErrorBytePos);
+			TEST_CHECK(Gif != NULL);
+
+			if (!Gif)
+				continue;
+
+			TEST_CHECK(GD_SetCheckpointPolicy(Gif, Intervals[i], 0) == GD_OK);
+			TEST_CHECK(Gif->CheckpointInterval == Intervals[i]);
+			TEST_CHECK(Gif->CheckpointCount == (FRAME_COUNT - 1) / Intervals[i]);
+
+			CheckSeeks(Gif, Canvases);
+			GD_CloseGif(Gif);
+		}
+
+		//
+		// A budget of Snapshots canvases, or one byte short of it: the interval is the
+		// smallest whose snapshots fit, and seeking everywhere never keeps more
+		//
+		for (GD_DWORD Snapshots = 0; Snapshots <= FRAME_COUNT; Snapshots += 1 + Snapshots / 2)
+		{
+			for (int Short = 0; Short < 2; ++Short)
+			{
+				const size_t Budget = CANVAS_BYTES * Snapshots - (Short && Snapshots ? 1 : 0);
+
+				if (!Budget)
+					continue;
+
+				GD_GIF_HANDLE Gif = GD_FromMemoryEx(File, Size, &Options, &ErrorCode, &ErrorBytePos);
+				TEST_CHECK(Gif != NULL);
+
+				if (!Gif)
+					continue;
+
+				TEST_CHECK(GD_SetCheckpointPolicy(Gif, 1, Budget) == GD_OK);
+
+				const GD_DWORD Interval = Gif->CheckpointInterval;
+				const size_t Fit = Budget / CANVAS_BYTES;
+
+				TEST_CHECK(Gif->CheckpointCount * CANVAS_BYTES <= Budget);
+				TEST_CHECK(Interval == 0 || Gif->CheckpointCount == (FRAME_COUNT - 1) / Interval);
+
+				// One frame less between snapshots would need more than the budget
+				TEST_CHECK(Fit == 0 || Interval == 1 || (FRAME_COUNT - 1) / (Interval - 1) > Fit);
+				TEST_CHECK((Fit == 0) == (Interval == 0));
+
+				CheckSeeks(Gif, Canvases);
+				TEST_CHECK(CountSnapshots(Gif) * CANVAS_BYTES <= Budget);
+
+				GD_CloseGif(Gif);
+			}
+		}
+
+		free(Canvases);
+	}
+
+	free(File);
+
+	return TestReport("checkpoint");
+}
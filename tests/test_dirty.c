@@ -0,0 +1,169 @@
+#include "gd_test.h"
+
+//
+// A viewer copying only the rectangles of GD_GetDirtyRects into its own canvas must end up
+// with the composed canvas after every call: going forward through every disposal method,
+// seeking anywhere, and sampling. With room for a single rectangle, it must bound them all
+//
+
+#define SCREEN_WIDTH  56
+#define SCREEN_HEIGHT 44
+#define FRAME_COUNT   40
+
+typedef struct SHADOW
+{
+	GD_GIF_HANDLE Gif;
+
+	// Copies made from the reported rectangles, with all the slots and with one
+	GD_GIF_COLOR Canvas[2][SCREEN_WIDTH * SCREEN_HEIGHT];
+} SHADOW;
+
+static void
+ApplyRects(GD_GIF_COLOR* Shadow, const GD_GIF_COLOR* Canvas, const GD_RECT* Rects, GD_DWORD Count)
+{
+	for (GD_DWORD r = 0; r < Count; ++r)
+	{
+		const GD_RECT* Rect = &Rects[r];
+
+		TEST_CHECK(Rect->Left + Rect->Width <= SCREEN_WIDTH && Rect->Top + Rect->Height <= SCREEN_HEIGHT);
+
+		if (Rect->Left + Rect->Width > SCREEN_WIDTH || Rect->Top + Rect->Height > SCREEN_HEIGHT)
+			continue;
+
+		for (size_t y = Rect->Top; y < (size_t)Rect->Top + Rect->Height; ++y)
+			memcpy(Shadow + y * SCREEN_WIDTH + Rect->Left, Canvas + y * SCREEN_WIDTH + Rect->Left, sizeof(GD_GIF_COLOR) * Rect->Width);
+	}
+}
+
+/// Bring both shadows up to date with Canvas, the last composed one of Shadow->Gif
+static void
+CheckCanvas(SHADOW* Shadow, const GD_GIF_COLOR* Canvas, GD_DWORD FrameIndex)
+{
+	GD_RECT Rects[GD_MAX_DIRTY_RECTS];
+	GD_DWORD Count = 0;
+
+	TEST_CHECK(GD_GetDirtyRects(Shadow->Gif, Rects, GD_MAX_DIRTY_RECTS, &Count) == GD_OK);
+	TEST_CHECK(Count <= GD_MAX_DIRTY_RECTS);
+	ApplyRects(Shadow->Canvas[0], Canvas, Rects, Count);
+
+	TEST_CHECK(GD_GetDirtyRects(Shadow->Gif, Rects, 1, &Count) == GD_OK);
+	TEST_CHECK(Count <= 1);
+	ApplyRects(Shadow->Canvas[1], Canvas, Rects, Count);
+
+	for (int s = 0; s < 2; ++s)
+	{
+		if (memcmp(Shadow->Canvas[s], Canvas, sizeof(Shadow->Canvas[s])))
+		{
+			fprintf(stderr, "frame %u (disposal %d): %s shadow differs\n", (unsigned)FrameIndex,
+			        (int)GD_GetFrame(Shadow->Gif, FrameIndex)->DisposalMethod, s ? "single rectangle" : "full");
+			TEST_CHECK(!"shadow canvas differs");
+
+			memcpy(Shadow->Canvas[s], Canvas, sizeof(Shadow->Canvas[s]));
+		}
+	}
+}
+
+static void
+Compose(SHADOW* Shadow, GD_DWORD FrameIndex)
+{
+	GD_ERR ErrorCode;
+	const GD_GIF_COLOR* Canvas = GD_ComposeFrame(Shadow->Gif, FrameIndex, &ErrorCode);
+	TEST_CHECK(Canvas != NULL);
+
+	if (Canvas)
+		CheckCanvas(Shadow, Canvas, FrameIndex);
+}
+
+static void
+CheckSample(const GD_SAMPLE* Sample, void* UserData)
+{
+	CheckCanvas((SHADOW*)UserData, Sample->Pixels, Sample->FrameIndex);
+}
+
+static void
+CheckDirty(GD_DWORD Flags, GD_DWORD Interval)
+{
+	size_t Size;
+	GD_BYTE* File = TestAnimation(SCREEN_WIDTH, SCREEN_HEIGHT, FRAME_COUNT, &Size);
+	TEST_CHECK(File != NULL);
+
+	if (!File)
+		return;
+
+	GD_DECODE_OPTIONS Options;
+	GD_InitDecodeOptions(&Options);
+	Options.Flags = Flags;
+
+	GD_ERR ErrorCode;
+	size_t ErrorBytePos;
+
+	SHADOW* Shadow = malloc(sizeof(SHADOW));
+	TEST_CHECK(Shadow != NULL);
+
+	if (Shadow)
+	{
+		Shadow->Gif = GD_FromMemoryEx(File, Size, &Options, &ErrorCode, &ErrorBytePos);
+		TEST_CHECK(Shadow->Gif != NULL);
+	}
+
+	if (Shadow && Shadow->Gif)
+	{
+		GD_GIF_HANDLE Gif = Shadow->Gif;
+
+		// Nothing a viewer could start from, the first canvas must be reported whole
+		memset(Shadow->Canvas, 0xA5, sizeof(Shadow->Canvas));
+
+		TEST_CHECK(GD_SetCheckpointPolicy(Gif, Interval, 0) == GD_OK);
+
+		//
+		// Every disposal method shows up, each one is checked when the next frame is drawn
+		//
+		GD_DWORD Seen = 0;
+
+		for (GD_DWORD i = 0; i + 1 < GD_FrameCount(Gif); ++i)
+			Seen |= 1u << (GD_GetFrame(Gif, i)->DisposalMethod & 7);
+
+		TEST_CHECK((Seen & (1u << GD_DISPOSAL_NONE)) && (Seen & (1u << GD_DISPOSAL_BACKGROUND)) && (Seen & (1u << GD_DISPOSAL_PREVIOUS)));
+
+		for (GD_DWORD i = 0; i < FRAME_COUNT; ++i)
+			Compose(Shadow, i);
+
+		// Twice the same frame, nothing changed
+		Compose(Shadow, FRAME_COUNT - 1);
+
+		for (GD_DWORD i = FRAME_COUNT; i-- > 0;)
+			Compose(Shadow, i);
+
+		for (int i = 0; i < 2 * FRAME_COUNT; ++i)
+			Compose(Shadow, TestRandom() % FRAME_COUNT);
+
+		GD_DWORD Timestamps[FRAME_COUNT];
+
+		for (GD_DWORD i = 0; i < FRAME_COUNT; ++i)
+			Timestamps[i] = i * 150 + TestRandom() % 100;
+
+		TEST_CHECK(GD_SampleFrames(Gif, Timestamps, FRAME_COUNT, CheckSample, Shadow) == GD_OK);
+
+		GD_CloseGif(Gif);
+	}
+
+	free(Shadow);
+	free(File);
+}
+
+int
+main(void)
+{
+	const GD_DWORD FlagSets[] = { 0, GD_DECODE_KEEP_INDICES, GD_DECODE_COMPRESS_FRAMES };
+
+	for (int Round = 0; Round < 4; ++Round)
+	{
+		for (size_t f = 0; f < sizeof(FlagSets) / sizeof(FlagSets[0]); ++f)
+		{
+			CheckDirty(FlagSets[f], 0);
+			CheckDirty(FlagSets[f], 5);
+		}
+	}
+
+	return TestReport("dirty");
+}
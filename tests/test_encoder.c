@@ -0,0 +1,184 @@
+#include "gd_test.h"
+
+//
+// Random frames written by the encoder must decode back to the same indices, colors
+// and graphic controls, whatever the palette size, Thorough and the thread count
+//
+
+#define FRAME_COUNT 40
+
+static void
+RoundTrip(GD_DWORD Colors, GD_BOOL Thorough, GD_DWORD Threads)
+{
+	const GD_WORD Width = (GD_WORD)(100 + TestRandom() % 300);
+	const GD_WORD Height = (GD_WORD)(100 + TestRandom() % 200);
+
+	GD_COLOR_TABLE Global;
+	TestRandomPalette(&Global, Colors);
+
+	GD_COLOR_TABLE Locals[FRAME_COUNT];
+	GD_ENCODER_FRAME Frames[FRAME_COUNT];
+	memset(Frames, 0, sizeof(Frames));
+
+	for (int i = 0; i < FRAME_COUNT; ++i)
+	{
+		GD_ENCODER_FRAME* Frame = &Frames[i];
+		GD_DWORD Count = Colors;
+
+		//
+		// Some frames bring a table of their own, of another size
+		//
+		if (TestRandom() % 4 == 0)
+		{
+			Count = 1 + TestRandom() % Colors;
+			TestRandomPalette(&Locals[i], Count);
+			Frame->Palette = &Locals[i];
+		}
+
+		Frame->Width = (GD_WORD)(1 + TestRandom() % Width);
+		Frame->Height = (GD_WORD)(1 + TestRandom() % Height);
+		Frame->Left = (GD_WORD)(TestRandom() % (Width - Frame->Width + 1));
+		Frame->Top = (GD_WORD)(TestRandom() % (Height - Frame->Height + 1));
+		Frame->DisposalMethod = (GD_DISPOSAL_METHOD)(TestRandom() % 4);
+		Frame->DelayTime = (GD_WORD)(TestRandom() % 500);
+		Frame->HasTransparency = (GD_BOOL)(TestRandom() % 2);
+		Frame->TransparentIndex = (GD_BYTE)(TestRandom() % Count);
+
+		//
+		// Noise, short runs or long runs: strings of every length, tables filling up or not
+		//
+		const size_t Pixels = (size_t)Frame->Width * Frame->Height;
+		const GD_DWORD Style = TestRandom() % 3;
+		GD_BYTE* Indices = malloc(Pixels);
+		GD_BYTE Value = 0;
+
+		for (size_t p = 0; p < Pixels; ++p)
+		{
+			if (Style == 0 || TestRandom() % (Style == 1 ? 4 : 40) == 0)
+				Value = (GD_BYTE)(TestRandom() % Count);
+
+			Indices[p] = Value;
+		}
+
+		Frame->Indices = Indices;
+	}
+
+	GD_ENCODER_OPTIONS Options;
+	memset(&Options, 0, sizeof(Options));
+	Options.Width = Width;
+	Options.Height = Height;
+	Options.GlobalPalette = &Global;
+	Options.BgColorIndex = (GD_BYTE)(TestRandom() % Colors);
+	Options.Threads = Threads;
+	Options.Thorough = Thorough;
+
+	GD_ERR ErrorCode;
+	GD_ENCODER_HANDLE Encoder = GD_EncoderCreate(&Options, &ErrorCode);
+	TEST_CHECK(Encoder != NULL);
+
+	if (Encoder)
+	{
+		TEST_CHECK(GD_EncoderSetLoopCount(Encoder, 3) == GD_OK);
+		TEST_CHECK(GD_EncoderAddComment(Encoder, "round trip") == GD_OK);
+
+		//
+		// Half of the frames together, the others one by one
+		//
+		TEST_CHECK(GD_EncoderAddFrames(Encoder, Frames, FRAME_COUNT / 2) == GD_OK);
+
+		for (int i = FRAME_COUNT / 2; i < FRAME_COUNT; ++i)
+			TEST_CHECK(GD_EncoderAddFrame(Encoder, &Frames[i]) == GD_OK);
+
+		const GD_BYTE* Data;
+		size_t Size;
+		TEST_CHECK(GD_EncoderFinish(Encoder, &Data, &Size) == GD_OK);
+
+		GD_DECODE_OPTIONS DecodeOptions;
+		GD_InitDecodeOptions(&DecodeOptions);
+		DecodeOptions.Flags = GD_DECODE_KEEP_INDICES;
+
+		size_t ErrorBytePos;
+		GD_GIF_HANDLE Gif = GD_FromMemoryEx(Data, Size, &DecodeOptions, &ErrorCode, &ErrorBytePos);
+		TEST_CHECK(Gif != NULL);
+
+		if (Gif)
+		{
+			TEST_CHECK(GD_FrameCount(Gif) == FRAME_COUNT);
+			TEST_CHECK(GD_GetScreenDescriptor(Gif)->LogicalWidth == Width);
+			TEST_CHECK(GD_GetScreenDescriptor(Gif)->LogicalHeight == Height);
+			TEST_CHECK(GD_GetScreenDescriptor(Gif)->BgColorIndex == Options.BgColorIndex);
+
+			for (GD_DWORD i = 0; i < FRAME_COUNT && i < GD_FrameCount(Gif); ++i)
+			{
+				const GD_FRAME* Decoded = GD_GetFrame(Gif, i);
+				const GD_ENCODER_FRAME* Source = &Frames[i];
+				const GD_COLOR_TABLE* Palette = Source->Palette ? Source->Palette : &Global;
+
+				TEST_CHECK(Decoded->Descriptor.PositionLeft == Source->Left);
+				TEST_CHECK(Decoded->Descriptor.PositionTop == Source->Top);
+				TEST_CHECK(Decoded->Descriptor.Width == Source->Width);
+				TEST_CHECK(Decoded->Descriptor.Height == Source->Height);
+				TEST_CHECK(Decoded->DisposalMethod == Source->DisposalMethod);
+				TEST_CHECK(Decoded->DelayTime == Source->DelayTime);
+				TEST_CHECK(Decoded->HasTransparency == Source->HasTransparency);
+				TEST_CHECK(!Source->HasTransparency || Decoded->TransparentIndex == Source->TransparentIndex);
+				TEST_CHECK(memcmp(Decoded->Palette->Internal, Palette->Internal, sizeof(GD_GIF_COLOR) * Palette->Count) == 0);
+				TEST_CHECK(memcmp(Decoded->Indices, Source->Indices, (size_t)Source->Width * Source->Height) == 0);
+			}
+
+			GD_CloseGif(Gif);
+		}
+
+		GD_EncoderDestroy(Encoder);
+	}
+
+	for (int i = 0; i < FRAME_COUNT; ++i)
+		free((void*)Frames[i].Indices);
+}
+
+int
+main(void)
+{
+	const GD_DWORD Colors[] = { 2, 16, 256 };
+
+	for (size_t c = 0; c < sizeof(Colors) / sizeof(Colors[0]); ++c)
+	{
+		for (int Thorough = 0; Thorough < 2; ++Thorough)
+		{
+			RoundTrip(Colors[c], (GD_BOOL)Thorough, 1);
+			RoundTrip(Colors[c], (GD_BOOL)Thorough, 4);
+		}
+	}
+
+	//
+	// Indices outside of the frame's table are refused
+	//
+	GD_COLOR_TABLE Palette;
+	TestRandomPalette(&Palette, 4);
+
+	const GD_BYTE Indices[4] = { 0, 1, 2, 4 };
+
+	GD_ENCODER_FRAME Frame;
+	memset(&Frame, 0, sizeof(Frame));
+	Frame.Width = 2;
+	Frame.Height = 2;
+	Frame.Indices = Indices;
+
+	GD_ENCODER_OPTIONS Options;
+	memset(&Options, 0, sizeof(Options));
+	Options.Width = 2;
+	Options.Height = 2;
+	Options.GlobalPalette = &Palette;
+
+	GD_ERR ErrorCode;
+	GD_ENCODER_HANDLE Encoder = GD_EncoderCreate(&Options, &ErrorCode);
+	TEST_CHECK(Encoder != NULL);
+
+	if (Encoder)
+	{
+		TEST_CHECK(GD_EncoderAddFrame(Encoder, &Frame) == GD_UNEXPECTED_DATA);
+		GD_EncoderDestroy(Encoder);
+	}
+
+	return TestReport("encoder");
+}
@@ -0,0 +1,193 @@
+#include "gd_test.h"
+
+//
+// Every limit of GD_DECODE_OPTIONS, set just above and just below what a file needs:
+// the file decodes at the limit and fails with its GD_LIMIT_* error one step below,
+// without a handle. Run under ASan, anything left allocated on failure is reported
+//
+
+#define SCREEN_WIDTH  200
+#define SCREEN_HEIGHT 150
+#define FRAME_COUNT   5
+
+/// FRAME_COUNT full screen frames of random runs, none of them a copy of another
+static GD_BYTE*
+MakeFile(GD_WORD Width, GD_WORD Height, GD_DWORD FrameCount, GD_DWORD RunLength, size_t* Size)
+{
+	GD_COLOR_TABLE Palette;
+	TestRandomPalette(&Palette, 256);
+
+	const size_t Pixels = (size_t)Width * Height;
+	GD_BYTE* Indices = malloc(Pixels * FrameCount);
+	GD_ENCODER_FRAME Frames[FRAME_COUNT];
+	memset(Frames, 0, sizeof(Frames));
+
+	GD_BYTE Value = 0;
+
+	for (size_t i = 0; i < Pixels * FrameCount; ++i)
+	{
+		if (TestRandom() % RunLength == 0)
+			Value = (GD_BYTE)TestRandom();
+
+		Indices[i] = Value;
+	}
+
+	for (GD_DWORD i = 0; i < FrameCount; ++i)
+	{
+		Frames[i].Width = Width;
+		Frames[i].Height = Height;
+		Frames[i].Indices = Indices + Pixels * i;
+	}
+
+	GD_ENCODER_OPTIONS Options;
+	memset(&Options, 0, sizeof(Options));
+	Options.Width = Width;
+	Options.Height = Height;
+	Options.GlobalPalette = &Palette;
+
+	GD_BYTE* File = TestEncode(&Options, Frames, FrameCount, Size);
+	free(Indices);
+
+	return File;
+}
+
+/// Bytes of image data in the sub-blocks of the first image of File
+static size_t
+CompressedSize(const GD_BYTE* File, size_t Size)
+{
+	size_t Offset = TestFirstRaster(File, Size, NULL);
+	size_t Total = 0;
+
+	if (!Offset)
+		return 0;
+
+	while (Offset < Size && File[Offset])
+	{
+		Total += File[Offset];
+		Offset += 1 + File[Offset];
+	}
+
+	return Total;
+}
+
+/// Decode with Options, expecting Expected and a handle only on success
+static void
+CheckDecode(const GD_BYTE* File, size_t Size, const GD_DECODE_OPTIONS* Options, GD_ERR Expected, int Line)
+{
+	GD_ERR ErrorCode = GD_OK;
+	size_t ErrorBytePos = 0;
+	GD_GIF_HANDLE Gif = GD_FromMemoryEx(File, Size, Options, &ErrorCode, &ErrorBytePos);
+
+	if (ErrorCode != Expected)
+		fprintf(stderr, "line %d: %s instead of %s\n", Line, GD_ErrorAsString(ErrorCode), GD_ErrorAsString(Expected));
+
+	TEST_CHECK(ErrorCode == Expected);
+	TEST_CHECK((Gif != NULL) == (Expected == GD_OK));
+
+	if (Gif)
+		GD_CloseGif(Gif);
+}
+
+int
+main(void)
+{
+	const GD_DWORD FlagSets[] = { 0, GD_DECODE_KEEP_INDICES, GD_DECODE_COMPRESS_FRAMES };
+	const size_t Pixels = (size_t)SCREEN_WIDTH * SCREEN_HEIGHT;
+
+	size_t Size;
+	GD_BYTE* File = MakeFile(SCREEN_WIDTH, SCREEN_HEIGHT, FRAME_COUNT, 6, &Size);
+	TEST_CHECK(File != NULL);
+
+	if (!File)
+		return TestReport("limits");
+
+	//
+	// One frame, long runs: a high ratio of indices to bytes of image data
+	//
+	size_t RunsSize;
+	GD_BYTE* Runs = MakeFile(SCREEN_WIDTH, SCREEN_HEIGHT, 1, 200, &RunsSize);
+	const size_t Compressed = Runs ? CompressedSize(Runs, RunsSize) : 0;
+	TEST_CHECK(Compressed != 0);
+
+	for (size_t f = 0; f < sizeof(FlagSets) / sizeof(FlagSets[0]); ++f)
+	{
+		for (GD_DWORD Threads = 1; Threads <= 4; Threads += 3)
+		{
+			GD_DECODE_OPTIONS Options;
+			GD_InitDecodeOptions(&Options);
+			Options.Flags = FlagSets[f];
+			Options.Threads = Threads;
+
+			CheckDecode(File, Size, &Options, GD_OK, __LINE__);
+
+			GD_DECODE_OPTIONS Limited = Options;
+			Limited.MaxFramePixels = (GD_DWORD)Pixels;
+			CheckDecode(File, Size, &Limited, GD_OK, __LINE__);
+			Limited.MaxFramePixels = (GD_DWORD)Pixels - 1;
+			CheckDecode(File, Size, &Limited, GD_LIMIT_PIXELS, __LINE__);
+
+			Limited = Options;
+			Limited.MaxTotalBytes = Pixels * FRAME_COUNT;
+			CheckDecode(File, Size, &Limited, GD_OK, __LINE__);
+			Limited.MaxTotalBytes = Pixels * FRAME_COUNT - 1;
+			CheckDecode(File, Size, &Limited, GD_LIMIT_TOTAL_BYTES, __LINE__);
+
+			Limited = Options;
+			Limited.MaxFrames = FRAME_COUNT;
+			CheckDecode(File, Size, &Limited, GD_OK, __LINE__);
+			Limited.MaxFrames = FRAME_COUNT - 1;
+			CheckDecode(File, Size, &Limited, GD_LIMIT_FRAMES, __LINE__);
+
+			if (Runs && Compressed)
+			{
+				//
+				// Accepted as long as Pixels <= Compressed * MaxCompressionRatio
+				//
+				const GD_DWORD Ratio = (GD_DWORD)((Pixels + Compressed - 1) / Compressed);
+
+				Limited = Options;
+				Limited.MaxCompressionRatio = Ratio;
+				CheckDecode(Runs, RunsSize, &Limited, GD_OK, __LINE__);
+				Limited.MaxCompressionRatio = Ratio - 1;
+				CheckDecode(Runs, RunsSize, &Limited, GD_LIMIT_RATIO, __LINE__);
+			}
+		}
+	}
+
+	//
+	// A large image against a budget it cannot meet, and one it easily does. The
+	// budget is checked every 64K indices inside the LZW decoder, so the first check
+	// already fails
+	//
+	size_t LargeSize;
+	GD_BYTE* Large = MakeFile(2048, 2048, 1, 1, &LargeSize);
+	TEST_CHECK(Large != NULL);
+
+	if (Large)
+	{
+		for (GD_DWORD Threads = 1; Threads <= 4; Threads += 3)
+		{
+			GD_DECODE_OPTIONS Options;
+			GD_InitDecodeOptions(&Options);
+			Options.Threads = Threads;
+
+			Options.TimeBudget = 60 * 1000;
+			CheckDecode(Large, LargeSize, &Options, GD_OK, __LINE__);
+
+			const double Start = TestNow();
+
+			Options.TimeBudget = 1;
+			CheckDecode(Large, LargeSize, &Options, GD_LIMIT_TIME, __LINE__);
+
+			// Stopped well before the whole image is decoded
+			TEST_CHECK(TestNow() - Start < 5.0);
+		}
+
+		free(Large);
+	}
+
+	free(Runs);
+	free(File);
+
+	return TestReport("limits");
+}
@@ -0,0 +1,210 @@
+//
+// Large images decoded on several threads, split at clear codes, must give the same
+// indices as on one thread and as encoded, whole or with their raster cut short.
+// Includes gd.c to check that the images really are split
+//
+#include "gd.c"
+#include "gd_test.h"
+
+#define IMAGE_WIDTH  1280
+#define IMAGE_HEIGHT 900
+
+/// Sub-blocks from Offset joined together, SubBlocks of them at most
+static GD_BYTE*
+JoinSubBlocks(const GD_BYTE* File, size_t Size, size_t Offset, size_t SubBlocks, size_t* Length)
+{
+	GD_BYTE* Data = malloc(Size);
+	*Length = 0;
+
+	for (size_t i = 0; i < SubBlocks && Offset < Size && File[Offset]; ++i)
+	{
+		memcpy(Data + *Length, File + Offset + 1, File[Offset]);
+		*Length += File[Offset];
+		Offset += 1 + File[Offset];
+	}
+
+	return Data;
+}
+
+/// Indices of the single frame of File decoded on Threads threads, NULL on failure
+static GD_BYTE*
+DecodeIndices(const GD_BYTE* File, size_t Size, GD_DWORD Threads, GD_ERR* ErrorCode)
+{
+	GD_DECODE_OPTIONS Options;
+	GD_InitDecodeOptions(&Options);
+	Options.Flags = GD_DECODE_KEEP_INDICES;
+	Options.Threads = Threads;
+
+	size_t ErrorBytePos;
+	GD_GIF_HANDLE Gif = GD_FromMemoryEx(File, Size, &Options, ErrorCode, &ErrorBytePos);
+
+	if (!Gif)
+		return NULL;
+
+	GD_BYTE* Indices = NULL;
+
+	if (GD_FrameCount(Gif) == 1 && GD_GetFrame(Gif, 0)->Indices)
+	{
+		Indices = malloc((size_t)IMAGE_WIDTH * IMAGE_HEIGHT);
+		memcpy(Indices, GD_GetFrame(Gif, 0)->Indices, (size_t)IMAGE_WIDTH * IMAGE_HEIGHT);
+	}
+
+	GD_CloseGif(Gif);
+
+	return Indices;
+}
+
+static void
+CheckThreads(GD_DWORD Colors, GD_DWORD RunLength, GD_BOOL Thorough)
+{
+	const size_t Pixels = (size_t)IMAGE_WIDTH * IMAGE_HEIGHT;
+
+	GD_COLOR_TABLE Palette;
+	TestRandomPalette(&Palette, Colors);
+
+	//
+	// Runs of random length, so that strings of every length end up in the dictionary
+	//
+	GD_BYTE* Source = malloc(Pixels);
+	GD_BYTE Value = 0;
+
+	for (size_t i = 0; i < Pixels; ++i)
+	{
+		if (TestRandom() % RunLength == 0)
+			Value = (GD_BYTE)(TestRandom() % Colors);
+
+		Source[i] = Value;
+	}
+
+	GD_ENCODER_FRAME Frame;
+	memset(&Frame, 0, sizeof(Frame));
+	Frame.Width = IMAGE_WIDTH;
+	Frame.Height = IMAGE_HEIGHT;
+	Frame.Indices = Source;
+
+	GD_ENCODER_OPTIONS EncoderOptions;
+	memset(&EncoderOptions, 0, sizeof(EncoderOptions));
+	EncoderOptions.Width = IMAGE_WIDTH;
+	EncoderOptions.Height = IMAGE_HEIGHT;
+	EncoderOptions.GlobalPalette = &Palette;
+	EncoderOptions.Thorough = Thorough;
+
+	size_t Size;
+	GD_BYTE* File = TestEncode(&EncoderOptions, &Frame, 1, &Size);
+	TEST_CHECK(File != NULL);
+
+	GD_BYTE CodeWidth = 0;
+	const size_t Raster = File ? TestFirstRaster(File, Size, &CodeWidth) : 0;
+	TEST_CHECK(Raster != 0);
+
+	if (!Raster)
+	{
+		free(File);
+		free(Source);
+		return;
+	}
+
+	//
+	// The image has to be split for the threads to be involved at all. Thorough keeps
+	// full tables where clearing does not pay, some of those images have no clear code
+	// past the first and go through the single thread path instead
+	//
+	size_t Length;
+	GD_BYTE* Data = JoinSubBlocks(File, Size, Raster, (size_t)-1, &Length);
+
+	LZW_SEGMENT* Segments = NULL;
+	size_t SegmentCount = 0;
+	TEST_CHECK(GD_LzwFindSegments(CodeWidth, Data, (GD_DWORD)Length, Pixels, &Segments, &SegmentCount) == GD_OK);
+	TEST_CHECK(Thorough || SegmentCount >= 4);
+
+	free(Segments);
+	free(Data);
+
+	GD_ERR ErrorCode;
+	GD_BYTE* Single = DecodeIndices(File, Size, 1, &ErrorCode);
+	GD_BYTE* Multi = DecodeIndices(File, Size, 4, &ErrorCode);
+
+	TEST_CHECK(Single != NULL && Multi != NULL);
+
+	if (Single && Multi)
+	{
+		TEST_CHECK(memcmp(Single, Source, Pixels) == 0);
+		TEST_CHECK(memcmp(Multi, Source, Pixels) == 0);
+	}
+
+	free(Single);
+	free(Multi);
+
+	//
+	// Raster cut after some of its sub-blocks, closed by a block terminator and the
+	// trailer. The indices decoded before the cut must be the same either way
+	//
+	size_t SubBlockCount = 0;
+
+	for (size_t Offset = Raster; Offset < Size && File[Offset]; Offset += 1 + File[Offset])
+		++SubBlockCount;
+
+	const size_t Cuts[] = { SubBlockCount / 3, SubBlockCount * 2 / 3, SubBlockCount - 1 };
+
+	for (size_t c = 0; c < sizeof(Cuts) / sizeof(Cuts[0]); ++c)
+	{
+		size_t Offset = Raster;
+
+		for (size_t i = 0; i < Cuts[c]; ++i)
+			Offset += 1 + File[Offset];
+
+		GD_BYTE* Cut = malloc(Offset + 2);
+		memcpy(Cut, File, Offset);
+		Cut[Offset] = 0;
+		Cut[Offset + 1] = 0x3B;
+
+		//
+		// Indices the cut raster still holds, up to its last whole segment
+		//
+		Data = JoinSubBlocks(File, Size, Raster, Cuts[c], &Length);
+		TEST_CHECK(GD_LzwFindSegments(CodeWidth, Data, (GD_DWORD)Length, Pixels, &Segments, &SegmentCount) == GD_OK);
+
+		const size_t Decoded = SegmentCount ? Segments[SegmentCount - 1].Output : 0;
+
+		free(Segments);
+		free(Data);
+
+		GD_ERR SingleError, MultiError;
+		Single = DecodeIndices(Cut, Offset + 2, 1, &SingleError);
+		Multi = DecodeIndices(Cut, Offset + 2, 4, &MultiError);
+
+		TEST_CHECK(SingleError == MultiError);
+		TEST_CHECK(!Single == !Multi);
+
+		if (Single && Multi)
+		{
+			TEST_CHECK(memcmp(Single, Multi, Pixels) == 0);
+			TEST_CHECK(memcmp(Single, Source, Decoded) == 0);
+		}
+
+		free(Single);
+		free(Multi);
+		free(Cut);
+	}
+
+	free(File);
+	free(Source);
+}
+
+int
+main(void)
+{
+	const GD_DWORD Colors[] = { 2, 16, 256 };
+	const GD_DWORD RunLengths[] = { 1, 6 };
+
+	for (size_t c = 0; c < sizeof(Colors) / sizeof(Colors[0]); ++c)
+	{
+		for (size_t r = 0; r < sizeof(RunLengths) / sizeof(RunLengths[0]); ++r)
+		{
+			CheckThreads(Colors[c], RunLengths[r], GD_FALSE);
+			CheckThreads(Colors[c], RunLengths[r], GD_TRUE);
+		}
+	}
+
+	return TestReport("lzw_threads");
+}
@@ -0,0 +1,259 @@
+#include "gd_test.h"
+
+//
+// Files written by GD_Optimize must compose to the same canvases as their source, frame
+// after frame: transparency, every disposal method, and frames whose changes need more
+// colors than one table holds
+//
+
+#define FRAME_COUNT 12
+
+typedef enum SCENARIO
+{
+	SCENARIO_TRANSPARENCY,
+	SCENARIO_DISPOSAL,
+	SCENARIO_MANY_COLORS,
+	SCENARIO_COUNT
+} SCENARIO;
+
+static const char* ScenarioNames[SCENARIO_COUNT] = { "transparency", "disposal", "many colors" };
+
+/// Runs of mean length 4 over the rectangle of Scene
+static void
+PaintScene(GD_BYTE* Scene, GD_WORD Width, GD_DWORD Colors, GD_WORD Left, GD_WORD Top, GD_WORD RectWidth, GD_WORD RectHeight)
+{
+	GD_BYTE Value = 0;
+
+	for (size_t y = Top; y < (size_t)Top + RectHeight; ++y)
+	{
+		for (size_t x = Left; x < (size_t)Left + RectWidth; ++x)
+		{
+			if (TestRandom() % 4 == 0)
+				Value = (GD_BYTE)(TestRandom() % Colors);
+
+			Scene[y * Width + x] = Value;
+		}
+	}
+}
+
+/// Source file for Scenario. Frames redraw much more of a scene than changes, so that
+/// the optimized frames usually win, and the first one does not cover the screen
+static GD_BYTE*
+MakeSource(SCENARIO Scenario, GD_WORD Width, GD_WORD Height, size_t* Size)
+{
+	GD_COLOR_TABLE Global;
+	TestRandomPalette(&Global, Scenario == SCENARIO_MANY_COLORS ? 256 : 16);
+
+	GD_BYTE* Scene = malloc((size_t)Width * Height);
+	PaintScene(Scene, Width, Global.Count, 0, 0, Width, Height);
+
+	GD_COLOR_TABLE Locals[FRAME_COUNT];
+	GD_ENCODER_FRAME Frames[FRAME_COUNT];
+	memset(Frames, 0, sizeof(Frames));
+
+	for (int i = 0; i < FRAME_COUNT; ++i)
+	{
+		GD_ENCODER_FRAME* Frame = &Frames[i];
+		const GD_COLOR_TABLE* Palette = &Global;
+
+		Frame->DelayTime = (GD_WORD)(TestRandom() % 100);
+		Frame->DisposalMethod = GD_DISPOSAL_NONE;
+
+		if (Scenario == SCENARIO_MANY_COLORS)
+		{
+			//
+			// Whole screen, 256 colors of its own, with holes through which the colors
+			// of the frame before stay visible
+			//
+			TestRandomPalette(&Locals[i], 256);
+			Palette = Frame->Palette = &Locals[i];
+
+			Frame->Width = Width;
+			Frame->Height = Height;
+			Frame->HasTransparency = (GD_BOOL)(i % 3 != 0);
+			Frame->TransparentIndex = (GD_BYTE)(TestRandom() % Palette->Count);
+
+			PaintScene(Scene, Width, Palette->Count, 0, 0, Width, Height);
+		}
+		else if (Scenario == SCENARIO_DISPOSAL && i % 2)
+		{
+			//
+			// Noise over a part of the scene, taken back by the disposal
+			//
+			Frame->Width = (GD_WORD)(1 + TestRandom() % (Width / 2));
+			Frame->Height = (GD_WORD)(1 + TestRandom() % (Height / 2));
+			Frame->Left = (GD_WORD)(TestRandom() % (Width - Frame->Width + 1));
+			Frame->Top = (GD_WORD)(TestRandom() % (Height - Frame->Height + 1));
+			Frame->DisposalMethod = (TestRandom() % 4) ? GD_DISPOSAL_PREVIOUS : GD_DISPOSAL_BACKGROUND;
+			Frame->HasTransparency = (GD_BOOL)(TestRandom() % 2);
+			Frame->TransparentIndex = (GD_BYTE)(TestRandom() % Palette->Count);
+
+			GD_BYTE* Indices = malloc((size_t)Frame->Width * Frame->Height);
+
+			for (size_t p = 0; p < (size_t)Frame->Width * Frame->Height; ++p)
+				Indices[p] = (GD_BYTE)(TestRandom() % Palette->Count);
+
+			Frame->Indices = Indices;
+			continue;
+		}
+		else
+		{
+			//
+			// A small change to the scene, written with a wide margin around it
+			//
+			const GD_WORD ChangeWidth = (GD_WORD)(1 + TestRandom() % (Width / 4));
+			const GD_WORD ChangeHeight = (GD_WORD)(1 + TestRandom() % (Height / 4));
+			const GD_WORD ChangeLeft = (GD_WORD)(TestRandom() % (Width - ChangeWidth + 1));
+			const GD_WORD ChangeTop = (GD_WORD)(TestRandom() % (Height - ChangeHeight + 1));
+
+			PaintScene(Scene, Width, Palette->Count, ChangeLeft, ChangeTop, ChangeWidth, ChangeHeight);
+
+			Frame->Left = (GD_WORD)(TestRandom() % (ChangeLeft + 1));
+			Frame->Top = (GD_WORD)(TestRandom() % (ChangeTop + 1));
+			Frame->Width = (GD_WORD)(ChangeLeft + ChangeWidth - Frame->Left + TestRandom() % (Width - ChangeLeft - ChangeWidth + 1));
+			Frame->Height = (GD_WORD)(ChangeTop + ChangeHeight - Frame->Top + TestRandom() % (Height - ChangeTop - ChangeHeight + 1));
+
+			if (Scenario == SCENARIO_DISPOSAL && TestRandom() % 3 == 0)
+				Frame->DisposalMethod = GD_DISPOSAL_BACKGROUND;
+
+			//
+			// Transparent pixels show what is under the frame, whatever the scene has there
+			//
+			Frame->HasTransparency = (Scenario == SCENARIO_TRANSPARENCY || TestRandom() % 2) ? GD_TRUE : GD_FALSE;
+			Frame->TransparentIndex = (GD_BYTE)(TestRandom() % Palette->Count);
+		}
+
+		GD_BYTE* Indices = malloc((size_t)Frame->Width * Frame->Height);
+
+		for (size_t y = 0; y < Frame->Height; ++y)
+			memcpy(Indices + y * Frame->Width, Scene + (Frame->Top + y) * Width + Frame->Left, Frame->Width);
+
+		Frame->Indices = Indices;
+	}
+
+	GD_ENCODER_OPTIONS Options;
+	memset(&Options, 0, sizeof(Options));
+	Options.Width = Width;
+	Options.Height = Height;
+	Options.GlobalPalette = &Global;
+	Options.BgColorIndex = (GD_BYTE)(TestRandom() % Global.Count);
+
+	GD_BYTE* File = TestEncode(&Options, Frames, FRAME_COUNT, Size);
+
+	for (int i = 0; i < FRAME_COUNT; ++i)
+		free((void*)Frames[i].Indices);
+
+	free(Scene);
+
+	return File;
+}
+
+static void
+CheckOptimize(SCENARIO Scenario, GD_DWORD Threads)
+{
+	const GD_WORD Width = (GD_WORD)(40 + TestRandom() % 120);
+	const GD_WORD Height = (GD_WORD)(30 + TestRandom() % 90);
+
+	size_t SourceSize = 0;
+	GD_BYTE* File = MakeSource(Scenario, Width, Height, &SourceSize);
+	TEST_CHECK(File != NULL);
+
+	if (!File)
+		return;
+
+	GD_ERR ErrorCode;
+	size_t ErrorBytePos;
+	GD_GIF_HANDLE Source = GD_FromMemory(File, SourceSize, &ErrorCode, &ErrorBytePos);
+	TEST_CHECK(Source != NULL);
+
+	GD_OPTIMIZE_OPTIONS Options;
+	memset(&Options, 0, sizeof(Options));
+	Options.Threads = Threads;
+
+	GD_ENCODER_HANDLE Encoder = Source ? GD_Optimize(Source, &Options, &ErrorCode) : NULL;
+	TEST_CHECK(Encoder != NULL);
+
+	GD_GIF_HANDLE Output = NULL;
+
+	if (Encoder)
+	{
+		const GD_BYTE* Data;
+		size_t Size;
+		TEST_CHECK(GD_EncoderFinish(Encoder, &Data, &Size) == GD_OK);
+
+		Output = GD_FromMemory(Data, Size, &ErrorCode, &ErrorBytePos);
+		TEST_CHECK(Output != NULL);
+	}
+
+	if (Source && Output)
+	{
+		TEST_CHECK(GD_FrameCount(Output) == FRAME_COUNT);
+		TEST_CHECK(GD_GetScreenDescriptor(Output)->LogicalWidth == Width);
+		TEST_CHECK(GD_GetScreenDescriptor(Output)->LogicalHeight == Height);
+
+		//
+		// Either the first frame covers the screen and hides whatever a viewer starts
+		// from, or the source frames were all kept and render as the source does
+		//
+		const GD_FRAME* First = GD_GetFrame(Output, 0);
+
+		GD_BOOL Kept = GD_TRUE;
+
+		for (GD_DWORD i = 0; i < FRAME_COUNT && i < GD_FrameCount(Output); ++i)
+		{
+			const GD_FRAME* A = GD_GetFrame(Source, i);
+			const GD_FRAME* B = GD_GetFrame(Output, i);
+
+			if (A->Descriptor.PositionLeft != B->Descriptor.PositionLeft || A->Descriptor.PositionTop != B->Descriptor.PositionTop ||
+			    A->Descriptor.Width != B->Descriptor.Width || A->Descriptor.Height != B->Descriptor.Height ||
+			    A->DisposalMethod != B->DisposalMethod || A->HasTransparency != B->HasTransparency)
+				Kept = GD_FALSE;
+		}
+
+		TEST_CHECK(Kept || (First->Descriptor.PositionLeft == 0 && First->Descriptor.PositionTop == 0 &&
+		                    First->Descriptor.Width == Width && First->Descriptor.Height == Height && !First->HasTransparency));
+
+		for (GD_DWORD i = 0; i < FRAME_COUNT && i < GD_FrameCount(Output); ++i)
+		{
+			TEST_CHECK(GD_GetFrame(Output, i)->DelayTime == GD_GetFrame(Source, i)->DelayTime);
+
+			//
+			// Both handles own their canvas, so both can be composed before comparing
+			//
+			const GD_GIF_COLOR* Expected = GD_ComposeFrame(Source, i, &ErrorCode);
+			const GD_GIF_COLOR* Actual = GD_ComposeFrame(Output, i, &ErrorCode);
+			TEST_CHECK(Expected != NULL && Actual != NULL);
+
+			if (!Expected || !Actual)
+				break;
+
+			if (memcmp(Expected, Actual, sizeof(GD_GIF_COLOR) * Width * Height))
+			{
+				fprintf(stderr, "%s: canvas %u differs\n", ScenarioNames[Scenario], (unsigned)i);
+				TEST_CHECK(!"optimized canvas differs from the source");
+				break;
+			}
+		}
+	}
+
+	if (Output)
+		GD_CloseGif(Output);
+
+	if (Source)
+		GD_CloseGif(Source);
+
+	GD_EncoderDestroy(Encoder);
+	free(File);
+}
+
+int
+main(void)
+{
+	for (int Scenario = 0; Scenario < SCENARIO_COUNT; ++Scenario)
+	{
+		for (int Round = 0; Round < 8; ++Round)
+			CheckOptimize((SCENARIO)Scenario, (Round % 2) ? 4 : 1);
+	}
+
+	return TestReport("optimize");
+}
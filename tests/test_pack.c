@@ -0,0 +1,171 @@
+//
+// Index streams packed by GD_PackIndices must unpack to themselves: noise that does not
+// compress, long runs, repeated patterns whose matches overlap what they produce, matches
+// as far back as an offset reaches, and lengths needing continuation bytes. Includes gd.c
+// to reach the codec, buffers are sized exactly so that ASan sees any overrun
+//
+#include "gd.c"
+#include "gd_test.h"
+
+typedef enum CONTENT
+{
+	CONTENT_NOISE,
+	CONTENT_RUNS,
+	CONTENT_PATTERN,
+	CONTENT_FAR,
+	CONTENT_TOO_FAR,
+	CONTENT_MIXED,
+	CONTENT_COUNT
+} CONTENT;
+
+static const char* ContentNames[CONTENT_COUNT] = { "noise", "runs", "pattern", "far", "too far", "mixed" };
+
+static void
+Fill(GD_BYTE* Indices, size_t Size, CONTENT Content)
+{
+	GD_BYTE Value = 0;
+
+	switch (Content)
+	{
+	case CONTENT_NOISE:
+		for (size_t i = 0; i < Size; ++i)
+			Indices[i] = (GD_BYTE)TestRandom();
+		break;
+
+	case CONTENT_RUNS:
+		//
+		// Runs up to several hundred long, longer than a token nibble holds
+		//
+		for (size_t i = 0; i < Size; ++i)
+		{
+			if (TestRandom() % 300 == 0)
+				Value = (GD_BYTE)(TestRandom() % 4);
+
+			Indices[i] = Value;
+		}
+		break;
+
+	case CONTENT_PATTERN:
+	{
+		//
+		// A short pattern repeated, matches start at offsets 2 to 7 and overlap
+		//
+		const size_t Period = 2 + TestRandom() % 6;
+
+		for (size_t i = 0; i < Size; ++i)
+			Indices[i] = (i < Period) ? (GD_BYTE)TestRandom() : Indices[i - Period];
+		break;
+	}
+
+	case CONTENT_FAR:
+	case CONTENT_TOO_FAR:
+	{
+		//
+		// A stretch of noise in a flat block, the block repeated as far back as an offset
+		// reaches, or one byte further where the noise has to be written again
+		//
+		const size_t Period = (Content == CONTENT_FAR) ? GD_PACK_MAX_OFFSET : GD_PACK_MAX_OFFSET + 1;
+
+		for (size_t i = 0; i < Size; ++i)
+		{
+			if (i >= Period)
+				Indices[i] = Indices[i - Period];
+			else
+				Indices[i] = (i < 1000) ? (GD_BYTE)TestRandom() : 0;
+		}
+		break;
+	}
+
+	default:
+		//
+		// Stretches of each kind, as a frame with a noisy region in a flat one
+		//
+		for (size_t i = 0; i < Size;)
+		{
+			const size_t Length = 1 + TestRandom() % 2000;
+			const size_t End = (i + Length < Size) ? i + Length : Size;
+
+			Fill(Indices + i, End - i, (CONTENT)(TestRandom() % CONTENT_FAR));
+			i = End;
+		}
+		break;
+	}
+}
+
+static void
+CheckRoundTrip(const GD_BYTE* Indices, size_t Size, CONTENT Content)
+{
+	const size_t Bound = GD_PackBound(Size);
+
+	GD_BYTE* Output = malloc(Bound);
+	TEST_CHECK(Output != NULL);
+
+	if (!Output)
+		return;
+
+	const size_t PackedSize = GD_PackIndices(Indices, Size, Output);
+	TEST_CHECK(PackedSize > 0 && PackedSize <= Bound);
+
+	//
+	// Unpacked from a copy of exactly the packed size, into exactly Size bytes
+	//
+	GD_BYTE* Packed = malloc(PackedSize);
+	GD_BYTE* Unpacked = malloc(Size ? Size : 1);
+	TEST_CHECK(Packed != NULL && Unpacked != NULL);
+
+	if (Packed && Unpacked)
+	{
+		memcpy(Packed, Output, PackedSize);
+		GD_UnpackIndices(Packed, Unpacked, Size);
+
+		if (memcmp(Unpacked, Indices, Size))
+		{
+			fprintf(stderr, "%s: %zu indices do not round trip\n", ContentNames[Content], Size);
+			TEST_CHECK(!"unpacked indices differ");
+		}
+	}
+
+	if (Content == CONTENT_RUNS && Size >= 4096)
+		TEST_CHECK(PackedSize < Size / 20);
+
+	//
+	// Only the noise of the first block is written out, later blocks are matched from the
+	// one before. Writing the noise of every block again would take 1000 bytes per block
+	//
+	if (Content == CONTENT_FAR && Size >= 3 * (GD_PACK_MAX_OFFSET + 1))
+		TEST_CHECK(PackedSize < 1000 + Size / 200);
+
+	free(Unpacked);
+	free(Packed);
+	free(Output);
+}
+
+int
+main(void)
+{
+	const size_t Sizes[] = { 0, 1, 3, 4, 5, 8, 9, 15, 16, 17, 31, 270, 271, 4096, 65535, 65536, 65537, 200000, 640 * 480 };
+
+	for (int Content = 0; Content < CONTENT_COUNT; ++Content)
+	{
+		for (size_t s = 0; s < sizeof(Sizes) / sizeof(Sizes[0]); ++s)
+		{
+			for (int Round = 0; Round < 3; ++Round)
+			{
+				//
+				// Allocated to the exact size, nothing past it can be read by accident
+				//
+				GD_BYTE* Indices = malloc(Sizes[s] ? Sizes[s] : 1);
+
+				if (!Indices)
+					return 1;
+
+				Fill(Indices, Sizes[s], (CONTENT)Content);
+				CheckRoundTrip(Indices, Sizes[s], (CONTENT)Content);
+
+				free(Indices);
+			}
+		}
+	}
+
+	return TestReport("pack");
+}
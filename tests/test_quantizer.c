@@ -0,0 +1,269 @@
+//
+// Quantizer: exact palettes for images with few colors, nearest color ties, and indices
+// of dithered remaps. Includes gd.c to reach GD_QuantizerNearest, run.sh builds it
+// with and without SSE2 so both versions are held to the same reference
+//
+#include "gd.c"
+#include "gd_test.h"
+
+static GD_GIF_COLOR
+RandomColor(void)
+{
+	GD_GIF_COLOR Color;
+	Color.r = (GD_BYTE)TestRandom();
+	Color.g = (GD_BYTE)TestRandom();
+	Color.b = (GD_BYTE)TestRandom();
+
+	return Color;
+}
+
+/// Lowest index among the closest entries
+static GD_BYTE
+ReferenceNearest(const GD_COLOR_TABLE* Palette, int r, int g, int b)
+{
+	GD_DWORD BestDistance = 0xFFFFFFFF;
+	GD_BYTE Best = 0;
+
+	for (GD_DWORD i = 0; i < Palette->Count; ++i)
+	{
+		const int dr = Palette->Internal[i].r - r;
+		const int dg = Palette->Internal[i].g - g;
+		const int db = Palette->Internal[i].b - b;
+		const GD_DWORD Distance = (GD_DWORD)(dr * dr + dg * dg + db * db);
+
+		if (Distance < BestDistance)
+		{
+			BestDistance = Distance;
+			Best = (GD_BYTE)i;
+		}
+	}
+
+	return Best;
+}
+
+static void
+TestExactPalette(GD_QUANTIZER_HANDLE Quantizer, GD_DWORD ColorCount)
+{
+	//
+	// Colors in pairs one step apart, so that both share their histogram and lookup cells
+	//
+	GD_GIF_COLOR Colors[GCT_MAX_SIZE];
+
+	for (GD_DWORD i = 0; i < ColorCount; ++i)
+	{
+		Colors[i] = (i % 2) ? Colors[i - 1] : RandomColor();
+
+		if (i % 2)
+			Colors[i].b ^= 1;
+
+		for (GD_DWORD k = 0; k < i; ++k)
+		{
+			if (GD_SameColor(Colors[k], Colors[i]))
+			{
+				Colors[i] = RandomColor();
+				k = (GD_DWORD)-1;
+			}
+		}
+	}
+
+	const GD_WORD Width = 97;
+	const GD_WORD Height = 61;
+	const size_t PixelCount = (size_t)Width * Height;
+
+	GD_GIF_COLOR* Pixels = malloc(sizeof(GD_GIF_COLOR) * PixelCount);
+	GD_BYTE* Indices = malloc(PixelCount);
+
+	for (size_t i = 0; i < PixelCount; ++i)
+		Pixels[i] = Colors[i < ColorCount ? i : TestRandom() % ColorCount];
+
+	//
+	// Added in two parts, like two frames
+	//
+	TEST_CHECK(GD_QuantizerAddPixels(Quantizer, Pixels, PixelCount / 2) == GD_OK);
+	TEST_CHECK(GD_QuantizerAddPixels(Quantizer, Pixels + PixelCount / 2, PixelCount - PixelCount / 2) == GD_OK);
+
+	GD_COLOR_TABLE Palette;
+	TEST_CHECK(GD_QuantizerBuildPalette(Quantizer, GCT_MAX_SIZE, &Palette) == GD_OK);
+	TEST_CHECK(Palette.Count == ColorCount);
+
+	for (GD_DWORD i = 0; i < ColorCount; ++i)
+	{
+		GD_BOOL Found = GD_FALSE;
+
+		for (GD_DWORD k = 0; k < Palette.Count; ++k)
+			Found |= GD_SameColor(Palette.Internal[k], Colors[i]);
+
+		TEST_CHECK(Found);
+	}
+
+	TEST_CHECK(GD_QuantizerRemap(Quantizer, Pixels, Width, Height, GD_DITHER_NONE, Indices) == GD_OK);
+
+	size_t Mismatches = 0;
+
+	for (size_t i = 0; i < PixelCount; ++i)
+		Mismatches += (Indices[i] >= Palette.Count || !GD_SameColor(Palette.Internal[Indices[i]], Pixels[i])) ? 1 : 0;
+
+	TEST_CHECK(Mismatches == 0);
+
+	//
+	// One color too many for the palette, the colors are merged instead
+	//
+	if (ColorCount > 1)
+	{
+		TEST_CHECK(GD_QuantizerAddPixels(Quantizer, Pixels, PixelCount) == GD_OK);
+		TEST_CHECK(GD_QuantizerBuildPalette(Quantizer, ColorCount - 1, &Palette) == GD_OK);
+		TEST_CHECK(Palette.Count >= 1 && Palette.Count <= ColorCount - 1);
+	}
+
+	free(Indices);
+	free(Pixels);
+}
+
+static void
+TestTies(GD_QUANTIZER_HANDLE Quantizer)
+{
+	for (int Round = 0; Round < 200; ++Round)
+	{
+		//
+		// Entries placed symmetrically around a point, repeated, and in counts that are
+		// not a multiple of 4 so that the padding of the SSE2 search is involved
+		//
+		const int r = 16 + TestRandom() % 224;
+		const int g = 16 + TestRandom() % 224;
+		const int b = 16 + TestRandom() % 224;
+
+		GD_COLOR_TABLE Palette;
+		Palette.Count = 1 + TestRandom() % GCT_MAX_SIZE;
+
+		for (GD_DWORD i = 0; i < Palette.Count; ++i)
+		{
+			const int d = 1 + TestRandom() % 15;
+			GD_GIF_COLOR* Entry = &Palette.Internal[i];
+
+			Entry->r = (GD_BYTE)r;
+			Entry->g = (GD_BYTE)g;
+			Entry->b = (GD_BYTE)b;
+
+			switch (TestRandom() % 7)
+			{
+				case 0: Entry->r = (GD_BYTE)(r + d); break;
+				case 1: Entry->r = (GD_BYTE)(r - d); break;
+				case 2: Entry->g = (GD_BYTE)(g + d); break;
+				case 3: Entry->g = (GD_BYTE)(g - d); break;
+				case 4: Entry->b = (GD_BYTE)(b + d); break;
+				case 5: Entry->b = (GD_BYTE)(b - d); break;
+				default: *Entry = RandomColor(); break;
+			}
+		}
+
+		TEST_CHECK(GD_QuantizerSetPalette(Quantizer, &Palette) == GD_OK);
+
+		for (int Query = 0; Query < 64; ++Query)
+		{
+			const int qr = Query ? r + (int)(TestRandom() % 9) - 4 : r;
+			const int qg = Query ? g + (int)(TestRandom() % 9) - 4 : g;
+			const int qb = Query ? b + (int)(TestRandom() % 9) - 4 : b;
+
+			TEST_CHECK(GD_QuantizerNearest(Quantizer, qr, qg, qb) == ReferenceNearest(&Palette, qr, qg, qb));
+		}
+	}
+
+	//
+	// The same color twice maps to the first one through the public functions too
+	//
+	GD_COLOR_TABLE Palette;
+	Palette.Count = 5;
+
+	for (GD_DWORD i = 0; i < Palette.Count; ++i)
+		Palette.Internal[i] = RandomColor();
+
+	Palette.Internal[3] = Palette.Internal[1];
+
+	TEST_CHECK(GD_QuantizerSetPalette(Quantizer, &Palette) == GD_OK);
+
+	GD_BYTE Index = 0xFF;
+	TEST_CHECK(GD_QuantizerRemap(Quantizer, &Palette.Internal[3], 1, 1, GD_DITHER_NONE, &Index) == GD_OK);
+	TEST_CHECK(Index == 1);
+}
+
+static void
+TestDitherBounds(GD_QUANTIZER_HANDLE Quantizer)
+{
+	const GD_WORD Width = 123;
+	const GD_WORD Height = 45;
+	const size_t PixelCount = (size_t)Width * Height;
+
+	GD_GIF_COLOR* Pixels = malloc(sizeof(GD_GIF_COLOR) * PixelCount);
+	GD_BYTE* Indices = malloc(PixelCount);
+
+	for (int Round = 0; Round < 40; ++Round)
+	{
+		//
+		// Extreme values push the dithered colors against the channel limits
+		//
+		for (size_t i = 0; i < PixelCount; ++i)
+		{
+			Pixels[i] = RandomColor();
+
+			if (TestRandom() % 4 == 0)
+			{
+				Pixels[i].r = (TestRandom() % 2) ? 255 : 0;
+				Pixels[i].g = (TestRandom() % 2) ? 255 : 0;
+				Pixels[i].b = (TestRandom() % 2) ? 255 : 0;
+			}
+		}
+
+		GD_COLOR_TABLE Palette;
+
+		if (Round % 2)
+		{
+			TestRandomPalette(&Palette, 1 + TestRandom() % GCT_MAX_SIZE);
+			TEST_CHECK(GD_QuantizerSetPalette(Quantizer, &Palette) == GD_OK);
+		}
+		else
+		{
+			TEST_CHECK(GD_QuantizerAddPixels(Quantizer, Pixels, PixelCount) == GD_OK);
+			TEST_CHECK(GD_QuantizerBuildPalette(Quantizer, 1 + TestRandom() % GCT_MAX_SIZE, &Palette) == GD_OK);
+		}
+
+		const GD_DITHER Dithers[] = { GD_DITHER_NONE, GD_DITHER_ORDERED, GD_DITHER_FLOYD_STEINBERG };
+
+		for (size_t d = 0; d < sizeof(Dithers) / sizeof(Dithers[0]); ++d)
+		{
+			memset(Indices, 0xFF, PixelCount);
+			TEST_CHECK(GD_QuantizerRemap(Quantizer, Pixels, Width, Height, Dithers[d], Indices) == GD_OK);
+
+			size_t OutOfBounds = 0;
+
+			for (size_t i = 0; i < PixelCount; ++i)
+				OutOfBounds += (Indices[i] >= Palette.Count) ? 1 : 0;
+
+			TEST_CHECK(OutOfBounds == 0);
+		}
+	}
+
+	free(Indices);
+	free(Pixels);
+}
+
+int
+main(void)
+{
+	GD_QUANTIZER_HANDLE Quantizer = GD_QuantizerCreate();
+	TEST_CHECK(Quantizer != NULL);
+
+	if (!Quantizer)
+		return TestReport("quantizer");
+
+	const GD_DWORD ColorCounts[] = { 1, 2, 3, 16, 17, 100, 255, 256 };
+
+	for (size_t i = 0; i < sizeof(ColorCounts) / sizeof(ColorCounts[0]); ++i)
+		TestExactPalette(Quantizer, ColorCounts[i]);
+
+	TestTies(Quantizer);
+	TestDitherBounds(Quantizer);
+
+	GD_QuantizerDestroy(Quantizer);
+
+	return TestReport("quantizer");
+}
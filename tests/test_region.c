@@ -0,0 +1,143 @@
+#include "gd_test.h"
+
+//
+// Images repeated at another position must only share buffers when the same part of
+// them lands in the decoded region
+//
+
+#define SCREEN_SIZE 100
+#define IMAGE_SIZE  20
+
+static void
+CheckImageOnCanvas(const GD_GIF_COLOR* Canvas, GD_WORD CanvasWidth, const GD_RECT* Region, const GD_COLOR_TABLE* Palette,
+                   const GD_BYTE* Indices, GD_WORD Left, GD_WORD Top)
+{
+	for (int y = 0; y < IMAGE_SIZE; ++y)
+	{
+		for (int x = 0; x < IMAGE_SIZE; ++x)
+		{
+			const int CanvasX = Left + x - Region->Left;
+			const int CanvasY = Top + y - Region->Top;
+
+			if (CanvasX < 0 || CanvasY < 0 || CanvasX >= Region->Width || CanvasY >= Region->Height)
+				continue;
+
+			const GD_GIF_COLOR* Pixel = &Canvas[(size_t)CanvasY * CanvasWidth + CanvasX];
+			const GD_GIF_COLOR* Expected = &Palette->Internal[Indices[y * IMAGE_SIZE + x]];
+
+			if (Pixel->r != Expected->r || Pixel->g != Expected->g || Pixel->b != Expected->b)
+			{
+				TEST_CHECK(!"canvas pixel differs from the image");
+				return;
+			}
+		}
+	}
+}
+
+int
+main(void)
+{
+	GD_COLOR_TABLE Palette;
+	TestRandomPalette(&Palette, 16);
+
+	GD_BYTE Indices[IMAGE_SIZE * IMAGE_SIZE];
+
+	for (size_t i = 0; i < sizeof(Indices); ++i)
+		Indices[i] = (GD_BYTE)(TestRandom() % Palette.Count);
+
+	//
+	// Frame 0 is cut by the region, frame 1 is the same data fully inside it,
+	// frame 2 a plain copy of frame 1
+	//
+	const GD_WORD Positions[3][2] = { { 0, 0 }, { 10, 10 }, { 30, 30 } };
+	GD_ENCODER_FRAME Frames[3];
+	memset(Frames, 0, sizeof(Frames));
+
+	for (int i = 0; i < 3; ++i)
+	{
+		Frames[i].Left    = Positions[i][0];
+		Frames[i].Top     = Positions[i][1];
+		Frames[i].Width   = IMAGE_SIZE;
+		Frames[i].Height  = IMAGE_SIZE;
+		Frames[i].Indices = Indices;
+	}
+
+	GD_ENCODER_OPTIONS EncoderOptions;
+	memset(&EncoderOptions, 0, sizeof(EncoderOptions));
+	EncoderOptions.Width = SCREEN_SIZE;
+	EncoderOptions.Height = SCREEN_SIZE;
+	EncoderOptions.GlobalPalette = &Palette;
+
+	size_t Size;
+	GD_BYTE* File = TestEncode(&EncoderOptions, Frames, 3, &Size);
+	TEST_CHECK(File != NULL);
+
+	if (!File)
+		return TestReport("region");
+
+	const GD_RECT Region = { 5, 5, 50, 50 };
+
+	GD_DECODE_OPTIONS Options;
+	GD_InitDecodeOptions(&Options);
+	Options.Region = Region;
+
+	for (GD_DWORD Threads = 1; Threads <= 4; Threads += 3)
+	{
+		Options.Threads = Threads;
+
+		GD_ERR ErrorCode;
+		size_t ErrorBytePos;
+		GD_GIF_HANDLE Gif = GD_FromMemoryEx(File, Size, &Options, &ErrorCode, &ErrorBytePos);
+		TEST_CHECK(Gif != NULL);
+
+		if (!Gif)
+			continue;
+
+		TEST_CHECK(GD_FrameCount(Gif) == 3);
+
+		const GD_FRAME* Clipped = GD_GetFrame(Gif, 0);
+		const GD_FRAME* Moved   = GD_GetFrame(Gif, 1);
+		const GD_FRAME* Copy    = GD_GetFrame(Gif, 2);
+
+		TEST_CHECK(Clipped->Region.Width == 15 && Clipped->Region.Height == 15);
+		TEST_CHECK(Moved->Region.Width == IMAGE_SIZE && Moved->Region.Height == IMAGE_SIZE);
+		TEST_CHECK(Moved->DuplicateOf == 1);
+		TEST_CHECK(Moved->Buffer != Clipped->Buffer);
+		TEST_CHECK(Copy->DuplicateOf == 1);
+		TEST_CHECK(Copy->Buffer == Moved->Buffer);
+
+		GD_WORD CanvasWidth, CanvasHeight;
+		TEST_CHECK(GD_GetCanvasSize(Gif, &CanvasWidth, &CanvasHeight) == GD_OK);
+		TEST_CHECK(CanvasWidth == Region.Width && CanvasHeight == Region.Height);
+
+		for (GD_DWORD i = 0; i < 3; ++i)
+		{
+			const GD_GIF_COLOR* Canvas = GD_ComposeFrame(Gif, i, &ErrorCode);
+			TEST_CHECK(Canvas != NULL);
+
+			if (Canvas)
+				CheckImageOnCanvas(Canvas, CanvasWidth, &Region, &Palette, Indices, Positions[i][0], Positions[i][1]);
+		}
+
+		GD_CloseGif(Gif);
+	}
+
+	//
+	// Without a region every copy shares the buffers of the first one
+	//
+	GD_ERR ErrorCode;
+	size_t ErrorBytePos;
+	GD_GIF_HANDLE Gif = GD_FromMemory(File, Size, &ErrorCode, &ErrorBytePos);
+	TEST_CHECK(Gif != NULL);
+
+	if (Gif)
+	{
+		TEST_CHECK(GD_GetFrame(Gif, 1)->DuplicateOf == 0);
+		TEST_CHECK(GD_GetFrame(Gif, 2)->DuplicateOf == 0);
+		GD_CloseGif(Gif);
+	}
+
+	free(File);
+
+	return TestReport("region");
+}
@@ -0,0 +1,220 @@
+//
+// GD_SampleFrames skips the frames that cannot show at the next sample. Every canvas it
+// hands out must still be the one GD_ComposeFrame gives for the same frame, for sorted
+// timestamps, out of order ones and repeated ones, and the snapshots it leaves behind
+// must be exact for later seeks. Includes gd.c to check that frames really are skipped
+//
+#include "gd.c"
+#include "gd_test.h"
+
+#define SCREEN_WIDTH  64
+#define SCREEN_HEIGHT 48
+#define FRAME_COUNT   60
+
+typedef struct SAMPLE_CHECK
+{
+	// Composed with GD_ComposeFrame, no checkpoints
+	GD_GIF_HANDLE Reference;
+	const GD_DWORD* Expected;
+	GD_DWORD Calls;
+} SAMPLE_CHECK;
+
+static void
+CheckSample(const GD_SAMPLE* Sample, void* UserData)
+{
+	SAMPLE_CHECK* Check = (SAMPLE_CHECK*)UserData;
+
+	TEST_CHECK(Sample->SampleIndex == Check->Calls);
+	TEST_CHECK(Sample->FrameIndex == Check->Expected[Sample->SampleIndex]);
+
+	GD_ERR ErrorCode;
+	const GD_GIF_COLOR* Canvas = GD_ComposeFrame(Check->Reference, Sample->FrameIndex, &ErrorCode);
+	TEST_CHECK(Canvas != NULL);
+
+	if (Canvas && memcmp(Sample->Pixels, Canvas, sizeof(GD_GIF_COLOR) * SCREEN_WIDTH * SCREEN_HEIGHT))
+	{
+		fprintf(stderr, "sample %u: canvas of frame %u differs\n", (unsigned)Sample->SampleIndex, (unsigned)Sample->FrameIndex);
+		TEST_CHECK(!"sampled canvas differs from GD_ComposeFrame");
+	}
+
+	++Check->Calls;
+}
+
+/// Frame on screen at Timestamp, from the delays of the encoded frames
+static GD_DWORD
+FrameAt(GD_GIF_HANDLE Gif, GD_DWORD Timestamp)
+{
+	GD_QWORD End = 0;
+
+	for (GD_DWORD i = 0; i < GD_FrameCount(Gif); ++i)
+	{
+		End += GD_GetFrame(Gif, i)->DelayTime * 10;
+
+		if (End > Timestamp)
+			return i;
+	}
+
+	return GD_FrameCount(Gif) - 1;
+}
+
+/// Frames GD_SampleFrames skips going forward through sorted targets because a frame
+/// drawn later covers them. Until then the canvas is not the one of any frame
+static GD_DWORD
+CountCovered(GD_GIF_HANDLE Gif, const GD_DWORD* Expected, GD_DWORD Count)
+{
+	GD_BYTE Skip[FRAME_COUNT];
+	GD_DWORD First = 0;
+	GD_DWORD Covered = 0;
+
+	for (GD_DWORD i = 0; i < Count; ++i)
+	{
+		if (Expected[i] < First)
+			continue;
+
+		GD_PlanSkips(Gif, First, Expected[i], Skip);
+
+		for (GD_DWORD f = First; f < Expected[i]; ++f)
+		{
+			const GD_DISPOSAL_METHOD Disposal = GD_GetFrame(Gif, f)->DisposalMethod;
+
+			if (Skip[f - First] && Disposal != GD_DISPOSAL_PREVIOUS && Disposal != GD_DISPOSAL_BACKGROUND)
+				++Covered;
+		}
+
+		First = Expected[i] + 1;
+	}
+
+	return Covered;
+}
+
+/// Sample Gif with checkpoints every Interval frames, against Reference composed without
+/// them and the canvases of a replay from frame 0
+static void
+CheckHandle(GD_GIF_HANDLE Gif, GD_GIF_HANDLE Reference, const GD_GIF_COLOR* Canvases, GD_DWORD Interval)
+{
+	TEST_CHECK(GD_SetCheckpointPolicy(Gif, Interval, 0) == GD_OK);
+
+	GD_QWORD Duration = 0;
+
+	for (GD_DWORD i = 0; i < FRAME_COUNT; ++i)
+		Duration += GD_GetFrame(Gif, i)->DelayTime * 10;
+
+	//
+	// Sparse and sorted first, several frames apart so that frames get skipped on
+	// the way. Then dense (the same frame twice in a row), out of order, past the
+	// end, and backwards
+	//
+	GD_DWORD Timestamps[4][FRAME_COUNT];
+	const GD_DWORD Counts[4] = { FRAME_COUNT / 6, FRAME_COUNT, FRAME_COUNT, FRAME_COUNT };
+	GD_DWORD Expected[FRAME_COUNT];
+
+	for (GD_DWORD i = 0; i < FRAME_COUNT; ++i)
+	{
+		Timestamps[0][i] = (GD_DWORD)(Duration * i / Counts[0] + TestRandom() % 100);
+		Timestamps[1][i] = (GD_DWORD)(Duration / 3 + i * 10);
+		Timestamps[2][i] = (GD_DWORD)(TestRandom() % (Duration + 500));
+		Timestamps[3][i] = (GD_DWORD)(Duration - Duration * i / FRAME_COUNT - 1);
+	}
+
+	for (int Set = 0; Set < 4; ++Set)
+	{
+		for (GD_DWORD i = 0; i < Counts[Set]; ++i)
+			Expected[i] = FrameAt(Gif, Timestamps[Set][i]);
+
+		if (Set == 0)
+			TEST_CHECK(CountCovered(Gif, Expected, Counts[Set]) > 0);
+
+		SAMPLE_CHECK Check;
+		Check.Reference = Reference;
+		Check.Expected = Expected;
+		Check.Calls = 0;
+
+		TEST_CHECK(GD_SampleFrames(Gif, Timestamps[Set], Counts[Set], CheckSample, &Check) == GD_OK);
+		TEST_CHECK(Check.Calls == Counts[Set]);
+
+		if (Set != 0 || !Interval)
+			continue;
+
+		//
+		// Checkpoints passed while covered frames were skipped are left empty. Seeking
+		// backwards restores the ones that were taken and fills in the others, and
+		// whatever is restored must be what a replay from frame 0 gives
+		//
+		for (GD_DWORD i = FRAME_COUNT; i-- > 0;)
+		{
+			GD_ERR ErrorCode;
+			const GD_GIF_COLOR* Canvas = GD_ComposeFrame(Gif, i, &ErrorCode);
+			TEST_CHECK(Canvas != NULL);
+
+			if (Canvas && memcmp(Canvas, Canvases + (size_t)SCREEN_WIDTH * SCREEN_HEIGHT * i, sizeof(GD_GIF_COLOR) * SCREEN_WIDTH * SCREEN_HEIGHT))
+			{
+				fprintf(stderr, "seek to %u after sampling differs\n", (unsigned)i);
+				TEST_CHECK(!"seek after sampling differs from a replay");
+			}
+		}
+
+		GD_DWORD Taken = 0;
+
+		for (GD_DWORD Slot = 0; Slot < Gif->CheckpointCount; ++Slot)
+			Taken += Gif->Checkpoints[Slot] ? 1 : 0;
+
+		TEST_CHECK(Taken == Gif->CheckpointCount);
+	}
+}
+
+static void
+CheckSampling(GD_DWORD Flags, GD_DWORD Interval)
+{
+	size_t Size;
+	GD_BYTE* File = TestAnimation(SCREEN_WIDTH, SCREEN_HEIGHT, FRAME_COUNT, &Size);
+	TEST_CHECK(File != NULL);
+
+	if (!File)
+		return;
+
+	GD_DECODE_OPTIONS Options;
+	GD_InitDecodeOptions(&Options);
+	Options.Flags = Flags;
+
+	GD_ERR ErrorCode;
+	size_t ErrorBytePos;
+	GD_GIF_HANDLE Gif = GD_FromMemoryEx(File, Size, &Options, &ErrorCode, &ErrorBytePos);
+	GD_GIF_HANDLE Reference = GD_FromMemoryEx(File, Size, &Options, &ErrorCode, &ErrorBytePos);
+	GD_GIF_HANDLE Replayed = GD_FromMemoryEx(File, Size, &Options, &ErrorCode, &ErrorBytePos);
+	TEST_CHECK(Gif != NULL && Reference != NULL && Replayed != NULL);
+
+	GD_GIF_COLOR* Canvases = Replayed ? TestReplay(Replayed) : NULL;
+	TEST_CHECK(Canvases != NULL);
+
+	if (Gif && Reference && Canvases)
+		CheckHandle(Gif, Reference, Canvases, Interval);
+
+	if (Gif)
+		GD_CloseGif(Gif);
+
+	if (Reference)
+		GD_CloseGif(Reference);
+
+	if (Replayed)
+		GD_CloseGif(Replayed);
+
+	free(Canvases);
+	free(File);
+}
+
+int
+main(void)
+{
+	const GD_DWORD FlagSets[] = { 0, GD_DECODE_KEEP_INDICES, GD_DECODE_COMPRESS_FRAMES };
+
+	for (int Round = 0; Round < 4; ++Round)
+	{
+		for (size_t f = 0; f < sizeof(FlagSets) / sizeof(FlagSets[0]); ++f)
+		{
+			CheckSampling(FlagSets[f], 0);
+			CheckSampling(FlagSets[f], 4);
+		}
+	}
+
+	return TestReport("sample");
+}